@@ -1,5 +1,7 @@
 /* Shared library add-on to iptables to add mpls target support. */
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -8,7 +10,22 @@
 #include <xtables.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter/xt_MPLS.h>
-#include <linux/mpls.h>
+#ifdef ENABLE_LIBMPLS
+#include <libmpls/libmpls.h>
+#endif
+
+/* Refuse a key with no NHLFE now, in the rule it is in, rather than
+ * have the kernel fail the whole table at commit.  The keys are read
+ * once, and again for a key not among them; if they cannot be, the
+ * kernel is left to check.  A rule to delete need not be checked. */
+static void mpls_check_key(u_int32_t key)
+{
+#ifdef ENABLE_LIBMPLS
+	if (key != 0 && !xtables_lookup_only && mpls_nhlfe_cached(key) == 0)
+		xtables_error(PARAMETER_PROBLEM,
+			      "MPLS: no NHLFE with key 0x%x", key);
+#endif
+}
 
 /* Function which prints out usage message. */
 static void help(void)
@@ -43,6 +60,7 @@ parse(int c, char **argv, int invert, unsigned int *flags,
 			xtables_error(PARAMETER_PROBLEM, "Bad MPLS key `%s'",
 				optarg);
 		}
+		mpls_check_key(mpls_info->key);
 
 		*flags = 1;
 		break;
@@ -67,7 +85,7 @@ static void print(const void *ip,
 {
 	const struct xt_MPLS_target_info *mpls_info =
 		(const struct xt_MPLS_target_info *)target->data;
-	printf("nhlfe 0x%x ", mpls_info->key);
+	printf(" nhlfe 0x%x", mpls_info->key);
 }
 
 /* Saves the union ipt_targinfo in parsable form to stdout. */
@@ -76,7 +94,212 @@ static void save(const void *ip, const struct xt_entry_target *target)
 	const struct xt_MPLS_target_info *mpls_info =
 		(const struct xt_MPLS_target_info *)target->data;
 
-	printf("--nhlfe 0x%x ", mpls_info->key);
+	printf(" --nhlfe 0x%x", mpls_info->key);
+}
+
+/* Revision 1 */
+
+enum {
+	O_NHLFE = 0,
+	O_NHLFE_BY,
+	O_NHLFE_MAP,
+	F_NHLFE_BY	= 1 << O_NHLFE_BY,
+	F_NHLFE_MAP	= 1 << O_NHLFE_MAP,
+};
+
+static const char *const mpls_by_names[] = {
+	[XT_MPLS_BY_NFMARK]	= "mark",
+	[XT_MPLS_BY_DSMARK]	= "dscp",
+	[XT_MPLS_BY_EXP]	= "exp",
+};
+
+static void mpls_tg_help(void)
+{
+	printf(
+"MPLS target options:\n"
+"  --nhlfe key                       Set an outgoing MPLS NHLFE\n"
+"  --nhlfe-by {mark|dscp}[/mask]|exp Choose the NHLFE by a value of\n"
+"                                    the packet, with --nhlfe-map\n"
+"  --nhlfe-map value=key[,value=key...]\n"
+"                                    NHLFE for each value; --nhlfe\n"
+"                                    for the others\n");
+}
+
+static const struct xt_option_entry mpls_tg_opts[] = {
+	{.name = "nhlfe", .id = O_NHLFE, .type = XTTYPE_UINT32,
+	 .flags = XTOPT_PUT, XTOPT_POINTER(struct xt_mpls_tginfo1, key)},
+	{.name = "nhlfe-by", .id = O_NHLFE_BY, .type = XTTYPE_STRING},
+	{.name = "nhlfe-map", .id = O_NHLFE_MAP, .type = XTTYPE_STRING,
+	 .also = F_NHLFE_BY},
+	XTOPT_TABLEEND,
+};
+
+/* Largest value of the packet the table has a key for */
+static unsigned int mpls_tg_mask(const struct xt_mpls_tginfo1 *info)
+{
+	switch (info->by) {
+	case XT_MPLS_BY_NFMARK:
+		return info->u.nf_fwd.nf_mask;
+	case XT_MPLS_BY_DSMARK:
+		return info->u.ds_fwd.df_mask;
+	case XT_MPLS_BY_EXP:
+		return MPLS_EXP_NUM - 1;
+	}
+	return 0;
+}
+
+static void mpls_tg_parse_by(struct xt_mpls_tginfo1 *info, const char *arg)
+{
+	const char *slash = strchr(arg, '/');
+	size_t len = slash != NULL ? slash - arg : strlen(arg);
+	unsigned int by, mask = MPLS_NFMARK_NUM - 1;
+
+	for (by = XT_MPLS_BY_NFMARK; by <= XT_MPLS_BY_EXP; ++by)
+		if (strlen(mpls_by_names[by]) == len &&
+		    strncmp(arg, mpls_by_names[by], len) == 0)
+			break;
+	if (by > XT_MPLS_BY_EXP)
+		xtables_error(PARAMETER_PROBLEM,
+			      "MPLS: --nhlfe-by takes mark, dscp or exp, "
+			      "not `%s'", arg);
+	if (slash != NULL &&
+	    (by == XT_MPLS_BY_EXP ||
+	     !xtables_strtoui(slash + 1, NULL, &mask, 0, MPLS_NFMARK_NUM - 1)))
+		xtables_error(PARAMETER_PROBLEM,
+			      "MPLS: bad mask in --nhlfe-by `%s'", arg);
+
+	info->by = by;
+	if (by == XT_MPLS_BY_NFMARK)
+		info->u.nf_fwd.nf_mask = mask;
+	else if (by == XT_MPLS_BY_DSMARK)
+		info->u.ds_fwd.df_mask = mask;
+}
+
+/* The key arrays of the tables all start the union */
+static void mpls_tg_parse_map(struct xt_mpls_tginfo1 *info, const char *arg)
+{
+	unsigned int value, key, mask = mpls_tg_mask(info);
+	char *buf, *tok, *next, *eq;
+
+	buf = strdup(arg);
+	if (buf == NULL)
+		xtables_error(RESOURCE_PROBLEM, "strdup");
+	for (tok = buf; tok != NULL; tok = next) {
+		next = strchr(tok, ',');
+		if (next != NULL)
+			*next++ = '\0';
+		eq = strchr(tok, '=');
+		if (eq == NULL)
+			xtables_error(PARAMETER_PROBLEM,
+				      "MPLS: `%s' is not value=key", tok);
+		*eq++ = '\0';
+		if (!xtables_strtoui(tok, NULL, &value, 0, mask) ||
+		    (value & ~mask) != 0)
+			xtables_error(PARAMETER_PROBLEM,
+				      "MPLS: value `%s' not within the "
+				      "--nhlfe-by mask 0x%x", tok, mask);
+		if (!xtables_strtoui(eq, NULL, &key, 1, UINT32_MAX))
+			xtables_error(PARAMETER_PROBLEM,
+				      "MPLS: bad NHLFE key `%s'", eq);
+		info->u.nf_fwd.nf_key[value] = key;
+	}
+	free(buf);
+}
+
+static void mpls_tg_parse(struct xt_option_call *cb)
+{
+	struct xt_mpls_tginfo1 *info = cb->data;
+
+	xtables_option_parse(cb);
+	switch (cb->entry->id) {
+	case O_NHLFE:
+		if (info->key == 0)
+			xtables_error(PARAMETER_PROBLEM,
+				      "MPLS: NHLFE key 0 is not allowed");
+		break;
+	case O_NHLFE_BY:
+		mpls_tg_parse_by(info, cb->arg);
+		break;
+	case O_NHLFE_MAP:
+		if (!(cb->xflags & F_NHLFE_BY))
+			xtables_error(PARAMETER_PROBLEM,
+				      "MPLS: --nhlfe-by has to come before "
+				      "--nhlfe-map");
+		mpls_tg_parse_map(info, cb->arg);
+		break;
+	}
+}
+
+static void mpls_tg_check(struct xt_fcheck_call *cb)
+{
+	const struct xt_mpls_tginfo1 *info = cb->data;
+	unsigned int value, mask = mpls_tg_mask(info);
+
+	if (cb->xflags == 0)
+		xtables_error(PARAMETER_PROBLEM,
+			      "MPLS: --nhlfe or --nhlfe-by is required");
+	if ((cb->xflags & F_NHLFE_BY) && !(cb->xflags & F_NHLFE_MAP))
+		xtables_error(PARAMETER_PROBLEM,
+			      "MPLS: --nhlfe-by needs --nhlfe-map");
+	/* Here, when -D or -C has been seen wherever it was */
+	if (cb->xflags & F_NHLFE_BY)
+		for (value = 0; value <= mask; ++value)
+			if ((value & ~mask) == 0)
+				mpls_check_key(info->u.nf_fwd.nf_key[value]);
+	mpls_check_key(info->key);
+}
+
+static void mpls_tg_print_by(const struct xt_mpls_tginfo1 *info)
+{
+	printf("%s", mpls_by_names[info->by]);
+	if (info->by != XT_MPLS_BY_EXP)
+		printf("/0x%x", mpls_tg_mask(info));
+}
+
+static void mpls_tg_print_map(const struct xt_mpls_tginfo1 *info,
+			      char sep)
+{
+	unsigned int value, mask = mpls_tg_mask(info);
+	char c = ' ';
+
+	for (value = 0; value <= mask; ++value) {
+		if ((value & ~mask) != 0 || info->u.nf_fwd.nf_key[value] == 0)
+			continue;
+		printf("%c%u=0x%x", c, value, info->u.nf_fwd.nf_key[value]);
+		c = sep;
+	}
+}
+
+static void mpls_tg_print(const void *ip, const struct xt_entry_target *target,
+			  int numeric)
+{
+	const struct xt_mpls_tginfo1 *info = (const void *)target->data;
+
+	if (info->by != XT_MPLS_BY_KEY) {
+		printf(" nhlfe by ");
+		mpls_tg_print_by(info);
+		mpls_tg_print_map(info, ' ');
+		if (info->key != 0)
+			printf(" else");
+	} else {
+		printf(" nhlfe");
+	}
+	if (info->key != 0)
+		printf(" 0x%x", info->key);
+}
+
+static void mpls_tg_save(const void *ip, const struct xt_entry_target *target)
+{
+	const struct xt_mpls_tginfo1 *info = (const void *)target->data;
+
+	if (info->by != XT_MPLS_BY_KEY) {
+		printf(" --nhlfe-by ");
+		mpls_tg_print_by(info);
+		printf(" --nhlfe-map");
+		mpls_tg_print_map(info, ',');
+	}
+	if (info->key != 0)
+		printf(" --nhlfe 0x%x", info->key);
 }
 static struct xtables_target mpls_tg_reg[] = {
 		{
@@ -106,7 +329,21 @@ static struct xtables_target mpls_tg_reg[] = {
 				.print		= &print,
 				.save		= &save,
 				.extra_opts	= opts
-		}
+		},
+		{
+				.family		= NFPROTO_UNSPEC,
+				.name		= "MPLS",
+				.version	= XTABLES_VERSION,
+				.revision	= 1,
+				.size		= XT_ALIGN(sizeof(struct xt_mpls_tginfo1)),
+				.userspacesize	= offsetof(struct xt_mpls_tginfo1, nhlfe),
+				.help		= mpls_tg_help,
+				.print		= mpls_tg_print,
+				.save		= mpls_tg_save,
+				.x6_parse	= mpls_tg_parse,
+				.x6_fcheck	= mpls_tg_check,
+				.x6_options	= mpls_tg_opts,
+		},
 };
 
 void _init(void)
@@ -0,0 +1,217 @@
+/* Shared library add-on to iptables to match on the MPLS label stack. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xtables.h>
+#include <linux/netfilter/xt_mpls.h>
+
+enum {
+	O_DEPTH = 0,
+	O_LABEL,
+	O_TC,
+	O_BOS,
+	O_TTL,
+};
+
+static const struct {
+	const char *name;
+	unsigned int label;
+} mpls_labels[] = {
+	{"ipv4-explicit-null",	MPLS_IPV4_EXPLICIT_NULL},
+	{"router-alert",	MPLS_ROUTER_ALERT},
+	{"ipv6-explicit-null",	MPLS_IPV6_EXPLICIT_NULL},
+	{"implicit-null",	MPLS_IMPLICIT_NULL},
+};
+
+static void mpls_mt_help(void)
+{
+	printf(
+"mpls match options:\n"
+"  --depth n                     Test the n-th label stack entry, from\n"
+"                                0, the top (default), to %u\n"
+"[!] --label label[:label]       Match the label against value or range\n"
+"                                (names: ipv4-explicit-null, router-alert,\n"
+"                                ipv6-explicit-null, implicit-null)\n"
+"[!] --tc value                  Match the traffic class (EXP) bits\n"
+"[!] --bos                       Match the bottom of stack entry\n"
+"[!] --ttl value[:value]         Match the TTL against value or range\n",
+	       XT_MPLS_DEPTH_MAX);
+}
+
+static const struct xt_option_entry mpls_mt_opts[] = {
+	{.name = "depth", .id = O_DEPTH, .type = XTTYPE_UINT8,
+	 .max = XT_MPLS_DEPTH_MAX, .flags = XTOPT_PUT,
+	 XTOPT_POINTER(struct xt_mpls_mtinfo, depth)},
+	{.name = "label", .id = O_LABEL, .type = XTTYPE_STRING,
+	 .flags = XTOPT_INVERT},
+	{.name = "tc", .id = O_TC, .type = XTTYPE_UINT8,
+	 .max = XT_MPLS_TC_MAX, .flags = XTOPT_INVERT | XTOPT_PUT,
+	 XTOPT_POINTER(struct xt_mpls_mtinfo, tc)},
+	{.name = "bos", .id = O_BOS, .type = XTTYPE_NONE,
+	 .flags = XTOPT_INVERT},
+	{.name = "ttl", .id = O_TTL, .type = XTTYPE_UINT8RC,
+	 .flags = XTOPT_INVERT},
+	XTOPT_TABLEEND,
+};
+
+static unsigned int mpls_mt_parse_label(const char *arg, size_t len)
+{
+	unsigned int i, label;
+	char *end;
+
+	for (i = 0; i < ARRAY_SIZE(mpls_labels); ++i)
+		if (strlen(mpls_labels[i].name) == len &&
+		    strncmp(arg, mpls_labels[i].name, len) == 0)
+			return mpls_labels[i].label;
+	if (!xtables_strtoui(arg, &end, &label, 0, XT_MPLS_LABEL_MAX) ||
+	    end != arg + len)
+		xtables_error(PARAMETER_PROBLEM,
+			      "mpls: bad label `%.*s', 0 to %u or a name",
+			      (int)len, arg, XT_MPLS_LABEL_MAX);
+	return label;
+}
+
+static void mpls_mt_parse(struct xt_option_call *cb)
+{
+	struct xt_mpls_mtinfo *info = cb->data;
+	const char *colon;
+	unsigned int bit = 0;
+
+	xtables_option_parse(cb);
+	switch (cb->entry->id) {
+	case O_LABEL:
+		bit = XT_MPLS_LABEL;
+		colon = strchr(cb->arg, ':');
+		if (colon == NULL) {
+			info->label_min = mpls_mt_parse_label(cb->arg,
+							      strlen(cb->arg));
+			info->label_max = info->label_min;
+			break;
+		}
+		info->label_min = mpls_mt_parse_label(cb->arg,
+						      colon - cb->arg);
+		info->label_max = mpls_mt_parse_label(colon + 1,
+						      strlen(colon + 1));
+		if (info->label_min > info->label_max)
+			xtables_error(PARAMETER_PROBLEM,
+				      "mpls: label range `%s' is backwards",
+				      cb->arg);
+		break;
+	case O_TC:
+		bit = XT_MPLS_TC;
+		break;
+	case O_BOS:
+		bit = XT_MPLS_BOS;
+		break;
+	case O_TTL:
+		bit = XT_MPLS_TTL;
+		info->ttl_min = cb->val.u8_range[0];
+		info->ttl_max = cb->nvals >= 2 ? cb->val.u8_range[1] :
+			info->ttl_min;
+		if (info->ttl_min > info->ttl_max)
+			xtables_error(PARAMETER_PROBLEM,
+				      "mpls: TTL range `%s' is backwards",
+				      cb->arg);
+		break;
+	}
+	info->flags |= bit;
+	if (cb->invert)
+		info->invert |= bit;
+}
+
+/* Reject the tests the label constants of linux/mpls.h say never match */
+static void mpls_mt_check(struct xt_fcheck_call *cb)
+{
+	const struct xt_mpls_mtinfo *info = cb->data;
+	unsigned int exact = XT_MPLS_LABEL & info->flags & ~info->invert;
+
+	if (!(info->flags & (XT_MPLS_LABEL | XT_MPLS_TC | XT_MPLS_BOS |
+			     XT_MPLS_TTL)))
+		xtables_error(PARAMETER_PROBLEM,
+			      "mpls: --label, --tc, --bos or --ttl is required");
+	if (exact && info->label_min == MPLS_IMPLICIT_NULL &&
+	    info->label_max == MPLS_IMPLICIT_NULL)
+		xtables_error(PARAMETER_PROBLEM,
+			      "mpls: implicit-null is only signalled, "
+			      "it is never in a packet");
+	if (exact && info->label_min == MPLS_ROUTER_ALERT &&
+	    info->label_max == MPLS_ROUTER_ALERT &&
+	    (info->flags & ~info->invert & XT_MPLS_BOS))
+		xtables_error(PARAMETER_PROBLEM,
+			      "mpls: router-alert is never at the bottom "
+			      "of the stack");
+}
+
+static void mpls_mt_print_label(unsigned int label, int numeric)
+{
+	unsigned int i;
+
+	if (!numeric)
+		for (i = 0; i < ARRAY_SIZE(mpls_labels); ++i)
+			if (mpls_labels[i].label == label) {
+				printf("%s", mpls_labels[i].name);
+				return;
+			}
+	printf("%u", label);
+}
+
+/* Prints both the -L and the -S form, which only differ in the option
+ * names and in whether labels are shown by name */
+static void mpls_mt_dump(const struct xt_mpls_mtinfo *info, int numeric,
+			 const char *pfx)
+{
+	if (info->depth != 0)
+		printf(" %sdepth %u", pfx, info->depth);
+	if (info->flags & XT_MPLS_LABEL) {
+		printf("%s %slabel ",
+		       info->invert & XT_MPLS_LABEL ? " !" : "", pfx);
+		mpls_mt_print_label(info->label_min, numeric);
+		if (info->label_max != info->label_min) {
+			printf(":");
+			mpls_mt_print_label(info->label_max, numeric);
+		}
+	}
+	if (info->flags & XT_MPLS_TC)
+		printf("%s %stc %u", info->invert & XT_MPLS_TC ? " !" : "",
+		       pfx, info->tc);
+	if (info->flags & XT_MPLS_BOS)
+		printf("%s %sbos", info->invert & XT_MPLS_BOS ? " !" : "",
+		       pfx);
+	if (info->flags & XT_MPLS_TTL) {
+		printf("%s %sttl %u", info->invert & XT_MPLS_TTL ? " !" : "",
+		       pfx, info->ttl_min);
+		if (info->ttl_max != info->ttl_min)
+			printf(":%u", info->ttl_max);
+	}
+}
+
+static void
+mpls_mt_print(const void *ip, const struct xt_entry_match *match, int numeric)
+{
+	printf(" mpls");
+	mpls_mt_dump((const void *)match->data, numeric, "");
+}
+
+static void mpls_mt_save(const void *ip, const struct xt_entry_match *match)
+{
+	mpls_mt_dump((const void *)match->data, 1, "--");
+}
+
+static struct xtables_match mpls_match = {
+	.family		= NFPROTO_UNSPEC,
+	.name		= "mpls",
+	.version	= XTABLES_VERSION,
+	.size		= XT_ALIGN(sizeof(struct xt_mpls_mtinfo)),
+	.userspacesize	= XT_ALIGN(sizeof(struct xt_mpls_mtinfo)),
+	.help		= mpls_mt_help,
+	.print		= mpls_mt_print,
+	.save		= mpls_mt_save,
+	.x6_parse	= mpls_mt_parse,
+	.x6_fcheck	= mpls_mt_check,
+	.x6_options	= mpls_mt_opts,
+};
+
+void _init(void)
+{
+	xtables_register_match(&mpls_match);
+}
@@ -40,6 +40,9 @@ typedef unsigned long ipq_id_t;
 #define LDEBUG(x...)
 #endif	/* DEBUG_LIBIPQ */
 
+/* Room for a message unless ipq_set_msglen() says otherwise: 8k of packet */
+#define IPQ_MSGLEN_DEFAULT	NLMSG_SPACE(sizeof(ipq_packet_msg_t) + 8192)
+
 /* FIXME: glibc sucks */
 #ifndef MSG_TRUNC
 #define MSG_TRUNC 0x20
@@ -51,8 +54,33 @@ struct ipq_handle
 	u_int8_t blocking;
 	struct sockaddr_nl local;
 	struct sockaddr_nl peer;
+	unsigned long drops;		/* overruns seen by ipq_process_pending */
+	struct ipq_pending *pending;	/* its buffers, made on first use */
+	size_t msglen;			/* the size of each */
+};
+
+struct ipq_pending;
+
+/* A buffer for ipq_read_batch(): len is its size, size what was read */
+struct ipq_msgbuf
+{
+	unsigned char *buf;
+	size_t len;
+	size_t size;
+};
+
+/* One verdict for ipq_set_verdict_batch(), as ipq_set_verdict() takes */
+struct ipq_verdict
+{
+	ipq_id_t id;
+	unsigned int verdict;
+	size_t data_len;
+	unsigned char *buf;
 };
 
+/* Called by ipq_process_pending() for each message; non-zero stops it */
+typedef int ipq_msg_fn(const unsigned char *buf, size_t len, void *data);
+
 struct ipq_handle *ipq_create_handle(u_int32_t flags, u_int32_t protocol);
 
 int ipq_destroy_handle(struct ipq_handle *h);
@@ -60,6 +88,43 @@ int ipq_destroy_handle(struct ipq_handle *h);
 ssize_t ipq_read(const struct ipq_handle *h,
                 unsigned char *buf, size_t len, int timeout);
 
+int ipq_read_batch(const struct ipq_handle *h,
+                   struct ipq_msgbuf *msgs, unsigned int n, int timeout);
+
+int ipq_fd(const struct ipq_handle *h);
+
+int ipq_set_nonblock(const struct ipq_handle *h, int on);
+
+int ipq_set_rcvbuf(const struct ipq_handle *h, size_t size);
+
+int ipq_set_msglen(struct ipq_handle *h, size_t len);
+
+int ipq_process_pending(struct ipq_handle *h, ipq_msg_fn *fn, void *data,
+                        unsigned int max);
+
+unsigned long ipq_get_drops(const struct ipq_handle *h);
+
+/* Packets read on one thread and worked on by others, see ipq_dispatch(3) */
+struct ipq_dispatch;
+
+/* Called on worker thread number worker with each packet; returns
+ * its verdict */
+typedef unsigned int ipq_work_fn(const ipq_packet_msg_t *m,
+                                 unsigned int worker, void *data);
+
+#define IPQ_DISPATCH_FLOW	0x1	/* a flow to one worker, in order */
+
+struct ipq_dispatch *ipq_dispatch_create(struct ipq_handle *h,
+                                         unsigned int workers,
+                                         unsigned int flags,
+                                         ipq_work_fn *fn, void *data);
+
+int ipq_dispatch_run(struct ipq_dispatch *d);
+
+void ipq_dispatch_stop(struct ipq_dispatch *d);
+
+void ipq_dispatch_destroy(struct ipq_dispatch *d);
+
 int ipq_set_mode(const struct ipq_handle *h, u_int8_t mode, size_t len);
 
 ipq_packet_msg_t *ipq_get_packet(const unsigned char *buf);
@@ -74,6 +139,9 @@ int ipq_set_verdict(const struct ipq_handle *h,
                     size_t data_len,
                     unsigned char *buf);
 
+int ipq_set_verdict_batch(const struct ipq_handle *h,
+                          const struct ipq_verdict *v, unsigned int n);
+
 int ipq_ctl(const struct ipq_handle *h, int request, ...);
 
 char *ipq_errstr(void);
@@ -10,8 +10,10 @@
 #	include <limits.h> /* INT_MAX in ip6_tables.h */
 #endif
 #include <linux/netfilter_ipv6/ip6_tables.h>
+#include <libiptc/libxtc.h>
 
 struct ip6tc_handle;
+struct ip6tc_snapshot;
 
 typedef char ip6t_chainlabel[32];
 
@@ -19,6 +21,7 @@ typedef char ip6t_chainlabel[32];
 #define IP6TC_LABEL_DROP "DROP"
 #define IP6TC_LABEL_QUEUE   "QUEUE"
 #define IP6TC_LABEL_RETURN "RETURN"
+#define IP6TC_LABEL_INDETERMINATE XTC_LABEL_INDETERMINATE
 
 /* Does this chain exist? */
 int ip6tc_is_chain(const char *chain, struct ip6tc_handle *const handle);
@@ -26,6 +29,10 @@ int ip6tc_is_chain(const char *chain, struct ip6tc_handle *const handle);
 /* Take a snapshot of the rules. Returns NULL on error. */
 struct ip6tc_handle *ip6tc_init(const char *tablename);
 
+/* An empty standard table built without the kernel, for working on
+   rules offline; it can't be committed.  Returns NULL on error. */
+struct ip6tc_handle *ip6tc_init_offline(const char *tablename);
+
 /* Cleanup after ip6tc_init(). */
 void ip6tc_free(struct ip6tc_handle *h);
 
@@ -98,6 +105,69 @@ const char *ip6tc_check_packet(const ip6t_chainlabel chain,
 			       struct ip6t_entry *,
 			       struct ip6tc_handle *handle);
 
+/* Like ip6tc_check_packet(), but with the rest of the packet in `pkt'
+   (may be NULL) and `trace' (may be NULL) called for each rule the
+   packet is compared against.  Returns IP6TC_LABEL_INDETERMINATE when
+   a rule that might apply can't be evaluated in userspace. */
+const char *ip6tc_trace_packet(const ip6t_chainlabel chain,
+			       const struct ip6t_entry *entry,
+			       const struct xtc_packet *pkt,
+			       xtc_trace_fn trace, void *data,
+			       struct ip6tc_handle *handle);
+
+/* Add a userspace evaluator for a match, used by ip6tc_trace_packet(). */
+void ip6tc_register_match_eval(struct xtc_match_eval *me);
+
+/* Build decision trees that let ip6tc_trace_packet() skip rules whose
+   addresses, protocol or interfaces can't match.  They are dropped
+   when the handle is changed. */
+int ip6tc_build_classifier(struct ip6tc_handle *handle);
+
+/* Sort the rules of a chain by their packet counters, moving a rule
+   only past rules no packet can match along with it, or that give the
+   same verdict.  The result is equivalent to the chain before. */
+int ip6tc_reorder_chain(const ip6t_chainlabel chain,
+				struct xtc_reorder_stats *stats,
+				struct ip6tc_handle *handle);
+
+/* Replace each run of at least `min_rules' rules of a chain that only
+   differ in their source (or destination) prefix with a jump into a
+   tree of new chains, which a packet goes down in a number of rules
+   logarithmic in the length of the run.  The result is equivalent to
+   the chain before. */
+int ip6tc_bisect_chain(const ip6t_chainlabel chain, unsigned int min_rules,
+			       struct xtc_bisect_stats *stats,
+			       struct ip6tc_handle *handle);
+
+/* Replace each run of at least `min_rules' rules of a chain that start
+   with the same header fields or matches with one rule testing them,
+   which jumps to a new chain holding the rest of the rules.  The
+   result is equivalent to the chain before. */
+int ip6tc_factor_chain(const ip6t_chainlabel chain, unsigned int min_rules,
+			       struct xtc_factor_stats *stats,
+			       struct ip6tc_handle *handle);
+
+/* Call `fn' for every rule of a chain that can never match, is the
+   same as an earlier one, or can go as the rest of the chain does the
+   same with its packets. */
+int ip6tc_analyze_chain(const ip6t_chainlabel chain, xtc_finding_fn fn,
+			void *data, struct ip6tc_handle *handle);
+
+/* Replace each run of at least `min_rules' rules of a chain that only
+   differ in their source, or destination, prefix with one rule testing
+   the match `fn' gives for the prefixes, such as an ipset. */
+int ip6tc_compact_chain(const ip6t_chainlabel chain, unsigned int min_rules,
+			xtc_compact_fn fn, void *data,
+			struct xtc_compact_stats *stats,
+			struct ip6tc_handle *handle);
+
+/* Replace each run of rules of a chain that only differ in the ports
+   they test with tcp, udp or multiport with as few multiport rules as
+   the ports fit in. */
+int ip6tc_multiport_chain(const ip6t_chainlabel chain,
+			  struct xtc_ports_stats *stats,
+			  struct ip6tc_handle *handle);
+
 /* Flushes the entries in the given chain (ie. empties chain). */
 int ip6tc_flush_entries(const ip6t_chainlabel chain,
 			struct ip6tc_handle *handle);
@@ -154,6 +224,24 @@ int ip6tc_get_raw_socket(void);
 /* Translates errno numbers into more human-readable form than strerror. */
 const char *ip6tc_strerror(int err);
 
+/* Copy the table as it was read by ip6tc_init(), counters included. */
+struct ip6tc_snapshot *ip6tc_snapshot(struct ip6tc_handle *handle);
+
+/* Cleanup after ip6tc_snapshot() or ip6tc_snapshot_load(). */
+void ip6tc_snapshot_free(struct ip6tc_snapshot *snap);
+
+/* Name of the table in the snapshot. */
+const char *ip6tc_snapshot_table(const struct ip6tc_snapshot *snap);
+
+/* Append the snapshot to a file; binary, for this machine only. */
+int ip6tc_snapshot_save(const struct ip6tc_snapshot *snap, int fd);
+
+/* Read the next snapshot; NULL with errno 0 at end of file. */
+struct ip6tc_snapshot *ip6tc_snapshot_load(int fd);
+
+/* Replace the table in the kernel with the snapshot. */
+int ip6tc_rollback(const struct ip6tc_snapshot *snap);
+
 /* Return prefix length, or -1 if not contiguous */
 int ipv6_prefix_length(const struct in6_addr *a);
 
@@ -10,12 +10,14 @@
 #	include <limits.h> /* INT_MAX in ip_tables.h */
 #endif
 #include <linux/netfilter_ipv4/ip_tables.h>
+#include <libiptc/libxtc.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 struct iptc_handle;
+struct iptc_snapshot;
 
 typedef char ipt_chainlabel[32];
 
@@ -23,6 +25,7 @@ typedef char ipt_chainlabel[32];
 #define IPTC_LABEL_DROP    "DROP"
 #define IPTC_LABEL_QUEUE   "QUEUE"
 #define IPTC_LABEL_RETURN  "RETURN"
+#define IPTC_LABEL_INDETERMINATE XTC_LABEL_INDETERMINATE
 
 /* Does this chain exist? */
 int iptc_is_chain(const char *chain, struct iptc_handle *const handle);
@@ -30,6 +33,10 @@ int iptc_is_chain(const char *chain, struct iptc_handle *const handle);
 /* Take a snapshot of the rules.  Returns NULL on error. */
 struct iptc_handle *iptc_init(const char *tablename);
 
+/* An empty standard table built without the kernel, for working on
+   rules offline; it can't be committed.  Returns NULL on error. */
+struct iptc_handle *iptc_init_offline(const char *tablename);
+
 /* Cleanup after iptc_init(). */
 void iptc_free(struct iptc_handle *h);
 
@@ -103,6 +110,69 @@ const char *iptc_check_packet(const ipt_chainlabel chain,
 			      struct ipt_entry *entry,
 			      struct iptc_handle *handle);
 
+/* Like iptc_check_packet(), but with the rest of the packet in `pkt'
+   (may be NULL) and `trace' (may be NULL) called for each rule the
+   packet is compared against.  Returns IPTC_LABEL_INDETERMINATE when
+   a rule that might apply can't be evaluated in userspace. */
+const char *iptc_trace_packet(const ipt_chainlabel chain,
+			      const struct ipt_entry *entry,
+			      const struct xtc_packet *pkt,
+			      xtc_trace_fn trace, void *data,
+			      struct iptc_handle *handle);
+
+/* Add a userspace evaluator for a match, used by iptc_trace_packet(). */
+void iptc_register_match_eval(struct xtc_match_eval *me);
+
+/* Build decision trees that let iptc_trace_packet() skip rules whose
+   addresses, protocol or interfaces can't match.  They are dropped
+   when the handle is changed. */
+int iptc_build_classifier(struct iptc_handle *handle);
+
+/* Sort the rules of a chain by their packet counters, moving a rule
+   only past rules no packet can match along with it, or that give the
+   same verdict.  The result is equivalent to the chain before. */
+int iptc_reorder_chain(const ipt_chainlabel chain,
+			       struct xtc_reorder_stats *stats,
+			       struct iptc_handle *handle);
+
+/* Replace each run of at least `min_rules' rules of a chain that only
+   differ in their source (or destination) prefix with a jump into a
+   tree of new chains, which a packet goes down in a number of rules
+   logarithmic in the length of the run.  The result is equivalent to
+   the chain before. */
+int iptc_bisect_chain(const ipt_chainlabel chain, unsigned int min_rules,
+			      struct xtc_bisect_stats *stats,
+			      struct iptc_handle *handle);
+
+/* Replace each run of at least `min_rules' rules of a chain that start
+   with the same header fields or matches with one rule testing them,
+   which jumps to a new chain holding the rest of the rules.  The
+   result is equivalent to the chain before. */
+int iptc_factor_chain(const ipt_chainlabel chain, unsigned int min_rules,
+			      struct xtc_factor_stats *stats,
+			      struct iptc_handle *handle);
+
+/* Call `fn' for every rule of a chain that can never match, is the
+   same as an earlier one, or can go as the rest of the chain does the
+   same with its packets. */
+int iptc_analyze_chain(const ipt_chainlabel chain, xtc_finding_fn fn,
+		       void *data, struct iptc_handle *handle);
+
+/* Replace each run of at least `min_rules' rules of a chain that only
+   differ in their source, or destination, prefix with one rule testing
+   the match `fn' gives for the prefixes, such as an ipset. */
+int iptc_compact_chain(const ipt_chainlabel chain, unsigned int min_rules,
+		       xtc_compact_fn fn, void *data,
+		       struct xtc_compact_stats *stats,
+		       struct iptc_handle *handle);
+
+/* Replace each run of rules of a chain that only differ in the ports
+   they test with tcp, udp or multiport with as few multiport rules as
+   the ports fit in. */
+int iptc_multiport_chain(const ipt_chainlabel chain,
+			 struct xtc_ports_stats *stats,
+			 struct iptc_handle *handle);
+
 /* Flushes the entries in the given chain (ie. empties chain). */
 int iptc_flush_entries(const ipt_chainlabel chain,
 		       struct iptc_handle *handle);
@@ -160,6 +230,24 @@ int iptc_get_raw_socket(void);
 /* Translates errno numbers into more human-readable form than strerror. */
 const char *iptc_strerror(int err);
 
+/* Copy the table as it was read by iptc_init(), counters included. */
+struct iptc_snapshot *iptc_snapshot(struct iptc_handle *handle);
+
+/* Cleanup after iptc_snapshot() or iptc_snapshot_load(). */
+void iptc_snapshot_free(struct iptc_snapshot *snap);
+
+/* Name of the table in the snapshot. */
+const char *iptc_snapshot_table(const struct iptc_snapshot *snap);
+
+/* Append the snapshot to a file; binary, for this machine only. */
+int iptc_snapshot_save(const struct iptc_snapshot *snap, int fd);
+
+/* Read the next snapshot; NULL with errno 0 at end of file. */
+struct iptc_snapshot *iptc_snapshot_load(int fd);
+
+/* Replace the table in the kernel with the snapshot. */
+int iptc_rollback(const struct iptc_snapshot *snap);
+
 extern void dump_entries(struct iptc_handle *const);
 
 #ifdef __cplusplus
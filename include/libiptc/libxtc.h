@@ -3,6 +3,7 @@
 /* Library which manipulates filtering rules. */
 
 #include <libiptc/ipt_kernel_headers.h>
+#include <linux/netfilter.h>
 #include <linux/netfilter/x_tables.h>
 
 #ifdef __cplusplus
@@ -24,6 +25,119 @@ extern "C" {
 #define XTC_LABEL_DROP    "DROP"
 #define XTC_LABEL_QUEUE   "QUEUE"
 #define XTC_LABEL_RETURN  "RETURN"
+/* check_packet() could not decide: a rule uses something it can't evaluate */
+#define XTC_LABEL_INDETERMINATE "INDETERMINATE"
+
+/* Which of the optional fields of struct xtc_packet are valid */
+enum {
+	XTC_PKT_PORTS		= 1 << 0,
+	XTC_PKT_TCPFLAGS	= 1 << 1,
+	XTC_PKT_ICMP		= 1 << 2,
+	XTC_PKT_MARK		= 1 << 3,
+	XTC_PKT_LENGTH		= 1 << 4,
+};
+
+/* A packet as seen by the match evaluators of trace_packet().  The
+   layer 3 fields are filled in from the entry describing the packet;
+   the rest is up to the caller, ports in host byte order. */
+struct xtc_packet {
+	__u8			family;		/* NFPROTO_* */
+	__u8			valid;		/* XTC_PKT_* */
+	__u8			fragment;	/* not the first fragment */
+	__u8			tcp_flags;
+	union nf_inet_addr	src, dst;
+	__u16			sport, dport;
+	__u8			icmp_type, icmp_code;
+	__u16			length;		/* as seen by -m length */
+	__u32			mark;
+};
+
+enum xtc_eval_result {
+	XTC_EVAL_NOMATCH = 0,
+	XTC_EVAL_MATCH,
+	XTC_EVAL_INDETERMINATE,
+};
+
+/* Userspace version of a match, for trace_packet().  Matches without
+   one make the rules using them indeterminate. */
+struct xtc_match_eval {
+	struct xtc_match_eval *next;
+	const char *name;
+	__u8 revision;
+	__u8 family;			/* NFPROTO_UNSPEC for any */
+	enum xtc_eval_result (*eval)(const struct xt_entry_match *match,
+				     const struct xtc_packet *pkt);
+};
+
+/* Called for every rule a packet is compared against (rulenum from 1),
+   and with rulenum 0 when the policy of a built-in chain applies. */
+typedef void (*xtc_trace_fn)(const char *chain, unsigned int rulenum,
+			     enum xtc_eval_result result, void *data);
+
+/* What reorder_chain() did.  The depths are the positions of the rules
+   weighted by the packets they matched: divide by packets for the mean
+   number of rules a packet went through. */
+struct xtc_reorder_stats {
+	__u64 packets;
+	__u64 depth_before, depth_after;
+	unsigned int moved;		/* rules not in their old place */
+};
+
+/* What bisect_chain() did.  The depths are the most rules a packet
+   could go through in one of the runs before, and in its tree now. */
+struct xtc_bisect_stats {
+	unsigned int runs, rules;	/* runs replaced, rules in them */
+	unsigned int chains;		/* chains added */
+	unsigned int copies;		/* rules put in more than one leaf */
+	unsigned int depth_before, depth_after;
+};
+
+/* What analyze_chain() finds wrong with a rule */
+enum xtc_rule_finding {
+	XTC_RULE_SHADOWED,	/* earlier rules take all its packets */
+	XTC_RULE_DUPLICATE,	/* the same as an earlier rule */
+	XTC_RULE_REDUNDANT,	/* the later rules, or the end of the chain,
+				   do the same to all its packets */
+};
+
+/* Called for each rule with a finding, rulenum from 1.  `by' is the
+   earlier (or later) rule it comes from, 0 for the end of the chain.
+   `removable' tells if the chain stays equivalent without the rule. */
+typedef void (*xtc_finding_fn)(const char *chain, unsigned int rulenum,
+			       enum xtc_rule_finding finding, unsigned int by,
+			       int removable, void *data);
+
+/* What factor_chain() did */
+struct xtc_factor_stats {
+	unsigned int runs, rules;	/* runs replaced, rules in them */
+	unsigned int tests;		/* header fields and matches taken
+					   out of the rules */
+};
+
+/* A prefix of the run that compact_chain() hands to its callback */
+struct xtc_prefix {
+	union nf_inet_addr	addr;
+	unsigned int		len;
+};
+
+/* Called for each run of rules that only differ in their source (`dst':
+   destination) prefix.  Returns the match to test instead of the
+   prefixes, copied into the rule put in place of the run, or NULL to
+   leave the run as it is. */
+typedef const struct xt_entry_match *
+(*xtc_compact_fn)(const char *chain, int dst, const struct xtc_prefix *prefixes,
+		  unsigned int n, void *data);
+
+/* What compact_chain() did */
+struct xtc_compact_stats {
+	unsigned int runs, rules;	/* runs replaced, rules in them */
+};
+
+/* What multiport_chain() did */
+struct xtc_ports_stats {
+	unsigned int runs, rules;	/* runs replaced, rules in them */
+	unsigned int merged;		/* rules put in their place */
+};
 
 
 #ifdef __cplusplus
@@ -15,25 +15,80 @@
 #include <linux/netfilter_ipv4/ipt_ULOG.h>
 
 /* FIXME: glibc sucks */
-#ifndef MSG_TRUNC 
+#ifndef MSG_TRUNC
 #define MSG_TRUNC	0x20
 #endif
 
+/* Room for the largest message the kernel sends: ULOG_MAX_QLEN packets */
+#define IPULOG_BUFSIZE	131072
+
 struct ipulog_handle;
 
+/* A buffer for ipulog_read_batch(): len is its size, size what was read
+ * and group the multicast group it came to, 0 if not known */
+struct ipulog_msgbuf
+{
+	unsigned char *buf;
+	size_t len;
+	size_t size;
+	u_int32_t group;
+};
+
+/* Walks the packets of a message read, where they are */
+struct ipulog_iter
+{
+	const unsigned char *buf;
+	size_t len;			/* from buf to the end of the message */
+	int done;
+	unsigned int invalid;		/* parts left out as malformed */
+};
+
+/* Called by the threads of ipulog_threads_start() for each packet */
+typedef void ipulog_fn(const ulog_packet_msg_t *pkt, u_int32_t group,
+		       void *data);
+
+struct ipulog_threads;
+
 u_int32_t ipulog_group2gmask(u_int32_t group);
 
 struct ipulog_handle *ipulog_create_handle(u_int32_t gmask);
 
+struct ipulog_handle *ipulog_open_capture(const char *file);
+
 void ipulog_destroy_handle(struct ipulog_handle *h);
 
 ssize_t ipulog_read(struct ipulog_handle *h,
 		    unsigned char *buf, size_t len, int timeout);
 
+int ipulog_read_batch(struct ipulog_handle *h,
+		      struct ipulog_msgbuf *msgs, unsigned int n, int timeout);
+
 ulog_packet_msg_t *ipulog_get_packet(struct ipulog_handle *h,
 				     const unsigned char *buf,
 				     size_t len);
 
+void ipulog_iter_init(struct ipulog_iter *it,
+		      const unsigned char *buf, size_t len);
+
+ulog_packet_msg_t *ipulog_iter_next(struct ipulog_iter *it);
+
+int ipulog_fd(const struct ipulog_handle *h);
+
+int ipulog_set_rcvbuf(const struct ipulog_handle *h, size_t size);
+
+unsigned long ipulog_get_drops(const struct ipulog_handle *h);
+
+struct ipulog_threads *ipulog_threads_start(u_int32_t gmask,
+					    unsigned int nthreads,
+					    size_t rcvbuf,
+					    ipulog_fn *fn, void *data);
+
+unsigned long ipulog_threads_drops(const struct ipulog_threads *t);
+
+int ipulog_threads_stop(struct ipulog_threads *t);
+
+char *ipulog_errstr(void);
+
 void ipulog_perror(const char *s);
 
 #endif /* _LIBULOG_H */
@@ -0,0 +1,133 @@
+/*
+ * libmpls.h
+ *
+ * Programming the ILM, NHLFE and XC tables of the nlmpls generic
+ * netlink family from userspace.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+#ifndef _LIBMPLS_H
+#define _LIBMPLS_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <linux/mpls.h>
+
+#define MPLS_GENL_VERSION	1
+
+/*
+ * How requests reach the nlmpls family.  send() is given one buffer of
+ * one or more netlink messages; recv() returns one or more, as many
+ * as fit in len, and -1 with errno set if nothing came.  The default
+ * is a NETLINK_GENERIC socket; mpls_fake_transport() answers in the
+ * same process, without a kernel.
+ */
+struct mpls_transport {
+	ssize_t (*send)(void *priv, const void *buf, size_t len);
+	ssize_t (*recv)(void *priv, void *buf, size_t len);
+	void (*close)(void *priv);
+	void *priv;
+};
+
+struct mpls_handle;
+
+/* Called by mpls_commit() for each request the kernel refused: index
+ * counts the requests queued since the last commit, from 0 */
+typedef void mpls_error_fn(unsigned int index, int error, void *data);
+
+/* Called by mpls_dump() for each object: a struct mpls_in_label_req,
+ * mpls_out_label_req, mpls_xconnect_req or mpls_labelspace_req, and
+ * its instructions if it has any */
+typedef void mpls_dump_fn(const void *obj, size_t len,
+			  const struct mpls_instr_req *instr, void *data);
+
+struct mpls_handle *mpls_open(void);
+struct mpls_handle *mpls_open_transport(const struct mpls_transport *tp);
+void mpls_close(struct mpls_handle *h);
+
+int mpls_set_batch(struct mpls_handle *h, size_t bufsize,
+		   unsigned int window);
+
+int mpls_request(struct mpls_handle *h, int cmd, const void *obj,
+		 size_t len, const struct mpls_instr_req *instr);
+
+int mpls_ilm_add(struct mpls_handle *h, const struct mpls_in_label_req *ilm,
+		 const struct mpls_instr_req *instr);
+int mpls_ilm_del(struct mpls_handle *h, const struct mpls_in_label_req *ilm);
+int mpls_nhlfe_add(struct mpls_handle *h,
+		   const struct mpls_out_label_req *nhlfe,
+		   const struct mpls_instr_req *instr);
+int mpls_nhlfe_del(struct mpls_handle *h,
+		   const struct mpls_out_label_req *nhlfe);
+int mpls_xc_add(struct mpls_handle *h, const struct mpls_xconnect_req *xc);
+int mpls_xc_del(struct mpls_handle *h, const struct mpls_xconnect_req *xc);
+int mpls_labelspace_set(struct mpls_handle *h,
+			const struct mpls_labelspace_req *ls);
+
+unsigned int mpls_queued(const struct mpls_handle *h);
+int mpls_commit(struct mpls_handle *h, mpls_error_fn *fn, void *data);
+void mpls_abort(struct mpls_handle *h);
+
+int mpls_dump(struct mpls_handle *h, int cmd, mpls_dump_fn *fn, void *data);
+
+size_t mpls_instr_size(unsigned int n);
+
+int mpls_fake_transport(struct mpls_transport *tp);
+
+struct mpls_instr_set;
+
+/* Called by mpls_instr_set_walk() for each sequence; non-zero stops */
+typedef int mpls_instr_walk_fn(u_int32_t key,
+			       const struct mpls_instr_req *instr,
+			       unsigned int uses, void *data);
+
+struct mpls_instr_req *mpls_instr_compile(const char *text, int dir,
+					  char *err, size_t errlen);
+int mpls_instr_check(const struct mpls_instr_req *instr, char *err,
+		     size_t errlen);
+int mpls_instr_format(const struct mpls_instr_req *instr, char *buf,
+		      size_t len);
+
+struct mpls_instr_set *mpls_instr_set_new(u_int32_t base);
+void mpls_instr_set_free(struct mpls_instr_set *s);
+u_int32_t mpls_instr_set_key(struct mpls_instr_set *s,
+			     const struct mpls_instr_req *instr);
+unsigned int mpls_instr_set_size(const struct mpls_instr_set *s);
+int mpls_instr_set_walk(const struct mpls_instr_set *s,
+			mpls_instr_walk_fn *fn, void *data);
+
+int mpls_nhlfe_cached(u_int32_t key);
+int mpls_nhlfe_cache_fill(struct mpls_handle *h);
+int mpls_nhlfe_cache_file(const char *path);
+void mpls_nhlfe_cache_flush(void);
+
+/* Labels of each label space, given out from the lowest free one */
+struct mpls_label_pool;
+
+enum {
+	MPLS_POOL_FREE = 0,
+	MPLS_POOL_USED,
+	MPLS_POOL_RESERVED,
+};
+
+struct mpls_label_pool *mpls_pool_new(void);
+void mpls_pool_free(struct mpls_label_pool *p);
+int mpls_pool_reserve(struct mpls_label_pool *p, int ls, u_int32_t first,
+		      u_int32_t last);
+int mpls_pool_unreserve(struct mpls_label_pool *p, int ls, u_int32_t first,
+			u_int32_t last);
+int mpls_pool_alloc(struct mpls_label_pool *p, int ls, u_int32_t *labels,
+		    unsigned int n);
+int mpls_pool_take(struct mpls_label_pool *p, int ls, u_int32_t label);
+int mpls_pool_release(struct mpls_label_pool *p, int ls,
+		      const u_int32_t *labels, unsigned int n);
+int mpls_pool_test(const struct mpls_label_pool *p, int ls, u_int32_t label);
+unsigned int mpls_pool_avail(const struct mpls_label_pool *p, int ls);
+int mpls_pool_save(const struct mpls_label_pool *p, const char *path);
+struct mpls_label_pool *mpls_pool_load(const char *path);
+
+#endif	/* _LIBMPLS_H */
@@ -1,6 +1,8 @@
 #ifndef _XT_MPLS_H_target
 #define _XT_MPLS_H_target
 
+#include <linux/mpls.h>
+
 struct xt_MPLS_target_info {
 	u_int32_t key;
 
@@ -9,4 +11,28 @@ struct xt_MPLS_target_info {
 	void *proto;
 };
 
+/* Revision 1: the NHLFE is looked up in a table by the mark, the DSCP
+ * or the EXP bits of the packet, as by MPLS_OP_{NF,DS,EXP}_FWD */
+enum xt_mpls_by {
+	XT_MPLS_BY_KEY = 0,		/* no table, only the key */
+	XT_MPLS_BY_NFMARK,		/* nf_key[mark & nf_mask] */
+	XT_MPLS_BY_DSMARK,		/* df_key[dscp & df_mask] */
+	XT_MPLS_BY_EXP,			/* ef_key[exp] */
+};
+
+struct xt_mpls_tginfo1 {
+	u_int32_t key;			/* where the table has no key,
+					   0 to let the packet go on */
+	u_int8_t by;			/* enum xt_mpls_by */
+	union {
+		struct mpls_nfmark_fwd nf_fwd;
+		struct mpls_dsmark_fwd ds_fwd;
+		struct mpls_exp_fwd exp_fwd;
+	} u;				/* keys 0 where unset */
+
+	/* only used by the netfilter kernel modules */
+	void *nhlfe[MPLS_NFMARK_NUM + 1] __attribute__((aligned(8)));
+	void *proto;
+};
+
 #endif /*_XT_MPLS_H_target */
@@ -0,0 +1,35 @@
+#ifndef _XT_MPLS_H
+#define _XT_MPLS_H
+
+#include <linux/types.h>
+#include <linux/mpls.h>
+
+/* One label stack entry, MPLS_HDR_LEN bytes in network order:
+ * label:20 tc:3 bottom-of-stack:1 ttl:8 */
+#define XT_MPLS_LABEL_SHIFT	12
+#define XT_MPLS_LABEL_MAX	0xfffff
+#define XT_MPLS_TC_SHIFT	9
+#define XT_MPLS_TC_MAX		7
+#define XT_MPLS_BOS_SHIFT	8
+#define XT_MPLS_TTL_MAX		0xff
+
+/* Deepest entry a rule can test, 0 being the top of the stack */
+#define XT_MPLS_DEPTH_MAX	7
+
+enum {
+	XT_MPLS_LABEL	= 1 << 0,
+	XT_MPLS_TC	= 1 << 1,
+	XT_MPLS_BOS	= 1 << 2,
+	XT_MPLS_TTL	= 1 << 3,
+};
+
+struct xt_mpls_mtinfo {
+	__u32 label_min, label_max;
+	__u8 tc;
+	__u8 ttl_min, ttl_max;
+	__u8 depth;
+	__u8 flags;			/* XT_MPLS_*: what to test */
+	__u8 invert;			/* XT_MPLS_*: which tests to invert */
+};
+
+#endif /*_XT_MPLS_H*/
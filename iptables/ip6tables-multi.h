@@ -1,8 +1,17 @@
 #ifndef _IP6TABLES_MULTI_H
 #define _IP6TABLES_MULTI_H 1
 
+struct ip6tc_handle;
+
 extern int ip6tables_main(int, char **);
 extern int ip6tables_save_main(int, char **);
 extern int ip6tables_restore_main(int, char **);
+extern int ip6tables_daemon_main(int, char **);
+extern int ip6tables_safe_apply_main(int, char **);
+extern int ip6tables_replay_main(int, char **);
+extern int ip6tables_optimize_main(int, char **);
+extern int ip6tables_analyze_main(int, char **);
+extern void ip6tables_restore_offline(int (*)(struct ip6tc_handle *));
+extern void ip6tables_save_handle(const char *, struct ip6tc_handle *, int);
 
 #endif /* _IP6TABLES_MULTI_H */
@@ -17,6 +17,7 @@
 #include "ip6tables.h"
 #include "xtables.h"
 #include "libiptc/libip6tc.h"
+#include "xshared.h"
 #include "ip6tables-multi.h"
 
 #ifdef DEBUG
@@ -36,6 +37,7 @@ static const struct option options[] = {
 	{.name = "help",     .has_arg = false, .val = 'h'},
 	{.name = "noflush",  .has_arg = false, .val = 'n'},
 	{.name = "modprobe", .has_arg = true,  .val = 'M'},
+	{.name = "table",    .has_arg = true,  .val = 'T'},
 	{NULL},
 };
 
@@ -50,16 +52,29 @@ static void print_usage(const char *name, const char *version)
 			"	   [ --test ]\n"
 			"	   [ --help ]\n"
 			"	   [ --noflush ]\n"
+			"	   [ --table=<TABLE> ]\n"
 			"          [ --modprobe=<command>]\n", name);
 
 	exit(1);
 }
 
+/* Set by ip6tables-replay: tables start out empty instead of being read
+ * from the kernel, and go to this function at COMMIT. */
+static int (*offline_commit)(struct ip6tc_handle *handle);
+
+void ip6tables_restore_offline(int (*commit)(struct ip6tc_handle *handle))
+{
+	offline_commit = commit;
+}
+
 static struct ip6tc_handle *create_handle(const char *tablename)
 {
 	struct ip6tc_handle *handle;
 
-	handle = ip6tc_init(tablename);
+	if (offline_commit != NULL)
+		handle = ip6tc_init_offline(tablename);
+	else
+		handle = ip6tc_init(tablename);
 
 	if (!handle) {
 		/* try to insmod the module if iptc_init failed */
@@ -125,6 +140,7 @@ int main(int argc, char *argv[])
 	char curtable[IP6T_TABLE_MAXNAMELEN + 1];
 	FILE *in;
 	int in_table = 0, testing = 0;
+	const char *tablename = NULL;
 
 	line = 0;
 
@@ -141,7 +157,7 @@ int main(int argc, char *argv[])
 	init_extensions6();
 #endif
 
-	while ((c = getopt_long(argc, argv, "bcvthnM:", options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "bcvthnM:T:", options, NULL)) != -1) {
 		switch (c) {
 			case 'b':
 				binary = 1;
@@ -165,6 +181,9 @@ int main(int argc, char *argv[])
 			case 'M':
 				xtables_modprobe_program = optarg;
 				break;
+			case 'T':
+				tablename = optarg;
+				break;
 		}
 	}
 
@@ -182,6 +201,9 @@ int main(int argc, char *argv[])
 	}
 	else in = stdin;
 
+	/* Resolve all hostnames in one go rather than line by line */
+	in = xs_prefetch_hostnames(in, NFPROTO_IPV6);
+
 	/* Grab standard input. */
 	while (fgets(buffer, sizeof(buffer), in)) {
 		int ret = 0;
@@ -194,7 +216,10 @@ int main(int argc, char *argv[])
 				fputs(buffer, stdout);
 			continue;
 		} else if ((strcmp(buffer, "COMMIT\n") == 0) && (in_table)) {
-			if (!testing) {
+			if (offline_commit != NULL) {
+				ret = offline_commit(handle);
+				handle = NULL;
+			} else if (!testing) {
 				DEBUGP("Calling commit\n");
 				ret = ip6tc_commit(handle);
 				ip6tc_free(handle);
@@ -220,6 +245,8 @@ int main(int argc, char *argv[])
 			strncpy(curtable, table, IP6T_TABLE_MAXNAMELEN);
 			curtable[IP6T_TABLE_MAXNAMELEN] = '\0';
 
+			if (tablename && (strcmp(tablename, table) != 0))
+				continue;
 			if (handle)
 				ip6tc_free(handle);
 
@@ -36,6 +36,7 @@
 #include <errno.h>
 #include <ip6tables.h>
 #include "ip6tables-multi.h"
+#include "xshared.h"
 
 #ifdef IPTABLES_MULTI
 int
@@ -63,6 +64,10 @@ main(int argc, char *argv[])
 	init_extensions6();
 #endif
 
+	ret = xs_batch_main(argc, argv, &ip6tables_batch_ops);
+	if (ret >= 0)
+		exit(ret);
+
 	ret = do_command6(argc, argv, &table, &handle);
 	if (ret) {
 		ret = ip6tc_commit(handle);
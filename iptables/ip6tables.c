@@ -122,6 +122,7 @@ static struct option original_opts[] = {
 	{.name = "help",          .has_arg = 2, .val = 'h'},
 	{.name = "line-numbers",  .has_arg = 0, .val = '0'},
 	{.name = "modprobe",      .has_arg = 1, .val = 'M'},
+	{.name = "aggregate",     .has_arg = 0, .val = 'a'},
 	{.name = "set-counters",  .has_arg = 1, .val = 'c'},
 	{.name = "goto",          .has_arg = 1, .val = 'g'},
 	{.name = "ipv4",          .has_arg = 0, .val = '4'},
@@ -195,6 +196,8 @@ struct pprot {
 static void __attribute__((noreturn))
 exit_tryhelp(int status)
 {
+	/* In batch mode, only this command fails */
+	xs_batch_exit(status);
 	if (line != -1)
 		fprintf(stderr, "Error occurred at line: %d\n", line);
 	fprintf(stderr, "Try `%s -h' or '%s --help' for more information.\n",
@@ -277,6 +280,9 @@ exit_printhelp(const struct xtables_rule_match *matches)
 /*"[!] --fragment	-f		match second or further fragments only\n"*/
 "  --modprobe=<command>		try to insert modules using this command\n"
 "  --set-counters PKTS BYTES	set the counter during insert/append\n"
+"  --batch FILE|- [--commit-every N]\n"
+"				run one command per line, committing once\n"
+"  --aggregate			merge overlapping -s/-d prefixes\n"
 "[!] --version	-V		print package version.\n");
 
 	print_extension_helps(xtables_targets, matches);
@@ -1140,7 +1146,8 @@ void print_rule6(const struct ip6t_entry *e,
 
 	/* Print targinfo part */
 	t = ip6t_get_target((struct ip6t_entry *)e);
-	if (t->u.user.name[0]) {
+	/* jumps in rules not yet committed still carry the chain name */
+	if (t->u.user.name[0] && !ip6tc_is_chain(t->u.user.name, h)) {
 		struct xtables_target *target =
 			xtables_find_target(t->u.user.name, XTF_TRY_LOAD);
 
@@ -1328,6 +1335,28 @@ static void command_match(struct iptables_command_state *cs)
 					     m->extra_opts, &m->option_offset);
 }
 
+/* What do_command6 has allocated, for batch mode to free if it bails out */
+struct command_alloc6 {
+	struct iptables_command_state *cs;
+	struct ip6t_entry **e;
+	struct in6_addr **addrs[4];
+};
+
+static void command_cleanup6(void *arg)
+{
+	struct command_alloc6 *a = arg;
+	unsigned int i;
+
+	clear_rule_matches(&a->cs->matches);
+	if (a->cs->target != NULL) {
+		free(a->cs->target->t);
+		a->cs->target->t = NULL;
+	}
+	free(*a->e);
+	for (i = 0; i < ARRAY_SIZE(a->addrs); ++i)
+		free(*a->addrs[i]);
+}
+
 int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **handle)
 {
 	struct iptables_command_state cs;
@@ -1337,6 +1366,7 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 	struct in6_addr *smasks = NULL, *dmasks = NULL;
 
 	int verbose = 0;
+	bool aggregate = false;
 	const char *chain = NULL;
 	const char *shostnetworkmask = NULL, *dhostnetworkmask = NULL;
 	const char *policy = NULL, *newname = NULL;
@@ -1347,10 +1377,32 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 	struct xtables_rule_match *matchp;
 	struct xtables_target *t;
 	unsigned long long cnt;
+	struct xs_argv *parts;
+	unsigned int nparts, i;
+	struct xs_cleanup cleanup;
+	struct command_alloc6 alloc = {
+		.cs    = &cs,
+		.e     = &e,
+		.addrs = {&saddrs, &smasks, &daddrs, &dmasks},
+	};
+
+	/* a multiport list too long for one rule makes several */
+	nparts = xs_split_ports(argc, argv, &parts);
+	if (nparts > 0) {
+		xs_cleanup_push(&cleanup, xs_argv_cleanup, parts);
+		for (i = 0; i < nparts && ret; ++i)
+			ret = do_command6(parts[i].argc, parts[i].argv,
+					  table, handle);
+		xs_cleanup_pop(&cleanup);
+		xs_argv_free(parts, nparts);
+		return ret;
+	}
 
 	memset(&cs, 0, sizeof(cs));
 	cs.jumpto = "";
 	cs.argv = argv;
+	xtables_lookup_only = false;
+	xs_cleanup_push(&cleanup, command_cleanup6, &alloc);
 
 	/* re-set optind to 0 in case do_command6 gets called
 	 * a second time */
@@ -1387,12 +1439,14 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 		case 'C':
 			add_command(&command, CMD_CHECK, CMD_NONE,
 			            cs.invert);
+			xtables_lookup_only = true;
 			chain = optarg;
 			break;
 
 		case 'D':
 			add_command(&command, CMD_DELETE, CMD_NONE,
 				    cs.invert);
+			xtables_lookup_only = true;
 			chain = optarg;
 			if (optind < argc && argv[optind][0] != '-'
 			    && argv[optind][0] != '!') {
@@ -1655,6 +1709,10 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 			xtables_modprobe_program = optarg;
 			break;
 
+		case 'a':
+			aggregate = true;
+			break;
+
 		case 'c':
 
 			set_option(&cs.options, OPT_COUNTERS, &cs.fw6.ipv6.invflags,
@@ -1686,8 +1744,10 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 
 		case '4':
 			/* This is not the IPv4 iptables */
-			if (line != -1)
+			if (line != -1) {
+				xs_cleanup_pop(&cleanup);
 				return 1; /* success: line ignored */
+			}
 			fprintf(stderr, "This is the IPv6 version of ip6tables.\n");
 			exit_tryhelp(2);
 
@@ -1757,6 +1817,17 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 		xtables_error(PARAMETER_PROBLEM, "! not allowed with multiple"
 			   " source or destination IP addresses");
 
+	if (aggregate && (nsaddrs > 1 || ndaddrs > 1)) {
+		unsigned int before = nsaddrs * ndaddrs;
+
+		xtables_ip6aggregate(saddrs, smasks, &nsaddrs);
+		xtables_ip6aggregate(daddrs, dmasks, &ndaddrs);
+		if (verbose)
+			printf("Aggregated to %u source and %u destination "
+			       "prefixes, %u rule(s) saved\n", nsaddrs, ndaddrs,
+			       before - nsaddrs * ndaddrs);
+	}
+
 	if (command == CMD_REPLACE && (nsaddrs != 1 || ndaddrs != 1))
 		xtables_error(PARAMETER_PROBLEM, "Replacement rule does not "
 			   "specify a unique address");
@@ -1813,6 +1884,7 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 
 			if (cs.target->t)
 				free(cs.target->t);
+			cs.target->t = NULL;
 
 			cs.target = NULL;
 		}
@@ -1850,6 +1922,7 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 		} else {
 			e = generate_entry(&cs.fw6, cs.matches, cs.target->t);
 			free(cs.target->t);
+			cs.target->t = NULL;
 		}
 	}
 
@@ -1948,6 +2021,7 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 	if (verbose > 1)
 		dump_entries6(*handle);
 
+	xs_cleanup_pop(&cleanup);
 	clear_rule_matches(&cs.matches);
 
 	if (e != NULL) {
@@ -1963,3 +2037,57 @@ int do_command6(int argc, char *argv[], char **table, struct ip6tc_handle **hand
 
 	return ret;
 }
+
+static void batch_setup6(const char *name)
+{
+	ip6tables_globals.program_name = name;
+	if (xtables_init_all(&ip6tables_globals, NFPROTO_IPV6) < 0) {
+		fprintf(stderr, "%s/%s Failed to initialize xtables\n",
+			ip6tables_globals.program_name,
+			ip6tables_globals.program_version);
+		exit(1);
+	}
+#if defined(ALL_INCLUSIVE) || defined(NO_SHARED_LIBS)
+	init_extensions();
+	init_extensions6();
+#endif
+}
+
+static void *batch_init6(const char *table)
+{
+	return ip6tc_init(table);
+}
+
+static int batch_do_command6(int argc, char **argv, char **table,
+			       void **handle)
+{
+	struct ip6tc_handle *h;
+
+	/* In *handle before do_command6 can change it: an xtables_error
+	 * does not come back here to store it. */
+	if (*handle == NULL)
+		*handle = ip6tc_init(*table);
+	h = *handle;
+	return do_command6(argc, argv, table, &h);
+}
+
+static int batch_commit6(void *handle)
+{
+	return ip6tc_commit(handle);
+}
+
+static void batch_free6(void *handle)
+{
+	ip6tc_free(handle);
+}
+
+const struct xs_batch_ops ip6tables_batch_ops = {
+	.name       = "ip6tables",
+	.family     = NFPROTO_IPV6,
+	.setup      = batch_setup6,
+	.init       = batch_init6,
+	.do_command = batch_do_command6,
+	.commit     = batch_commit6,
+	.free       = batch_free6,
+	.strerror   = ip6tc_strerror,
+};
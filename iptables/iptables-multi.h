@@ -1,8 +1,17 @@
 #ifndef _IPTABLES_MULTI_H
 #define _IPTABLES_MULTI_H 1
 
+struct iptc_handle;
+
 extern int iptables_main(int, char **);
 extern int iptables_save_main(int, char **);
 extern int iptables_restore_main(int, char **);
+extern int iptables_daemon_main(int, char **);
+extern int iptables_safe_apply_main(int, char **);
+extern int iptables_replay_main(int, char **);
+extern int iptables_optimize_main(int, char **);
+extern int iptables_analyze_main(int, char **);
+extern void iptables_restore_offline(int (*)(struct iptc_handle *));
+extern void iptables_save_handle(const char *, struct iptc_handle *, int);
 
 #endif /* _IPTABLES_MULTI_H */
@@ -14,6 +14,7 @@
 #include "iptables.h"
 #include "xtables.h"
 #include "libiptc/libiptc.h"
+#include "xshared.h"
 #include "iptables-multi.h"
 
 #ifdef DEBUG
@@ -56,11 +57,23 @@ static void print_usage(const char *name, const char *version)
 	exit(1);
 }
 
+/* Set by iptables-replay: tables start out empty instead of being read
+ * from the kernel, and go to this function at COMMIT. */
+static int (*offline_commit)(struct iptc_handle *handle);
+
+void iptables_restore_offline(int (*commit)(struct iptc_handle *handle))
+{
+	offline_commit = commit;
+}
+
 static struct iptc_handle *create_handle(const char *tablename)
 {
 	struct iptc_handle *handle;
 
-	handle = iptc_init(tablename);
+	if (offline_commit != NULL)
+		handle = iptc_init_offline(tablename);
+	else
+		handle = iptc_init(tablename);
 
 	if (!handle) {
 		/* try to insmod the module if iptc_init failed */
@@ -188,6 +201,9 @@ main(int argc, char *argv[])
 	}
 	else in = stdin;
 
+	/* Resolve all hostnames in one go rather than line by line */
+	in = xs_prefetch_hostnames(in, NFPROTO_IPV4);
+
 	/* Grab standard input. */
 	while (fgets(buffer, sizeof(buffer), in)) {
 		int ret = 0;
@@ -200,7 +216,10 @@ main(int argc, char *argv[])
 				fputs(buffer, stdout);
 			continue;
 		} else if ((strcmp(buffer, "COMMIT\n") == 0) && (in_table)) {
-			if (!testing) {
+			if (offline_commit != NULL) {
+				ret = offline_commit(handle);
+				handle = NULL;
+			} else if (!testing) {
 				DEBUGP("Calling commit\n");
 				ret = iptc_commit(handle);
 				iptc_free(handle);
@@ -37,6 +37,7 @@
 #include <string.h>
 #include <iptables.h>
 #include "iptables-multi.h"
+#include "xshared.h"
 
 #ifdef IPTABLES_MULTI
 int
@@ -63,6 +64,10 @@ main(int argc, char *argv[])
 	init_extensions4();
 #endif
 
+	ret = xs_batch_main(argc, argv, &iptables_batch_ops);
+	if (ret >= 0)
+		exit(ret);
+
 	ret = do_command4(argc, argv, &table, &handle);
 	if (ret) {
 		ret = iptc_commit(handle);
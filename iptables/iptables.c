@@ -122,6 +122,7 @@ static struct option original_opts[] = {
 	{.name = "help",          .has_arg = 2, .val = 'h'},
 	{.name = "line-numbers",  .has_arg = 0, .val = '0'},
 	{.name = "modprobe",      .has_arg = 1, .val = 'M'},
+	{.name = "aggregate",     .has_arg = 0, .val = 'a'},
 	{.name = "set-counters",  .has_arg = 1, .val = 'c'},
 	{.name = "goto",          .has_arg = 1, .val = 'g'},
 	{.name = "ipv4",          .has_arg = 0, .val = '4'},
@@ -209,6 +210,8 @@ enum {
 static void __attribute__((noreturn))
 exit_tryhelp(int status)
 {
+	/* In batch mode, only this command fails */
+	xs_batch_exit(status);
 	if (line != -1)
 		fprintf(stderr, "Error occurred at line: %d\n", line);
 	fprintf(stderr, "Try `%s -h' or '%s --help' for more information.\n",
@@ -291,6 +294,9 @@ exit_printhelp(const struct xtables_rule_match *matches)
 "[!] --fragment	-f		match second or further fragments only\n"
 "  --modprobe=<command>		try to insert modules using this command\n"
 "  --set-counters PKTS BYTES	set the counter during insert/append\n"
+"  --batch FILE|- [--commit-every N]\n"
+"				run one command per line, committing once\n"
+"  --aggregate			merge overlapping -s/-d prefixes\n"
 "[!] --version	-V		print package version.\n");
 
 	print_extension_helps(xtables_targets, matches);
@@ -1152,7 +1158,8 @@ void print_rule4(const struct ipt_entry *e,
 
 	/* Print targinfo part */
 	t = ipt_get_target((struct ipt_entry *)e);
-	if (t->u.user.name[0]) {
+	/* jumps in rules not yet committed still carry the chain name */
+	if (t->u.user.name[0] && !iptc_is_chain(t->u.user.name, h)) {
 		const struct xtables_target *target =
 			xtables_find_target(t->u.user.name, XTF_TRY_LOAD);
 
@@ -1359,6 +1366,28 @@ static void command_match(struct iptables_command_state *cs)
 		xtables_error(OTHER_PROBLEM, "can't alloc memory!");
 }
 
+/* What do_command4 has allocated, for batch mode to free if it bails out */
+struct command_alloc4 {
+	struct iptables_command_state *cs;
+	struct ipt_entry **e;
+	struct in_addr **addrs[4];
+};
+
+static void command_cleanup4(void *arg)
+{
+	struct command_alloc4 *a = arg;
+	unsigned int i;
+
+	clear_rule_matches(&a->cs->matches);
+	if (a->cs->target != NULL) {
+		free(a->cs->target->t);
+		a->cs->target->t = NULL;
+	}
+	free(*a->e);
+	for (i = 0; i < ARRAY_SIZE(a->addrs); ++i)
+		free(*a->addrs[i]);
+}
+
 int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handle)
 {
 	struct iptables_command_state cs;
@@ -1368,6 +1397,7 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 	struct in_addr *daddrs = NULL, *dmasks = NULL;
 
 	int verbose = 0;
+	bool aggregate = false;
 	const char *chain = NULL;
 	const char *shostnetworkmask = NULL, *dhostnetworkmask = NULL;
 	const char *policy = NULL, *newname = NULL;
@@ -1378,10 +1408,32 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 	struct xtables_rule_match *matchp;
 	struct xtables_target *t;
 	unsigned long long cnt;
+	struct xs_argv *parts;
+	unsigned int nparts, i;
+	struct xs_cleanup cleanup;
+	struct command_alloc4 alloc = {
+		.cs    = &cs,
+		.e     = &e,
+		.addrs = {&saddrs, &smasks, &daddrs, &dmasks},
+	};
+
+	/* a multiport list too long for one rule makes several */
+	nparts = xs_split_ports(argc, argv, &parts);
+	if (nparts > 0) {
+		xs_cleanup_push(&cleanup, xs_argv_cleanup, parts);
+		for (i = 0; i < nparts && ret; ++i)
+			ret = do_command4(parts[i].argc, parts[i].argv,
+					  table, handle);
+		xs_cleanup_pop(&cleanup);
+		xs_argv_free(parts, nparts);
+		return ret;
+	}
 
 	memset(&cs, 0, sizeof(cs));
 	cs.jumpto = "";
 	cs.argv = argv;
+	xtables_lookup_only = false;
+	xs_cleanup_push(&cleanup, command_cleanup4, &alloc);
 
 	/* re-set optind to 0 in case do_command4 gets called
 	 * a second time */
@@ -1418,12 +1470,14 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 		case 'C':
 			add_command(&command, CMD_CHECK, CMD_NONE,
 				    cs.invert);
+			xtables_lookup_only = true;
 			chain = optarg;
 			break;
 
 		case 'D':
 			add_command(&command, CMD_DELETE, CMD_NONE,
 				    cs.invert);
+			xtables_lookup_only = true;
 			chain = optarg;
 			if (optind < argc && argv[optind][0] != '-'
 			    && argv[optind][0] != '!') {
@@ -1692,6 +1746,10 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 			xtables_modprobe_program = optarg;
 			break;
 
+		case 'a':
+			aggregate = true;
+			break;
+
 		case 'c':
 
 			set_option(&cs.options, OPT_COUNTERS, &cs.fw.ip.invflags,
@@ -1727,8 +1785,10 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 
 		case '6':
 			/* This is not the IPv6 ip6tables */
-			if (line != -1)
+			if (line != -1) {
+				xs_cleanup_pop(&cleanup);
 				return 1; /* success: line ignored */
+			}
 			fprintf(stderr, "This is the IPv4 version of iptables.\n");
 			exit_tryhelp(2);
 
@@ -1797,6 +1857,17 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 		xtables_error(PARAMETER_PROBLEM, "! not allowed with multiple"
 			   " source or destination IP addresses");
 
+	if (aggregate && (nsaddrs > 1 || ndaddrs > 1)) {
+		unsigned int before = nsaddrs * ndaddrs;
+
+		xtables_ipaggregate(saddrs, smasks, &nsaddrs);
+		xtables_ipaggregate(daddrs, dmasks, &ndaddrs);
+		if (verbose)
+			printf("Aggregated to %u source and %u destination "
+			       "prefixes, %u rule(s) saved\n", nsaddrs, ndaddrs,
+			       before - nsaddrs * ndaddrs);
+	}
+
 	if (command == CMD_REPLACE && (nsaddrs != 1 || ndaddrs != 1))
 		xtables_error(PARAMETER_PROBLEM, "Replacement rule does not "
 			   "specify a unique address");
@@ -1853,6 +1924,7 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 
 			if (cs.target->t)
 				free(cs.target->t);
+			cs.target->t = NULL;
 
 			cs.target = NULL;
 		}
@@ -1892,6 +1964,7 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 		} else {
 			e = generate_entry(&cs.fw, cs.matches, cs.target->t);
 			free(cs.target->t);
+			cs.target->t = NULL;
 		}
 	}
 
@@ -1990,6 +2063,7 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 	if (verbose > 1)
 		dump_entries(*handle);
 
+	xs_cleanup_pop(&cleanup);
 	clear_rule_matches(&cs.matches);
 
 	if (e != NULL) {
@@ -2005,3 +2079,57 @@ int do_command4(int argc, char *argv[], char **table, struct iptc_handle **handl
 
 	return ret;
 }
+
+static void batch_setup4(const char *name)
+{
+	iptables_globals.program_name = name;
+	if (xtables_init_all(&iptables_globals, NFPROTO_IPV4) < 0) {
+		fprintf(stderr, "%s/%s Failed to initialize xtables\n",
+			iptables_globals.program_name,
+			iptables_globals.program_version);
+		exit(1);
+	}
+#if defined(ALL_INCLUSIVE) || defined(NO_SHARED_LIBS)
+	init_extensions();
+	init_extensions4();
+#endif
+}
+
+static void *batch_init4(const char *table)
+{
+	return iptc_init(table);
+}
+
+static int batch_do_command4(int argc, char **argv, char **table,
+			       void **handle)
+{
+	struct iptc_handle *h;
+
+	/* In *handle before do_command4 can change it: an xtables_error
+	 * does not come back here to store it. */
+	if (*handle == NULL)
+		*handle = iptc_init(*table);
+	h = *handle;
+	return do_command4(argc, argv, table, &h);
+}
+
+static int batch_commit4(void *handle)
+{
+	return iptc_commit(handle);
+}
+
+static void batch_free4(void *handle)
+{
+	iptc_free(handle);
+}
+
+const struct xs_batch_ops iptables_batch_ops = {
+	.name       = "iptables",
+	.family     = NFPROTO_IPV4,
+	.setup      = batch_setup4,
+	.init       = batch_init4,
+	.do_command = batch_do_command4,
+	.commit     = batch_commit4,
+	.free       = batch_free4,
+	.strerror   = iptc_strerror,
+};
@@ -1,12 +1,18 @@
+#include <ctype.h>
+#include <errno.h>
 #include <getopt.h>
 #include <libgen.h>
 #include <netdb.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <xtables.h>
+#include <linux/netfilter/xt_multiport.h>
+#include "iptables/internal.h"
 #include "xshared.h"
 
 /*
@@ -88,11 +94,17 @@ find_proto(const char *pname, enum xtables_tryload tryload,
  */
 static bool should_load_proto(struct iptables_command_state *cs)
 {
+	struct xtables_match *m;
+
 	if (cs->protocol == NULL)
 		return false;
-	if (find_proto(cs->protocol, XTF_DONT_LOAD,
-	    cs->options & OPT_NUMERIC, NULL) == NULL)
+	m = find_proto(cs->protocol, XTF_DONT_LOAD,
+		       cs->options & OPT_NUMERIC, NULL);
+	if (m == NULL)
 		return true;
+	/* Only asked whether it is there: a clone made for that is unused */
+	if (m->next == m)
+		free(m);
 	return !cs->proto_used;
 }
 
@@ -236,3 +248,938 @@ void xs_init_match(struct xtables_match *match)
 	if (match->init != NULL)
 		match->init(match->m);
 }
+
+static bool is_address_option(const char *arg)
+{
+	static const char *const address_opts[] = {
+		"-s", "--source", "--src",
+		"-d", "--destination", "--dst",
+	};
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(address_opts); ++i)
+		if (strcmp(arg, address_opts[i]) == 0)
+			return true;
+	return false;
+}
+
+/*
+ * Collect the arguments of all -s/-d options found in restore input and
+ * have them resolved concurrently before the rules get parsed one by
+ * one. Only done when @in can seek back: input from a pipe is left
+ * alone and streamed, so that a generator feeding a long-lived pipe sees
+ * its lines applied as they come. Returns the stream to read from.
+ */
+FILE *xs_prefetch_hostnames(FILE *in, uint8_t nfproto)
+{
+	char *buffer = NULL, *tok, *saveptr, *spec, *next, *mask;
+	const char **names = NULL;
+	unsigned int count = 0, size = 0;
+	bool want_addr = false;
+	size_t buflen = 0;
+	long start;
+
+	start = ftell(in);
+	if (start < 0)
+		return in;
+
+	/* whole lines, however long, so that no name is cut in two */
+	while (getline(&buffer, &buflen, in) >= 0) {
+		if (buffer[0] == '#' || buffer[0] == '*' || buffer[0] == ':')
+			continue;
+
+		want_addr = false;
+		for (tok = strtok_r(buffer, " \t\n", &saveptr); tok != NULL;
+		     tok = strtok_r(NULL, " \t\n", &saveptr)) {
+			if (!want_addr) {
+				want_addr = is_address_option(tok);
+				continue;
+			}
+			if (strcmp(tok, "!") == 0)
+				continue;
+			want_addr = false;
+			if (*tok == '"')
+				continue;
+
+			for (spec = tok; spec != NULL; spec = next) {
+				next = strchr(spec, ',');
+				if (next != NULL)
+					*next++ = '\0';
+				mask = strrchr(spec, '/');
+				if (mask != NULL)
+					*mask = '\0';
+				if (*spec == '\0')
+					continue;
+				if (count == size) {
+					size = size ? size * 2 : 64;
+					names = xtables_realloc(names,
+						size * sizeof(*names));
+				}
+				names[count] = strdup(spec);
+				if (names[count] == NULL)
+					xtables_error(RESOURCE_PROBLEM,
+						      "strdup");
+				++count;
+			}
+		}
+	}
+
+	free(buffer);
+	xtables_hostcache_prefetch(names, count, nfproto);
+	while (count > 0)
+		free((char *)names[--count]);
+	free(names);
+
+	fseek(in, start, SEEK_SET);
+	return in;
+}
+
+static bool is_multiport_list(const char *arg)
+{
+	static const char *const list_opts[] = {
+		"--source-ports", "--sports", "--destination-ports",
+		"--dports", "--ports",
+	};
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(list_opts); ++i)
+		if (strcmp(arg, list_opts[i]) == 0)
+			return true;
+	return false;
+}
+
+/* Entries a multiport list takes up in the match, a range taking two */
+static unsigned int multiport_slots(const char *s, size_t len)
+{
+	return 1 + (memchr(s, ':', len) != NULL);
+}
+
+/* Parts a multiport list has to be cut into, at commas */
+static unsigned int multiport_chunks(const char *list)
+{
+	unsigned int nchunks = 0, slots = 0, w;
+	const char *tok, *end;
+
+	for (tok = list; ; tok = end + 1) {
+		end = strchr(tok, ',');
+		w = multiport_slots(tok, end != NULL ?
+				    (size_t)(end - tok) : strlen(tok));
+		if (nchunks == 0 || slots + w > XT_MULTI_PORTS) {
+			++nchunks;
+			slots = 0;
+		}
+		slots += w;
+		if (end == NULL)
+			break;
+	}
+	return nchunks;
+}
+
+/* Where a port list entry begins and ends, if both are numbers */
+static bool multiport_range(const char *s, size_t len,
+			    unsigned long *lo, unsigned long *hi)
+{
+	char *end;
+
+	if (!isdigit((unsigned char)*s))
+		return false;
+	*lo = *hi = strtoul(s, &end, 10);
+	if (*end == ':' && end < s + len) {
+		if (!isdigit((unsigned char)end[1]))
+			return false;
+		*hi = strtoul(end + 1, &end, 10);
+	}
+	return end == s + len && *lo <= *hi;
+}
+
+/* Whether no port of a list is in more than one of its parts */
+static bool multiport_disjoint(const char *list)
+{
+	struct { unsigned long lo, hi; unsigned int chunk; } *e;
+	unsigned int n = 0, chunk = 0, slots = 0, w, i, k;
+	const char *tok, *end;
+	bool ok = true;
+	size_t len;
+
+	e = xtables_malloc((strlen(list) / 2 + 1) * sizeof(*e));
+	for (tok = list; ok; tok = end + 1) {
+		end = strchr(tok, ',');
+		len = end != NULL ? (size_t)(end - tok) : strlen(tok);
+		w = multiport_slots(tok, len);
+		if (n > 0 && slots + w > XT_MULTI_PORTS) {
+			++chunk;
+			slots = 0;
+		}
+		slots += w;
+		e[n].chunk = chunk;
+		ok = multiport_range(tok, len, &e[n].lo, &e[n].hi);
+		++n;
+		if (end == NULL)
+			break;
+	}
+	for (i = 0; ok && i < n; ++i)
+		for (k = i + 1; ok && k < n; ++k)
+			ok = e[i].chunk == e[k].chunk ||
+			     e[i].hi < e[k].lo || e[k].hi < e[i].lo;
+	free(e);
+	return ok;
+}
+
+/* Whether a packet the rule matches goes no further in the chain */
+static bool rule_terminates(int argc, char **argv)
+{
+	static const char *const verdicts[] = {
+		"ACCEPT", "DROP", "RETURN", "QUEUE", "REJECT", "NFQUEUE",
+	};
+	unsigned int i;
+	int j;
+
+	for (j = 1; j < argc - 1; ++j) {
+		if (strcmp(argv[j], "-g") == 0 ||
+		    strcmp(argv[j], "--goto") == 0)
+			return true;
+		if (strcmp(argv[j], "-j") != 0 &&
+		    strcmp(argv[j], "--jump") != 0)
+			continue;
+		for (i = 0; i < ARRAY_SIZE(verdicts); ++i)
+			if (strcmp(argv[j + 1], verdicts[i]) == 0)
+				return true;
+		return false;
+	}
+	return false;
+}
+
+/*
+ * Split a port list of -m multiport longer than the XT_MULTI_PORTS
+ * entries one match holds. Returns the number of command lines @argv
+ * becomes, in @parts, to be run in turn until one fails, or 0 if it
+ * needs no splitting. A list becomes a rule for each part of it; a
+ * negated one becomes one rule with a negated multiport match for each
+ * part, as the packet has to be in none of them. Only the first long
+ * list is split: each new command line is to go through here again.
+ *
+ * The rules only do what the one would if a packet can't match two of
+ * them, or if the first it matches ends its way through the chain:
+ * anything else is refused. -I inserts the rules last to first, so
+ * they end up in order at the position given; -D first checks that
+ * all of them are there, then deletes them. Replacing one rule with
+ * many can't be done, so -R is left to fail as before.
+ */
+unsigned int xs_split_ports(int argc, char **argv, struct xs_argv **parts)
+{
+	unsigned int nchunks = 0, nparts, nlines, slots = 0, w, i, c, k;
+	bool multiport = false, invert, insert = false, delete = false;
+	static const char glue[] = "-m\0multiport\0!";
+	static char check[] = "-C";
+	const char *list = NULL;
+	char *buf, *tok, *end, *g;
+	struct xs_argv *p;
+	int pos = 0, cmd = 0, j;
+
+	for (j = 1; j < argc; ++j) {
+		if (strcmp(argv[j], "-R") == 0 ||
+		    strcmp(argv[j], "--replace") == 0)
+			return 0;
+		if (strcmp(argv[j], "-I") == 0 ||
+		    strcmp(argv[j], "--insert") == 0)
+			insert = true;
+		if (strcmp(argv[j], "-D") == 0 ||
+		    strcmp(argv[j], "--delete") == 0) {
+			delete = true;
+			cmd = j;
+		}
+		if ((strcmp(argv[j], "-m") == 0 ||
+		     strcmp(argv[j], "--match") == 0) && j + 1 < argc) {
+			multiport = strcmp(argv[++j], "multiport") == 0;
+			continue;
+		}
+		if (list == NULL && multiport && j + 1 < argc &&
+		    is_multiport_list(argv[j])) {
+			nchunks = multiport_chunks(argv[j + 1]);
+			if (nchunks < 2)
+				continue;
+			pos = ++j;
+			list = argv[j];
+		}
+	}
+	if (list == NULL)
+		return 0;
+
+	invert = pos >= 2 && strcmp(argv[pos - 2], "!") == 0;
+	/* --ports may match the source port in one part and the
+	 * destination port in another */
+	if (!invert && !rule_terminates(argc, argv) &&
+	    (strcmp(argv[pos - 1], "--ports") == 0 ||
+	     !multiport_disjoint(list)))
+		xtables_error(PARAMETER_PROBLEM,
+			      "multiport: %s is too long for one rule, and "
+			      "a packet could match more than one of the "
+			      "rules it would be split into", argv[pos - 1]);
+	nparts = invert ? 1 : nchunks;
+	nlines = delete ? 2 * nparts : nparts;
+	/* with an empty entry at the end, for xs_argv_cleanup */
+	p = xtables_calloc(nlines + 1, sizeof(*p));
+	for (i = 0; i < nlines; ++i) {
+		/* the part this command line has */
+		c = insert ? nparts - 1 - i : i % nparts;
+		/* the argv and the strings it adds in one block; these may
+		 * be written to, as "!" is by the parser */
+		p[i].argc = argc + (invert ? 5 * (nchunks - 1) : 0);
+		p[i].argv = xtables_malloc((p[i].argc + 1) * sizeof(char *) +
+					   strlen(list) + 1 +
+					   (invert ? nchunks * sizeof(glue) : 0));
+		buf = (char *)(p[i].argv + p[i].argc + 1);
+		strcpy(buf, list);
+		g = buf + strlen(list) + 1;
+		memcpy(p[i].argv, argv, pos * sizeof(char *));
+		memcpy(p[i].argv + p[i].argc - (argc - pos - 1),
+		       argv + pos + 1, (argc - pos - 1) * sizeof(char *));
+		p[i].argv[p[i].argc] = NULL;
+		if (delete && i < nparts)
+			p[i].argv[cmd] = check;
+
+		/* cut the list into the same chunks */
+		for (tok = buf, k = 0, j = pos; ; tok = end + 1) {
+			end = strchr(tok, ',');
+			w = multiport_slots(tok, end != NULL ?
+					    (size_t)(end - tok) : strlen(tok));
+			if (tok == buf || slots + w > XT_MULTI_PORTS) {
+				if (tok != buf)
+					tok[-1] = '\0';
+				if (invert && tok != buf) {
+					memcpy(g, glue, sizeof(glue));
+					p[i].argv[j++] = g;
+					p[i].argv[j++] = g + 3;
+					p[i].argv[j++] = g + 13;
+					p[i].argv[j++] = argv[pos - 1];
+					g += sizeof(glue);
+				}
+				if (invert || k++ == c)
+					p[i].argv[j++] = tok;
+				slots = 0;
+			}
+			slots += w;
+			if (end == NULL)
+				break;
+		}
+	}
+	*parts = p;
+	return nlines;
+}
+
+void xs_argv_free(struct xs_argv *parts, unsigned int n)
+{
+	while (n > 0)
+		free(parts[--n].argv);
+	free(parts);
+}
+
+/* xs_argv_free for an xs_cleanup, which does not know the count */
+void xs_argv_cleanup(void *arg)
+{
+	struct xs_argv *parts = arg;
+	unsigned int n = 0;
+
+	while (parts[n].argv != NULL)
+		++n;
+	xs_argv_free(parts, n);
+}
+
+static struct xs_cleanup *cleanups;
+
+/**
+ * xs_cleanup_push - have @fn(@arg) called if the command is abandoned
+ * @c:		caller-provided storage, until xs_cleanup_pop
+ *
+ * Batch mode abandons a failing command by jumping out of do_command4/6
+ * from the xtables_error handler. What the command has allocated by
+ * then is released through the cleanups it registered here; they run
+ * newest first, while the command's stack frame is still there.
+ */
+void xs_cleanup_push(struct xs_cleanup *c, void (*fn)(void *), void *arg)
+{
+	c->fn   = fn;
+	c->arg  = arg;
+	c->prev = cleanups;
+	cleanups = c;
+}
+
+/* Forget @c, the newest cleanup, once its resources have been freed */
+void xs_cleanup_pop(struct xs_cleanup *c)
+{
+	if (cleanups == c)
+		cleanups = c->prev;
+}
+
+static void xs_cleanup_run(void)
+{
+	struct xs_cleanup *c;
+
+	while ((c = cleanups) != NULL) {
+		cleanups = c->prev;
+		c->fn(c->arg);
+	}
+}
+
+/*
+ * Batch engine: runs ordinary iptables command lines through
+ * do_command4/6 against one cached handle per table, so that a whole
+ * series of commands costs one iptc_init and one commit per table.
+ *
+ * Errors raised through xtables_error are caught and turned into a
+ * message in b->errmsg instead of terminating the process. Every
+ * successful command that may change a table is kept in the table's
+ * journal; after a failed command, or when the kernel table changed
+ * underneath us (EAGAIN on commit), the handle is thrown away and the
+ * journal replayed on a fresh one. When the kernel rejects a commit,
+ * the journal is committed in parts until the commands it rejects are
+ * found; those are dropped and the others committed. Each command thus
+ * takes effect or not on its own, like a separate iptables invocation.
+ */
+enum {
+	XS_BATCH_MAXARGS       = 255,
+	XS_BATCH_COMMIT_TRIES  = 3,
+};
+
+static struct xs_batch *batch_active;
+static sigjmp_buf batch_jmp;
+
+static void batch_error(enum xtables_exittype status, const char *msg, ...)
+	__attribute__((noreturn, format(printf,2,3)));
+
+static void batch_error(enum xtables_exittype status, const char *msg, ...)
+{
+	struct xs_batch *b = batch_active;
+	va_list args;
+	size_t len;
+
+	va_start(args, msg);
+	vsnprintf(b->errmsg, sizeof(b->errmsg), msg, args);
+	va_end(args);
+	len = strlen(b->errmsg);
+	while (len > 0 && b->errmsg[len-1] == '\n')
+		b->errmsg[--len] = '\0';
+	xs_cleanup_run();
+	xtables_free_opts(1);
+	siglongjmp(batch_jmp, 1);
+}
+
+/**
+ * xs_batch_exit - abort the current batch command instead of exiting
+ * @status:	exit status the caller was about to use
+ *
+ * For the few paths in do_command4/6 that print a message and call
+ * exit() directly. Returns only if no batch command is running.
+ */
+void xs_batch_exit(int status)
+{
+	if (batch_active != NULL)
+		batch_error(status, "invalid command line");
+}
+
+/*
+ * Split @s in place into words, honouring double quotes and backslash
+ * escapes within them like iptables-restore does. Returns the number
+ * of words, or -1 if there are too many or a quote is left open.
+ */
+static int batch_split(char *s, char **argv, int max)
+{
+	bool quote;
+	int argc = 0;
+	char *out;
+
+	for (;;) {
+		while (isspace(*s))
+			++s;
+		if (*s == '\0')
+			return argc;
+		if (argc >= max)
+			return -1;
+		argv[argc++] = out = s;
+		for (quote = false; *s != '\0'; ++s) {
+			if (quote) {
+				if (*s == '"') {
+					quote = false;
+					continue;
+				}
+				if (*s == '\\' && s[1] != '\0')
+					++s;
+			} else if (*s == '"') {
+				quote = true;
+				continue;
+			} else if (isspace(*s)) {
+				++s;
+				break;
+			}
+			*out++ = *s;
+		}
+		if (quote)
+			return -1;
+		*out = '\0';
+	}
+}
+
+static bool batch_is_arg(const char *arg, const char *s, const char *l)
+{
+	return strcmp(arg, s) == 0 || strcmp(arg, l) == 0;
+}
+
+/* Is @arg option @s or @l, possibly grouped like -nvL? */
+static bool batch_has_opt(const char *arg, char s, const char *l)
+{
+	if (strcmp(arg, l) == 0)
+		return true;
+	if (arg[0] != '-' || arg[1] == '-' || arg[1] == '\0')
+		return false;
+	return strspn(arg + 1, "nvxLSCZ") == strlen(arg + 1) &&
+	       strchr(arg + 1, s) != NULL;
+}
+
+/* Table named on the command line, or "filter" */
+static const char *batch_table_name(int argc, char **argv)
+{
+	int i;
+
+	for (i = 1; i < argc; ++i) {
+		if (batch_is_arg(argv[i], "-t", "--table") && i + 1 < argc)
+			return argv[i+1];
+		if (strncmp(argv[i], "--table=", 8) == 0)
+			return argv[i] + 8;
+		if (strncmp(argv[i], "-t", 2) == 0 && argv[i][2] != '\0')
+			return argv[i] + 2;
+	}
+	return "filter";
+}
+
+/* Listing and checking leave the table alone, unless combined with -Z. */
+static bool batch_read_only(int argc, char **argv)
+{
+	bool ro = false;
+	int i;
+
+	for (i = 1; i < argc; ++i) {
+		if (batch_has_opt(argv[i], 'Z', "--zero"))
+			return false;
+		if (batch_has_opt(argv[i], 'L', "--list") ||
+		    batch_has_opt(argv[i], 'S', "--list-rules") ||
+		    batch_has_opt(argv[i], 'C', "--check"))
+			ro = true;
+	}
+	return ro;
+}
+
+static struct xs_batch_table *
+batch_get_table(struct xs_batch *b, const char *name)
+{
+	struct xs_batch_table *t;
+
+	for (t = b->tables; t != NULL; t = t->next)
+		if (strcmp(t->name, name) == 0)
+			return t;
+
+	t = xtables_calloc(1, sizeof(*t));
+	snprintf(t->name, sizeof(t->name), "%s", name);
+	t->next   = b->tables;
+	b->tables = t;
+	return t;
+}
+
+/* Run one split command line; returns do_command's verdict. */
+static int batch_run(struct xs_batch *b, struct xs_batch_table *t,
+		     int argc, char **argv)
+{
+	__typeof__(xt_params->exit_err) exit_err = xt_params->exit_err;
+	char *table = t->name;
+	volatile int ret = 0;
+
+	b->errmsg[0] = '\0';
+	batch_active = b;
+	xt_params->exit_err = batch_error;
+	if (sigsetjmp(batch_jmp, 0) == 0) {
+		ret = b->ops->do_command(argc, argv, &table, &t->handle);
+		if (!ret)
+			snprintf(b->errmsg, sizeof(b->errmsg), "%s",
+				 b->ops->strerror(errno));
+	} else {
+		struct xtables_match *m;
+
+		/* do_command did not get to clear_rule_matches */
+		for (m = xtables_matches; m != NULL; m = m->next) {
+			free(m->m);
+			m->m = NULL;
+		}
+	}
+	xt_params->exit_err = exit_err;
+	batch_active = NULL;
+	return ret;
+}
+
+static int batch_run_line(struct xs_batch *b, struct xs_batch_table *t,
+			  const char *cmd)
+{
+	char *buf, *argv[XS_BATCH_MAXARGS + 2];
+	int argc, ret;
+
+	buf = strdup(cmd);
+	if (buf == NULL)
+		xtables_error(RESOURCE_PROBLEM, "strdup");
+	argv[0] = (char *)b->ops->name;
+	argc = batch_split(buf, argv + 1, XS_BATCH_MAXARGS);
+	if (argc < 0) {
+		snprintf(b->errmsg, sizeof(b->errmsg),
+			 "unbalanced quotes or too many arguments");
+		free(buf);
+		return 0;
+	}
+	argv[++argc] = NULL;
+	ret = batch_run(b, t, argc, argv);
+	free(buf);
+	return ret;
+}
+
+static void batch_reset(struct xs_batch *b, struct xs_batch_table *t)
+{
+	struct xs_batch_cmd *c;
+
+	if (t->handle != NULL)
+		b->ops->free(t->handle);
+	t->handle = NULL;
+	b->pending -= t->njournal;
+	while (t->njournal > 0) {
+		c = &t->journal[--t->njournal];
+		free(c->line);
+		free(c->error);
+	}
+}
+
+static void batch_drop(struct xs_batch_cmd *c, const char *reason)
+{
+	c->error = strdup(reason);
+	if (c->error == NULL)
+		xtables_error(RESOURCE_PROBLEM, "strdup");
+}
+
+/*
+ * Throw away the handle and replay the journal entries from @lo up to
+ * @hi that have not been dropped on a fresh one. A command that fails
+ * now, e.g. because the kernel table changed underneath us, is dropped
+ * with the reason and the replay started over, since it may have left
+ * the handle half changed. Returns the number of commands replayed.
+ */
+static unsigned int batch_replay(struct xs_batch *b, struct xs_batch_table *t,
+				 unsigned int lo, unsigned int hi)
+{
+	char errmsg[sizeof(b->errmsg)];
+	unsigned int i, n;
+
+	memcpy(errmsg, b->errmsg, sizeof(errmsg));
+ again:
+	if (t->handle != NULL)
+		b->ops->free(t->handle);
+	t->handle = NULL;
+	for (i = lo, n = 0; i < hi; ++i) {
+		if (t->journal[i].error != NULL)
+			continue;
+		if (!batch_run_line(b, t, t->journal[i].line)) {
+			batch_drop(&t->journal[i], b->errmsg);
+			goto again;
+		}
+		++n;
+	}
+	memcpy(b->errmsg, errmsg, sizeof(errmsg));
+	return n;
+}
+
+/*
+ * Commit the journal entries from @lo up to @hi on top of what the
+ * kernel has now; @replay is false if t->handle holds exactly those.
+ * When the kernel rejects them, each half is committed in turn, down
+ * to single commands, so that only the commands it rejects are dropped
+ * and the others are committed in order, as separate iptables
+ * invocations would have been.
+ */
+static void batch_commit_range(struct xs_batch *b, struct xs_batch_table *t,
+			       unsigned int lo, unsigned int hi, bool replay)
+{
+	unsigned int i, mid, n = 0, tries = 0;
+	int err;
+
+	if (!replay)
+		for (i = lo; i < hi; ++i)
+			n += t->journal[i].error == NULL;
+	for (;;) {
+		if (replay)
+			n = batch_replay(b, t, lo, hi);
+		if (n == 0)
+			return;
+		if (b->ops->commit(t->handle))
+			return;
+		err = errno;
+		/* Replaced underneath us: try again on the new ruleset */
+		if (err != EAGAIN || ++tries >= XS_BATCH_COMMIT_TRIES)
+			break;
+		replay = true;
+	}
+	if (n == 1 || err == EAGAIN) {
+		for (i = lo; i < hi; ++i)
+			if (t->journal[i].error == NULL)
+				batch_drop(&t->journal[i],
+					   b->ops->strerror(err));
+		return;
+	}
+	for (mid = lo, i = 0; i < n / 2; ++mid)
+		i += t->journal[mid].error == NULL;
+	batch_commit_range(b, t, lo, mid, true);
+	batch_commit_range(b, t, mid, hi, true);
+}
+
+/**
+ * xs_batch_exec - run one command line
+ * @b:		batch state
+ * @cmd:	command line without the program name
+ * @lineno:	line number for error messages, or -1
+ * @tablep:	set to the table the command went to
+ *
+ * Returns XS_BATCH_PENDING if the command changed a table and needs a
+ * commit, XS_BATCH_DONE if it had nothing to commit (listing), or
+ * XS_BATCH_FAILED with the reason in b->errmsg.
+ */
+int xs_batch_exec(struct xs_batch *b, const char *cmd, int lineno,
+		  struct xs_batch_table **tablep)
+{
+	char *buf, *argv[XS_BATCH_MAXARGS + 2];
+	struct xs_batch_table *t;
+	int argc, i;
+	bool ro;
+
+	*tablep = NULL;
+	b->errmsg[0] = '\0';
+	buf = strdup(cmd);
+	if (buf == NULL)
+		xtables_error(RESOURCE_PROBLEM, "strdup");
+	argv[0] = (char *)b->ops->name;
+	argc = batch_split(buf, argv + 1, XS_BATCH_MAXARGS);
+	if (argc < 0) {
+		snprintf(b->errmsg, sizeof(b->errmsg),
+			 "unbalanced quotes or too many arguments");
+		goto fail;
+	}
+	argv[++argc] = NULL;
+	if (argc == 1) {
+		free(buf);
+		return XS_BATCH_DONE;
+	}
+	for (i = 1; i < argc; ++i)
+		if (batch_is_arg(argv[i], "-h", "--help") ||
+		    batch_is_arg(argv[i], "-V", "--version")) {
+			snprintf(b->errmsg, sizeof(b->errmsg),
+				 "`%s' is not supported in batch mode",
+				 argv[i]);
+			goto fail;
+		}
+
+	t = *tablep = batch_get_table(b, batch_table_name(argc, argv));
+	ro = batch_read_only(argc, argv);
+	/* Listings must not show a handle that may have gone stale */
+	if (ro && t->njournal == 0)
+		batch_reset(b, t);
+	line = lineno;
+	if (!batch_run(b, t, argc, argv)) {
+		line = -1;
+		/* Even an error raised while parsing may come after the
+		 * first parts of a split command went into the handle */
+		batch_replay(b, t, 0, t->njournal);
+		goto fail;
+	}
+	line = -1;
+	free(buf);
+
+	if (ro) {
+		/* Nothing to commit: next time, look at the kernel again */
+		if (t->njournal == 0)
+			batch_reset(b, t);
+		return XS_BATCH_DONE;
+	}
+	if (t->njournal == t->max_journal) {
+		t->max_journal = t->max_journal ? 2 * t->max_journal : 64;
+		t->journal = xtables_realloc(t->journal,
+			     t->max_journal * sizeof(*t->journal));
+	}
+	t->journal[t->njournal].line = strdup(cmd);
+	if (t->journal[t->njournal].line == NULL)
+		xtables_error(RESOURCE_PROBLEM, "strdup");
+	t->journal[t->njournal].lineno = lineno;
+	t->journal[t->njournal].error  = NULL;
+	++t->njournal;
+	++b->pending;
+	return XS_BATCH_PENDING;
+
+ fail:
+	free(buf);
+	return XS_BATCH_FAILED;
+}
+
+/**
+ * xs_batch_commit - commit one table and start over from the kernel
+ * @report:	called for each command that did not get committed, or NULL
+ * @data:	passed to @report
+ *
+ * On EAGAIN, somebody else replaced the table since we read it; the
+ * journal is then replayed on the new ruleset and the commit retried.
+ * If the kernel rejects the commit, the commands it does not take are
+ * singled out and the others committed. Returns 1 if all commands were
+ * committed, 0 with the first reason in b->errmsg otherwise.
+ */
+int xs_batch_commit(struct xs_batch *b, struct xs_batch_table *t,
+		    xs_batch_report_t *report, void *data)
+{
+	unsigned int i;
+	int ret = 1;
+
+	b->errmsg[0] = '\0';
+	if (t->njournal > 0)
+		batch_commit_range(b, t, 0, t->njournal, t->handle == NULL);
+	for (i = 0; i < t->njournal; ++i) {
+		if (t->journal[i].error == NULL)
+			continue;
+		if (ret)
+			snprintf(b->errmsg, sizeof(b->errmsg), "%s",
+				 t->journal[i].error);
+		ret = 0;
+		if (report != NULL)
+			report(&t->journal[i], i, data);
+	}
+	batch_reset(b, t);
+	return ret;
+}
+
+/**
+ * xs_batch_prepare - read the table ahead of the next command
+ *
+ * If the kernel table changes before the next commit, the commit gets
+ * EAGAIN and the journal is replayed on a fresh copy.
+ */
+void xs_batch_prepare(struct xs_batch *b, struct xs_batch_table *t)
+{
+	if (t->handle == NULL)
+		t->handle = b->ops->init(t->name);
+}
+
+void xs_batch_init(struct xs_batch *b, const struct xs_batch_ops *ops)
+{
+	memset(b, 0, sizeof(*b));
+	b->ops = ops;
+}
+
+void xs_batch_free(struct xs_batch *b)
+{
+	struct xs_batch_table *t;
+
+	while ((t = b->tables) != NULL) {
+		b->tables = t->next;
+		batch_reset(b, t);
+		free(t->journal);
+		free(t);
+	}
+}
+
+/* A line the commit dropped, reported like a line that failed at once */
+static void batch_report_line(const struct xs_batch_cmd *cmd,
+			      unsigned int index, void *data)
+{
+	const struct xs_batch *b = data;
+
+	fprintf(stderr, "%s: line %d failed: %s\n", b->ops->name,
+		cmd->lineno, cmd->error);
+}
+
+/* Commit all tables; returns false if any line did not get committed. */
+static bool batch_commit_all(struct xs_batch *b)
+{
+	struct xs_batch_table *t;
+	bool ok = true;
+
+	for (t = b->tables; t != NULL; t = t->next) {
+		if (t->njournal == 0)
+			continue;
+		if (!xs_batch_commit(b, t, batch_report_line, b))
+			ok = false;
+	}
+	return ok;
+}
+
+/**
+ * xs_batch_main - iptables --batch FILE|- [--commit-every N]
+ *
+ * Runs one iptables command per line of FILE, committing each table at
+ * the end, or whenever N commands are pending. Failed lines are
+ * reported with their line number and skipped. Returns the exit status,
+ * or -1 if @argv does not ask for batch mode.
+ */
+int xs_batch_main(int argc, char **argv, const struct xs_batch_ops *ops)
+{
+	const char *file = NULL;
+	unsigned int every = 0, lineno = 0;
+	struct xs_batch_table *t;
+	struct xs_batch b;
+	char *buf = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int i, status = 0;
+	FILE *in;
+
+	if (argc < 2 || strncmp(argv[1], "--batch", 7) != 0 ||
+	    (argv[1][7] != '\0' && argv[1][7] != '='))
+		return -1;
+	for (i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+			file = argv[++i];
+		else if (strncmp(argv[i], "--batch=", 8) == 0)
+			file = argv[i] + 8;
+		else if (strcmp(argv[i], "--commit-every") == 0 &&
+		    i + 1 < argc &&
+		    xtables_strtoui(argv[i+1], NULL, &every, 1, UINT_MAX))
+			++i;
+		else
+			xtables_error(PARAMETER_PROBLEM,
+				"usage: %s --batch FILE|- [--commit-every N]",
+				ops->name);
+	}
+	if (file == NULL)
+		xtables_error(PARAMETER_PROBLEM, "--batch needs a file name");
+
+	if (strcmp(file, "-") == 0) {
+		in = stdin;
+	} else {
+		in = fopen(file, "re");
+		if (in == NULL)
+			xtables_error(OTHER_PROBLEM, "Can't open %s: %s",
+				      file, strerror(errno));
+	}
+	in = xs_prefetch_hostnames(in, ops->family);
+
+	xs_batch_init(&b, ops);
+	while ((len = getline(&buf, &size, in)) >= 0) {
+		++lineno;
+		while (len > 0 && (buf[len-1] == '\n' || buf[len-1] == '\r'))
+			buf[--len] = '\0';
+		if (buf[strspn(buf, " \t")] == '\0' || buf[0] == '#')
+			continue;
+		if (xs_batch_exec(&b, buf, lineno, &t) == XS_BATCH_FAILED) {
+			fprintf(stderr, "%s: line %u failed: %s\n",
+				ops->name, lineno, b.errmsg);
+			status = 1;
+		}
+		if (every != 0 && b.pending >= every &&
+		    !batch_commit_all(&b))
+			status = 1;
+	}
+	if (!batch_commit_all(&b))
+		status = 1;
+
+	xs_batch_free(&b);
+	free(buf);
+	if (in != stdin)
+		fclose(in);
+	return status;
+}
@@ -2,7 +2,9 @@
 #define IPTABLES_XSHARED_H 1
 
 #include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <netinet/in.h>
 #include <net/if.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
@@ -63,6 +65,84 @@ struct iptables_command_state {
 	char **argv;
 };
 
+/**
+ * xs_batch_ops - protocol family hooks for the batch engine
+ * @name:	program name passed as argv[0] (e.g. "iptables")
+ * @family:	nfproto family
+ * @setup:	set up xtables and the extensions for this family
+ * @init:	iptc_init/ip6tc_init
+ * @do_command:	do_command4/do_command6
+ * @commit:	iptc_commit/ip6tc_commit
+ * @free:	iptc_free/ip6tc_free
+ * @strerror:	iptc_strerror/ip6tc_strerror
+ */
+struct xs_batch_ops {
+	const char *name;
+	uint8_t family;
+	void (*setup)(const char *program_name);
+	void *(*init)(const char *);
+	int (*do_command)(int, char **, char **, void **);
+	int (*commit)(void *);
+	void (*free)(void *);
+	const char *(*strerror)(int);
+};
+
+/**
+ * xs_batch_cmd - a command applied to a cached handle
+ * @line:	command line without the program name
+ * @lineno:	line number for error messages, or -1
+ * @error:	why the command was dropped before it got committed (a
+ * 		replay or the kernel turned it down), or NULL
+ */
+struct xs_batch_cmd {
+	char *line;
+	int lineno;
+	char *error;
+};
+
+/* Called by xs_batch_commit for each dropped command, with its index */
+typedef void xs_batch_report_t(const struct xs_batch_cmd *, unsigned int,
+			       void *);
+
+/**
+ * xs_batch_table - per-table state of a batch
+ * @handle:	libiptc handle, NULL until the first command
+ * @journal:	commands applied to @handle since the last commit
+ */
+struct xs_batch_table {
+	struct xs_batch_table *next;
+	char name[XT_TABLE_MAXNAMELEN];
+	void *handle;
+	struct xs_batch_cmd *journal;
+	unsigned int njournal, max_journal;
+};
+
+struct xs_batch {
+	const struct xs_batch_ops *ops;
+	struct xs_batch_table *tables;
+	unsigned int pending;
+	char errmsg[512];
+};
+
+enum {
+	XS_BATCH_FAILED = 0,
+	XS_BATCH_DONE,
+	XS_BATCH_PENDING,
+};
+
+/* A command line made by xs_split_ports() */
+struct xs_argv {
+	int argc;
+	char **argv;
+};
+
+/* See xs_cleanup_push() */
+struct xs_cleanup {
+	struct xs_cleanup *prev;
+	void (*fn)(void *);
+	void *arg;
+};
+
 typedef int (*mainfunc_t)(int, char **);
 
 struct subcommand {
@@ -83,6 +163,23 @@ extern struct xtables_match *load_proto(struct iptables_command_state *);
 extern int subcmd_main(int, char **, const struct subcommand *);
 extern void xs_init_target(struct xtables_target *);
 extern void xs_init_match(struct xtables_match *);
+extern FILE *xs_prefetch_hostnames(FILE *, uint8_t);
+extern unsigned int xs_split_ports(int, char **, struct xs_argv **);
+extern void xs_argv_free(struct xs_argv *, unsigned int);
+extern void xs_argv_cleanup(void *);
+extern void xs_cleanup_push(struct xs_cleanup *, void (*)(void *), void *);
+extern void xs_cleanup_pop(struct xs_cleanup *);
+extern void xs_batch_init(struct xs_batch *, const struct xs_batch_ops *);
+extern int xs_batch_exec(struct xs_batch *, const char *, int,
+	struct xs_batch_table **);
+extern int xs_batch_commit(struct xs_batch *, struct xs_batch_table *,
+	xs_batch_report_t *, void *);
+extern void xs_batch_prepare(struct xs_batch *, struct xs_batch_table *);
+extern void xs_batch_free(struct xs_batch *);
+extern void xs_batch_exit(int);
+extern int xs_batch_main(int, char **, const struct xs_batch_ops *);
+
+extern const struct xs_batch_ops iptables_batch_ops, ip6tables_batch_ops;
 
 extern const struct xtables_afinfo *afinfo;
 
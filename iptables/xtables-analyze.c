@@ -0,0 +1,414 @@
+/*
+ *	iptables-analyze: report the rules of a table that can never match,
+ *	that repeat an earlier rule, or that the rest of their chain makes
+ *	useless, and optionally print the table without them.  The table is
+ *	read from the kernel, or from a saved ruleset without touching the
+ *	kernel.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation; either version 2 of
+ *	the License, or (at your option) any later version.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xtables.h>
+#include "xshared.h"
+
+#ifdef ENABLE_IPV4
+#include <iptables.h>
+#include "iptables-multi.h"
+#endif
+
+#ifdef ENABLE_IPV6
+#include <ip6tables.h>
+#include "ip6tables-multi.h"
+#endif
+
+/**
+ * analyze_ops - libiptc flavour used by the analyze subcommand
+ * @batch:	setup, init, free and strerror of the family
+ * @save:	print a table as restore input
+ */
+struct analyze_ops {
+	const struct xs_batch_ops *batch;
+	const char *restore_name;
+	int (*restore_main)(int, char **);
+	void (*restore_offline)(void);
+	const char *(*first_chain)(void *h);
+	const char *(*next_chain)(void *h);
+	const void *(*first_rule)(const char *chain, void *h);
+	const void *(*next_rule)(const void *prev, void *h);
+	int (*analyze_chain)(const char *chain, xtc_finding_fn fn, void *data,
+			     void *h);
+	int (*delete_num_entry)(const char *chain, unsigned int rulenum,
+				void *h);
+	void (*print_rule)(const void *e, void *h, const char *chain);
+	void (*save)(const char *table, void *h, int counters);
+};
+
+struct analyze_finding {
+	unsigned int rulenum, by;
+	enum xtc_rule_finding finding;
+	bool removable;
+};
+
+struct analyze_chain {
+	struct analyze_finding *findings;
+	unsigned int num_findings;
+};
+
+static const struct option analyze_opts[] = {
+	{.name = "table",    .has_arg = true,  .val = 't'},
+	{.name = "file",     .has_arg = true,  .val = 'f'},
+	{.name = "chain",    .has_arg = true,  .val = 'c'},
+	{.name = "counters", .has_arg = false, .val = 'C'},
+	{.name = "clean",    .has_arg = false, .val = 'w'},
+	{.name = "modprobe", .has_arg = true,  .val = 'M'},
+	{.name = "help",     .has_arg = false, .val = 'h'},
+	{NULL},
+};
+
+static const char *const analyze_names[] = {
+	[XTC_RULE_SHADOWED]	= "shadowed by",
+	[XTC_RULE_DUPLICATE]	= "duplicate of",
+	[XTC_RULE_REDUNDANT]	= "redundant with",
+};
+
+/* The table handed over by the restore code at COMMIT */
+static void *analyze_handle;
+
+static void print_usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-t TABLE] [-f RULESFILE] [-c CHAIN] "
+		"[--clean [-C]]\n", name);
+	exit(1);
+}
+
+static void analyze_found(const char *chain, unsigned int rulenum,
+			  enum xtc_rule_finding finding, unsigned int by,
+			  int removable, void *data)
+{
+	struct analyze_chain *ac = data;
+	struct analyze_finding *f;
+
+	ac->findings = xtables_realloc(ac->findings, (ac->num_findings + 1) *
+				       sizeof(*ac->findings));
+	f = &ac->findings[ac->num_findings++];
+	f->rulenum = rulenum;
+	f->by = by;
+	f->finding = finding;
+	f->removable = removable;
+}
+
+/* One line per finding, with the rule unless the table goes to stdout */
+static void analyze_report(const struct analyze_ops *ops, const char *chain,
+			   const struct analyze_chain *ac, bool clean)
+{
+	const struct analyze_finding *f;
+	const void *e = NULL;
+	unsigned int i, num = 0;
+	FILE *out = clean ? stderr : stdout;
+
+	for (i = 0; i < ac->num_findings; i++) {
+		f = &ac->findings[i];
+		fprintf(out, "%s:%u: %s ", chain, f->rulenum,
+			analyze_names[f->finding]);
+		if (f->by != 0)
+			fprintf(out, "rule %u", f->by);
+		else
+			fprintf(out, "the end of the chain");
+		if (!f->removable)
+			fprintf(out, ", kept");
+		if (clean) {
+			fputc('\n', out);
+			continue;
+		}
+		fputs(": ", out);
+		for (; num < f->rulenum; num++)
+			e = num == 0 ? ops->first_rule(chain, analyze_handle) :
+				       ops->next_rule(e, analyze_handle);
+		ops->print_rule(e, analyze_handle, chain);
+	}
+}
+
+/* Delete the rules that can go, last first so the numbers hold */
+static unsigned int analyze_clean(const struct analyze_ops *ops,
+				  const char *chain,
+				  const struct analyze_chain *ac)
+{
+	unsigned int i, n = 0;
+
+	for (i = ac->num_findings; i-- > 0;) {
+		if (!ac->findings[i].removable)
+			continue;
+		if (!ops->delete_num_entry(chain, ac->findings[i].rulenum - 1,
+					   analyze_handle))
+			xtables_error(OTHER_PROBLEM, "chain `%s': %s", chain,
+				      ops->batch->strerror(errno));
+		n++;
+	}
+	return n;
+}
+
+static int analyze_main(int argc, char **argv, const struct analyze_ops *ops,
+			const char *name)
+{
+	const char *table = "filter", *file = NULL, *only = NULL;
+	unsigned int num_chains = 0, found = 0, removed = 0, i;
+	char (*chains)[XT_TABLE_MAXNAMELEN] = NULL;
+	struct analyze_chain ac;
+	char *restore_argv[6];
+	bool counters = false, clean = false;
+	const char *chain;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "t:f:c:CwM:h", analyze_opts,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 't':
+			table = optarg;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'c':
+			only = optarg;
+			break;
+		case 'C':
+			counters = true;
+			break;
+		case 'w':
+			clean = true;
+			break;
+		case 'M':
+			xtables_modprobe_program = optarg;
+			break;
+		default:
+			print_usage(name);
+		}
+	}
+	if (optind != argc)
+		print_usage(name);
+
+	if (file != NULL) {
+		/* Load only the table asked for, without the kernel */
+		restore_argv[0] = (char *)ops->restore_name;
+		restore_argv[1] = "-c";
+		restore_argv[2] = "-T";
+		restore_argv[3] = (char *)table;
+		restore_argv[4] = (char *)file;
+		restore_argv[5] = NULL;
+		ops->restore_offline();
+		optind = 0;
+		if (ops->restore_main(5, restore_argv) != 0)
+			return 1;
+		if (analyze_handle == NULL)
+			xtables_error(PARAMETER_PROBLEM, "%s: no table `%s'",
+				      file, table);
+	} else {
+		ops->batch->setup(name);
+		analyze_handle = ops->batch->init(table);
+		if (analyze_handle == NULL) {
+			xtables_load_ko(xtables_modprobe_program, false);
+			analyze_handle = ops->batch->init(table);
+		}
+		if (analyze_handle == NULL)
+			xtables_error(OTHER_PROBLEM, "Cannot initialize: %s",
+				      ops->batch->strerror(errno));
+	}
+
+	for (chain = ops->first_chain(analyze_handle); chain != NULL;
+	     chain = ops->next_chain(analyze_handle)) {
+		if (only != NULL && strcmp(chain, only) != 0)
+			continue;
+		chains = xtables_realloc(chains,
+					 (num_chains + 1) * sizeof(*chains));
+		strcpy(chains[num_chains++], chain);
+	}
+	if (only != NULL && num_chains == 0)
+		xtables_error(PARAMETER_PROBLEM, "no chain `%s' in table `%s'",
+			      only, table);
+
+	for (i = 0; i < num_chains; i++) {
+		memset(&ac, 0, sizeof(ac));
+		if (!ops->analyze_chain(chains[i], analyze_found, &ac,
+					analyze_handle))
+			xtables_error(OTHER_PROBLEM, "chain `%s': %s", chains[i],
+				      ops->batch->strerror(errno));
+		analyze_report(ops, chains[i], &ac, clean);
+		found += ac.num_findings;
+		if (clean)
+			removed += analyze_clean(ops, chains[i], &ac);
+		free(ac.findings);
+	}
+
+	if (clean) {
+		fprintf(stderr, "%u findings, %u rules removed\n", found,
+			removed);
+		ops->save(table, analyze_handle, counters);
+	}
+
+	free(chains);
+	ops->batch->free(analyze_handle);
+	analyze_handle = NULL;
+	return 0;
+}
+
+#ifdef ENABLE_IPV4
+static int analyze_commit4(struct iptc_handle *h)
+{
+	if (analyze_handle != NULL)
+		iptc_free(analyze_handle);
+	analyze_handle = h;
+	return 1;
+}
+
+static void analyze_offline4(void)
+{
+	iptables_restore_offline(analyze_commit4);
+}
+
+static const char *analyze_first_chain4(void *h)
+{
+	return iptc_first_chain(h);
+}
+
+static const char *analyze_next_chain4(void *h)
+{
+	return iptc_next_chain(h);
+}
+
+static const void *analyze_first_rule4(const char *chain, void *h)
+{
+	return iptc_first_rule(chain, h);
+}
+
+static const void *analyze_next_rule4(const void *prev, void *h)
+{
+	return iptc_next_rule(prev, h);
+}
+
+static int analyze_chain4(const char *chain, xtc_finding_fn fn, void *data,
+			  void *h)
+{
+	return iptc_analyze_chain(chain, fn, data, h);
+}
+
+static int analyze_delete_num_entry4(const char *chain, unsigned int rulenum,
+				     void *h)
+{
+	return iptc_delete_num_entry(chain, rulenum, h);
+}
+
+static void analyze_print_rule4(const void *e, void *h, const char *chain)
+{
+	print_rule4(e, h, chain, 0);
+}
+
+static void analyze_save4(const char *table, void *h, int counters)
+{
+	iptables_save_handle(table, h, counters);
+}
+
+static const struct analyze_ops analyze_ops4 = {
+	.batch			= &iptables_batch_ops,
+	.restore_name		= "iptables-restore",
+	.restore_main		= iptables_restore_main,
+	.restore_offline	= analyze_offline4,
+	.first_chain		= analyze_first_chain4,
+	.next_chain		= analyze_next_chain4,
+	.first_rule		= analyze_first_rule4,
+	.next_rule		= analyze_next_rule4,
+	.analyze_chain		= analyze_chain4,
+	.delete_num_entry	= analyze_delete_num_entry4,
+	.print_rule		= analyze_print_rule4,
+	.save			= analyze_save4,
+};
+
+int iptables_analyze_main(int argc, char **argv)
+{
+	return analyze_main(argc, argv, &analyze_ops4, "iptables-analyze");
+}
+#endif
+
+#ifdef ENABLE_IPV6
+static int analyze_commit6(struct ip6tc_handle *h)
+{
+	if (analyze_handle != NULL)
+		ip6tc_free(analyze_handle);
+	analyze_handle = h;
+	return 1;
+}
+
+static void analyze_offline6(void)
+{
+	ip6tables_restore_offline(analyze_commit6);
+}
+
+static const char *analyze_first_chain6(void *h)
+{
+	return ip6tc_first_chain(h);
+}
+
+static const char *analyze_next_chain6(void *h)
+{
+	return ip6tc_next_chain(h);
+}
+
+static const void *analyze_first_rule6(const char *chain, void *h)
+{
+	return ip6tc_first_rule(chain, h);
+}
+
+static const void *analyze_next_rule6(const void *prev, void *h)
+{
+	return ip6tc_next_rule(prev, h);
+}
+
+static int analyze_chain6(const char *chain, xtc_finding_fn fn, void *data,
+			  void *h)
+{
+	return ip6tc_analyze_chain(chain, fn, data, h);
+}
+
+static int analyze_delete_num_entry6(const char *chain, unsigned int rulenum,
+				     void *h)
+{
+	return ip6tc_delete_num_entry(chain, rulenum, h);
+}
+
+static void analyze_print_rule6(const void *e, void *h, const char *chain)
+{
+	print_rule6(e, h, chain, 0);
+}
+
+static void analyze_save6(const char *table, void *h, int counters)
+{
+	ip6tables_save_handle(table, h, counters);
+}
+
+static const struct analyze_ops analyze_ops6 = {
+	.batch			= &ip6tables_batch_ops,
+	.restore_name		= "ip6tables-restore",
+	.restore_main		= ip6tables_restore_main,
+	.restore_offline	= analyze_offline6,
+	.first_chain		= analyze_first_chain6,
+	.next_chain		= analyze_next_chain6,
+	.first_rule		= analyze_first_rule6,
+	.next_rule		= analyze_next_rule6,
+	.analyze_chain		= analyze_chain6,
+	.delete_num_entry	= analyze_delete_num_entry6,
+	.print_rule		= analyze_print_rule6,
+	.save			= analyze_save6,
+};
+
+int ip6tables_analyze_main(int argc, char **argv)
+{
+	return analyze_main(argc, argv, &analyze_ops6, "ip6tables-analyze");
+}
+#endif
@@ -0,0 +1,485 @@
+/*
+ *	iptables-daemon: keep the tables cached and apply iptables commands
+ *	received on a unix socket, committing them in batches.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation; either version 2 of
+ *	the License, or (at your option) any later version.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <xtables.h>
+#include "xshared.h"
+
+#ifdef ENABLE_IPV4
+#include "iptables-multi.h"
+#endif
+
+#ifdef ENABLE_IPV6
+#include "ip6tables-multi.h"
+#endif
+
+enum {
+	DAEMON_LINE_MAX      = 10240,
+	DAEMON_WINDOW        = 10, /* ms */
+};
+
+/**
+ * One reply per command, sent in order. @table is set while the reply
+ * waits for that table to be committed; @index is then the command's
+ * place in the table's journal.
+ */
+struct daemon_reply {
+	struct daemon_reply *next;
+	struct xs_batch_table *table;
+	unsigned int index;
+	bool ok;
+	char *text;
+	size_t len;
+};
+
+struct daemon_client {
+	struct daemon_client *next;
+	int fd;
+	bool eof;
+	char in[DAEMON_LINE_MAX];
+	size_t inlen;
+	char *out;
+	size_t outlen, outsize;
+	struct daemon_reply *replies, **tail;
+};
+
+static const struct option daemon_opts[] = {
+	{.name = "socket",   .has_arg = true,  .val = 's'},
+	{.name = "window",   .has_arg = true,  .val = 'w'},
+	{.name = "modprobe", .has_arg = true,  .val = 'M'},
+	{.name = "help",     .has_arg = false, .val = 'h'},
+	{NULL},
+};
+
+static volatile sig_atomic_t daemon_quit;
+static struct daemon_client *clients;
+static struct xs_batch batch;
+static int capture_fd = -1;
+
+static void daemon_sighandler(int sig)
+{
+	daemon_quit = 1;
+}
+
+static unsigned long long daemon_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void print_usage(const char *name, const char *sock)
+{
+	fprintf(stderr, "Usage: %s [--socket PATH] [--window MSEC] "
+		"[--modprobe=<command>]\n"
+		"Default socket: %s\n", name, sock);
+	exit(1);
+}
+
+static void client_queue_output(struct daemon_client *c, const char *buf,
+				size_t len)
+{
+	if (c->outlen + len > c->outsize) {
+		c->outsize = c->outlen + len + 1024;
+		c->out = xtables_realloc(c->out, c->outsize);
+	}
+	memcpy(c->out + c->outlen, buf, len);
+	c->outlen += len;
+}
+
+/* Move all replies that are no longer waiting for a commit to @c->out. */
+static void client_flush_replies(struct daemon_client *c)
+{
+	struct daemon_reply *r;
+	char hdr[32];
+	int n;
+
+	while ((r = c->replies) != NULL && r->table == NULL) {
+		n = snprintf(hdr, sizeof(hdr), "%s %zu\n",
+			     r->ok ? "OK" : "ERR", r->len);
+		client_queue_output(c, hdr, n);
+		client_queue_output(c, r->text, r->len);
+		c->replies = r->next;
+		if (c->replies == NULL)
+			c->tail = &c->replies;
+		free(r->text);
+		free(r);
+	}
+}
+
+static void reply_append(struct daemon_reply *r, const char *msg)
+{
+	size_t len = strlen(msg);
+
+	r->text = xtables_realloc(r->text, r->len + len + 2);
+	memcpy(r->text + r->len, msg, len);
+	r->len += len;
+	r->text[r->len++] = '\n';
+}
+
+/* Read back whatever the last command wrote to stdout and stderr. */
+static void capture_collect(struct daemon_reply *r)
+{
+	off_t len = lseek(capture_fd, 0, SEEK_CUR);
+
+	if (len > 0) {
+		r->text = xtables_malloc(len + 1);
+		if (pread(capture_fd, r->text, len, 0) == len)
+			r->len = len;
+	}
+	if (ftruncate(capture_fd, 0) < 0)
+		perror("ftruncate");
+	lseek(capture_fd, 0, SEEK_SET);
+}
+
+static void client_exec(struct daemon_client *c, const char *cmd)
+{
+	struct daemon_reply *r = xtables_calloc(1, sizeof(*r));
+	struct xs_batch_table *t;
+	int saved_out, saved_err, ret;
+
+	/* A new batch sees the name maps as they are now */
+	if (batch.pending == 0)
+		xtables_lmap_flush();
+
+	fflush(stdout);
+	fflush(stderr);
+	saved_out = dup(STDOUT_FILENO);
+	saved_err = dup(STDERR_FILENO);
+	dup2(capture_fd, STDOUT_FILENO);
+	dup2(capture_fd, STDERR_FILENO);
+
+	ret = xs_batch_exec(&batch, cmd, -1, &t);
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(saved_out, STDOUT_FILENO);
+	dup2(saved_err, STDERR_FILENO);
+	close(saved_out);
+	close(saved_err);
+
+	capture_collect(r);
+	r->ok = ret != XS_BATCH_FAILED;
+	if (!r->ok)
+		reply_append(r, batch.errmsg);
+	else if (ret == XS_BATCH_PENDING) {
+		r->table = t;
+		r->index = t->njournal - 1;
+	}
+
+	*c->tail = r;
+	c->tail = &r->next;
+	client_flush_replies(c);
+}
+
+static void client_process_input(struct daemon_client *c)
+{
+	char *start = c->in, *nl;
+	size_t left;
+
+	while ((nl = memchr(start, '\n', c->inlen - (start - c->in))) != NULL) {
+		*nl = '\0';
+		if (*start != '#')
+			client_exec(c, start);
+		start = nl + 1;
+	}
+	left = c->inlen - (start - c->in);
+	memmove(c->in, start, left);
+	c->inlen = left;
+
+	if (c->eof && c->inlen > 0) {
+		/* last line without a newline */
+		c->in[c->inlen] = '\0';
+		client_exec(c, c->in);
+		c->inlen = 0;
+	}
+}
+
+static void client_read(struct daemon_client *c)
+{
+	ssize_t n;
+
+	n = read(c->fd, c->in + c->inlen, sizeof(c->in) - 1 - c->inlen);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		c->eof = true;
+	} else if (n == 0) {
+		c->eof = true;
+	} else {
+		c->inlen += n;
+		if (c->inlen == sizeof(c->in) - 1 &&
+		    memchr(c->in, '\n', c->inlen) == NULL) {
+			/* Cannot be a valid command; give up on the client */
+			c->inlen = 0;
+			c->eof = true;
+		}
+	}
+	client_process_input(c);
+}
+
+static void client_write(struct daemon_client *c)
+{
+	ssize_t n;
+
+	n = write(c->fd, c->out, c->outlen);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			/* Reader went away; drop what is left */
+			c->outlen = 0;
+			c->eof = true;
+		}
+		return;
+	}
+	memmove(c->out, c->out + n, c->outlen - n);
+	c->outlen -= n;
+}
+
+static void client_free(struct daemon_client *c)
+{
+	struct daemon_reply *r;
+
+	while ((r = c->replies) != NULL) {
+		c->replies = r->next;
+		free(r->text);
+		free(r);
+	}
+	close(c->fd);
+	free(c->out);
+	free(c);
+}
+
+/* A command the commit of table @data dropped: fail its reply only */
+static void daemon_reject(const struct xs_batch_cmd *cmd, unsigned int index,
+			  void *data)
+{
+	struct daemon_client *c;
+	struct daemon_reply *r;
+
+	for (c = clients; c != NULL; c = c->next)
+		for (r = c->replies; r != NULL; r = r->next)
+			if (r->table == data && r->index == index) {
+				r->ok = false;
+				reply_append(r, cmd->error);
+				return;
+			}
+}
+
+/* Commit every table with pending commands and answer their senders. */
+static void daemon_commit(void)
+{
+	struct daemon_client *c;
+	struct daemon_reply *r;
+	struct xs_batch_table *t;
+
+	for (t = batch.tables; t != NULL; t = t->next) {
+		if (t->njournal == 0)
+			continue;
+		xs_batch_commit(&batch, t, daemon_reject, t);
+		for (c = clients; c != NULL; c = c->next)
+			for (r = c->replies; r != NULL; r = r->next)
+				if (r->table == t)
+					r->table = NULL;
+		/* Have the next burst start from a warm handle */
+		xs_batch_prepare(&batch, t);
+	}
+	for (c = clients; c != NULL; c = c->next)
+		client_flush_replies(c);
+}
+
+static int daemon_listen(const char *path)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	mode_t mask;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		xtables_error(PARAMETER_PROBLEM, "socket path too long");
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		xtables_error(OTHER_PROBLEM, "socket: %s", strerror(errno));
+	unlink(path);
+	mask = umask(077);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		xtables_error(OTHER_PROBLEM, "bind %s: %s", path,
+			      strerror(errno));
+	umask(mask);
+	if (listen(fd, SOMAXCONN) < 0)
+		xtables_error(OTHER_PROBLEM, "listen: %s", strerror(errno));
+	return fd;
+}
+
+static void daemon_accept(int lfd)
+{
+	struct daemon_client *c;
+	int fd;
+
+	while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		c = xtables_calloc(1, sizeof(*c));
+		c->fd   = fd;
+		c->tail = &c->replies;
+		c->next = clients;
+		clients = c;
+	}
+}
+
+static int daemon_main(int argc, char **argv, const struct xs_batch_ops *ops,
+		       const char *program_name, const char *sock)
+{
+	unsigned long long deadline = 0, now;
+	unsigned int window = DAEMON_WINDOW, nfds, i;
+	struct daemon_client *c, **cp;
+	struct pollfd *pfd = NULL;
+	struct sigaction sa;
+	char tmpl[] = "/tmp/xtables-daemon.XXXXXX";
+	int lfd, opt, timeout;
+
+	ops->setup(program_name);
+
+	while ((opt = getopt_long(argc, argv, "s:w:M:h", daemon_opts,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			sock = optarg;
+			break;
+		case 'w':
+			if (!xtables_strtoui(optarg, NULL, &window, 0, 60000))
+				xtables_error(PARAMETER_PROBLEM,
+					      "invalid window `%s'", optarg);
+			break;
+		case 'M':
+			xtables_modprobe_program = optarg;
+			break;
+		default:
+			print_usage(program_name, sock);
+		}
+	}
+	if (optind < argc)
+		print_usage(program_name, sock);
+
+	capture_fd = mkstemp(tmpl);
+	if (capture_fd < 0)
+		xtables_error(OTHER_PROBLEM, "mkstemp: %s", strerror(errno));
+	unlink(tmpl);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemon_sighandler;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	xs_batch_init(&batch, ops);
+	lfd = daemon_listen(sock);
+
+	while (!daemon_quit) {
+		nfds = 1;
+		for (c = clients; c != NULL; c = c->next)
+			++nfds;
+		pfd = xtables_realloc(pfd, nfds * sizeof(*pfd));
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		for (c = clients, i = 1; c != NULL; c = c->next, ++i) {
+			pfd[i].fd = c->fd;
+			pfd[i].events = c->eof ? 0 : POLLIN;
+			if (c->outlen > 0)
+				pfd[i].events |= POLLOUT;
+			else if (c->eof)
+				pfd[i].fd = -1;
+		}
+
+		timeout = -1;
+		if (deadline != 0) {
+			now = daemon_now();
+			timeout = deadline > now ? deadline - now : 0;
+		}
+		if (poll(pfd, nfds, timeout) < 0 && errno != EINTR)
+			xtables_error(OTHER_PROBLEM, "poll: %s",
+				      strerror(errno));
+
+		for (c = clients, i = 1; c != NULL; c = c->next, ++i) {
+			if (!c->eof &&
+			    (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				client_read(c);
+			if (pfd[i].revents & POLLOUT)
+				client_write(c);
+		}
+		if (pfd[0].revents & POLLIN)
+			daemon_accept(lfd);
+
+		if (batch.pending == 0)
+			deadline = 0;
+		else if (deadline == 0)
+			deadline = daemon_now() + window;
+		if (deadline != 0 && daemon_now() >= deadline) {
+			daemon_commit();
+			deadline = 0;
+		}
+
+		/* Forget clients that hung up and have been answered */
+		for (cp = &clients; (c = *cp) != NULL; ) {
+			if (c->eof && c->replies == NULL && c->outlen == 0) {
+				*cp = c->next;
+				client_free(c);
+			} else {
+				cp = &c->next;
+			}
+		}
+	}
+
+	daemon_commit();
+	for (c = clients; c != NULL; c = c->next) {
+		fcntl(c->fd, F_SETFL, 0);
+		while (c->outlen > 0 && !c->eof)
+			client_write(c);
+	}
+	while ((c = clients) != NULL) {
+		clients = c->next;
+		client_free(c);
+	}
+	free(pfd);
+	xs_batch_free(&batch);
+	close(lfd);
+	unlink(sock);
+	return 0;
+}
+
+#ifdef ENABLE_IPV4
+int iptables_daemon_main(int argc, char **argv)
+{
+	return daemon_main(argc, argv, &iptables_batch_ops,
+			   "iptables-daemon", "/var/run/iptables.sock");
+}
+#endif
+
+#ifdef ENABLE_IPV6
+int ip6tables_daemon_main(int argc, char **argv)
+{
+	return daemon_main(argc, argv, &ip6tables_batch_ops,
+			   "ip6tables-daemon", "/var/run/ip6tables.sock");
+}
+#endif
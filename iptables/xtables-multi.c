@@ -21,6 +21,16 @@ static const struct subcommand multi_subcommands[] = {
 	{"save4",               iptables_save_main},
 	{"iptables-restore",    iptables_restore_main},
 	{"restore4",            iptables_restore_main},
+	{"iptables-daemon",     iptables_daemon_main},
+	{"daemon4",             iptables_daemon_main},
+	{"iptables-safe-apply", iptables_safe_apply_main},
+	{"safe-apply4",         iptables_safe_apply_main},
+	{"iptables-replay",     iptables_replay_main},
+	{"replay4",             iptables_replay_main},
+	{"iptables-optimize",   iptables_optimize_main},
+	{"optimize4",           iptables_optimize_main},
+	{"iptables-analyze",    iptables_analyze_main},
+	{"analyze4",            iptables_analyze_main},
 #endif
 	{"iptables-xml",        iptables_xml_main},
 	{"xml",                 iptables_xml_main},
@@ -31,6 +41,16 @@ static const struct subcommand multi_subcommands[] = {
 	{"save6",               ip6tables_save_main},
 	{"ip6tables-restore",   ip6tables_restore_main},
 	{"restore6",            ip6tables_restore_main},
+	{"ip6tables-daemon",    ip6tables_daemon_main},
+	{"daemon6",             ip6tables_daemon_main},
+	{"ip6tables-safe-apply", ip6tables_safe_apply_main},
+	{"safe-apply6",         ip6tables_safe_apply_main},
+	{"ip6tables-replay",    ip6tables_replay_main},
+	{"replay6",             ip6tables_replay_main},
+	{"ip6tables-optimize",  ip6tables_optimize_main},
+	{"optimize6",           ip6tables_optimize_main},
+	{"ip6tables-analyze",   ip6tables_analyze_main},
+	{"analyze6",            ip6tables_analyze_main},
 #endif
 	{NULL},
 };
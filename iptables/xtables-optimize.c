@@ -0,0 +1,583 @@
+/*
+ *	iptables-optimize: rewrite a table into a faster, equivalent one
+ *	and print it as iptables-restore input.  The table is read from
+ *	the kernel, or from a saved ruleset without touching the kernel.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation; either version 2 of
+ *	the License, or (at your option) any later version.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <xtables.h>
+#include <linux/netfilter/xt_set.h>
+#include "xshared.h"
+
+#ifdef ENABLE_IPV4
+#include <iptables.h>
+#include "iptables-multi.h"
+#endif
+
+#ifdef ENABLE_IPV6
+#include <ip6tables.h>
+#include "ip6tables-multi.h"
+#endif
+
+/**
+ * optimize_ops - libiptc flavour used by the optimize subcommand
+ * @family:	NFPROTO_* of the sets made by --sets
+ * @batch:	setup, init, free and strerror of the family
+ * @save:	print a table as restore input
+ */
+struct optimize_ops {
+	uint8_t family;
+	const struct xs_batch_ops *batch;
+	const char *restore_name;
+	int (*restore_main)(int, char **);
+	void (*restore_offline)(void);
+	const char *(*first_chain)(void *h);
+	const char *(*next_chain)(void *h);
+	int (*reorder_chain)(const char *chain,
+			     struct xtc_reorder_stats *stats, void *h);
+	int (*bisect_chain)(const char *chain, unsigned int min_rules,
+			    struct xtc_bisect_stats *stats, void *h);
+	int (*factor_chain)(const char *chain, unsigned int min_rules,
+			    struct xtc_factor_stats *stats, void *h);
+	int (*compact_chain)(const char *chain, unsigned int min_rules,
+			     xtc_compact_fn fn, void *data,
+			     struct xtc_compact_stats *stats, void *h);
+	int (*multiport_chain)(const char *chain,
+			       struct xtc_ports_stats *stats, void *h);
+	void (*save)(const char *table, void *h, int counters);
+};
+
+enum {
+	OPTIMIZE_REORDER	= 1 << 0,
+	OPTIMIZE_BISECT		= 1 << 1,
+	OPTIMIZE_FACTOR		= 1 << 2,
+	OPTIMIZE_SETS		= 1 << 3,
+	OPTIMIZE_MULTIPORT	= 1 << 4,
+
+	OPTIMIZE_MIN_RUN	= 16,
+};
+
+static const struct option optimize_opts[] = {
+	{.name = "table",    .has_arg = true,  .val = 't'},
+	{.name = "file",     .has_arg = true,  .val = 'f'},
+	{.name = "chain",    .has_arg = true,  .val = 'c'},
+	{.name = "counters", .has_arg = false, .val = 'C'},
+	{.name = "reorder",  .has_arg = false, .val = 'r'},
+	{.name = "bisect",   .has_arg = false, .val = 'b'},
+	{.name = "factor",   .has_arg = false, .val = 'F'},
+	{.name = "sets",     .has_arg = true,  .val = 'S'},
+	{.name = "multiport", .has_arg = false, .val = 'P'},
+	{.name = "min-run",  .has_arg = true,  .val = 'm'},
+	{.name = "modprobe", .has_arg = true,  .val = 'M'},
+	{.name = "help",     .has_arg = false, .val = 'h'},
+	{NULL},
+};
+
+/* The table handed over by the restore code at COMMIT */
+static void *optimize_handle;
+
+/* Sets made by --sets.  Their rules carry an index from the top down,
+ * out of the way of the sets the kernel has, which the set match
+ * would look up there to print the name. */
+static struct optimize_sets {
+	FILE *fp;
+	uint8_t family;
+	unsigned int num;
+	char (*names)[IPSET_MAXNAMELEN];
+	union {
+		struct xt_entry_match m;
+		char buf[XT_ALIGN(sizeof(struct xt_entry_match)) +
+			 XT_ALIGN(sizeof(struct xt_set_info_match_v1))];
+	} match;
+} optimize_sets;
+
+static void (*optimize_set_save_next)(const void *ip,
+				      const struct xt_entry_match *match);
+
+static void print_usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-t TABLE] [-f RULESFILE] [-c CHAIN] "
+		"[-C] [--reorder] [--bisect] [--factor] [--sets SETFILE] "
+		"[--multiport] [--min-run N]\n", name);
+	exit(1);
+}
+
+static void optimize_reorder(const struct optimize_ops *ops,
+			     const char *chain)
+{
+	struct xtc_reorder_stats st;
+
+	if (!ops->reorder_chain(chain, &st, optimize_handle))
+		xtables_error(OTHER_PROBLEM, "chain `%s': %s", chain,
+			      ops->batch->strerror(errno));
+	if (st.packets == 0) {
+		fprintf(stderr, "%s: no packets counted, left as is\n", chain);
+		return;
+	}
+	fprintf(stderr, "%s: %u rules moved, mean depth %.2f -> %.2f "
+		"(%.1f%% less) over %llu packets\n", chain, st.moved,
+		(double)st.depth_before / st.packets,
+		(double)st.depth_after / st.packets,
+		100.0 * (st.depth_before - st.depth_after) / st.depth_before,
+		(unsigned long long)st.packets);
+}
+
+static void optimize_bisect(const struct optimize_ops *ops,
+			    const char *chain, unsigned int min_run)
+{
+	struct xtc_bisect_stats st;
+
+	if (!ops->bisect_chain(chain, min_run, &st, optimize_handle))
+		xtables_error(OTHER_PROBLEM, "chain `%s': %s", chain,
+			      ops->batch->strerror(errno));
+	if (st.runs == 0)
+		return;
+	fprintf(stderr, "%s: %u runs of %u rules into %u chains (%u rules "
+		"copied), longest path %u -> %u rules\n", chain, st.runs,
+		st.rules, st.chains, st.copies, st.depth_before,
+		st.depth_after);
+}
+
+static void optimize_factor(const struct optimize_ops *ops,
+			    const char *chain, unsigned int min_run)
+{
+	struct xtc_factor_stats st;
+
+	if (!ops->factor_chain(chain, min_run, &st, optimize_handle))
+		xtables_error(OTHER_PROBLEM, "chain `%s': %s", chain,
+			      ops->batch->strerror(errno));
+	if (st.runs == 0)
+		return;
+	fprintf(stderr, "%s: %u runs of %u rules into new chains, %u tests "
+		"taken out of the rules\n", chain, st.runs, st.rules,
+		st.tests);
+}
+
+static const char *optimize_prefix(const struct xtc_prefix *p,
+				   uint8_t family, unsigned int full)
+{
+	static char buf[64];
+	const char *addr;
+
+	if (family == NFPROTO_IPV6)
+		addr = xtables_ip6addr_to_numeric(&p->addr.in6);
+	else
+		addr = xtables_ipaddr_to_numeric(&p->addr.in);
+	if (p->len == full)
+		return addr;
+	snprintf(buf, sizeof(buf), "%s/%u", addr, p->len);
+	return buf;
+}
+
+/* Write a set of the prefixes as ipset-restore input, and give the set
+ * match on it that is to replace the run */
+static const struct xt_entry_match *
+optimize_set_match(const char *chain, int dst, const struct xtc_prefix *p,
+		   unsigned int n, void *data)
+{
+	struct optimize_sets *s = data;
+	struct xt_set_info_match_v1 *info = (void *)s->match.m.data;
+	unsigned int full = s->family == NFPROTO_IPV6 ? 128 : 32;
+	unsigned int i, hashsize = 1024, maxelem = 65536;
+	char suffix[16], *name;
+	bool nets = false;
+	int len;
+
+	if (s->num == IPSET_INVALID_ID)
+		return NULL;
+	s->names = xtables_realloc(s->names,
+				   (s->num + 1) * sizeof(*s->names));
+	name = s->names[s->num];
+	len = snprintf(suffix, sizeof(suffix), "-%c%u", dst ? 'd' : 's',
+		       s->num + 1);
+	snprintf(name, IPSET_MAXNAMELEN, "%.*s%s",
+		 IPSET_MAXNAMELEN - 1 - len, chain, suffix);
+
+	for (i = 0; i < n; i++)
+		if (p[i].len != full)
+			nets = true;
+	while (hashsize < n / 4)
+		hashsize <<= 1;
+	while (maxelem < n)
+		maxelem <<= 1;
+	fprintf(s->fp, "create %s %s family %s hashsize %u maxelem %u\n",
+		name, nets ? "hash:net" : "hash:ip",
+		s->family == NFPROTO_IPV6 ? "inet6" : "inet",
+		hashsize, maxelem);
+	for (i = 0; i < n; i++)
+		fprintf(s->fp, "add %s %s\n", name,
+			optimize_prefix(&p[i], s->family, full));
+
+	memset(&s->match, 0, sizeof(s->match));
+	s->match.m.u.user.match_size = sizeof(s->match);
+	strcpy(s->match.m.u.user.name, "set");
+	s->match.m.u.user.revision = 1;
+	info->match_set.index = IPSET_INVALID_ID - 1 - s->num;
+	info->match_set.dim = IPSET_DIM_ONE;
+	if (!dst)
+		info->match_set.flags = IPSET_DIM_ONE_SRC;
+	s->num++;
+	return &s->match.m;
+}
+
+/* Print the name of the sets made by --sets, which aren't in the kernel
+ * yet, and leave the others to the set match */
+static void optimize_set_save(const void *ip,
+			      const struct xt_entry_match *match)
+{
+	const struct xt_set_info_match_v1 *info = (const void *)match->data;
+	unsigned int idx = IPSET_INVALID_ID - 1 - info->match_set.index;
+
+	if (match->u.user.revision != 1 || idx >= optimize_sets.num) {
+		optimize_set_save_next(ip, match);
+		return;
+	}
+	printf(" --match-set %s %s", optimize_sets.names[idx],
+	       info->match_set.flags & IPSET_DIM_ONE_SRC ? "src" : "dst");
+}
+
+static void optimize_compact(const struct optimize_ops *ops,
+			     const char *chain, unsigned int min_run)
+{
+	struct xtc_compact_stats st;
+
+	if (!ops->compact_chain(chain, min_run, optimize_set_match,
+				&optimize_sets, &st, optimize_handle))
+		xtables_error(OTHER_PROBLEM, "chain `%s': %s", chain,
+			      ops->batch->strerror(errno));
+	if (st.runs == 0)
+		return;
+	fprintf(stderr, "%s: %u runs of %u rules into rules matching a set, "
+		"%u rules fewer\n", chain, st.runs, st.rules,
+		st.rules - st.runs);
+}
+
+static void optimize_multiport(const struct optimize_ops *ops,
+			       const char *chain)
+{
+	struct xtc_ports_stats st;
+
+	if (!ops->multiport_chain(chain, &st, optimize_handle))
+		xtables_error(OTHER_PROBLEM, "chain `%s': %s", chain,
+			      ops->batch->strerror(errno));
+	if (st.runs == 0)
+		return;
+	fprintf(stderr, "%s: %u runs of %u rules into %u multiport rules\n",
+		chain, st.runs, st.rules, st.merged);
+}
+
+static int optimize_main(int argc, char **argv,
+			 const struct optimize_ops *ops, const char *name)
+{
+	const char *table = "filter", *file = NULL, *only = NULL;
+	const char *setfile = NULL;
+	struct xtables_match *set;
+	unsigned int passes = 0, num_chains = 0, i;
+	unsigned int min_run = OPTIMIZE_MIN_RUN;
+	char (*chains)[XT_TABLE_MAXNAMELEN] = NULL;
+	char *restore_argv[6];
+	const char *chain;
+	bool counters = false;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "t:f:c:CrbFS:Pm:M:h", optimize_opts,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 't':
+			table = optarg;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'c':
+			only = optarg;
+			break;
+		case 'C':
+			counters = true;
+			break;
+		case 'r':
+			passes |= OPTIMIZE_REORDER;
+			break;
+		case 'b':
+			passes |= OPTIMIZE_BISECT;
+			break;
+		case 'F':
+			passes |= OPTIMIZE_FACTOR;
+			break;
+		case 'S':
+			passes |= OPTIMIZE_SETS;
+			setfile = optarg;
+			break;
+		case 'P':
+			passes |= OPTIMIZE_MULTIPORT;
+			break;
+		case 'm':
+			if (!xtables_strtoui(optarg, NULL, &min_run, 2,
+					     UINT32_MAX))
+				xtables_error(PARAMETER_PROBLEM,
+					      "invalid run length `%s'", optarg);
+			break;
+		case 'M':
+			xtables_modprobe_program = optarg;
+			break;
+		default:
+			print_usage(name);
+		}
+	}
+	if (optind != argc)
+		print_usage(name);
+
+	if (setfile != NULL) {
+		optimize_sets.fp = fopen(setfile, "w");
+		if (optimize_sets.fp == NULL)
+			xtables_error(OTHER_PROBLEM, "%s: %s", setfile,
+				      strerror(errno));
+		optimize_sets.family = ops->family;
+	}
+
+	if (file != NULL) {
+		/* Load only the table asked for, without the kernel */
+		restore_argv[0] = (char *)ops->restore_name;
+		restore_argv[1] = "-c";
+		restore_argv[2] = "-T";
+		restore_argv[3] = (char *)table;
+		restore_argv[4] = (char *)file;
+		restore_argv[5] = NULL;
+		ops->restore_offline();
+		optind = 0;
+		if (ops->restore_main(5, restore_argv) != 0)
+			return 1;
+		if (optimize_handle == NULL)
+			xtables_error(PARAMETER_PROBLEM, "%s: no table `%s'",
+				      file, table);
+	} else {
+		ops->batch->setup(name);
+		optimize_handle = ops->batch->init(table);
+		if (optimize_handle == NULL) {
+			xtables_load_ko(xtables_modprobe_program, false);
+			optimize_handle = ops->batch->init(table);
+		}
+		if (optimize_handle == NULL)
+			xtables_error(OTHER_PROBLEM, "Cannot initialize: %s",
+				      ops->batch->strerror(errno));
+	}
+
+	/* The passes may add chains, so walk a copy of the names */
+	for (chain = ops->first_chain(optimize_handle); chain != NULL;
+	     chain = ops->next_chain(optimize_handle)) {
+		if (only != NULL && strcmp(chain, only) != 0)
+			continue;
+		chains = xtables_realloc(chains,
+					 (num_chains + 1) * sizeof(*chains));
+		strcpy(chains[num_chains++], chain);
+	}
+	if (only != NULL && num_chains == 0)
+		xtables_error(PARAMETER_PROBLEM, "no chain `%s' in table `%s'",
+			      only, table);
+
+	for (i = 0; i < num_chains; i++) {
+		if (passes & OPTIMIZE_MULTIPORT)
+			optimize_multiport(ops, chains[i]);
+		if (passes & OPTIMIZE_REORDER)
+			optimize_reorder(ops, chains[i]);
+		if (passes & OPTIMIZE_BISECT)
+			optimize_bisect(ops, chains[i], min_run);
+		if (passes & OPTIMIZE_FACTOR)
+			optimize_factor(ops, chains[i], min_run);
+		if (passes & OPTIMIZE_SETS)
+			optimize_compact(ops, chains[i], min_run);
+	}
+
+	if (optimize_sets.num > 0) {
+		set = xtables_find_match("set", XTF_LOAD_MUST_SUCCEED, NULL);
+		optimize_set_save_next = set->save;
+		set->save = optimize_set_save;
+	}
+	if (optimize_sets.fp != NULL && fclose(optimize_sets.fp) != 0)
+		xtables_error(OTHER_PROBLEM, "%s: %s", setfile,
+			      strerror(errno));
+
+	ops->save(table, optimize_handle, counters);
+
+	free(chains);
+	free(optimize_sets.names);
+	memset(&optimize_sets, 0, sizeof(optimize_sets));
+	ops->batch->free(optimize_handle);
+	optimize_handle = NULL;
+	return 0;
+}
+
+#ifdef ENABLE_IPV4
+static int optimize_commit4(struct iptc_handle *h)
+{
+	if (optimize_handle != NULL)
+		iptc_free(optimize_handle);
+	optimize_handle = h;
+	return 1;
+}
+
+static void optimize_offline4(void)
+{
+	iptables_restore_offline(optimize_commit4);
+}
+
+static const char *optimize_first_chain4(void *h)
+{
+	return iptc_first_chain(h);
+}
+
+static const char *optimize_next_chain4(void *h)
+{
+	return iptc_next_chain(h);
+}
+
+static int optimize_reorder_chain4(const char *chain,
+				   struct xtc_reorder_stats *stats, void *h)
+{
+	return iptc_reorder_chain(chain, stats, h);
+}
+
+static int optimize_bisect_chain4(const char *chain, unsigned int min_rules,
+				  struct xtc_bisect_stats *stats, void *h)
+{
+	return iptc_bisect_chain(chain, min_rules, stats, h);
+}
+
+static int optimize_factor_chain4(const char *chain, unsigned int min_rules,
+				  struct xtc_factor_stats *stats, void *h)
+{
+	return iptc_factor_chain(chain, min_rules, stats, h);
+}
+
+static int optimize_compact_chain4(const char *chain, unsigned int min_rules,
+				   xtc_compact_fn fn, void *data,
+				   struct xtc_compact_stats *stats, void *h)
+{
+	return iptc_compact_chain(chain, min_rules, fn, data, stats, h);
+}
+
+static int optimize_multiport_chain4(const char *chain,
+				     struct xtc_ports_stats *stats, void *h)
+{
+	return iptc_multiport_chain(chain, stats, h);
+}
+
+static void optimize_save4(const char *table, void *h, int counters)
+{
+	iptables_save_handle(table, h, counters);
+}
+
+static const struct optimize_ops optimize_ops4 = {
+	.family			= NFPROTO_IPV4,
+	.batch			= &iptables_batch_ops,
+	.restore_name		= "iptables-restore",
+	.restore_main		= iptables_restore_main,
+	.restore_offline	= optimize_offline4,
+	.first_chain		= optimize_first_chain4,
+	.next_chain		= optimize_next_chain4,
+	.reorder_chain		= optimize_reorder_chain4,
+	.bisect_chain		= optimize_bisect_chain4,
+	.factor_chain		= optimize_factor_chain4,
+	.compact_chain		= optimize_compact_chain4,
+	.multiport_chain	= optimize_multiport_chain4,
+	.save			= optimize_save4,
+};
+
+int iptables_optimize_main(int argc, char **argv)
+{
+	return optimize_main(argc, argv, &optimize_ops4, "iptables-optimize");
+}
+#endif
+
+#ifdef ENABLE_IPV6
+static int optimize_commit6(struct ip6tc_handle *h)
+{
+	if (optimize_handle != NULL)
+		ip6tc_free(optimize_handle);
+	optimize_handle = h;
+	return 1;
+}
+
+static void optimize_offline6(void)
+{
+	ip6tables_restore_offline(optimize_commit6);
+}
+
+static const char *optimize_first_chain6(void *h)
+{
+	return ip6tc_first_chain(h);
+}
+
+static const char *optimize_next_chain6(void *h)
+{
+	return ip6tc_next_chain(h);
+}
+
+static int optimize_reorder_chain6(const char *chain,
+				   struct xtc_reorder_stats *stats, void *h)
+{
+	return ip6tc_reorder_chain(chain, stats, h);
+}
+
+static int optimize_bisect_chain6(const char *chain, unsigned int min_rules,
+				  struct xtc_bisect_stats *stats, void *h)
+{
+	return ip6tc_bisect_chain(chain, min_rules, stats, h);
+}
+
+static int optimize_factor_chain6(const char *chain, unsigned int min_rules,
+				  struct xtc_factor_stats *stats, void *h)
+{
+	return ip6tc_factor_chain(chain, min_rules, stats, h);
+}
+
+static int optimize_compact_chain6(const char *chain, unsigned int min_rules,
+				   xtc_compact_fn fn, void *data,
+				   struct xtc_compact_stats *stats, void *h)
+{
+	return ip6tc_compact_chain(chain, min_rules, fn, data, stats, h);
+}
+
+static int optimize_multiport_chain6(const char *chain,
+				     struct xtc_ports_stats *stats, void *h)
+{
+	return ip6tc_multiport_chain(chain, stats, h);
+}
+
+static void optimize_save6(const char *table, void *h, int counters)
+{
+	ip6tables_save_handle(table, h, counters);
+}
+
+static const struct optimize_ops optimize_ops6 = {
+	.family			= NFPROTO_IPV6,
+	.batch			= &ip6tables_batch_ops,
+	.restore_name		= "ip6tables-restore",
+	.restore_main		= ip6tables_restore_main,
+	.restore_offline	= optimize_offline6,
+	.first_chain		= optimize_first_chain6,
+	.next_chain		= optimize_next_chain6,
+	.reorder_chain		= optimize_reorder_chain6,
+	.bisect_chain		= optimize_bisect_chain6,
+	.factor_chain		= optimize_factor_chain6,
+	.compact_chain		= optimize_compact_chain6,
+	.multiport_chain	= optimize_multiport_chain6,
+	.save			= optimize_save6,
+};
+
+int ip6tables_optimize_main(int argc, char **argv)
+{
+	return optimize_main(argc, argv, &optimize_ops6, "ip6tables-optimize");
+}
+#endif
@@ -0,0 +1,973 @@
+/*
+ *	iptables-replay: run the packets of a pcap file through a saved
+ *	ruleset in userspace and report which rules they hit.  The ruleset
+ *	is loaded into an offline libiptc table, so neither the kernel nor
+ *	any privileges are needed.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation; either version 2 of
+ *	the License, or (at your option) any later version.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <xtables.h>
+#include "xshared.h"
+
+#ifdef ENABLE_IPV4
+#include <iptables.h>
+#include "iptables-multi.h"
+#endif
+
+#ifdef ENABLE_IPV6
+#include <ip6tables.h>
+#include "ip6tables-multi.h"
+#endif
+
+enum {
+	PCAP_MAGIC		= 0xa1b2c3d4,
+	PCAP_MAGIC_NSEC		= 0xa1b23c4d,
+	PCAP_SNAPLEN_MAX	= 262144,
+
+	DLT_NULL		= 0,
+	DLT_EN10MB		= 1,
+	DLT_RAW_BSD		= 12,
+	DLT_RAW			= 101,
+	DLT_LINUX_SLL		= 113,
+	DLT_LINUX_SLL2		= 276,
+
+	REPLAY_DEPTH_BUCKETS	= 16,
+	REPLAY_VERDICTS		= 32,
+};
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major, version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs, snaplen, linktype;
+};
+
+struct pcap_rec_header {
+	uint32_t ts_sec, ts_frac, incl_len, orig_len;
+};
+
+/**
+ * replay_ops - libiptc flavour used by the replay subcommand
+ * @fill:	fill in the entry and packet from a layer 3 header,
+ *		false if it isn't of this family
+ */
+struct replay_ops {
+	const char *restore_name;
+	int (*restore_main)(int, char **);
+	void (*restore_offline)(void);
+	size_t entry_size;
+	bool (*fill)(void *entry, struct xtc_packet *p,
+		     const unsigned char *l3, size_t len);
+	void (*set_ifaces)(void *entry, const char *in, const char *out);
+	const char *(*first_chain)(void *h);
+	const char *(*next_chain)(void *h);
+	const void *(*first_rule)(const char *chain, void *h);
+	const void *(*next_rule)(const void *prev, void *h);
+	const char *(*trace_packet)(const char *chain, const void *entry,
+				    const struct xtc_packet *pkt,
+				    xtc_trace_fn trace, void *data, void *h);
+	int (*build_classifier)(void *h);
+	void (*print_rule)(const void *e, void *h, const char *chain);
+	void (*free)(void *h);
+	const char *(*strerror)(int);
+};
+
+struct replay_chain {
+	const char *name;		/* as returned by libiptc */
+	unsigned int num_rules;
+	const void **rules;
+	uint64_t *hits, *unknown;
+};
+
+struct replay_rule {
+	const struct replay_chain *chain;
+	unsigned int num;
+};
+
+struct replay_state {
+	struct replay_chain *chains, *last;
+	unsigned int num_chains;
+	unsigned int depth;		/* rules compared, current packet */
+	unsigned int max_depth;
+	uint64_t total_depth;
+	uint64_t depths[REPLAY_DEPTH_BUCKETS];
+	struct {
+		const char *name;
+		uint64_t count;
+	} verdicts[REPLAY_VERDICTS];
+	unsigned int num_verdicts;
+};
+
+/* Packets held in memory for --check */
+struct replay_batch {
+	unsigned int num, max;
+	unsigned char *entries;
+	struct xtc_packet *pkts;
+	const char **verdicts;
+	uint64_t *hashes;
+};
+
+/* Per-packet fingerprint of the rules that didn't fail to match */
+struct replay_hash {
+	uint64_t hash;
+};
+
+static const struct option replay_opts[] = {
+	{.name = "table",      .has_arg = true,  .val = 't'},
+	{.name = "chain",      .has_arg = true,  .val = 'c'},
+	{.name = "in-interface", .has_arg = true, .val = 'i'},
+	{.name = "out-interface", .has_arg = true, .val = 'o'},
+	{.name = "mark",       .has_arg = true,  .val = 'm'},
+	{.name = "top",        .has_arg = true,  .val = 'n'},
+	{.name = "compile",    .has_arg = false, .val = 'C'},
+	{.name = "check",      .has_arg = false, .val = 'K'},
+	{.name = "help",       .has_arg = false, .val = 'h'},
+	{NULL},
+};
+
+/* The table handed over by the restore code at COMMIT */
+static void *replay_handle;
+
+static void print_usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-t TABLE] [-c CHAIN] [-i IFACE] "
+		"[-o IFACE] [-m MARK] [-n TOP] [-C] [--check] "
+		"RULESFILE PCAPFILE\n", name);
+	exit(1);
+}
+
+static uint32_t pcap_swap32(uint32_t v, bool swapped)
+{
+	return swapped ? __builtin_bswap32(v) : v;
+}
+
+static FILE *pcap_open(const char *file, uint32_t *linktype, bool *swapped)
+{
+	struct pcap_file_header hdr;
+	FILE *fp;
+
+	fp = fopen(file, "re");
+	if (fp == NULL)
+		xtables_error(PARAMETER_PROBLEM, "Can't open %s: %s",
+			      file, strerror(errno));
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1)
+		xtables_error(PARAMETER_PROBLEM, "%s: not a pcap file", file);
+
+	if (hdr.magic == PCAP_MAGIC || hdr.magic == PCAP_MAGIC_NSEC)
+		*swapped = false;
+	else if (__builtin_bswap32(hdr.magic) == PCAP_MAGIC ||
+		 __builtin_bswap32(hdr.magic) == PCAP_MAGIC_NSEC)
+		*swapped = true;
+	else
+		xtables_error(PARAMETER_PROBLEM, "%s: not a pcap file "
+			      "(pcapng is not supported)", file);
+	*linktype = pcap_swap32(hdr.linktype, *swapped) & 0xffff;
+	switch (*linktype) {
+	case DLT_NULL:
+	case DLT_EN10MB:
+	case DLT_RAW_BSD:
+	case DLT_RAW:
+	case DLT_LINUX_SLL:
+	case DLT_LINUX_SLL2:
+		break;
+	default:
+		xtables_error(PARAMETER_PROBLEM, "%s: link type %u is not "
+			      "supported", file, *linktype);
+	}
+	return fp;
+}
+
+/* Skip the link layer header, return the offset of the IP header or -1 */
+static long replay_l2(uint32_t linktype, const unsigned char *pkt,
+		      size_t len)
+{
+	unsigned int off, type;
+
+	switch (linktype) {
+	case DLT_EN10MB:
+		off = 12;
+		for (;;) {
+			if (len < off + 2)
+				return -1;
+			type = pkt[off] << 8 | pkt[off + 1];
+			if (type != 0x8100 && type != 0x88a8)
+				break;
+			off += 4;		/* VLAN tag */
+		}
+		off += 2;
+		break;
+	case DLT_LINUX_SLL:
+		if (len < 16)
+			return -1;
+		type = pkt[14] << 8 | pkt[15];
+		off = 16;
+		break;
+	case DLT_LINUX_SLL2:
+		if (len < 20)
+			return -1;
+		type = pkt[0] << 8 | pkt[1];
+		off = 20;
+		break;
+	case DLT_NULL:
+		off = 4;
+		type = 0;
+		break;
+	default:
+		off = 0;
+		type = 0;
+		break;
+	}
+	if (type != 0 && type != 0x0800 && type != 0x86dd)
+		return -1;
+	return off < len ? (long)off : -1;
+}
+
+static void replay_l4(struct xtc_packet *p, unsigned int proto,
+		      const unsigned char *l4, size_t len)
+{
+	switch (proto) {
+	case IPPROTO_TCP:
+		if (len < 14)
+			break;
+		p->tcp_flags = l4[13];
+		p->valid |= XTC_PKT_TCPFLAGS;
+		/* fall through */
+	case IPPROTO_UDP:
+	case IPPROTO_UDPLITE:
+	case IPPROTO_SCTP:
+	case IPPROTO_DCCP:
+		if (len < 4)
+			break;
+		p->sport = l4[0] << 8 | l4[1];
+		p->dport = l4[2] << 8 | l4[3];
+		p->valid |= XTC_PKT_PORTS;
+		break;
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		if (len < 2)
+			break;
+		p->icmp_type = l4[0];
+		p->icmp_code = l4[1];
+		p->valid |= XTC_PKT_ICMP;
+		break;
+	}
+}
+
+static void replay_trace(const char *chain, unsigned int rulenum,
+			 enum xtc_eval_result res, void *data)
+{
+	struct replay_state *st = data;
+	struct replay_chain *c = st->last;
+	unsigned int lo, hi, mid;
+
+	if (rulenum == 0)
+		return;
+	st->depth++;
+	if (res == XTC_EVAL_NOMATCH)
+		return;
+
+	if (c == NULL || c->name != chain) {
+		/* chains are sorted by the address of their name */
+		lo = 0;
+		hi = st->num_chains;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if ((uintptr_t)st->chains[mid].name < (uintptr_t)chain)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == st->num_chains || st->chains[lo].name != chain)
+			return;
+		c = st->last = &st->chains[lo];
+	}
+	if (rulenum > c->num_rules)
+		return;
+	if (res == XTC_EVAL_MATCH)
+		c->hits[rulenum - 1]++;
+	else
+		c->unknown[rulenum - 1]++;
+}
+
+static void replay_hash_trace(const char *chain, unsigned int rulenum,
+			      enum xtc_eval_result res, void *data)
+{
+	struct replay_hash *h = data;
+	uint64_t v[3] = { (uintptr_t)chain, rulenum, res };
+	unsigned int i;
+
+	if (res == XTC_EVAL_NOMATCH)
+		return;
+	/* FNV-1a */
+	for (i = 0; i < 3; i++)
+		h->hash = (h->hash ^ v[i]) * 0x100000001b3ULL;
+}
+
+static int replay_chain_cmp(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t)((const struct replay_chain *)a)->name;
+	uintptr_t y = (uintptr_t)((const struct replay_chain *)b)->name;
+
+	return x < y ? -1 : x > y;
+}
+
+static void replay_load_chains(const struct replay_ops *ops,
+			       struct replay_state *st)
+{
+	struct replay_chain *c;
+	const char *chain;
+	const void *e;
+	unsigned int n;
+
+	for (chain = ops->first_chain(replay_handle); chain != NULL;
+	     chain = ops->next_chain(replay_handle)) {
+		st->chains = xtables_realloc(st->chains,
+				(st->num_chains + 1) * sizeof(*st->chains));
+		c = &st->chains[st->num_chains++];
+		memset(c, 0, sizeof(*c));
+		c->name = chain;
+		for (e = ops->first_rule(chain, replay_handle); e != NULL;
+		     e = ops->next_rule(e, replay_handle))
+			c->num_rules++;
+		n = c->num_rules > 0 ? c->num_rules : 1;
+		c->rules = xtables_calloc(n, sizeof(*c->rules));
+		c->hits = xtables_calloc(n, sizeof(*c->hits));
+		c->unknown = xtables_calloc(n, sizeof(*c->unknown));
+		n = 0;
+		for (e = ops->first_rule(chain, replay_handle); e != NULL;
+		     e = ops->next_rule(e, replay_handle))
+			c->rules[n++] = e;
+	}
+	qsort(st->chains, st->num_chains, sizeof(*st->chains),
+	      replay_chain_cmp);
+}
+
+static void replay_count_verdict(struct replay_state *st, const char *verdict)
+{
+	unsigned int i;
+
+	for (i = 0; i < st->num_verdicts; i++) {
+		if (strcmp(st->verdicts[i].name, verdict) == 0) {
+			st->verdicts[i].count++;
+			return;
+		}
+	}
+	if (st->num_verdicts == REPLAY_VERDICTS)
+		return;
+	st->verdicts[i].name = verdict;
+	st->verdicts[i].count = 1;
+	st->num_verdicts++;
+}
+
+static int replay_rule_cmp(const void *a, const void *b)
+{
+	const struct replay_rule *x = a, *y = b;
+	uint64_t hx = x->chain->hits[x->num] + x->chain->unknown[x->num];
+	uint64_t hy = y->chain->hits[y->num] + y->chain->unknown[y->num];
+
+	return hx < hy ? 1 : hx > hy ? -1 : 0;
+}
+
+static void replay_report(const struct replay_ops *ops,
+			  const struct replay_state *st, uint64_t packets,
+			  uint64_t skipped, double secs, unsigned int top)
+{
+	struct replay_rule *rules = NULL;
+	const struct replay_chain *c;
+	unsigned int i, j, n = 0;
+
+	printf("%llu packets, %llu skipped, %.3f s, %.0f packets/s\n",
+	       (unsigned long long)packets, (unsigned long long)skipped, secs,
+	       secs > 0 ? packets / secs : 0.0);
+	if (packets == 0)
+		return;
+
+	printf("\nVerdicts:\n");
+	for (i = 0; i < st->num_verdicts; i++)
+		printf("  %-16s %12llu %6.2f%%\n", st->verdicts[i].name,
+		       (unsigned long long)st->verdicts[i].count,
+		       100.0 * st->verdicts[i].count / packets);
+
+	printf("\nRules compared per packet: mean %.2f, max %u\n",
+	       (double)st->total_depth / packets, st->max_depth);
+	for (i = 0; i < REPLAY_DEPTH_BUCKETS; i++) {
+		if (st->depths[i] == 0)
+			continue;
+		if (i == 0)
+			printf("  %11s", "0");
+		else if (i == REPLAY_DEPTH_BUCKETS - 1)
+			printf("  %10u+", 1U << (i - 1));
+		else
+			printf("  %5u-%-5u", 1U << (i - 1), (1U << i) - 1);
+		printf(" %12llu %6.2f%%\n", (unsigned long long)st->depths[i],
+		       100.0 * st->depths[i] / packets);
+	}
+
+	for (i = 0; i < st->num_chains; i++) {
+		c = &st->chains[i];
+		for (j = 0; j < c->num_rules; j++) {
+			if (c->hits[j] == 0 && c->unknown[j] == 0)
+				continue;
+			rules = xtables_realloc(rules, (n + 1) * sizeof(*rules));
+			rules[n].chain = c;
+			rules[n++].num = j;
+		}
+	}
+	qsort(rules, n, sizeof(*rules), replay_rule_cmp);
+	if (top != 0 && n > top)
+		n = top;
+
+	printf("\nRule hits (matched, undecidable offline):\n");
+	for (i = 0; i < n; i++) {
+		c = rules[i].chain;
+		printf("  %12llu %12llu  ",
+		       (unsigned long long)c->hits[rules[i].num],
+		       (unsigned long long)c->unknown[rules[i].num]);
+		ops->print_rule(c->rules[rules[i].num], replay_handle,
+				c->name);
+	}
+	free(rules);
+}
+
+struct replay_input {
+	FILE *fp;
+	const char *file;
+	uint32_t linktype;
+	bool swapped;
+	unsigned char *buf;
+	const char *in, *out;
+	bool have_mark;
+	uint32_t mark;
+	uint64_t skipped;
+};
+
+/* Read the next packet of the capture we can evaluate, false at its end */
+static bool replay_read(const struct replay_ops *ops, struct replay_input *ri,
+			void *entry, struct xtc_packet *p)
+{
+	struct pcap_rec_header rec;
+	uint32_t len;
+	long off;
+
+	while (fread(&rec, sizeof(rec), 1, ri->fp) == 1) {
+		len = pcap_swap32(rec.incl_len, ri->swapped);
+		if (len > PCAP_SNAPLEN_MAX)
+			xtables_error(OTHER_PROBLEM, "%s: corrupt record",
+				      ri->file);
+		if (fread(ri->buf, len, 1, ri->fp) != 1 && len != 0)
+			break;
+
+		memset(entry, 0, ops->entry_size);
+		memset(p, 0, sizeof(*p));
+		off = replay_l2(ri->linktype, ri->buf, len);
+		if (off < 0 || !ops->fill(entry, p, ri->buf + off, len - off)) {
+			++ri->skipped;
+			continue;
+		}
+		ops->set_ifaces(entry, ri->in, ri->out);
+		if (ri->have_mark) {
+			p->mark = ri->mark;
+			p->valid |= XTC_PKT_MARK;
+		}
+		return true;
+	}
+	return false;
+}
+
+static double replay_elapsed(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) +
+	       (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Evaluate the whole batch once for speed and once with a trace to
+ * fingerprint the rules each packet matched; returns the seconds taken
+ * by the first pass. */
+static double replay_batch_run(const struct replay_ops *ops,
+			       const struct replay_batch *b, const char *chain,
+			       const char **verdicts, uint64_t *hashes)
+{
+	struct replay_hash h;
+	struct timespec start;
+	struct xtc_packet p;
+	unsigned int i;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < b->num; i++) {
+		p = b->pkts[i];
+		verdicts[i] = ops->trace_packet(chain,
+					b->entries + i * ops->entry_size,
+					&p, NULL, NULL, replay_handle);
+		if (verdicts[i] == NULL)
+			xtables_error(OTHER_PROBLEM, "chain `%s': %s", chain,
+				      ops->strerror(errno));
+	}
+	secs = replay_elapsed(&start);
+
+	for (i = 0; i < b->num; i++) {
+		p = b->pkts[i];
+		h.hash = 0xcbf29ce484222325ULL;
+		ops->trace_packet(chain, b->entries + i * ops->entry_size,
+				  &p, replay_hash_trace, &h, replay_handle);
+		hashes[i] = h.hash;
+	}
+	return secs;
+}
+
+/* --check: compare the classifier against the linear walk */
+static int replay_check(const struct replay_ops *ops, struct replay_input *ri,
+			const char *chain)
+{
+	struct replay_batch b = {};
+	const char **verdicts;
+	uint64_t *hashes, mismatches = 0;
+	struct timespec start;
+	double linear, tree, build;
+	unsigned int i;
+
+	for (;;) {
+		if (b.num == b.max) {
+			b.max = b.max ? 2 * b.max : 4096;
+			b.entries = xtables_realloc(b.entries,
+						    b.max * ops->entry_size);
+			b.pkts = xtables_realloc(b.pkts,
+						 b.max * sizeof(*b.pkts));
+		}
+		if (!replay_read(ops, ri, b.entries + b.num * ops->entry_size,
+				 &b.pkts[b.num]))
+			break;
+		b.num++;
+	}
+	b.verdicts = xtables_calloc(b.num + 1, sizeof(*b.verdicts));
+	b.hashes = xtables_calloc(b.num + 1, sizeof(*b.hashes));
+	verdicts = xtables_calloc(b.num + 1, sizeof(*verdicts));
+	hashes = xtables_calloc(b.num + 1, sizeof(*hashes));
+
+	linear = replay_batch_run(ops, &b, chain, b.verdicts, b.hashes);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!ops->build_classifier(replay_handle))
+		xtables_error(OTHER_PROBLEM, "classifier: %s",
+			      ops->strerror(errno));
+	build = replay_elapsed(&start);
+
+	tree = replay_batch_run(ops, &b, chain, verdicts, hashes);
+
+	for (i = 0; i < b.num; i++) {
+		if (strcmp(verdicts[i], b.verdicts[i]) == 0 &&
+		    hashes[i] == b.hashes[i])
+			continue;
+		if (mismatches++ < 10)
+			fprintf(stderr, "packet %u: %s linear, %s with "
+				"classifier\n", i + 1, b.verdicts[i],
+				verdicts[i]);
+	}
+
+	printf("%u packets, %llu skipped\n", b.num,
+	       (unsigned long long)ri->skipped);
+	printf("linear:     %.3f s, %.0f packets/s\n", linear,
+	       linear > 0 ? b.num / linear : 0.0);
+	printf("classifier: %.3f s, %.0f packets/s, built in %.3f s\n", tree,
+	       tree > 0 ? b.num / tree : 0.0, build);
+	if (linear > 0 && tree > 0)
+		printf("speedup:    %.2fx\n", linear / tree);
+	printf("%llu mismatches\n", (unsigned long long)mismatches);
+
+	free(b.entries);
+	free(b.pkts);
+	free(b.verdicts);
+	free(b.hashes);
+	free(verdicts);
+	free(hashes);
+	return mismatches != 0;
+}
+
+static int replay_main(int argc, char **argv, const struct replay_ops *ops,
+		       const char *name)
+{
+	struct replay_input ri = { .in = "", .out = "" };
+	const char *table = "filter";
+	unsigned int top = 20, bucket;
+	char chain[XT_TABLE_MAXNAMELEN] = "INPUT";
+	uint64_t packets = 0;
+	struct replay_state st = {};
+	struct timespec start;
+	struct xtc_packet p;
+	const char *verdict;
+	bool compile = false, check = false;
+	char *restore_argv[5];
+	double secs;
+	void *entry;
+	int opt, ret = 0;
+
+	while ((opt = getopt_long(argc, argv, "t:c:i:o:m:n:Ch", replay_opts,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 't':
+			table = optarg;
+			break;
+		case 'c':
+			if (strlen(optarg) >= sizeof(chain))
+				xtables_error(PARAMETER_PROBLEM,
+					      "chain name `%s' too long", optarg);
+			strcpy(chain, optarg);
+			break;
+		case 'i':
+			ri.in = optarg;
+			break;
+		case 'o':
+			ri.out = optarg;
+			break;
+		case 'm':
+			if (!xtables_strtoui(optarg, NULL, &ri.mark, 0,
+					     UINT32_MAX))
+				xtables_error(PARAMETER_PROBLEM,
+					      "invalid mark `%s'", optarg);
+			ri.have_mark = true;
+			break;
+		case 'n':
+			if (!xtables_strtoui(optarg, NULL, &top, 0, UINT_MAX))
+				xtables_error(PARAMETER_PROBLEM,
+					      "invalid count `%s'", optarg);
+			break;
+		case 'C':
+			compile = true;
+			break;
+		case 'K':
+			check = true;
+			break;
+		default:
+			print_usage(name);
+		}
+	}
+	if (optind != argc - 2)
+		print_usage(name);
+	if (strlen(ri.in) >= IFNAMSIZ || strlen(ri.out) >= IFNAMSIZ)
+		xtables_error(PARAMETER_PROBLEM, "interface name too long");
+
+	/* Load only the table asked for, without the kernel */
+	restore_argv[0] = (char *)ops->restore_name;
+	restore_argv[1] = "-T";
+	restore_argv[2] = (char *)table;
+	restore_argv[3] = argv[optind];
+	restore_argv[4] = NULL;
+	ri.file = argv[optind + 1];
+	ri.fp = pcap_open(ri.file, &ri.linktype, &ri.swapped);
+	ri.buf = xtables_malloc(PCAP_SNAPLEN_MAX);
+	ops->restore_offline();
+	optind = 0;
+	if (ops->restore_main(4, restore_argv) != 0)
+		return 1;
+	if (replay_handle == NULL)
+		xtables_error(PARAMETER_PROBLEM, "%s: no table `%s'",
+			      restore_argv[3], table);
+
+	if (check) {
+		ret = replay_check(ops, &ri, chain);
+		goto out;
+	}
+
+	replay_load_chains(ops, &st);
+	if (compile && !ops->build_classifier(replay_handle))
+		xtables_error(OTHER_PROBLEM, "classifier: %s",
+			      ops->strerror(errno));
+
+	entry = xtables_malloc(ops->entry_size);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (replay_read(ops, &ri, entry, &p)) {
+		st.depth = 0;
+		verdict = ops->trace_packet(chain, entry, &p, replay_trace,
+					    &st, replay_handle);
+		if (verdict == NULL)
+			xtables_error(OTHER_PROBLEM, "chain `%s': %s", chain,
+				      ops->strerror(errno));
+		replay_count_verdict(&st, verdict);
+		++packets;
+
+		st.total_depth += st.depth;
+		if (st.depth > st.max_depth)
+			st.max_depth = st.depth;
+		for (bucket = 0; bucket < REPLAY_DEPTH_BUCKETS - 1 &&
+		     st.depth >= 1U << bucket; bucket++)
+			;
+		st.depths[bucket]++;
+	}
+	secs = replay_elapsed(&start);
+
+	replay_report(ops, &st, packets, ri.skipped, secs, top);
+
+	while (st.num_chains > 0) {
+		--st.num_chains;
+		free(st.chains[st.num_chains].rules);
+		free(st.chains[st.num_chains].hits);
+		free(st.chains[st.num_chains].unknown);
+	}
+	free(st.chains);
+	free(entry);
+out:
+	fclose(ri.fp);
+	free(ri.buf);
+	ops->free(replay_handle);
+	replay_handle = NULL;
+	return ret;
+}
+
+#ifdef ENABLE_IPV4
+static int replay_commit4(struct iptc_handle *h)
+{
+	if (replay_handle != NULL)
+		iptc_free(replay_handle);
+	replay_handle = h;
+	return 1;
+}
+
+static void replay_offline4(void)
+{
+	iptables_restore_offline(replay_commit4);
+}
+
+static bool replay_fill4(void *entry, struct xtc_packet *p,
+			 const unsigned char *l3, size_t len)
+{
+	struct ipt_entry *e = entry;
+	unsigned int ihl;
+
+	if (len < 20 || l3[0] >> 4 != 4)
+		return false;
+	ihl = (l3[0] & 0x0f) * 4;
+	if (ihl < 20 || ihl > len)
+		return false;
+
+	memcpy(&e->ip.src, l3 + 12, sizeof(e->ip.src));
+	memcpy(&e->ip.dst, l3 + 16, sizeof(e->ip.dst));
+	e->ip.proto = l3[9];
+	p->length = l3[2] << 8 | l3[3];
+	p->valid = XTC_PKT_LENGTH;
+	/* non-first fragments carry no layer 4 header */
+	if (((l3[6] << 8 | l3[7]) & 0x1fff) != 0)
+		p->fragment = 1;
+	else
+		replay_l4(p, l3[9], l3 + ihl, len - ihl);
+	return true;
+}
+
+static void replay_set_ifaces4(void *entry, const char *in, const char *out)
+{
+	struct ipt_entry *e = entry;
+
+	strcpy(e->ip.iniface, in);
+	strcpy(e->ip.outiface, out);
+}
+
+static const char *replay_first_chain4(void *h)
+{
+	return iptc_first_chain(h);
+}
+
+static const char *replay_next_chain4(void *h)
+{
+	return iptc_next_chain(h);
+}
+
+static const void *replay_first_rule4(const char *chain, void *h)
+{
+	return iptc_first_rule(chain, h);
+}
+
+static const void *replay_next_rule4(const void *prev, void *h)
+{
+	return iptc_next_rule(prev, h);
+}
+
+static const char *replay_trace_packet4(const char *chain, const void *entry,
+					const struct xtc_packet *pkt,
+					xtc_trace_fn trace, void *data, void *h)
+{
+	return iptc_trace_packet(chain, entry, pkt, trace, data, h);
+}
+
+static int replay_build_classifier4(void *h)
+{
+	return iptc_build_classifier(h);
+}
+
+static void replay_print_rule4(const void *e, void *h, const char *chain)
+{
+	print_rule4(e, h, chain, 0);
+}
+
+static void replay_free4(void *h)
+{
+	iptc_free(h);
+}
+
+static const struct replay_ops replay_ops4 = {
+	.restore_name		= "iptables-restore",
+	.restore_main		= iptables_restore_main,
+	.restore_offline	= replay_offline4,
+	.entry_size		= sizeof(struct ipt_entry),
+	.fill			= replay_fill4,
+	.set_ifaces		= replay_set_ifaces4,
+	.first_chain		= replay_first_chain4,
+	.next_chain		= replay_next_chain4,
+	.first_rule		= replay_first_rule4,
+	.next_rule		= replay_next_rule4,
+	.trace_packet		= replay_trace_packet4,
+	.build_classifier	= replay_build_classifier4,
+	.print_rule		= replay_print_rule4,
+	.free			= replay_free4,
+	.strerror		= iptc_strerror,
+};
+
+int iptables_replay_main(int argc, char **argv)
+{
+	return replay_main(argc, argv, &replay_ops4, "iptables-replay");
+}
+#endif
+
+#ifdef ENABLE_IPV6
+static int replay_commit6(struct ip6tc_handle *h)
+{
+	if (replay_handle != NULL)
+		ip6tc_free(replay_handle);
+	replay_handle = h;
+	return 1;
+}
+
+static void replay_offline6(void)
+{
+	ip6tables_restore_offline(replay_commit6);
+}
+
+static bool replay_fill6(void *entry, struct xtc_packet *p,
+			 const unsigned char *l3, size_t len)
+{
+	struct ip6t_entry *e = entry;
+	unsigned int off = 40, next, hlen;
+
+	if (len < 40 || l3[0] >> 4 != 6)
+		return false;
+
+	memcpy(&e->ipv6.src, l3 + 8, sizeof(e->ipv6.src));
+	memcpy(&e->ipv6.dst, l3 + 24, sizeof(e->ipv6.dst));
+	p->length = (l3[4] << 8 | l3[5]) + 40;
+	p->valid = XTC_PKT_LENGTH;
+
+	/* Find the last header, as ip6t_do_table does for -p */
+	next = l3[6];
+	while (off + 8 <= len) {
+		if (next == IPPROTO_FRAGMENT) {
+			if (((l3[off + 2] << 8 | l3[off + 3]) & 0xfff8) != 0)
+				p->fragment = 1;
+			hlen = 8;
+		} else if (next == IPPROTO_AH) {
+			hlen = (l3[off + 1] + 2) * 4;
+		} else if (next == IPPROTO_HOPOPTS ||
+			   next == IPPROTO_ROUTING ||
+			   next == IPPROTO_DSTOPTS) {
+			hlen = (l3[off + 1] + 1) * 8;
+		} else {
+			break;
+		}
+		next = l3[off];
+		off += hlen;
+		if (p->fragment)
+			break;
+	}
+	e->ipv6.proto = next;
+	if (!p->fragment && off <= len)
+		replay_l4(p, next, l3 + off, len - off);
+	return true;
+}
+
+static void replay_set_ifaces6(void *entry, const char *in, const char *out)
+{
+	struct ip6t_entry *e = entry;
+
+	strcpy(e->ipv6.iniface, in);
+	strcpy(e->ipv6.outiface, out);
+}
+
+static const char *replay_first_chain6(void *h)
+{
+	return ip6tc_first_chain(h);
+}
+
+static const char *replay_next_chain6(void *h)
+{
+	return ip6tc_next_chain(h);
+}
+
+static const void *replay_first_rule6(const char *chain, void *h)
+{
+	return ip6tc_first_rule(chain, h);
+}
+
+static const void *replay_next_rule6(const void *prev, void *h)
+{
+	return ip6tc_next_rule(prev, h);
+}
+
+static const char *replay_trace_packet6(const char *chain, const void *entry,
+					const struct xtc_packet *pkt,
+					xtc_trace_fn trace, void *data, void *h)
+{
+	return ip6tc_trace_packet(chain, entry, pkt, trace, data, h);
+}
+
+static int replay_build_classifier6(void *h)
+{
+	return ip6tc_build_classifier(h);
+}
+
+static void replay_print_rule6(const void *e, void *h, const char *chain)
+{
+	print_rule6(e, h, chain, 0);
+}
+
+static void replay_free6(void *h)
+{
+	ip6tc_free(h);
+}
+
+static const struct replay_ops replay_ops6 = {
+	.restore_name		= "ip6tables-restore",
+	.restore_main		= ip6tables_restore_main,
+	.restore_offline	= replay_offline6,
+	.entry_size		= sizeof(struct ip6t_entry),
+	.fill			= replay_fill6,
+	.set_ifaces		= replay_set_ifaces6,
+	.first_chain		= replay_first_chain6,
+	.next_chain		= replay_next_chain6,
+	.first_rule		= replay_first_rule6,
+	.next_rule		= replay_next_rule6,
+	.trace_packet		= replay_trace_packet6,
+	.build_classifier	= replay_build_classifier6,
+	.print_rule		= replay_print_rule6,
+	.free			= replay_free6,
+	.strerror		= ip6tc_strerror,
+};
+
+int ip6tables_replay_main(int argc, char **argv)
+{
+	return replay_main(argc, argv, &replay_ops6, "ip6tables-replay");
+}
+#endif
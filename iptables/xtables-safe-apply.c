@@ -0,0 +1,420 @@
+/*
+ *	iptables-safe-apply: load a ruleset and take it back unless the user
+ *	confirms it in time, like iptables-apply, but with an in-memory
+ *	snapshot of the old tables instead of iptables-save output.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation; either version 2 of
+ *	the License, or (at your option) any later version.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <xtables.h>
+#include "xshared.h"
+
+#ifdef ENABLE_IPV4
+#include <libiptc/libiptc.h>
+#include "iptables-multi.h"
+#endif
+
+#ifdef ENABLE_IPV6
+#include <libiptc/libip6tc.h>
+#include "ip6tables-multi.h"
+#endif
+
+enum {
+	APPLY_TIMEOUT = 10, /* seconds */
+};
+
+/**
+ * apply_ops - libiptc flavour used by the safe-apply subcommand
+ */
+struct apply_ops {
+	const char *restore_name;
+	int (*restore_main)(int, char **);
+	void *(*init)(const char *);
+	void (*free)(void *);
+	void *(*snapshot)(void *);
+	void (*snapshot_free)(void *);
+	const char *(*snapshot_table)(const void *);
+	int (*snapshot_save)(const void *, int);
+	void *(*snapshot_load)(int);
+	int (*rollback)(const void *);
+	const char *(*strerror)(int);
+};
+
+static const struct option apply_opts[] = {
+	{.name = "timeout",  .has_arg = true,  .val = 't'},
+	{.name = "write",    .has_arg = true,  .val = 'w'},
+	{.name = "rollback", .has_arg = true,  .val = 'r'},
+	{.name = "noflush",  .has_arg = false, .val = 'n'},
+	{.name = "help",     .has_arg = false, .val = 'h'},
+	{NULL},
+};
+
+static volatile sig_atomic_t apply_interrupted;
+
+static void apply_sighandler(int sig)
+{
+	apply_interrupted = 1;
+}
+
+static void print_usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-t SECONDS] [-w SNAPSHOT] [-n] RULESFILE\n"
+		"       %s --rollback SNAPSHOT\n", name, name);
+	exit(1);
+}
+
+static double apply_elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000.0 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/* Names of the tables a restore file touches ("*filter" lines) */
+static unsigned int apply_tables(const char *file, char names[][XT_TABLE_MAXNAMELEN],
+				 unsigned int max)
+{
+	char buf[10240], *tok;
+	unsigned int i, n = 0;
+	FILE *fp;
+
+	fp = fopen(file, "re");
+	if (fp == NULL)
+		xtables_error(PARAMETER_PROBLEM, "Can't open %s: %s",
+			      file, strerror(errno));
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		if (buf[0] != '*')
+			continue;
+		tok = strtok(buf + 1, " \t\n");
+		if (tok == NULL || strlen(tok) >= XT_TABLE_MAXNAMELEN)
+			continue;
+		for (i = 0; i < n; ++i)
+			if (strcmp(names[i], tok) == 0)
+				break;
+		if (i == n && n < max)
+			strcpy(names[n++], tok);
+	}
+	fclose(fp);
+	return n;
+}
+
+static bool apply_rollback(const struct apply_ops *ops, void **snaps,
+			   unsigned int n)
+{
+	struct timespec start;
+	bool ok = true;
+	unsigned int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; ++i) {
+		if (ops->rollback(snaps[i]))
+			continue;
+		fprintf(stderr, "Rolling back table `%s' failed: %s\n",
+			ops->snapshot_table(snaps[i]), ops->strerror(errno));
+		ok = false;
+	}
+	fprintf(stderr, "Rolled back %u table(s) in %.1f ms.\n", n,
+		apply_elapsed(&start));
+	return ok;
+}
+
+/* --rollback: put back all tables stored in a snapshot file */
+static int apply_from_file(const struct apply_ops *ops, const char *file)
+{
+	void *snaps[64];
+	unsigned int n = 0;
+	bool ok;
+	int fd;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		xtables_error(PARAMETER_PROBLEM, "Can't open %s: %s",
+			      file, strerror(errno));
+	while (n < ARRAY_SIZE(snaps) &&
+	       (snaps[n] = ops->snapshot_load(fd)) != NULL)
+		++n;
+	if (errno != 0 && n < ARRAY_SIZE(snaps))
+		xtables_error(OTHER_PROBLEM, "%s: %s", file,
+			      ops->strerror(errno));
+	close(fd);
+
+	ok = apply_rollback(ops, snaps, n);
+	while (n > 0)
+		ops->snapshot_free(snaps[--n]);
+	return ok ? 0 : 1;
+}
+
+static bool apply_restore(const struct apply_ops *ops, const char *file,
+			  bool noflush)
+{
+	char *argv[4];
+	int argc = 0, status;
+	pid_t pid;
+
+	argv[argc++] = (char *)ops->restore_name;
+	if (noflush)
+		argv[argc++] = "--noflush";
+	argv[argc++] = (char *)file;
+	argv[argc] = NULL;
+
+	pid = fork();
+	if (pid < 0)
+		xtables_error(OTHER_PROBLEM, "fork: %s", strerror(errno));
+	if (pid == 0) {
+		optind = 0;
+		exit(ops->restore_main(argc, argv));
+	}
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return false;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Ask for confirmation; anything but "y" within @timeout is a no. */
+static bool apply_confirm(unsigned int timeout)
+{
+	struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+	char answer[16];
+	ssize_t n;
+
+	fprintf(stderr, "Can you establish NEW connections to the machine? "
+		"(y/N) ");
+	if (poll(&pfd, 1, timeout * 1000) <= 0 || apply_interrupted) {
+		fprintf(stderr, "\nTimeout.\n");
+		return false;
+	}
+	n = read(STDIN_FILENO, answer, sizeof(answer) - 1);
+	return n > 0 && (answer[0] == 'y' || answer[0] == 'Y');
+}
+
+static int apply_main(int argc, char **argv, const struct apply_ops *ops,
+		      const char *name)
+{
+	char tables[16][XT_TABLE_MAXNAMELEN];
+	const char *snapfile = NULL, *rollback = NULL;
+	unsigned int timeout = APPLY_TIMEOUT, ntables, n, i;
+	void *snaps[ARRAY_SIZE(tables)], *h;
+	struct sigaction sa;
+	bool noflush = false;
+	int opt, fd, ret = 0;
+
+	while ((opt = getopt_long(argc, argv, "t:w:r:nh", apply_opts,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 't':
+			if (!xtables_strtoui(optarg, NULL, &timeout, 1, 86400))
+				xtables_error(PARAMETER_PROBLEM,
+					      "invalid timeout `%s'", optarg);
+			break;
+		case 'w':
+			snapfile = optarg;
+			break;
+		case 'r':
+			rollback = optarg;
+			break;
+		case 'n':
+			noflush = true;
+			break;
+		default:
+			print_usage(name);
+		}
+	}
+	if (rollback != NULL) {
+		if (optind != argc)
+			print_usage(name);
+		return apply_from_file(ops, rollback);
+	}
+	if (optind != argc - 1)
+		print_usage(name);
+
+	ntables = apply_tables(argv[optind], tables, ARRAY_SIZE(tables));
+	if (ntables == 0)
+		xtables_error(PARAMETER_PROBLEM, "%s: no tables to apply",
+			      argv[optind]);
+
+	for (n = 0; n < ntables; ++n) {
+		h = ops->init(tables[n]);
+		if (h == NULL)
+			xtables_error(OTHER_PROBLEM, "can't read table `%s': %s",
+				      tables[n], ops->strerror(errno));
+		snaps[n] = ops->snapshot(h);
+		ops->free(h);
+		if (snaps[n] == NULL)
+			xtables_error(OTHER_PROBLEM, "snapshot of `%s': %s",
+				      tables[n], ops->strerror(errno));
+	}
+
+	if (snapfile != NULL) {
+		fd = open(snapfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			  0600);
+		if (fd < 0)
+			xtables_error(OTHER_PROBLEM, "Can't open %s: %s",
+				      snapfile, strerror(errno));
+		for (i = 0; i < n; ++i)
+			if (!ops->snapshot_save(snaps[i], fd))
+				xtables_error(OTHER_PROBLEM, "%s: %s", snapfile,
+					      strerror(errno));
+		if (fsync(fd) < 0 || close(fd) < 0)
+			xtables_error(OTHER_PROBLEM, "%s: %s", snapfile,
+				      strerror(errno));
+	}
+
+	/* A dropped ssh session must not keep the new rules either */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = apply_sighandler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	if (!apply_restore(ops, argv[optind], noflush)) {
+		fprintf(stderr, "Failed to apply %s.\n", argv[optind]);
+		apply_rollback(ops, snaps, n);
+		ret = 1;
+	} else if (!apply_confirm(timeout)) {
+		ret = apply_rollback(ops, snaps, n) ? 2 : 1;
+	} else {
+		fprintf(stderr, "Rules applied.\n");
+	}
+
+	while (n > 0)
+		ops->snapshot_free(snaps[--n]);
+	return ret;
+}
+
+#ifdef ENABLE_IPV4
+static void *apply_init4(const char *table)
+{
+	return iptc_init(table);
+}
+
+static void apply_free4(void *h)
+{
+	iptc_free(h);
+}
+
+static void *apply_snapshot4(void *h)
+{
+	return iptc_snapshot(h);
+}
+
+static void apply_snapshot_free4(void *snap)
+{
+	iptc_snapshot_free(snap);
+}
+
+static const char *apply_snapshot_table4(const void *snap)
+{
+	return iptc_snapshot_table(snap);
+}
+
+static int apply_snapshot_save4(const void *snap, int fd)
+{
+	return iptc_snapshot_save(snap, fd);
+}
+
+static void *apply_snapshot_load4(int fd)
+{
+	return iptc_snapshot_load(fd);
+}
+
+static int apply_rollback4(const void *snap)
+{
+	return iptc_rollback(snap);
+}
+
+static const struct apply_ops apply_ops4 = {
+	.restore_name	= "iptables-restore",
+	.restore_main	= iptables_restore_main,
+	.init		= apply_init4,
+	.free		= apply_free4,
+	.snapshot	= apply_snapshot4,
+	.snapshot_free	= apply_snapshot_free4,
+	.snapshot_table	= apply_snapshot_table4,
+	.snapshot_save	= apply_snapshot_save4,
+	.snapshot_load	= apply_snapshot_load4,
+	.rollback	= apply_rollback4,
+	.strerror	= iptc_strerror,
+};
+
+int iptables_safe_apply_main(int argc, char **argv)
+{
+	return apply_main(argc, argv, &apply_ops4, "iptables-safe-apply");
+}
+#endif
+
+#ifdef ENABLE_IPV6
+static void *apply_init6(const char *table)
+{
+	return ip6tc_init(table);
+}
+
+static void apply_free6(void *h)
+{
+	ip6tc_free(h);
+}
+
+static void *apply_snapshot6(void *h)
+{
+	return ip6tc_snapshot(h);
+}
+
+static void apply_snapshot_free6(void *snap)
+{
+	ip6tc_snapshot_free(snap);
+}
+
+static const char *apply_snapshot_table6(const void *snap)
+{
+	return ip6tc_snapshot_table(snap);
+}
+
+static int apply_snapshot_save6(const void *snap, int fd)
+{
+	return ip6tc_snapshot_save(snap, fd);
+}
+
+static void *apply_snapshot_load6(int fd)
+{
+	return ip6tc_snapshot_load(fd);
+}
+
+static int apply_rollback6(const void *snap)
+{
+	return ip6tc_rollback(snap);
+}
+
+static const struct apply_ops apply_ops6 = {
+	.restore_name	= "ip6tables-restore",
+	.restore_main	= ip6tables_restore_main,
+	.init		= apply_init6,
+	.free		= apply_free6,
+	.snapshot	= apply_snapshot6,
+	.snapshot_free	= apply_snapshot_free6,
+	.snapshot_table	= apply_snapshot_table6,
+	.snapshot_save	= apply_snapshot_save6,
+	.snapshot_load	= apply_snapshot_load6,
+	.rollback	= apply_rollback6,
+	.strerror	= ip6tc_strerror,
+};
+
+int ip6tables_safe_apply_main(int argc, char **argv)
+{
+	return apply_main(argc, argv, &apply_ops6, "ip6tables-safe-apply");
+}
+#endif
@@ -21,11 +21,13 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -76,6 +78,10 @@ void basic_exit_err(enum xtables_exittype status, const char *msg, ...) __attrib
 
 struct xtables_globals *xt_params = NULL;
 
+/* Set by the tools while the rule parsed is only looked for, by -D or
+ * -C, so that extensions can skip checking what it refers to exists */
+bool xtables_lookup_only;
+
 void basic_exit_err(enum xtables_exittype status, const char *msg, ...)
 {
 	va_list args;
@@ -1228,13 +1234,344 @@ static struct in_addr *network_to_ipaddr(const char *name)
 	return NULL;
 }
 
-static struct in_addr *host_to_ipaddr(const char *name, unsigned int *naddr)
+/*
+ * Forward lookups are memoized process-wide, so that a hostname that
+ * recurs on many lines of a restore file is resolved only once. Failed
+ * lookups are cached too (with a shorter lifetime) when the resolver
+ * said the name does not exist, since they would otherwise block on the
+ * resolver again for every rule. Transient failures (a timeout, a server
+ * failure) are not cached, so that the next rule asks again. The
+ * lifetimes can be set with XTABLES_HOSTCACHE_TTL=seconds[,negative].
+ */
+#define HOSTCACHE_BUCKETS	256
+#define HOSTCACHE_TTL		300	/* seconds */
+#define HOSTCACHE_NEG_TTL	30	/* seconds */
+#define HOSTCACHE_MAX_THREADS	16
+
+struct hostcache_entry {
+	struct hostcache_entry *next;
+	char *name;
+	uint8_t family;
+	unsigned int naddrs;		/* 0 for a negative entry */
+	void *addrs;			/* in_addr[] or in6_addr[] */
+	time_t expires;
+};
+
+static struct hostcache_entry *hostcache[HOSTCACHE_BUCKETS];
+
+static unsigned int hostcache_hash(const char *name, uint8_t family)
+{
+	unsigned int hash = 5381 + family;
+
+	for (; *name != '\0'; ++name)
+		hash = hash * 33 + (unsigned char)*name;
+	return hash % HOSTCACHE_BUCKETS;
+}
+
+static size_t hostcache_addrlen(uint8_t family)
+{
+	return family == AF_INET6 ?
+	       sizeof(struct in6_addr) : sizeof(struct in_addr);
+}
+
+static void hostcache_free_entry(struct hostcache_entry *e)
+{
+	free(e->name);
+	free(e->addrs);
+	free(e);
+}
+
+static struct hostcache_entry *
+hostcache_lookup(const char *name, uint8_t family)
+{
+	struct hostcache_entry **pe, *e;
+	time_t now = time(NULL);
+
+	pe = &hostcache[hostcache_hash(name, family)];
+	while ((e = *pe) != NULL) {
+		if (e->family != family || strcmp(e->name, name) != 0) {
+			pe = &e->next;
+			continue;
+		}
+		if (now < e->expires)
+			return e;
+		/* stale: drop it and let the caller resolve again */
+		*pe = e->next;
+		hostcache_free_entry(e);
+		return NULL;
+	}
+	return NULL;
+}
+
+/* Lifetime of an entry, from XTABLES_HOSTCACHE_TTL if it is set */
+static time_t hostcache_ttl(bool negative)
+{
+	static long ttl[2] = {-1, -1};
+	const char *env;
+	char *end;
+
+	if (ttl[0] < 0) {
+		ttl[0] = HOSTCACHE_TTL;
+		ttl[1] = HOSTCACHE_NEG_TTL;
+		env = getenv("XTABLES_HOSTCACHE_TTL");
+		if (env != NULL && isdigit((unsigned char)*env)) {
+			ttl[0] = strtol(env, &end, 10);
+			if (*end == ',' && isdigit((unsigned char)end[1]))
+				ttl[1] = strtol(end + 1, &end, 10);
+			else if (ttl[0] < ttl[1])
+				ttl[1] = ttl[0];
+		}
+	}
+	return ttl[negative];
+}
+
+/* Takes ownership of @addrs (which may be NULL if @naddrs is 0). */
+static struct hostcache_entry *hostcache_store(const char *name, uint8_t family,
+			    void *addrs, unsigned int naddrs)
+{
+	struct hostcache_entry *e;
+	unsigned int hash = hostcache_hash(name, family);
+
+	for (e = hostcache[hash]; e != NULL; e = e->next)
+		if (e->family == family && strcmp(e->name, name) == 0)
+			break;
+	if (e == NULL) {
+		e = xtables_calloc(1, sizeof(*e));
+		e->name   = strdup(name);
+		if (e->name == NULL)
+			xt_params->exit_err(RESOURCE_PROBLEM, "strdup");
+		e->family = family;
+		e->next   = hostcache[hash];
+		hostcache[hash] = e;
+	} else {
+		free(e->addrs);
+	}
+	e->addrs   = addrs;
+	e->naddrs  = naddrs;
+	e->expires = time(NULL) + hostcache_ttl(naddrs == 0);
+	return e;
+}
+
+/* Returns a private copy of the cached addresses, like host_to_ip*addr. */
+static void *hostcache_copy(const struct hostcache_entry *e,
+			    unsigned int *naddrs)
+{
+	size_t len = hostcache_addrlen(e->family) * e->naddrs;
+	void *addrs = xtables_malloc(len);
+
+	memcpy(addrs, e->addrs, len);
+	*naddrs = e->naddrs;
+	return addrs;
+}
+
+/**
+ * xtables_hostcache_flush - forget all memoized name lookups
+ */
+void xtables_hostcache_flush(void)
+{
+	struct hostcache_entry *e, *next;
+	unsigned int i;
+
+	for (i = 0; i < HOSTCACHE_BUCKETS; ++i) {
+		for (e = hostcache[i]; e != NULL; e = next) {
+			next = e->next;
+			hostcache_free_entry(e);
+		}
+		hostcache[i] = NULL;
+	}
+}
+
+struct hostcache_job {
+	const char *name;
+	uint8_t family;
+	bool absent;			/* the name definitely does not exist */
+	void *addrs;
+	unsigned int naddrs;
+};
+
+struct hostcache_worker {
+	pthread_t thread;
+	struct hostcache_job *jobs;
+	unsigned int first, count, stride;
+};
+
+/*
+ * Thread-safe resolvers for the prefetch workers. They must return the
+ * same address lists as host_to_ipaddr()/host_to_ip6addr(), so IPv4 goes
+ * through gethostbyname_r rather than getaddrinfo (which reorders).
+ */
+static void hostcache_resolve4(struct hostcache_job *job)
+{
+	struct hostent hbuf, *host = NULL;
+	size_t buflen = 1024;
+	char *buf = NULL;
+	unsigned int i, n = 0;
+	int ret, herr;
+
+	do {
+		buflen *= 2;
+		free(buf);
+		buf = malloc(buflen);
+		if (buf == NULL)
+			return;
+		ret = gethostbyname_r(job->name, &hbuf, buf, buflen,
+				      &host, &herr);
+	} while (ret == ERANGE);
+
+	if (ret == 0 && host != NULL && host->h_addrtype == AF_INET &&
+	    host->h_length == sizeof(struct in_addr)) {
+		while (host->h_addr_list[n] != NULL)
+			++n;
+		job->addrs = malloc(n * sizeof(struct in_addr));
+		if (job->addrs != NULL) {
+			for (i = 0; i < n; ++i)
+				memcpy((struct in_addr *)job->addrs + i,
+				       host->h_addr_list[i],
+				       sizeof(struct in_addr));
+			job->naddrs = n;
+		}
+	} else if (ret == 0) {
+		job->absent = host != NULL ||
+			      herr == HOST_NOT_FOUND || herr == NO_DATA;
+	}
+	free(buf);
+}
+
+static bool gai_name_absent(int err)
+{
+#ifdef EAI_NODATA
+	if (err == EAI_NODATA)
+		return true;
+#endif
+	return err == EAI_NONAME;
+}
+
+static void hostcache_resolve6(struct hostcache_job *job)
+{
+	struct addrinfo hints, *res, *p;
+	unsigned int i, n = 0;
+	int err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags    = AI_CANONNAME;
+	hints.ai_family   = AF_INET6;
+	hints.ai_socktype = SOCK_RAW;
+
+	if ((err = getaddrinfo(job->name, NULL, &hints, &res)) != 0) {
+		job->absent = gai_name_absent(err);
+		return;
+	}
+	for (p = res; p != NULL; p = p->ai_next)
+		++n;
+	job->addrs = malloc(n * sizeof(struct in6_addr));
+	if (job->addrs != NULL) {
+		for (i = 0, p = res; p != NULL; p = p->ai_next)
+			memcpy((struct in6_addr *)job->addrs + i++,
+			       &((const struct sockaddr_in6 *)p->ai_addr)->sin6_addr,
+			       sizeof(struct in6_addr));
+		job->naddrs = n;
+	}
+	freeaddrinfo(res);
+}
+
+static void *hostcache_worker_run(void *arg)
+{
+	struct hostcache_worker *w = arg;
+	unsigned int i;
+
+	for (i = w->first; i < w->count; i += w->stride) {
+		if (w->jobs[i].family == AF_INET6)
+			hostcache_resolve6(&w->jobs[i]);
+		else
+			hostcache_resolve4(&w->jobs[i]);
+	}
+	return NULL;
+}
+
+static int hostcache_name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/**
+ * xtables_hostcache_prefetch - resolve a batch of hostnames concurrently
+ * @names:	hostnames to look up (duplicates and numeric addresses are
+ * 		skipped)
+ * @count:	number of elements in @names
+ * @nfproto:	NFPROTO_IPV4 or NFPROTO_IPV6
+ *
+ * The results (including names that do not exist, but not transient
+ * resolver failures) are put into the name cache that
+ * ipparse_hostnetwork()/ip6parse_hostnetwork() consult, so subsequent rule
+ * parsing does not wait for the resolver one name at a time.
+ */
+void xtables_hostcache_prefetch(const char *const *names, unsigned int count,
+				uint8_t nfproto)
+{
+	uint8_t family = nfproto == NFPROTO_IPV6 ? AF_INET6 : AF_INET;
+	struct hostcache_worker workers[HOSTCACHE_MAX_THREADS];
+	struct hostcache_job *jobs;
+	const char **sorted;
+	unsigned int i, njobs = 0, nthreads, started;
+
+	if (count == 0)
+		return;
+	sorted = xtables_malloc(count * sizeof(*sorted));
+	memcpy(sorted, names, count * sizeof(*sorted));
+	qsort(sorted, count, sizeof(*sorted), hostcache_name_cmp);
+
+	jobs = xtables_calloc(count, sizeof(*jobs));
+	for (i = 0; i < count; ++i) {
+		if (i > 0 && strcmp(sorted[i], sorted[i-1]) == 0)
+			continue;
+		if (family == AF_INET6 ?
+		    xtables_numeric_to_ip6addr(sorted[i]) != NULL :
+		    xtables_numeric_to_ipaddr(sorted[i]) != NULL)
+			continue;
+		if (hostcache_lookup(sorted[i], family) != NULL)
+			continue;
+		jobs[njobs].name   = sorted[i];
+		jobs[njobs].family = family;
+		++njobs;
+	}
+
+	nthreads = njobs < HOSTCACHE_MAX_THREADS ?
+		   njobs : HOSTCACHE_MAX_THREADS;
+	for (i = 0; i < nthreads; ++i) {
+		workers[i].jobs   = jobs;
+		workers[i].first  = i;
+		workers[i].count  = njobs;
+		workers[i].stride = nthreads;
+	}
+	for (started = 0; started < nthreads; ++started)
+		if (pthread_create(&workers[started].thread, NULL,
+		    hostcache_worker_run, &workers[started]) != 0)
+			break;
+	/* If we ran out of threads, do the remaining share ourselves. */
+	for (i = started; i < nthreads; ++i)
+		hostcache_worker_run(&workers[i]);
+	for (i = 0; i < started; ++i)
+		pthread_join(workers[i].thread, NULL);
+
+	for (i = 0; i < njobs; ++i)
+		if (jobs[i].naddrs > 0 || jobs[i].absent)
+			hostcache_store(jobs[i].name, jobs[i].family,
+					jobs[i].addrs, jobs[i].naddrs);
+		else
+			free(jobs[i].addrs);
+	free(jobs);
+	free(sorted);
+}
+
+static struct in_addr *host_to_ipaddr(const char *name, unsigned int *naddr,
+				      bool *absent)
 {
 	struct hostent *host;
 	struct in_addr *addr;
 	unsigned int i;
 
 	*naddr = 0;
+	*absent = true;
 	if ((host = gethostbyname(name)) != NULL) {
 		if (host->h_addrtype != AF_INET ||
 		    host->h_length != sizeof(struct in_addr))
@@ -1249,13 +1586,16 @@ static struct in_addr *host_to_ipaddr(const char *name, unsigned int *naddr)
 		return addr;
 	}
 
+	*absent = h_errno == HOST_NOT_FOUND || h_errno == NO_DATA;
 	return NULL;
 }
 
 static struct in_addr *
 ipparse_hostnetwork(const char *name, unsigned int *naddrs)
 {
+	const struct hostcache_entry *hc;
 	struct in_addr *addrptmp, *addrp;
+	bool absent;
 
 	if ((addrptmp = xtables_numeric_to_ipaddr(name)) != NULL ||
 	    (addrptmp = network_to_ipaddr(name)) != NULL) {
@@ -1264,8 +1604,15 @@ ipparse_hostnetwork(const char *name, unsigned int *naddrs)
 		*naddrs = 1;
 		return addrp;
 	}
-	if ((addrptmp = host_to_ipaddr(name, naddrs)) != NULL)
-		return addrptmp;
+	if ((hc = hostcache_lookup(name, AF_INET)) == NULL) {
+		addrptmp = host_to_ipaddr(name, naddrs, &absent);
+		if (addrptmp == NULL && !absent)
+			xt_params->exit_err(PARAMETER_PROBLEM,
+				"temporary failure resolving host `%s'", name);
+		hc = hostcache_store(name, AF_INET, addrptmp, *naddrs);
+	}
+	if (hc->naddrs > 0)
+		return hostcache_copy(hc, naddrs);
 
 	xt_params->exit_err(PARAMETER_PROBLEM, "host/network `%s' not found", name);
 }
@@ -1374,6 +1721,110 @@ void xtables_ipparse_multiple(const char *name, struct in_addr **addrpp,
 		(*addrpp+i)->s_addr &= (*maskpp+i)->s_addr;
 }
 
+struct ipprefix {
+	uint32_t net; /* host byte order */
+	unsigned int len;
+};
+
+static int ipprefix_cmp(const void *a, const void *b)
+{
+	const struct ipprefix *x = a, *y = b;
+
+	if (x->net != y->net)
+		return x->net < y->net ? -1 : 1;
+	return (int)x->len - (int)y->len;
+}
+
+static uint32_t ipprefix_mask(unsigned int len)
+{
+	return len == 0 ? 0 : ~0U << (32 - len);
+}
+
+/* Returns the prefix length of a contiguous netmask, or -1. */
+static int ipmask_prefix_length(const struct in_addr *mask)
+{
+	uint32_t m = ntohl(mask->s_addr);
+	int bits = 0;
+
+	while (m & 0x80000000U) {
+		++bits;
+		m <<= 1;
+	}
+	return m != 0 ? -1 : bits;
+}
+
+/**
+ * xtables_ipaggregate - reduce an address list to a minimal prefix set
+ * @addrs:	addresses, as returned by xtables_ipparse_multiple
+ * @masks:	matching netmasks
+ * @naddrs:	number of entries; updated on return
+ *
+ * Sorts the list, drops duplicates and prefixes covered by another
+ * entry, and merges sibling prefixes (10.0.0.0/25 + 10.0.0.128/25 into
+ * 10.0.0.0/24) until no more merges are possible. The result matches
+ * exactly the same set of addresses. Entries with non-contiguous masks
+ * are left alone and kept in front. Returns the number of entries saved.
+ */
+unsigned int xtables_ipaggregate(struct in_addr *addrs, struct in_addr *masks,
+				 unsigned int *naddrs)
+{
+	struct ipprefix *pfx, *top;
+	unsigned int i, n = 0, depth = 0, keep = 0, count = *naddrs;
+	int len;
+
+	if (count < 2)
+		return 0;
+	pfx = xtables_malloc(sizeof(*pfx) * count);
+	for (i = 0; i < count; ++i) {
+		len = ipmask_prefix_length(&masks[i]);
+		if (len < 0) {
+			addrs[keep] = addrs[i];
+			masks[keep] = masks[i];
+			++keep;
+			continue;
+		}
+		pfx[n].len = len;
+		pfx[n].net = ntohl(addrs[i].s_addr) & ipprefix_mask(len);
+		++n;
+	}
+	qsort(pfx, n, sizeof(*pfx), ipprefix_cmp);
+
+	/*
+	 * Walk in address order, keeping a stack of disjoint prefixes.
+	 * Anything inside the top of the stack is covered; two siblings
+	 * on top of the stack collapse into their parent. The stack is
+	 * pfx[0..depth-1], which never overtakes the element being read.
+	 */
+	for (i = 0; i < n; ++i) {
+		if (depth > 0) {
+			top = &pfx[depth - 1];
+			if ((pfx[i].net & ipprefix_mask(top->len)) ==
+			    top->net && pfx[i].len >= top->len)
+				continue;
+		}
+		pfx[depth++] = pfx[i];
+		while (depth > 1) {
+			top = &pfx[depth - 1];
+			if (top->len != top[-1].len || top->len == 0 ||
+			    (top[-1].net ^ top->net) != 1U << (32 - top->len) ||
+			    (top[-1].net & ipprefix_mask(top->len - 1)) !=
+			    top[-1].net)
+				break;
+			--depth;
+			--pfx[depth - 1].len;
+		}
+	}
+
+	n = depth;
+	for (i = 0; i < n; ++i) {
+		addrs[keep + i].s_addr = htonl(pfx[i].net);
+		masks[keep + i].s_addr = htonl(ipprefix_mask(pfx[i].len));
+	}
+	free(pfx);
+	*naddrs = keep + n;
+	return count - *naddrs;
+}
+
 
 /**
  * xtables_ipparse_any - transform arbitrary name to in_addr
@@ -1516,7 +1967,7 @@ struct in6_addr *xtables_numeric_to_ip6addr(const char *num)
 }
 
 static struct in6_addr *
-host_to_ip6addr(const char *name, unsigned int *naddr)
+host_to_ip6addr(const char *name, unsigned int *naddr, bool *absent)
 {
 	struct in6_addr *addr;
 	struct addrinfo hints;
@@ -1530,10 +1981,12 @@ host_to_ip6addr(const char *name, unsigned int *naddr)
 	hints.ai_socktype = SOCK_RAW;
 
 	*naddr = 0;
+	*absent = true;
 	if ((err = getaddrinfo(name, NULL, &hints, &res)) != 0) {
 #ifdef DEBUG
 		fprintf(stderr,"Name2IP: %s\n",gai_strerror(err));
 #endif
+		*absent = gai_name_absent(err);
 		return NULL;
 	} else {
 		/* Find length of address chain */
@@ -1567,7 +2020,9 @@ static struct in6_addr *network_to_ip6addr(const char *name)
 static struct in6_addr *
 ip6parse_hostnetwork(const char *name, unsigned int *naddrs)
 {
+	const struct hostcache_entry *hc;
 	struct in6_addr *addrp, *addrptmp;
+	bool absent;
 
 	if ((addrptmp = xtables_numeric_to_ip6addr(name)) != NULL ||
 	    (addrptmp = network_to_ip6addr(name)) != NULL) {
@@ -1576,8 +2031,15 @@ ip6parse_hostnetwork(const char *name, unsigned int *naddrs)
 		*naddrs = 1;
 		return addrp;
 	}
-	if ((addrp = host_to_ip6addr(name, naddrs)) != NULL)
-		return addrp;
+	if ((hc = hostcache_lookup(name, AF_INET6)) == NULL) {
+		addrp = host_to_ip6addr(name, naddrs, &absent);
+		if (addrp == NULL && !absent)
+			xt_params->exit_err(PARAMETER_PROBLEM,
+				"temporary failure resolving host `%s'", name);
+		hc = hostcache_store(name, AF_INET6, addrp, *naddrs);
+	}
+	if (hc->naddrs > 0)
+		return hostcache_copy(hc, naddrs);
 
 	xt_params->exit_err(PARAMETER_PROBLEM, "host/network `%s' not found", name);
 }
@@ -1687,6 +2149,113 @@ xtables_ip6parse_multiple(const char *name, struct in6_addr **addrpp,
 			(*addrpp+i)->s6_addr32[j] &= (*maskpp+i)->s6_addr32[j];
 }
 
+struct ip6prefix {
+	struct in6_addr net;
+	unsigned int len;
+};
+
+static int ip6prefix_cmp(const void *a, const void *b)
+{
+	const struct ip6prefix *x = a, *y = b;
+	int ret = memcmp(&x->net, &y->net, sizeof(x->net));
+
+	return ret != 0 ? ret : (int)x->len - (int)y->len;
+}
+
+static unsigned int ip6prefix_bit(const struct in6_addr *a, unsigned int bit)
+{
+	return (a->s6_addr[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+/* Do @a and @b agree on their first @len bits? */
+static bool ip6prefix_equal(const struct in6_addr *a,
+			    const struct in6_addr *b, unsigned int len)
+{
+	unsigned int bytes = len / 8, rest = len % 8;
+
+	if (memcmp(a, b, bytes) != 0)
+		return false;
+	return rest == 0 || ((a->s6_addr[bytes] ^ b->s6_addr[bytes]) &
+	       (0xFF << (8 - rest))) == 0;
+}
+
+static void ip6prefix_mask(struct in6_addr *mask, unsigned int len)
+{
+	unsigned int i;
+
+	memset(mask, 0, sizeof(*mask));
+	for (i = 0; i < len / 8; ++i)
+		mask->s6_addr[i] = 0xFF;
+	if (len % 8 != 0)
+		mask->s6_addr[i] = 0xFF << (8 - len % 8);
+}
+
+/**
+ * xtables_ip6aggregate - reduce an address list to a minimal prefix set
+ * @addrs:	addresses, as returned by xtables_ip6parse_multiple
+ * @masks:	matching netmasks
+ * @naddrs:	number of entries; updated on return
+ *
+ * IPv6 counterpart of xtables_ipaggregate().
+ */
+unsigned int xtables_ip6aggregate(struct in6_addr *addrs,
+				  struct in6_addr *masks, unsigned int *naddrs)
+{
+	struct ip6prefix *pfx, *top;
+	unsigned int i, j, n = 0, depth = 0, keep = 0, count = *naddrs;
+	int len;
+
+	if (count < 2)
+		return 0;
+	pfx = xtables_malloc(sizeof(*pfx) * count);
+	for (i = 0; i < count; ++i) {
+		len = ip6addr_prefix_length(&masks[i]);
+		if (len < 0) {
+			addrs[keep] = addrs[i];
+			masks[keep] = masks[i];
+			++keep;
+			continue;
+		}
+		pfx[n].len = len;
+		pfx[n].net = addrs[i];
+		for (j = 0; j < 4; ++j)
+			pfx[n].net.s6_addr32[j] &= masks[i].s6_addr32[j];
+		++n;
+	}
+	qsort(pfx, n, sizeof(*pfx), ip6prefix_cmp);
+
+	/* See xtables_ipaggregate() */
+	for (i = 0; i < n; ++i) {
+		if (depth > 0) {
+			top = &pfx[depth - 1];
+			if (pfx[i].len >= top->len &&
+			    ip6prefix_equal(&pfx[i].net, &top->net, top->len))
+				continue;
+		}
+		pfx[depth++] = pfx[i];
+		while (depth > 1) {
+			top = &pfx[depth - 1];
+			if (top->len != top[-1].len || top->len == 0 ||
+			    !ip6prefix_equal(&top[-1].net, &top->net,
+					     top->len - 1) ||
+			    ip6prefix_bit(&top[-1].net, top->len - 1) != 0 ||
+			    ip6prefix_bit(&top->net, top->len - 1) != 1)
+				break;
+			--depth;
+			--pfx[depth - 1].len;
+		}
+	}
+
+	n = depth;
+	for (i = 0; i < n; ++i) {
+		addrs[keep + i] = pfx[i].net;
+		ip6prefix_mask(&masks[keep + i], pfx[i].len);
+	}
+	free(pfx);
+	*naddrs = keep + n;
+	return count - *naddrs;
+}
+
 void xtables_ip6parse_any(const char *name, struct in6_addr **addrpp,
                           struct in6_addr *maskp, unsigned int *naddrs)
 {
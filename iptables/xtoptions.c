@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <netinet/ip.h>
 #include "xtables.h"
@@ -1060,7 +1061,41 @@ void xtables_option_mfcall(struct xtables_match *m)
 		xtables_options_fcheck(m->name, m->mflags, m->x6_options);
 }
 
-struct xtables_lmap *xtables_lmap_init(const char *file)
+#define LMAP_HASH_SIZE 64
+
+/**
+ * Lookup index shared by all entries of a map loaded through
+ * xtables_lmap_init. Loaded maps are remembered by file name, so that
+ * per-rule init hooks (realm, devgroup) do not reread the file.
+ * @stale is set by xtables_lmap_flush: the file is then checked against
+ * @st before the map is handed out again.
+ */
+struct xtables_lmap_index {
+	struct xtables_lmap_index *next;
+	char *file;
+	struct xtables_lmap *head;
+	unsigned int refcnt;
+	int err;
+	bool stale;
+	struct stat st;
+	struct xtables_lmap *by_id[256];
+	struct xtables_lmap *by_name[LMAP_HASH_SIZE];
+};
+
+static struct xtables_lmap_index *lmap_loaded;
+/* Replaced maps, which extensions may still point to */
+static struct xtables_lmap_index *lmap_retired;
+
+static unsigned int lmap_hash(const char *name)
+{
+	unsigned int h = 5381;
+
+	while (*name != '\0')
+		h = h * 33 + (unsigned char)*name++;
+	return h % LMAP_HASH_SIZE;
+}
+
+static struct xtables_lmap *lmap_read(const char *file)
 {
 	struct xtables_lmap *lmap_head = NULL, *lmap_prev = NULL, *lmap_this;
 	char buf[512];
@@ -1115,7 +1150,9 @@ struct xtables_lmap *xtables_lmap_init(const char *file)
 			free(lmap_this);
 			goto out;
 		}
-		lmap_this->next = NULL;
+		lmap_this->next  = NULL;
+		lmap_this->hnext = NULL;
+		lmap_this->index = NULL;
 
 		if (lmap_prev != NULL)
 			lmap_prev->next = lmap_this;
@@ -1127,11 +1164,100 @@ struct xtables_lmap *xtables_lmap_init(const char *file)
 	fclose(fp);
 	return lmap_head;
  out:
+	fclose(fp);
 	xtables_lmap_free(lmap_head);
+	errno = ENOMEM;
 	return NULL;
 }
 
-void xtables_lmap_free(struct xtables_lmap *head)
+/* Fill the id array and name hash. The first entry in file order wins. */
+static void lmap_build_index(struct xtables_lmap_index *idx)
+{
+	struct xtables_lmap *this, **pp;
+
+	for (this = idx->head; this != NULL; this = this->next) {
+		this->index = idx;
+		if (idx->by_id[this->id] == NULL)
+			idx->by_id[this->id] = this;
+		for (pp = &idx->by_name[lmap_hash(this->name)]; *pp != NULL;
+		     pp = &(*pp)->hnext)
+			if (strcmp((*pp)->name, this->name) == 0)
+				break;
+		if (*pp == NULL)
+			*pp = this;
+	}
+}
+
+static void lmap_stat(const char *file, struct stat *st)
+{
+	if (stat(file, st) < 0)
+		memset(st, 0, sizeof(*st));
+}
+
+/* Is @idx still what its file holds? */
+static bool lmap_unchanged(struct xtables_lmap_index *idx)
+{
+	struct stat st;
+
+	lmap_stat(idx->file, &st);
+	return st.st_dev == idx->st.st_dev && st.st_ino == idx->st.st_ino &&
+	       st.st_size == idx->st.st_size &&
+	       st.st_mtim.tv_sec == idx->st.st_mtim.tv_sec &&
+	       st.st_mtim.tv_nsec == idx->st.st_mtim.tv_nsec;
+}
+
+struct xtables_lmap *xtables_lmap_init(const char *file)
+{
+	struct xtables_lmap_index **pp, *idx;
+
+	for (pp = &lmap_loaded; (idx = *pp) != NULL; pp = &idx->next) {
+		if (strcmp(idx->file, file) != 0)
+			continue;
+		if (idx->stale && !lmap_unchanged(idx)) {
+			*pp = idx->next;
+			idx->next = lmap_retired;
+			lmap_retired = idx;
+			break;
+		}
+		idx->stale = false;
+		++idx->refcnt;
+		errno = idx->err;
+		return idx->head;
+	}
+
+	idx = calloc(1, sizeof(*idx));
+	if (idx == NULL)
+		return lmap_read(file);
+	idx->file = strdup(file);
+	if (idx->file == NULL) {
+		free(idx);
+		return lmap_read(file);
+	}
+	lmap_stat(file, &idx->st);
+	idx->head   = lmap_read(file);
+	idx->err    = errno;
+	idx->refcnt = 1;
+	lmap_build_index(idx);
+	idx->next   = lmap_loaded;
+	lmap_loaded = idx;
+	errno = idx->err;
+	return idx->head;
+}
+
+/**
+ * Have the maps loaded so far checked against their files again, and
+ * reread if they changed, the next time xtables_lmap_init asks for them.
+ * For long-running programs, such as the daemon, between batches.
+ */
+void xtables_lmap_flush(void)
+{
+	struct xtables_lmap_index *idx;
+
+	for (idx = lmap_loaded; idx != NULL; idx = idx->next)
+		idx->stale = true;
+}
+
+static void lmap_free_list(struct xtables_lmap *head)
 {
 	struct xtables_lmap *next;
 
@@ -1142,8 +1268,41 @@ void xtables_lmap_free(struct xtables_lmap *head)
 	}
 }
 
+void xtables_lmap_free(struct xtables_lmap *head)
+{
+	struct xtables_lmap_index **pp, *idx;
+
+	if (head == NULL || head->index == NULL) {
+		lmap_free_list(head);
+		return;
+	}
+	idx = head->index;
+	if (--idx->refcnt > 0)
+		return;
+	for (pp = &lmap_loaded; *pp != NULL; pp = &(*pp)->next)
+		if (*pp == idx) {
+			*pp = idx->next;
+			break;
+		}
+	for (pp = &lmap_retired; *pp != NULL; pp = &(*pp)->next)
+		if (*pp == idx) {
+			*pp = idx->next;
+			break;
+		}
+	lmap_free_list(idx->head);
+	free(idx->file);
+	free(idx);
+}
+
 int xtables_lmap_name2id(const struct xtables_lmap *head, const char *name)
 {
+	if (head != NULL && head->index != NULL) {
+		for (head = head->index->by_name[lmap_hash(name)];
+		     head != NULL; head = head->hnext)
+			if (strcmp(head->name, name) == 0)
+				return head->id;
+		return -1;
+	}
 	for (; head != NULL; head = head->next)
 		if (strcmp(head->name, name) == 0)
 			return head->id;
@@ -1152,6 +1311,11 @@ int xtables_lmap_name2id(const struct xtables_lmap *head, const char *name)
 
 const char *xtables_lmap_id2name(const struct xtables_lmap *head, int id)
 {
+	if (head != NULL && head->index != NULL) {
+		if (id < 0 || id > 255 || head->index->by_id[id] == NULL)
+			return NULL;
+		return head->index->by_id[id]->name;
+	}
 	for (; head != NULL; head = head->next)
 		if (head->id == id)
 			return head->name;
@@ -0,0 +1,224 @@
+/*
+ * ipq_bench.c
+ *
+ * Packets through libipq and back, one at a time with ipq_read and
+ * ipq_set_verdict, then in batches with ipq_read_batch and
+ * ipq_set_verdict_batch.  The kernel is played by a child process on
+ * the other end of a socketpair, so that no privileges or ip_queue
+ * are needed and only the library is measured.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#define _GNU_SOURCE 1		/* recvmmsg, sendmmsg */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <libipq/libipq.h>
+#include <netinet/in.h>
+#include <linux/netfilter.h>
+
+#define BENCH_BATCH	64
+#define BENCH_WINDOW	1024	/* packets the peer has out at most */
+#define BENCH_PAYLOAD	64
+#define BENCH_BUFSIZE	2048
+
+struct bench_packet {
+	struct nlmsghdr nlh;
+	ipq_packet_msg_t pm;
+	unsigned char payload[BENCH_PAYLOAD];
+};
+
+static void bench_fail(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+/*
+ * The kernel: queue n packets, never more than a window of them
+ * without their verdicts, and count the verdicts.
+ */
+static void bench_peer(int fd, unsigned int n)
+{
+	struct bench_packet pkt[BENCH_BATCH];
+	struct mmsghdr out[BENCH_BATCH], in[BENCH_BATCH];
+	struct iovec oiov[BENCH_BATCH], iiov[BENCH_BATCH];
+	unsigned char vbuf[BENCH_BATCH][256];
+	unsigned int sent = 0, done = 0, i, k;
+	int ret;
+
+	memset(pkt, 0, sizeof(pkt));
+	memset(out, 0, sizeof(out));
+	memset(in, 0, sizeof(in));
+	for (i = 0; i < BENCH_BATCH; i++) {
+		pkt[i].nlh.nlmsg_len = sizeof(pkt[i]);
+		pkt[i].nlh.nlmsg_type = IPQM_PACKET;
+		pkt[i].pm.data_len = BENCH_PAYLOAD;
+		oiov[i].iov_base = &pkt[i];
+		oiov[i].iov_len = sizeof(pkt[i]);
+		out[i].msg_hdr.msg_iov = &oiov[i];
+		out[i].msg_hdr.msg_iovlen = 1;
+		iiov[i].iov_base = vbuf[i];
+		iiov[i].iov_len = sizeof(vbuf[i]);
+		in[i].msg_hdr.msg_iov = &iiov[i];
+		in[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (done < n) {
+		while (sent < n && sent - done < BENCH_WINDOW) {
+			k = n - sent;
+			if (k > BENCH_BATCH)
+				k = BENCH_BATCH;
+			if (k > BENCH_WINDOW - (sent - done))
+				k = BENCH_WINDOW - (sent - done);
+			for (i = 0; i < k; i++)
+				pkt[i].pm.packet_id = sent + i + 1;
+			ret = sendmmsg(fd, out, k, 0);
+			if (ret < 0)
+				bench_fail("peer sendmmsg");
+			sent += ret;
+		}
+		ret = recvmmsg(fd, in, BENCH_BATCH, MSG_WAITFORONE, NULL);
+		if (ret < 0)
+			bench_fail("peer recvmmsg");
+		done += ret;
+	}
+}
+
+/* A handle on our end of the socketpair instead of netlink */
+static struct ipq_handle *bench_handle(unsigned int n, pid_t *pid)
+{
+	struct ipq_handle *h;
+	int sv[2], size = 4 << 20;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+		bench_fail("socketpair");
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(sv[0], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	*pid = fork();
+	if (*pid < 0)
+		bench_fail("fork");
+	if (*pid == 0) {
+		close(sv[0]);
+		bench_peer(sv[1], n);
+		_exit(0);
+	}
+	close(sv[1]);
+
+	h = calloc(1, sizeof(*h));
+	if (h == NULL)
+		bench_fail("calloc");
+	h->fd = sv[0];
+	h->local.nl_family = AF_UNSPEC;
+	return h;
+}
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench_single(unsigned int n)
+{
+	unsigned char buf[BENCH_BUFSIZE];
+	ipq_packet_msg_t *m;
+	struct ipq_handle *h;
+	unsigned int i;
+	double t;
+	pid_t pid;
+
+	h = bench_handle(n, &pid);
+	t = bench_now();
+	for (i = 0; i < n; i++) {
+		if (ipq_read(h, buf, sizeof(buf), 0) <= 0 ||
+		    ipq_message_type(buf) != IPQM_PACKET) {
+			ipq_perror("ipq_read");
+			exit(1);
+		}
+		m = ipq_get_packet(buf);
+		if (ipq_set_verdict(h, m->packet_id, NF_ACCEPT, 0, NULL) < 0) {
+			ipq_perror("ipq_set_verdict");
+			exit(1);
+		}
+	}
+	waitpid(pid, NULL, 0);
+	t = bench_now() - t;
+	ipq_destroy_handle(h);
+	return t;
+}
+
+static double bench_batch(unsigned int n)
+{
+	static unsigned char bufs[BENCH_BATCH][BENCH_BUFSIZE];
+	struct ipq_msgbuf msgs[BENCH_BATCH];
+	struct ipq_verdict v[BENCH_BATCH];
+	struct ipq_handle *h;
+	unsigned int done = 0;
+	int i, k;
+	double t;
+	pid_t pid;
+
+	for (i = 0; i < BENCH_BATCH; i++) {
+		msgs[i].buf = bufs[i];
+		msgs[i].len = sizeof(bufs[i]);
+	}
+	memset(v, 0, sizeof(v));
+
+	h = bench_handle(n, &pid);
+	t = bench_now();
+	while (done < n) {
+		k = ipq_read_batch(h, msgs, BENCH_BATCH, 0);
+		if (k <= 0) {
+			ipq_perror("ipq_read_batch");
+			exit(1);
+		}
+		for (i = 0; i < k; i++) {
+			v[i].id = ipq_get_packet(msgs[i].buf)->packet_id;
+			v[i].verdict = NF_ACCEPT;
+		}
+		if (ipq_set_verdict_batch(h, v, k) != k) {
+			ipq_perror("ipq_set_verdict_batch");
+			exit(1);
+		}
+		done += k;
+	}
+	waitpid(pid, NULL, 0);
+	t = bench_now() - t;
+	ipq_destroy_handle(h);
+	return t;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int n = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+	double single, batch;
+
+	if (n == 0) {
+		fprintf(stderr, "Usage: %s [packets]\n", argv[0]);
+		exit(1);
+	}
+	single = bench_single(n);
+	printf("ipq_read/ipq_set_verdict:             %u packets, %.3f s, "
+	       "%.0f pps\n", n, single, n / single);
+	batch = bench_batch(n);
+	printf("ipq_read_batch/ipq_set_verdict_batch: %u packets, %.3f s, "
+	       "%.0f pps\n", n, batch, n / batch);
+	printf("speedup %.2fx\n", single / batch);
+	return 0;
+}
@@ -0,0 +1,564 @@
+/*
+ * ipq_dispatch.c
+ *
+ * Packets read on one thread and worked on by others.  The reader
+ * hands each packet to a worker through a single-producer, single-
+ * consumer ring, the worker hands it back with its verdict through
+ * another, and the reader sends the verdicts in batches.  Threads only
+ * sleep, and the rings only take a lock to wake them, when there is
+ * nothing to do.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <libipq/libipq.h>
+#include <netinet/in.h>
+#include <linux/netfilter.h>
+
+#define IPQ_RING_SIZE		256	/* a power of two */
+#define IPQ_DISPATCH_BATCH	64	/* packets read, verdicts sent, at once */
+#define IPQ_DISPATCH_MAX	64	/* workers */
+#define IPQ_SPIN		2000	/* looks at an empty ring before sleeping */
+#define IPQ_CACHELINE		64
+
+/****************************************************************************
+ *
+ * Rings
+ *
+ ****************************************************************************/
+
+/* head is only written by the consumer, tail by the producer */
+struct ipq_ring {
+	unsigned int head __attribute__((aligned(IPQ_CACHELINE)));
+	unsigned int tail __attribute__((aligned(IPQ_CACHELINE)));
+	void *slot[IPQ_RING_SIZE];
+};
+
+static int ipq_ring_push(struct ipq_ring *r, void *p)
+{
+	unsigned int tail = r->tail;
+
+	if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) ==
+	    IPQ_RING_SIZE)
+		return -1;
+	r->slot[tail & (IPQ_RING_SIZE - 1)] = p;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void *ipq_ring_pop(struct ipq_ring *r)
+{
+	unsigned int head = r->head;
+	void *p;
+
+	if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	p = r->slot[head & (IPQ_RING_SIZE - 1)];
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return p;
+}
+
+/* For the consumer */
+static int ipq_ring_empty(const struct ipq_ring *r)
+{
+	return r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+/****************************************************************************
+ *
+ * Dispatcher
+ *
+ ****************************************************************************/
+
+/* A buffer of the pool, with the verdict its worker gave */
+struct ipq_dispatch_pkt {
+	unsigned int verdict;
+	unsigned int worker;
+	unsigned char buf[] __attribute__((aligned(8)));
+};
+
+struct ipq_worker {
+	struct ipq_ring in;		/* packets, from the reader */
+	struct ipq_ring out;		/* the same, with their verdicts */
+	struct ipq_dispatch *d;
+	unsigned int index;
+	unsigned int inflight;		/* in either ring or worked on */
+	int sleeping;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t thread;
+};
+
+struct ipq_dispatch {
+	struct ipq_worker *workers;
+	unsigned int nworkers, flags, next;
+	struct ipq_handle *h;
+	ipq_work_fn *fn;
+	void *data;
+
+	unsigned char *pool;		/* of IPQ_RING_SIZE buffers a worker */
+	size_t stride, msglen;
+	struct ipq_dispatch_pkt **free;	/* the reader's stack of them */
+	unsigned int nfree, inflight;
+
+	int efd;			/* wakes the reader */
+	int reader_sleeping;
+	int stop, quit;
+};
+
+#define IPQ_PKT(b) \
+	((struct ipq_dispatch_pkt *)((b) - offsetof(struct ipq_dispatch_pkt, buf)))
+
+static void ipq_worker_wake(struct ipq_worker *w)
+{
+	/* Either we see it asleep, or it sees the ring not empty */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&w->sleeping, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&w->lock);
+		pthread_cond_signal(&w->wake);
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+/* Wait for packets; 1 once told to quit with nothing left */
+static int ipq_worker_sleep(struct ipq_worker *w)
+{
+	int quit;
+
+	pthread_mutex_lock(&w->lock);
+	__atomic_store_n(&w->sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (ipq_ring_empty(&w->in) &&
+	       !__atomic_load_n(&w->d->quit, __ATOMIC_ACQUIRE))
+		pthread_cond_wait(&w->wake, &w->lock);
+	__atomic_store_n(&w->sleeping, 0, __ATOMIC_RELAXED);
+	quit = ipq_ring_empty(&w->in) &&
+	       __atomic_load_n(&w->d->quit, __ATOMIC_ACQUIRE);
+	pthread_mutex_unlock(&w->lock);
+	return quit;
+}
+
+/* Fails only when the counter is already set, which is as good */
+static void ipq_efd_signal(int efd)
+{
+	u_int64_t one = 1;
+	ssize_t ret;
+
+	ret = write(efd, &one, sizeof(one));
+	(void)ret;
+}
+
+static void ipq_reader_wake(struct ipq_dispatch *d)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&d->reader_sleeping, 0, __ATOMIC_SEQ_CST))
+		ipq_efd_signal(d->efd);
+}
+
+static void *ipq_worker_run(void *arg)
+{
+	struct ipq_worker *w = arg;
+	struct ipq_dispatch *d = w->d;
+	struct ipq_dispatch_pkt *pkt;
+	unsigned int spin = 0;
+
+	for (;;) {
+		pkt = ipq_ring_pop(&w->in);
+		if (pkt == NULL) {
+			if (++spin < IPQ_SPIN)
+				continue;
+			spin = 0;
+			if (ipq_worker_sleep(w))
+				break;
+			continue;
+		}
+		spin = 0;
+		pkt->verdict = d->fn(ipq_get_packet(pkt->buf), w->index,
+		                     d->data);
+		/* Never full: the reader keeps a ring's worth in flight */
+		ipq_ring_push(&w->out, pkt);
+		ipq_reader_wake(d);
+	}
+	return NULL;
+}
+
+/*
+ * The same worker for both directions of a flow: addresses, protocol
+ * and, unless it is a fragment, ports of TCP, UDP, SCTP and UDP-Lite.
+ * Packets whose header was not copied all go to the first.
+ */
+static u_int32_t ipq_flow_hash(const ipq_packet_msg_t *m)
+{
+	const unsigned char *p = m->payload, *l4;
+	size_t len = m->data_len, alen, hlen, saddr, daddr;
+	u_int32_t ha = 2166136261U, hb = 2166136261U, ports = 0;
+	unsigned int i, proto;
+	int frag;
+
+	if (len < 1)
+		return 0;
+	switch (p[0] >> 4) {
+	case 4:
+		hlen = (p[0] & 0x0f) * 4;
+		if (hlen < 20 || len < hlen)
+			return 0;
+		proto = p[9];
+		alen = 4;
+		saddr = 12;
+		daddr = 16;
+		frag = ((p[6] & 0x3f) << 8 | p[7]) != 0;
+		break;
+	case 6:
+		hlen = 40;
+		if (len < hlen)
+			return 0;
+		proto = p[6];
+		alen = 16;
+		saddr = 8;
+		daddr = 24;
+		frag = proto == IPPROTO_FRAGMENT;
+		break;
+	default:
+		return 0;
+	}
+	for (i = 0; i < alen; i++) {
+		ha = (ha ^ p[saddr + i]) * 16777619U;
+		hb = (hb ^ p[daddr + i]) * 16777619U;
+	}
+	l4 = p + hlen;
+	if (!frag && hlen + 4 <= len &&
+	    (proto == IPPROTO_TCP || proto == IPPROTO_UDP ||
+	     proto == IPPROTO_SCTP || proto == IPPROTO_UDPLITE))
+		ports = (l4[0] << 8 | l4[1]) ^ (l4[2] << 8 | l4[3]);
+	/* xor, so that the two directions are the same */
+	return ((ha ^ hb) + proto) * 2654435761U ^ ports * 2246822519U;
+}
+
+static struct ipq_worker *ipq_dispatch_worker(struct ipq_dispatch *d,
+                                              const ipq_packet_msg_t *m)
+{
+	if (d->flags & IPQ_DISPATCH_FLOW)
+		return &d->workers[ipq_flow_hash(m) % d->nworkers];
+	if (++d->next == d->nworkers)
+		d->next = 0;
+	return &d->workers[d->next];
+}
+
+/* Send n verdicts and take their buffers back */
+static int ipq_dispatch_flush(struct ipq_dispatch *d,
+                              const struct ipq_verdict *v,
+                              struct ipq_dispatch_pkt **pkt, unsigned int n)
+{
+	unsigned int i;
+	int ret;
+
+	ret = ipq_set_verdict_batch(d->h, v, n);
+	for (i = 0; i < n; i++)
+		d->free[d->nfree++] = pkt[i];
+	d->inflight -= n;
+	return ret == (int)n ? 0 : -1;
+}
+
+/*
+ * Send the verdicts the workers have given, those of each worker in
+ * the order it got the packets.  Returns how many, or -1 if sending
+ * failed; the buffers are taken back anyway.
+ */
+static int ipq_dispatch_verdicts(struct ipq_dispatch *d)
+{
+	struct ipq_verdict v[IPQ_DISPATCH_BATCH];
+	struct ipq_dispatch_pkt *pkt[IPQ_DISPATCH_BATCH];
+	struct ipq_worker *w;
+	unsigned int i, n = 0;
+	int total = 0, err = 0;
+
+	for (i = 0; i < d->nworkers; i++) {
+		w = &d->workers[i];
+		while ((pkt[n] = ipq_ring_pop(&w->out)) != NULL) {
+			memset(&v[n], 0, sizeof(v[n]));
+			v[n].id = ipq_get_packet(pkt[n]->buf)->packet_id;
+			v[n].verdict = pkt[n]->verdict;
+			w->inflight--;
+			if (++n < IPQ_DISPATCH_BATCH)
+				continue;
+			if (ipq_dispatch_flush(d, v, pkt, n) < 0)
+				err = 1;
+			total += n;
+			n = 0;
+		}
+	}
+	if (n > 0) {
+		if (ipq_dispatch_flush(d, v, pkt, n) < 0)
+			err = 1;
+		total += n;
+	}
+	return err ? -1 : total;
+}
+
+/*
+ * Sleep until a worker has a verdict, the dispatcher is stopped or,
+ * if reading, a message arrives.
+ */
+static void ipq_dispatch_wait(struct ipq_dispatch *d, int reading)
+{
+	struct pollfd pfd[2];
+	u_int64_t n;
+	unsigned int i;
+	ssize_t ret;
+
+	__atomic_store_n(&d->reader_sleeping, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (i = 0; i < d->nworkers; i++)
+		if (!ipq_ring_empty(&d->workers[i].out)) {
+			__atomic_store_n(&d->reader_sleeping, 0,
+			                 __ATOMIC_SEQ_CST);
+			return;
+		}
+	pfd[0].fd = d->efd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = reading ? d->h->fd : -1;
+	pfd[1].events = POLLIN;
+	if (!__atomic_load_n(&d->stop, __ATOMIC_ACQUIRE))
+		poll(pfd, 2, -1);
+	__atomic_store_n(&d->reader_sleeping, 0, __ATOMIC_SEQ_CST);
+	ret = read(d->efd, &n, sizeof(n));	/* EAGAIN if not written */
+	(void)ret;
+}
+
+/* Give a packet to its worker, once it has room */
+static int ipq_dispatch_one(struct ipq_dispatch *d,
+                            struct ipq_dispatch_pkt *pkt)
+{
+	struct ipq_worker *w;
+
+	w = ipq_dispatch_worker(d, ipq_get_packet(pkt->buf));
+	while (w->inflight == IPQ_RING_SIZE) {
+		int ret = ipq_dispatch_verdicts(d);
+
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			ipq_dispatch_wait(d, 0);
+	}
+	pkt->worker = w->index;
+	w->inflight++;
+	d->inflight++;
+	ipq_ring_push(&w->in, pkt);
+	ipq_worker_wake(w);
+	return 0;
+}
+
+/*
+ * Read what has arrived, into free buffers, and hand the packets out.
+ * Returns how many messages were read, or -1.
+ */
+static int ipq_dispatch_read(struct ipq_dispatch *d)
+{
+	struct ipq_msgbuf msgs[IPQ_DISPATCH_BATCH];
+	struct ipq_dispatch_pkt *pkt;
+	unsigned int i, n;
+	int got;
+
+	n = d->nfree < IPQ_DISPATCH_BATCH ? d->nfree : IPQ_DISPATCH_BATCH;
+	for (i = 0; i < n; i++) {
+		pkt = d->free[--d->nfree];
+		msgs[i].buf = pkt->buf;
+		msgs[i].len = d->msglen;
+	}
+	got = ipq_read_batch(d->h, msgs, n, 0);
+	if (got < 0) {
+		for (i = 0; i < n; i++)
+			d->free[d->nfree++] = IPQ_PKT(msgs[i].buf);
+		switch (errno) {
+		case ENOBUFS:
+			d->h->drops++;
+			/* fall through */
+		case EAGAIN:
+		case EINTR:
+		case EBADMSG:
+			return 0;
+		}
+		return -1;
+	}
+	for (i = got; i < n; i++)
+		d->free[d->nfree++] = IPQ_PKT(msgs[i].buf);
+	for (i = 0; i < (unsigned int)got; i++) {
+		pkt = IPQ_PKT(msgs[i].buf);
+		/* Errors from the kernel have no verdict to wait for */
+		if (ipq_message_type(pkt->buf) != IPQM_PACKET) {
+			d->free[d->nfree++] = pkt;
+			continue;
+		}
+		if (ipq_dispatch_one(d, pkt) < 0) {
+			while (++i < (unsigned int)got)
+				d->free[d->nfree++] = IPQ_PKT(msgs[i].buf);
+			d->free[d->nfree++] = pkt;
+			return -1;
+		}
+	}
+	return got;
+}
+
+/*
+ * Read packets and hand them to the workers, and send their verdicts
+ * back, until ipq_dispatch_stop() is called or reading fails.  The
+ * packets in flight then are seen through before it returns.
+ */
+int ipq_dispatch_run(struct ipq_dispatch *d)
+{
+	int busy, ret = 0, err = 0, reading = 1;
+
+	__atomic_store_n(&d->stop, 0, __ATOMIC_RELEASE);
+	for (;;) {
+		if (reading && __atomic_load_n(&d->stop, __ATOMIC_ACQUIRE))
+			reading = 0;
+		busy = ipq_dispatch_verdicts(d);
+		if (busy < 0) {
+			err = errno;
+			ret = -1;
+			reading = 0;
+			busy = 0;
+		}
+		if (!reading && d->inflight == 0)
+			break;
+		if (reading && d->nfree > 0) {
+			int got = ipq_dispatch_read(d);
+
+			if (got < 0) {
+				err = errno;
+				ret = -1;
+				reading = 0;
+			} else {
+				busy += got;
+			}
+		}
+		if (busy == 0)
+			ipq_dispatch_wait(d, reading && d->nfree > 0);
+	}
+	if (ret < 0)
+		errno = err;
+	return ret;
+}
+
+/*
+ * Make ipq_dispatch_run() return.  Safe from a signal handler and from
+ * the workers.
+ */
+void ipq_dispatch_stop(struct ipq_dispatch *d)
+{
+	__atomic_store_n(&d->stop, 1, __ATOMIC_RELEASE);
+	ipq_efd_signal(d->efd);
+}
+
+void ipq_dispatch_destroy(struct ipq_dispatch *d)
+{
+	unsigned int i;
+
+	if (d == NULL)
+		return;
+	__atomic_store_n(&d->quit, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < d->nworkers; i++) {
+		struct ipq_worker *w = &d->workers[i];
+
+		pthread_mutex_lock(&w->lock);
+		pthread_cond_signal(&w->wake);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->thread, NULL);
+		pthread_cond_destroy(&w->wake);
+		pthread_mutex_destroy(&w->lock);
+	}
+	if (d->efd >= 0)
+		close(d->efd);
+	free(d->workers);
+	free(d->pool);
+	free(d->free);
+	free(d);
+}
+
+/*
+ * A dispatcher reading from h, with workers threads calling fn.  With
+ * IPQ_DISPATCH_FLOW, the packets of a flow all go to the same worker,
+ * and their verdicts are sent in the order they came; otherwise they
+ * go round the workers.  The socket of h is made non-blocking.
+ */
+struct ipq_dispatch *ipq_dispatch_create(struct ipq_handle *h,
+                                         unsigned int workers,
+                                         unsigned int flags,
+                                         ipq_work_fn *fn, void *data)
+{
+	struct ipq_dispatch *d;
+	unsigned int i, npool;
+	int err;
+
+	if (workers == 0 || workers > IPQ_DISPATCH_MAX || fn == NULL ||
+	    (flags & ~IPQ_DISPATCH_FLOW)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	d = calloc(1, sizeof(*d));
+	if (d == NULL)
+		return NULL;
+	d->h = h;
+	d->fn = fn;
+	d->data = data;
+	d->flags = flags;
+	d->efd = -1;
+	d->msglen = h->msglen ? h->msglen : IPQ_MSGLEN_DEFAULT;
+	d->stride = (sizeof(struct ipq_dispatch_pkt) + d->msglen +
+	             IPQ_CACHELINE - 1) & ~(size_t)(IPQ_CACHELINE - 1);
+
+	npool = workers * IPQ_RING_SIZE;
+	if ((errno = posix_memalign((void **)&d->workers, IPQ_CACHELINE,
+	                            workers * sizeof(*d->workers))) != 0 ||
+	    (errno = posix_memalign((void **)&d->pool, IPQ_CACHELINE,
+	                            npool * d->stride)) != 0)
+		goto fail;
+	memset(d->workers, 0, workers * sizeof(*d->workers));
+	d->free = malloc(npool * sizeof(*d->free));
+	if (d->free == NULL)
+		goto fail;
+	for (i = npool; i-- > 0; )
+		d->free[d->nfree++] =
+			(struct ipq_dispatch_pkt *)(d->pool + i * d->stride);
+
+	d->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (d->efd < 0 || ipq_set_nonblock(h, 1) < 0)
+		goto fail;
+
+	for (i = 0; i < workers; i++) {
+		struct ipq_worker *w = &d->workers[i];
+
+		w->d = d;
+		w->index = i;
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->wake, NULL);
+		errno = pthread_create(&w->thread, NULL, ipq_worker_run, w);
+		if (errno != 0) {
+			pthread_cond_destroy(&w->wake);
+			pthread_mutex_destroy(&w->lock);
+			goto fail;
+		}
+		d->nworkers++;
+	}
+	return d;
+
+ fail:
+	err = errno;
+	ipq_dispatch_destroy(d);
+	errno = err;
+	return NULL;
+}
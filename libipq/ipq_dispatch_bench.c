@@ -0,0 +1,267 @@
+/*
+ * ipq_dispatch_bench.c
+ *
+ * Packets through ipq_dispatch and back, with one worker and then more,
+ * handed out round robin and then by flow.  The kernel is played by a
+ * thread on the other end of a socketpair; it queues UDP packets of
+ * many flows, times each until its verdict and checks that the
+ * verdicts of a flow come back in order.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#define _GNU_SOURCE 1		/* recvmmsg, sendmmsg */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <libipq/libipq.h>
+#include <netinet/in.h>
+#include <linux/netfilter.h>
+
+#define BENCH_BATCH	64
+#define BENCH_WINDOW	1024	/* packets the peer has out at most */
+#define BENCH_FLOWS	1024
+#define BENCH_PAYLOAD	64	/* IPv4 and UDP headers, and data */
+
+struct bench_packet {
+	struct nlmsghdr nlh;
+	ipq_packet_msg_t pm;
+	unsigned char payload[BENCH_PAYLOAD];
+};
+
+struct bench_peer {
+	int fd;
+	unsigned int n;
+	struct ipq_dispatch *d;
+	double *sent;			/* by packet id */
+	double *latency;		/* in the order verdicts came */
+	unsigned long last[BENCH_FLOWS];
+	unsigned int reordered;
+};
+
+static unsigned int bench_cost;
+
+static void bench_fail(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 10.0.x.y:port to 192.0.2.1:53, a flow for each of x, y and port */
+static void bench_fill(struct bench_packet *pkt, unsigned long id)
+{
+	unsigned int flow = id % BENCH_FLOWS;
+	unsigned char *p = pkt->payload;
+
+	pkt->pm.packet_id = id;
+	memset(p, 0, 28);
+	p[0] = 0x45;
+	p[3] = BENCH_PAYLOAD;
+	p[8] = 64;
+	p[9] = IPPROTO_UDP;
+	p[12] = 10;
+	p[14] = flow >> 8;
+	p[15] = flow & 0xff;
+	p[16] = 192;
+	p[18] = 2;
+	p[19] = 1;
+	p[20] = (1024 + flow) >> 8;
+	p[21] = (1024 + flow) & 0xff;
+	p[23] = 53;
+}
+
+static void bench_verdict(struct bench_peer *peer, const unsigned char *buf,
+                          unsigned int done, double now)
+{
+	const struct nlmsghdr *nlh = (const struct nlmsghdr *)buf;
+	const ipq_peer_msg_t *pm = NLMSG_DATA(nlh);
+	unsigned long id = pm->msg.verdict.id;
+	unsigned int flow = id % BENCH_FLOWS;
+
+	if (nlh->nlmsg_type != IPQM_VERDICT || id == 0 || id > peer->n) {
+		fprintf(stderr, "peer: bad verdict\n");
+		exit(1);
+	}
+	peer->latency[done] = now - peer->sent[id - 1];
+	if (id < peer->last[flow])
+		peer->reordered++;
+	else
+		peer->last[flow] = id;
+}
+
+/*
+ * The kernel: queue n packets, never more than a window of them
+ * without their verdicts, then stop the dispatcher.
+ */
+static void *bench_peer_run(void *arg)
+{
+	struct bench_peer *peer = arg;
+	struct bench_packet pkt[BENCH_BATCH];
+	struct mmsghdr out[BENCH_BATCH], in[BENCH_BATCH];
+	struct iovec oiov[BENCH_BATCH], iiov[BENCH_BATCH];
+	unsigned char vbuf[BENCH_BATCH][256];
+	unsigned int sent = 0, done = 0, i, k;
+	double now;
+	int ret;
+
+	memset(pkt, 0, sizeof(pkt));
+	memset(out, 0, sizeof(out));
+	memset(in, 0, sizeof(in));
+	for (i = 0; i < BENCH_BATCH; i++) {
+		pkt[i].nlh.nlmsg_len = sizeof(pkt[i]);
+		pkt[i].nlh.nlmsg_type = IPQM_PACKET;
+		pkt[i].pm.data_len = BENCH_PAYLOAD;
+		oiov[i].iov_base = &pkt[i];
+		oiov[i].iov_len = sizeof(pkt[i]);
+		out[i].msg_hdr.msg_iov = &oiov[i];
+		out[i].msg_hdr.msg_iovlen = 1;
+		iiov[i].iov_base = vbuf[i];
+		iiov[i].iov_len = sizeof(vbuf[i]);
+		in[i].msg_hdr.msg_iov = &iiov[i];
+		in[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (done < peer->n) {
+		while (sent < peer->n && sent - done < BENCH_WINDOW) {
+			k = peer->n - sent;
+			if (k > BENCH_BATCH)
+				k = BENCH_BATCH;
+			if (k > BENCH_WINDOW - (sent - done))
+				k = BENCH_WINDOW - (sent - done);
+			now = bench_now();
+			for (i = 0; i < k; i++) {
+				bench_fill(&pkt[i], sent + i + 1);
+				peer->sent[sent + i] = now;
+			}
+			ret = sendmmsg(peer->fd, out, k, 0);
+			if (ret < 0)
+				bench_fail("peer sendmmsg");
+			sent += ret;
+		}
+		ret = recvmmsg(peer->fd, in, BENCH_BATCH, MSG_WAITFORONE, NULL);
+		if (ret < 0)
+			bench_fail("peer recvmmsg");
+		now = bench_now();
+		for (i = 0; i < (unsigned int)ret; i++)
+			bench_verdict(peer, vbuf[i], done++, now);
+	}
+	ipq_dispatch_stop(peer->d);
+	return NULL;
+}
+
+/* The inspection, as much of it as bench_cost asks for */
+static unsigned int bench_work(const ipq_packet_msg_t *m,
+                               unsigned int worker, void *data)
+{
+	unsigned int i, j, h = 2166136261U;
+
+	for (i = 0; i < bench_cost; i++)
+		for (j = 0; j < m->data_len; j++)
+			h = (h ^ m->payload[j]) * 16777619U;
+	/* Keep the loop */
+	return h == 0 && bench_cost ? NF_DROP : NF_ACCEPT;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void bench_run(unsigned int n, unsigned int workers,
+                      unsigned int flags)
+{
+	struct bench_peer peer;
+	struct ipq_handle *h;
+	pthread_t thread;
+	int sv[2], size = 4 << 20;
+	double t;
+
+	memset(&peer, 0, sizeof(peer));
+	peer.n = n;
+	peer.sent = calloc(n, sizeof(*peer.sent));
+	peer.latency = calloc(n, sizeof(*peer.latency));
+	if (peer.sent == NULL || peer.latency == NULL)
+		bench_fail("calloc");
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+		bench_fail("socketpair");
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(sv[0], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	peer.fd = sv[1];
+
+	/* A handle on our end of the socketpair instead of netlink */
+	h = calloc(1, sizeof(*h));
+	if (h == NULL)
+		bench_fail("calloc");
+	h->fd = sv[0];
+	h->local.nl_family = AF_UNSPEC;
+	ipq_set_msglen(h, NLMSG_SPACE(sizeof(struct bench_packet)));
+
+	peer.d = ipq_dispatch_create(h, workers, flags, bench_work, NULL);
+	if (peer.d == NULL)
+		bench_fail("ipq_dispatch_create");
+	t = bench_now();
+	if (pthread_create(&thread, NULL, bench_peer_run, &peer) != 0)
+		bench_fail("pthread_create");
+	if (ipq_dispatch_run(peer.d) < 0) {
+		ipq_perror("ipq_dispatch_run");
+		exit(1);
+	}
+	pthread_join(thread, NULL);
+	t = bench_now() - t;
+
+	qsort(peer.latency, n, sizeof(*peer.latency), bench_cmp);
+	printf("%2u worker%s %-6s %9.0f pps  p50 %7.1f us  p99 %7.1f us  "
+	       "%u reordered\n", workers, workers == 1 ? " " : "s",
+	       flags & IPQ_DISPATCH_FLOW ? "flow" : "rr", n / t,
+	       peer.latency[n / 2] * 1e6, peer.latency[n - 1 - n / 100] * 1e6,
+	       peer.reordered);
+
+	ipq_dispatch_destroy(peer.d);
+	ipq_destroy_handle(h);
+	close(sv[1]);
+	free(peer.sent);
+	free(peer.latency);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int n = argc > 1 ? strtoul(argv[1], NULL, 0) : 200000;
+	unsigned int max = argc > 2 ? strtoul(argv[2], NULL, 0) : 4;
+	unsigned int w;
+
+	bench_cost = argc > 3 ? strtoul(argv[3], NULL, 0) : 16;
+	if (n == 0 || max == 0 || argc > 4) {
+		fprintf(stderr, "Usage: %s [packets [workers [cost]]]\n",
+		        argv[0]);
+		exit(1);
+	}
+	printf("%u packets, %u flows, cost %u, %ld CPUs\n", n, BENCH_FLOWS,
+	       bench_cost, sysconf(_SC_NPROCESSORS_ONLN));
+	for (w = 1; w <= max; w *= 2) {
+		bench_run(n, w, 0);
+		bench_run(n, w, IPQ_DISPATCH_FLOW);
+	}
+	return 0;
+}
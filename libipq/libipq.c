@@ -24,6 +24,8 @@
  *
  */
 
+#define _GNU_SOURCE 1		/* recvmmsg, sendmmsg */
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -58,9 +60,11 @@ enum {
 	IPQ_ERR_SUPP,
 	IPQ_ERR_RECVBUF,
 	IPQ_ERR_TIMEOUT,
-        IPQ_ERR_PROTOCOL
+        IPQ_ERR_PROTOCOL,
+	IPQ_ERR_SOCKOPT,
+	IPQ_ERR_PENDING,
 };
-#define IPQ_MAXERR IPQ_ERR_PROTOCOL
+#define IPQ_MAXERR IPQ_ERR_PENDING
 
 struct ipq_errmap_t {
 	int errcode;
@@ -82,11 +86,23 @@ struct ipq_errmap_t {
 	{ IPQ_ERR_SUPP, "Operation not supported" },
 	{ IPQ_ERR_RECVBUF, "Receive buffer size invalid" },
 	{ IPQ_ERR_TIMEOUT, "Timeout"},
-	{ IPQ_ERR_PROTOCOL, "Invalid protocol specified" }
+	{ IPQ_ERR_PROTOCOL, "Invalid protocol specified" },
+	{ IPQ_ERR_SOCKOPT, "Unable to set socket option" },
+	{ IPQ_ERR_PENDING, "Messages read are still pending" }
 };
 
 static int ipq_errno = IPQ_ERR_NONE;
 
+/* Most messages read or verdicts sent by one call of the batch API */
+#define IPQ_BATCH_MAX	64
+
+/* Messages read by ipq_process_pending(), from next on not yet handed */
+struct ipq_pending {
+	unsigned int next, num;
+	struct ipq_msgbuf msgs[IPQ_BATCH_MAX];
+	unsigned char buf[];
+};
+
 static ssize_t ipq_netlink_sendto(const struct ipq_handle *h,
                                   const void *msg, size_t len);
 
@@ -100,11 +116,45 @@ static ssize_t ipq_netlink_sendmsg(const struct ipq_handle *h,
 
 static char *ipq_strerror(int errcode);
 
+/*
+ * Whether the handle is on a netlink socket.  Only the benchmarks are
+ * built with IPQ_TEST_TRANSPORT, for a handle made by hand on one end
+ * of a socketpair standing in for the kernel, which sends to and reads
+ * from its peer without netlink addresses.  The library itself always
+ * uses them, so a handle on any socket but netlink fails to send, and
+ * what it reads is refused as not from the kernel.
+ */
+#ifdef IPQ_TEST_TRANSPORT
+#define ipq_is_netlink(h)	((h)->local.nl_family == AF_NETLINK)
+#else
+#define ipq_is_netlink(h)	1
+#endif
+
+/* Refuse a handle not on netlink, but in the benchmarks */
+static int ipq_check_handle(const struct ipq_handle *h)
+{
+#ifndef IPQ_TEST_TRANSPORT
+	if (h->local.nl_family != AF_NETLINK) {
+		ipq_errno = IPQ_ERR_SUPP;
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+#endif
+	return 0;
+}
+
 static ssize_t ipq_netlink_sendto(const struct ipq_handle *h,
                                   const void *msg, size_t len)
 {
-	int status = sendto(h->fd, msg, len, 0,
-	                    (struct sockaddr *)&h->peer, sizeof(h->peer));
+	int status;
+
+	if (ipq_check_handle(h) < 0)
+		return -1;
+	if (ipq_is_netlink(h))
+		status = sendto(h->fd, msg, len, 0,
+		                (struct sockaddr *)&h->peer, sizeof(h->peer));
+	else
+		status = send(h->fd, msg, len, 0);
 	if (status < 0)
 		ipq_errno = IPQ_ERR_SEND;
 	return status;
@@ -114,12 +164,53 @@ static ssize_t ipq_netlink_sendmsg(const struct ipq_handle *h,
                                    const struct msghdr *msg,
                                    unsigned int flags)
 {
-	int status = sendmsg(h->fd, msg, flags);
+	int status;
+
+	if (ipq_check_handle(h) < 0)
+		return -1;
+	status = sendmsg(h->fd, msg, flags);
 	if (status < 0)
 		ipq_errno = IPQ_ERR_SEND;
 	return status;
 }
 
+/*
+ * Wait for a message for timeout microseconds, or not at all if it is
+ * negative: 1 if one came, 0 on timeout or a signal, -1 on error.
+ */
+static int ipq_netlink_wait(const struct ipq_handle *h, int timeout)
+{
+	int ret;
+	struct timeval tv;
+	fd_set read_fds;
+
+	if (timeout < 0) {
+		/* non-block non-timeout */
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+	} else {
+		tv.tv_sec = timeout / 1000000;
+		tv.tv_usec = timeout % 1000000;
+	}
+
+	FD_ZERO(&read_fds);
+	FD_SET(h->fd, &read_fds);
+	ret = select(h->fd+1, &read_fds, NULL, NULL, &tv);
+	if (ret < 0) {
+		if (errno == EINTR) {
+			return 0;
+		} else {
+			ipq_errno = IPQ_ERR_RECV;
+			return -1;
+		}
+	}
+	if (!FD_ISSET(h->fd, &read_fds)) {
+		ipq_errno = IPQ_ERR_TIMEOUT;
+		return 0;
+	}
+	return 1;
+}
+
 static ssize_t ipq_netlink_recvfrom(const struct ipq_handle *h,
                                     unsigned char *buf, size_t len,
                                     int timeout)
@@ -128,6 +219,8 @@ static ssize_t ipq_netlink_recvfrom(const struct ipq_handle *h,
 	int status;
 	struct nlmsghdr *nlh;
 
+	if (ipq_check_handle(h) < 0)
+		return -1;
 	if (len < sizeof(struct nlmsgerr)) {
 		ipq_errno = IPQ_ERR_RECVBUF;
 		return -1;
@@ -135,49 +228,25 @@ static ssize_t ipq_netlink_recvfrom(const struct ipq_handle *h,
 	addrlen = sizeof(h->peer);
 
 	if (timeout != 0) {
-		int ret;
-		struct timeval tv;
-		fd_set read_fds;
-		
-		if (timeout < 0) {
-			/* non-block non-timeout */
-			tv.tv_sec = 0;
-			tv.tv_usec = 0;
-		} else {
-			tv.tv_sec = timeout / 1000000;
-			tv.tv_usec = timeout % 1000000;
-		}
-
-		FD_ZERO(&read_fds);
-		FD_SET(h->fd, &read_fds);
-		ret = select(h->fd+1, &read_fds, NULL, NULL, &tv);
-		if (ret < 0) {
-			if (errno == EINTR) {
-				return 0;
-			} else {
-				ipq_errno = IPQ_ERR_RECV;
-				return -1;
-			}
-		}
-		if (!FD_ISSET(h->fd, &read_fds)) {
-			ipq_errno = IPQ_ERR_TIMEOUT;
-			return 0;
+		status = ipq_netlink_wait(h, timeout);
+		if (status <= 0)
+			return status;
+	}
+	if (!ipq_is_netlink(h)) {
+		status = recv(h->fd, buf, len, 0);
+	} else {
+		status = recvfrom(h->fd, buf, len, 0,
+		                  (struct sockaddr *)&h->peer, &addrlen);
+		if (status >= 0 &&
+		    (addrlen != sizeof(h->peer) || h->peer.nl_pid != 0)) {
+			ipq_errno = IPQ_ERR_RECV;
+			return -1;
 		}
 	}
-	status = recvfrom(h->fd, buf, len, 0,
-	                      (struct sockaddr *)&h->peer, &addrlen);
 	if (status < 0) {
 		ipq_errno = IPQ_ERR_RECV;
 		return status;
 	}
-	if (addrlen != sizeof(h->peer)) {
-		ipq_errno = IPQ_ERR_RECV;
-		return -1;
-	}
-	if (h->peer.nl_pid != 0) {
-		ipq_errno = IPQ_ERR_RECV;
-		return -1;
-	}
 	if (status == 0) {
 		ipq_errno = IPQ_ERR_NLEOF;
 		return -1;
@@ -190,6 +259,125 @@ static ssize_t ipq_netlink_recvfrom(const struct ipq_handle *h,
 	return status;
 }
 
+/*
+ * Read up to n messages with one recvmmsg.  The messages that are not
+ * valid, as ipq_netlink_recvfrom() checks them, are left out and the
+ * valid ones moved to the front, buffers and all; -1 if none was.
+ */
+static int ipq_netlink_recvmmsg(const struct ipq_handle *h,
+                                struct ipq_msgbuf *msgs, unsigned int n,
+                                int timeout, int flags)
+{
+	struct mmsghdr mmsg[IPQ_BATCH_MAX];
+	struct sockaddr_nl addr[IPQ_BATCH_MAX];
+	struct iovec iov[IPQ_BATCH_MAX];
+	struct ipq_msgbuf tmp;
+	struct nlmsghdr *nlh;
+	unsigned int i, got = 0;
+	int status, err = IPQ_ERR_NONE;
+
+	if (ipq_check_handle(h) < 0)
+		return -1;
+	if (n > IPQ_BATCH_MAX)
+		n = IPQ_BATCH_MAX;
+	memset(mmsg, 0, n * sizeof(mmsg[0]));
+	for (i = 0; i < n; i++) {
+		if (msgs[i].len < sizeof(struct nlmsgerr)) {
+			ipq_errno = IPQ_ERR_RECVBUF;
+			return -1;
+		}
+		iov[i].iov_base = msgs[i].buf;
+		iov[i].iov_len = msgs[i].len;
+		mmsg[i].msg_hdr.msg_iov = &iov[i];
+		mmsg[i].msg_hdr.msg_iovlen = 1;
+		if (ipq_is_netlink(h)) {
+			mmsg[i].msg_hdr.msg_name = &addr[i];
+			mmsg[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+		}
+	}
+
+	if (timeout != 0) {
+		status = ipq_netlink_wait(h, timeout);
+		if (status <= 0)
+			return status;
+	}
+	/* Block for the first only, then take what is already there */
+	status = recvmmsg(h->fd, mmsg, n, MSG_WAITFORONE | flags, NULL);
+	if (status < 0) {
+		ipq_errno = IPQ_ERR_RECV;
+		return -1;
+	}
+
+	for (i = 0; i < (unsigned int)status; i++) {
+		nlh = (struct nlmsghdr *)msgs[i].buf;
+		if (ipq_is_netlink(h) &&
+		    (mmsg[i].msg_hdr.msg_namelen != sizeof(addr[i]) ||
+		     addr[i].nl_pid != 0)) {
+			err = IPQ_ERR_RECV;
+			continue;
+		}
+		if (mmsg[i].msg_len == 0) {
+			err = IPQ_ERR_NLEOF;
+			continue;
+		}
+		if (mmsg[i].msg_hdr.msg_flags & MSG_TRUNC ||
+		    nlh->nlmsg_len > mmsg[i].msg_len) {
+			err = IPQ_ERR_RTRUNC;
+			continue;
+		}
+		msgs[i].size = mmsg[i].msg_len;
+		if (i != got) {
+			tmp = msgs[got];
+			msgs[got] = msgs[i];
+			msgs[i] = tmp;
+		}
+		got++;
+	}
+	if (got == 0 && err != IPQ_ERR_NONE) {
+		ipq_errno = err;
+		errno = EBADMSG;
+		return -1;
+	}
+	return got;
+}
+
+/* The messages of a verdict, pointing into nlh, pm and iov */
+static void ipq_build_verdict(const struct ipq_handle *h,
+                              const struct ipq_verdict *v,
+                              struct nlmsghdr *nlh, ipq_peer_msg_t *pm,
+                              struct iovec *iov, struct msghdr *msg)
+{
+	size_t tlen;
+
+	memset(nlh, 0, sizeof(*nlh));
+	nlh->nlmsg_flags = NLM_F_REQUEST;
+	nlh->nlmsg_type = IPQM_VERDICT;
+	nlh->nlmsg_pid = h->local.nl_pid;
+	memset(pm, 0, sizeof(*pm));
+	pm->msg.verdict.value = v->verdict;
+	pm->msg.verdict.id = v->id;
+	pm->msg.verdict.data_len = v->data_len;
+	iov[0].iov_base = nlh;
+	iov[0].iov_len = sizeof(*nlh);
+	iov[1].iov_base = pm;
+	iov[1].iov_len = sizeof(*pm);
+	tlen = sizeof(*nlh) + sizeof(*pm);
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_iovlen = 2;
+	if (v->data_len && v->buf) {
+		iov[2].iov_base = v->buf;
+		iov[2].iov_len = v->data_len;
+		tlen += v->data_len;
+		msg->msg_iovlen++;
+	}
+	if (ipq_is_netlink(h)) {
+		msg->msg_name = (void *)&h->peer;
+		msg->msg_namelen = sizeof(h->peer);
+	}
+	msg->msg_iov = iov;
+	nlh->nlmsg_len = tlen;
+}
+
 static char *ipq_strerror(int errcode)
 {
 	if (errcode < 0 || errcode > IPQ_MAXERR)
@@ -260,6 +448,7 @@ int ipq_destroy_handle(struct ipq_handle *h)
 {
 	if (h) {
 		close(h->fd);
+		free(h->pending);
 		free(h);
 	}
 	return 0;
@@ -293,6 +482,166 @@ ssize_t ipq_read(const struct ipq_handle *h,
 	return ipq_netlink_recvfrom(h, buf, len, timeout);
 }
 
+/*
+ * Read up to n messages, as many as are there once the first is, with
+ * one system call.  timeout is that of ipq_read().  Returns how many
+ * were read, each into the buffer of msgs[i] with its length in
+ * msgs[i].size.
+ */
+int ipq_read_batch(const struct ipq_handle *h,
+                   struct ipq_msgbuf *msgs, unsigned int n, int timeout)
+{
+	if (n == 0)
+		return 0;
+	return ipq_netlink_recvmmsg(h, msgs, n, timeout, 0);
+}
+
+/*
+ * The socket, for poll, epoll and the like.
+ */
+int ipq_fd(const struct ipq_handle *h)
+{
+	return h->fd;
+}
+
+/*
+ * Make reads fail with EAGAIN rather than wait when nothing is queued,
+ * or wait again.
+ */
+int ipq_set_nonblock(const struct ipq_handle *h, int on)
+{
+	int flags = fcntl(h->fd, F_GETFL);
+
+	if (flags < 0 ||
+	    fcntl(h->fd, F_SETFL, on ? flags | O_NONBLOCK :
+	                               flags & ~O_NONBLOCK) < 0) {
+		ipq_errno = IPQ_ERR_SOCKOPT;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Size the receive buffer, beyond the rmem_max limit if we are
+ * allowed to.  Packets that arrive with it full are dropped by the
+ * kernel.  Returns the size granted.
+ */
+int ipq_set_rcvbuf(const struct ipq_handle *h, size_t size)
+{
+	int val, status;
+	socklen_t len = sizeof(val);
+
+	if (size > INT_MAX / 2) {
+		errno = EINVAL;
+		ipq_errno = IPQ_ERR_SOCKOPT;
+		return -1;
+	}
+	val = size;
+	status = setsockopt(h->fd, SOL_SOCKET, SO_RCVBUFFORCE,
+	                    &val, sizeof(val));
+	if (status < 0)
+		status = setsockopt(h->fd, SOL_SOCKET, SO_RCVBUF,
+		                    &val, sizeof(val));
+	if (status < 0 ||
+	    getsockopt(h->fd, SOL_SOCKET, SO_RCVBUF, &val, &len) < 0) {
+		ipq_errno = IPQ_ERR_SOCKOPT;
+		return -1;
+	}
+	return val;
+}
+
+/*
+ * Room for one message in ipq_process_pending(): at least the copy
+ * range given to ipq_set_mode() and the packet header.  Refused while
+ * messages read are kept for the next call, as their packets would be
+ * left without a verdict.
+ */
+int ipq_set_msglen(struct ipq_handle *h, size_t len)
+{
+	if (len < sizeof(struct nlmsgerr)) {
+		ipq_errno = IPQ_ERR_RECVBUF;
+		return -1;
+	}
+	if (h->pending != NULL && h->pending->next < h->pending->num) {
+		ipq_errno = IPQ_ERR_PENDING;
+		errno = EBUSY;
+		return -1;
+	}
+	free(h->pending);
+	h->pending = NULL;
+	h->msglen = len;
+	return 0;
+}
+
+/*
+ * Hand every message already queued to fn, up to max if not zero,
+ * without waiting and a recvmmsg for as many as 64 of them, until one
+ * finds none, so that it suits edge-triggered epoll.  Messages read
+ * but not handed, when fn or max stops it, are kept for the next call.
+ * Overruns of the receive buffer are counted, see ipq_get_drops(), and
+ * do not stop it.  Returns how many messages fn was given.
+ */
+int ipq_process_pending(struct ipq_handle *h, ipq_msg_fn *fn, void *data,
+                        unsigned int max)
+{
+	struct ipq_pending *p = h->pending;
+	struct ipq_msgbuf *m;
+	unsigned int done = 0, i;
+	int got;
+
+	if (h->msglen == 0)
+		h->msglen = IPQ_MSGLEN_DEFAULT;
+	if (p == NULL) {
+		p = calloc(1, sizeof(*p) + IPQ_BATCH_MAX * h->msglen);
+		if (p == NULL) {
+			ipq_errno = IPQ_ERR_BUFFER;
+			return -1;
+		}
+		h->pending = p;
+	}
+
+	while (max == 0 || done < max) {
+		if (p->next < p->num) {
+			m = &p->msgs[p->next++];
+			done++;
+			if (fn(m->buf, m->size, data) != 0)
+				break;
+			continue;
+		}
+		for (i = 0; i < IPQ_BATCH_MAX; i++) {
+			p->msgs[i].buf = p->buf + i * h->msglen;
+			p->msgs[i].len = h->msglen;
+		}
+		p->next = p->num = 0;
+		got = ipq_netlink_recvmmsg(h, p->msgs, IPQ_BATCH_MAX, 0,
+		                           MSG_DONTWAIT);
+		if (got < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR)
+				break;
+			if (errno == ENOBUFS) {
+				h->drops++;
+				continue;
+			}
+			/* Only bad messages in this lot: on to the next */
+			if (errno == EBADMSG)
+				continue;
+			return done ? (int)done : -1;
+		}
+		p->num = got;
+	}
+	return done;
+}
+
+/*
+ * How many times ipq_process_pending() found that the kernel had
+ * dropped messages because the receive buffer was full.
+ */
+unsigned long ipq_get_drops(const struct ipq_handle *h)
+{
+	return h->drops;
+}
+
 int ipq_message_type(const unsigned char *buf)
 {
 	return ((struct nlmsghdr*)buf)->nlmsg_type;
@@ -316,44 +665,60 @@ int ipq_set_verdict(const struct ipq_handle *h,
                     size_t data_len,
                     unsigned char *buf)
 {
-	unsigned char nvecs;
-	size_t tlen;
+	struct ipq_verdict v = {
+		.id = id,
+		.verdict = verdict,
+		.data_len = data_len,
+		.buf = buf,
+	};
 	struct nlmsghdr nlh;
 	ipq_peer_msg_t pm;
 	struct iovec iov[3];
 	struct msghdr msg;
 
-	memset(&nlh, 0, sizeof(nlh));
-	nlh.nlmsg_flags = NLM_F_REQUEST;
-	nlh.nlmsg_type = IPQM_VERDICT;
-	nlh.nlmsg_pid = h->local.nl_pid;
-	memset(&pm, 0, sizeof(pm));
-	pm.msg.verdict.value = verdict;
-	pm.msg.verdict.id = id;
-	pm.msg.verdict.data_len = data_len;
-	iov[0].iov_base = &nlh;
-	iov[0].iov_len = sizeof(nlh);
-	iov[1].iov_base = &pm;
-	iov[1].iov_len = sizeof(pm);
-	tlen = sizeof(nlh) + sizeof(pm);
-	nvecs = 2;
-	if (data_len && buf) {
-		iov[2].iov_base = buf;
-		iov[2].iov_len = data_len;
-		tlen += data_len;
-		nvecs++;
-	}
-	msg.msg_name = (void *)&h->peer;
-	msg.msg_namelen = sizeof(h->peer);
-	msg.msg_iov = iov;
-	msg.msg_iovlen = nvecs;
-	msg.msg_control = NULL;
-	msg.msg_controllen = 0;
-	msg.msg_flags = 0;
-	nlh.nlmsg_len = tlen;
+	ipq_build_verdict(h, &v, &nlh, &pm, iov, &msg);
 	return ipq_netlink_sendmsg(h, &msg, 0);
 }
 
+/*
+ * Send n verdicts, each as ipq_set_verdict() would, with as few
+ * sendmmsg calls as it takes.  Returns how many were sent, fewer than
+ * n if sending failed part way, or -1 if none was.
+ */
+int ipq_set_verdict_batch(const struct ipq_handle *h,
+                          const struct ipq_verdict *v, unsigned int n)
+{
+	struct mmsghdr mmsg[IPQ_BATCH_MAX];
+	struct nlmsghdr nlh[IPQ_BATCH_MAX];
+	ipq_peer_msg_t pm[IPQ_BATCH_MAX];
+	struct iovec iov[IPQ_BATCH_MAX][3];
+	unsigned int done = 0, i, k;
+	int status;
+
+	if (ipq_check_handle(h) < 0)
+		return -1;
+	while (done < n) {
+		k = n - done < IPQ_BATCH_MAX ? n - done : IPQ_BATCH_MAX;
+		for (i = 0; i < k; i++) {
+			ipq_build_verdict(h, &v[done + i], &nlh[i], &pm[i],
+			                  iov[i], &mmsg[i].msg_hdr);
+			mmsg[i].msg_len = 0;
+		}
+		for (i = 0; i < k; i += status) {
+			status = sendmmsg(h->fd, mmsg + i, k - i, 0);
+			if (status < 0 && errno == EINTR) {
+				status = 0;
+			} else if (status < 0) {
+				ipq_errno = IPQ_ERR_SEND;
+				done += i;
+				return done ? (int)done : -1;
+			}
+		}
+		done += k;
+	}
+	return done;
+}
+
 /* Not implemented yet */
 int ipq_ctl(const struct ipq_handle *h, int request, ...)
 {
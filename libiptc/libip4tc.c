@@ -49,9 +49,11 @@ typedef unsigned int socklen_t;
 #define STRUCT_COUNTERS_INFO	struct ipt_counters_info
 #define STRUCT_STANDARD_TARGET	struct ipt_standard_target
 #define STRUCT_REPLACE		struct ipt_replace
+#define STRUCT_ICMP		struct ipt_icmp
 
 #define STRUCT_TC_HANDLE	struct iptc_handle
 #define xtc_handle		iptc_handle
+#define xtc_snapshot		iptc_snapshot
 
 #define ENTRY_ITERATE		IPT_ENTRY_ITERATE
 #define TABLE_MAXNAMELEN	IPT_TABLE_MAXNAMELEN
@@ -91,9 +93,26 @@ typedef unsigned int socklen_t;
 #define TC_SET_POLICY		iptc_set_policy
 #define TC_GET_RAW_SOCKET	iptc_get_raw_socket
 #define TC_INIT			iptc_init
+#define TC_INIT_OFFLINE		iptc_init_offline
 #define TC_FREE			iptc_free
 #define TC_COMMIT		iptc_commit
 #define TC_STRERROR		iptc_strerror
+#define TC_SNAPSHOT		iptc_snapshot
+#define TC_SNAPSHOT_FREE	iptc_snapshot_free
+#define TC_SNAPSHOT_TABLE	iptc_snapshot_table
+#define TC_SNAPSHOT_SAVE	iptc_snapshot_save
+#define TC_SNAPSHOT_LOAD	iptc_snapshot_load
+#define TC_ROLLBACK		iptc_rollback
+#define TC_CHECK_PACKET		iptc_check_packet
+#define TC_TRACE_PACKET		iptc_trace_packet
+#define TC_REGISTER_MATCH_EVAL	iptc_register_match_eval
+#define TC_BUILD_CLASSIFIER	iptc_build_classifier
+#define TC_REORDER_CHAIN	iptc_reorder_chain
+#define TC_BISECT_CHAIN		iptc_bisect_chain
+#define TC_FACTOR_CHAIN		iptc_factor_chain
+#define TC_ANALYZE_CHAIN	iptc_analyze_chain
+#define TC_COMPACT_CHAIN	iptc_compact_chain
+#define TC_MULTIPORT_CHAIN	iptc_multiport_chain
 #define TC_NUM_RULES		iptc_num_rules
 #define TC_GET_RULE		iptc_get_rule
 
@@ -114,6 +133,13 @@ typedef unsigned int socklen_t;
 
 #define ALIGN			XT_ALIGN
 #define RETURN			IPT_RETURN
+#define ICMP_INV		IPT_ICMP_INV
+
+/* Classifier fields: source, destination, protocol, in and out interface */
+#define IPTCC_DT_DIMS		5
+#define IPTCC_ADDR_BITS		32
+#define IPTCC_ADDR_WORDS	1
+#define ENTRY_GOTO(e)		((e)->ip.flags & IPT_F_GOTO)
 
 #include "libiptc.c"
 
@@ -214,6 +240,248 @@ is_same(const STRUCT_ENTRY *a, const STRUCT_ENTRY *b, unsigned char *matchmask)
 	return mptr;
 }
 
+static void
+packet_fill(struct xtc_packet *p, const STRUCT_ENTRY *e)
+{
+	p->family = NFPROTO_IPV4;
+	p->src.ip = e->ip.src.s_addr;
+	p->dst.ip = e->ip.dst.s_addr;
+	if (e->ip.flags & IPT_F_FRAG)
+		p->fragment = 1;
+}
+
+static void
+packet_keys(const STRUCT_ENTRY *e, uint64_t *key)
+{
+	key[0] = ntohl(e->ip.src.s_addr);
+	key[1] = ntohl(e->ip.dst.s_addr);
+	key[2] = e->ip.proto;
+	key[3] = iptcc_iface_key(e->ip.iniface);
+	key[4] = iptcc_iface_key(e->ip.outiface);
+}
+
+static void
+rule_box(const STRUCT_ENTRY *r, uint64_t *lo, uint64_t *hi)
+{
+	const struct ipt_ip *ip = &r->ip;
+
+	iptcc_mask_range(ntohl(ip->src.s_addr), ntohl(ip->smsk.s_addr),
+			 0xffffffff, ip->invflags & IPT_INV_SRCIP,
+			 &lo[0], &hi[0]);
+	iptcc_mask_range(ntohl(ip->dst.s_addr), ntohl(ip->dmsk.s_addr),
+			 0xffffffff, ip->invflags & IPT_INV_DSTIP,
+			 &lo[1], &hi[1]);
+	if (ip->proto == 0 || (ip->invflags & IPT_INV_PROTO)) {
+		lo[2] = 0;
+		hi[2] = ~(uint64_t)0;
+	} else {
+		lo[2] = hi[2] = ip->proto;
+	}
+	iptcc_iface_range(ip->iniface, ip->iniface_mask,
+			  ip->invflags & IPT_INV_VIA_IN, &lo[3], &hi[3]);
+	iptcc_iface_range(ip->outiface, ip->outiface_mask,
+			  ip->invflags & IPT_INV_VIA_OUT, &lo[4], &hi[4]);
+}
+
+/* The source (or destination) of a rule as a prefix; false if it is
+ * inverted or the mask isn't one. */
+static bool
+rule_prefix(const STRUCT_ENTRY *e, bool dst, union nf_inet_addr *addr,
+	    unsigned int *len)
+{
+	uint32_t mask = ntohl(dst ? e->ip.dmsk.s_addr : e->ip.smsk.s_addr);
+
+	if (e->ip.invflags & (dst ? IPT_INV_DSTIP : IPT_INV_SRCIP))
+		return false;
+	if ((~mask & (~mask + 1)) != 0)
+		return false;
+	memset(addr, 0, sizeof(*addr));
+	addr->ip = dst ? e->ip.dst.s_addr : e->ip.src.s_addr;
+	*len = mask ? 32 - __builtin_ctz(mask) : 0;
+	return true;
+}
+
+static void
+entry_set_prefix(STRUCT_ENTRY *e, bool dst, const union nf_inet_addr *addr,
+		 unsigned int len, bool inv)
+{
+	uint32_t mask = len ? htonl(~0U << (32 - len)) : 0;
+
+	if (dst) {
+		e->ip.dst.s_addr = addr->ip & mask;
+		e->ip.dmsk.s_addr = mask;
+		e->ip.invflags &= ~IPT_INV_DSTIP;
+		if (inv)
+			e->ip.invflags |= IPT_INV_DSTIP;
+	} else {
+		e->ip.src.s_addr = addr->ip & mask;
+		e->ip.smsk.s_addr = mask;
+		e->ip.invflags &= ~IPT_INV_SRCIP;
+		if (inv)
+			e->ip.invflags |= IPT_INV_SRCIP;
+	}
+}
+
+/* Whether the headers of two rules differ in the source (destination)
+ * only */
+static bool
+header_same_but_prefix(const STRUCT_ENTRY *a, const STRUCT_ENTRY *b,
+		       bool dst)
+{
+	struct ipt_ip x = a->ip, y = b->ip;
+
+	if (dst) {
+		x.dst.s_addr = x.dmsk.s_addr = 0;
+		y.dst.s_addr = y.dmsk.s_addr = 0;
+	} else {
+		x.src.s_addr = x.smsk.s_addr = 0;
+		y.src.s_addr = y.smsk.s_addr = 0;
+	}
+	return memcmp(&x, &y, sizeof(x)) == 0;
+}
+
+/* Whether rule_box() is all the header of a rule tests: nothing
+ * inverted, prefixes for the addresses, and interface names that fit
+ * the keys */
+static bool
+header_exact(const STRUCT_ENTRY *e)
+{
+	union nf_inet_addr addr;
+	unsigned int len;
+
+	return e->ip.invflags == 0 && !(e->ip.flags & IPT_F_FRAG) &&
+	       rule_prefix(e, false, &addr, &len) &&
+	       rule_prefix(e, true, &addr, &len) &&
+	       e->ip.iniface_mask[8] == 0 && e->ip.outiface_mask[8] == 0;
+}
+
+/* The fields both rules test, and test the same way */
+static unsigned int
+header_same_fields(const STRUCT_ENTRY *a, const STRUCT_ENTRY *b)
+{
+	const struct ipt_ip *x = &a->ip, *y = &b->ip;
+	unsigned int inv = x->invflags ^ y->invflags, fields = 0;
+
+	if ((x->smsk.s_addr || (x->invflags & IPT_INV_SRCIP)) &&
+	    x->src.s_addr == y->src.s_addr &&
+	    x->smsk.s_addr == y->smsk.s_addr && !(inv & IPT_INV_SRCIP))
+		fields |= IPTCC_H_SRC;
+	if ((x->dmsk.s_addr || (x->invflags & IPT_INV_DSTIP)) &&
+	    x->dst.s_addr == y->dst.s_addr &&
+	    x->dmsk.s_addr == y->dmsk.s_addr && !(inv & IPT_INV_DSTIP))
+		fields |= IPTCC_H_DST;
+	if ((x->iniface[0] || (x->invflags & IPT_INV_VIA_IN)) &&
+	    memcmp(x->iniface, y->iniface, sizeof(x->iniface)) == 0 &&
+	    memcmp(x->iniface_mask, y->iniface_mask,
+		   sizeof(x->iniface_mask)) == 0 && !(inv & IPT_INV_VIA_IN))
+		fields |= IPTCC_H_IN;
+	if ((x->outiface[0] || (x->invflags & IPT_INV_VIA_OUT)) &&
+	    memcmp(x->outiface, y->outiface, sizeof(x->outiface)) == 0 &&
+	    memcmp(x->outiface_mask, y->outiface_mask,
+		   sizeof(x->outiface_mask)) == 0 && !(inv & IPT_INV_VIA_OUT))
+		fields |= IPTCC_H_OUT;
+	if ((x->proto || (x->invflags & IPT_INV_PROTO)) &&
+	    x->proto == y->proto && !(inv & IPT_INV_PROTO))
+		fields |= IPTCC_H_PROTO;
+	if ((x->flags & IPT_F_FRAG) && (y->flags & IPT_F_FRAG) &&
+	    !(inv & IPT_INV_FRAG))
+		fields |= IPTCC_H_FRAG;
+	return fields;
+}
+
+/* Copy `fields' of the header of `from' to `to' (if not NULL), and take
+ * them out of `from'.  The protocol stays, the matches may need it. */
+static void
+header_move(STRUCT_ENTRY *to, STRUCT_ENTRY *from, unsigned int fields)
+{
+	struct ipt_ip *x = &from->ip, *y = to != NULL ? &to->ip : NULL;
+
+	if (fields & IPTCC_H_SRC) {
+		if (y != NULL) {
+			y->src = x->src;
+			y->smsk = x->smsk;
+			y->invflags |= x->invflags & IPT_INV_SRCIP;
+		}
+		x->src.s_addr = x->smsk.s_addr = 0;
+		x->invflags &= ~IPT_INV_SRCIP;
+	}
+	if (fields & IPTCC_H_DST) {
+		if (y != NULL) {
+			y->dst = x->dst;
+			y->dmsk = x->dmsk;
+			y->invflags |= x->invflags & IPT_INV_DSTIP;
+		}
+		x->dst.s_addr = x->dmsk.s_addr = 0;
+		x->invflags &= ~IPT_INV_DSTIP;
+	}
+	if (fields & IPTCC_H_IN) {
+		if (y != NULL) {
+			memcpy(y->iniface, x->iniface, sizeof(y->iniface));
+			memcpy(y->iniface_mask, x->iniface_mask,
+			       sizeof(y->iniface_mask));
+			y->invflags |= x->invflags & IPT_INV_VIA_IN;
+		}
+		memset(x->iniface, 0, sizeof(x->iniface));
+		memset(x->iniface_mask, 0, sizeof(x->iniface_mask));
+		x->invflags &= ~IPT_INV_VIA_IN;
+	}
+	if (fields & IPTCC_H_OUT) {
+		if (y != NULL) {
+			memcpy(y->outiface, x->outiface, sizeof(y->outiface));
+			memcpy(y->outiface_mask, x->outiface_mask,
+			       sizeof(y->outiface_mask));
+			y->invflags |= x->invflags & IPT_INV_VIA_OUT;
+		}
+		memset(x->outiface, 0, sizeof(x->outiface));
+		memset(x->outiface_mask, 0, sizeof(x->outiface_mask));
+		x->invflags &= ~IPT_INV_VIA_OUT;
+	}
+	if ((fields & IPTCC_H_PROTO) && y != NULL) {
+		y->proto = x->proto;
+		y->invflags |= x->invflags & IPT_INV_PROTO;
+	}
+	if (fields & IPTCC_H_FRAG) {
+		if (y != NULL) {
+			y->flags |= IPT_F_FRAG;
+			y->invflags |= x->invflags & IPT_INV_FRAG;
+		}
+		x->flags &= ~IPT_F_FRAG;
+		x->invflags &= ~IPT_INV_FRAG;
+	}
+}
+
+#define FWINV(bool, invflg) ((bool) ^ !!(ip->invflags & (invflg)))
+
+/* Same test as ip_packet_match() in the kernel */
+static int
+packet_header_match(const STRUCT_ENTRY *r, const STRUCT_ENTRY *e,
+		    const struct xtc_packet *p)
+{
+	const struct ipt_ip *ip = &r->ip;
+
+	if (FWINV((e->ip.src.s_addr & ip->smsk.s_addr) != ip->src.s_addr,
+		  IPT_INV_SRCIP)
+	    || FWINV((e->ip.dst.s_addr & ip->dmsk.s_addr) != ip->dst.s_addr,
+		     IPT_INV_DSTIP))
+		return 0;
+
+	if (FWINV(!iptcc_iface_match(e->ip.iniface, ip->iniface,
+				     ip->iniface_mask), IPT_INV_VIA_IN)
+	    || FWINV(!iptcc_iface_match(e->ip.outiface, ip->outiface,
+					ip->outiface_mask), IPT_INV_VIA_OUT))
+		return 0;
+
+	if (ip->proto && FWINV(e->ip.proto != ip->proto, IPT_INV_PROTO))
+		return 0;
+
+	if (FWINV((ip->flags & IPT_F_FRAG) && !p->fragment, IPT_INV_FRAG))
+		return 0;
+
+	return 1;
+}
+
+#undef FWINV
+
 #if 0
 /***************************** DEBUGGING ********************************/
 static inline int
@@ -44,9 +44,11 @@ typedef unsigned int socklen_t;
 #define STRUCT_COUNTERS_INFO	struct ip6t_counters_info
 #define STRUCT_STANDARD_TARGET	struct ip6t_standard_target
 #define STRUCT_REPLACE		struct ip6t_replace
+#define STRUCT_ICMP		struct ip6t_icmp
 
 #define STRUCT_TC_HANDLE	struct ip6tc_handle
 #define xtc_handle		ip6tc_handle
+#define xtc_snapshot		ip6tc_snapshot
 
 #define ENTRY_ITERATE		IP6T_ENTRY_ITERATE
 #define TABLE_MAXNAMELEN	IP6T_TABLE_MAXNAMELEN
@@ -86,9 +88,26 @@ typedef unsigned int socklen_t;
 #define TC_SET_POLICY		ip6tc_set_policy
 #define TC_GET_RAW_SOCKET	ip6tc_get_raw_socket
 #define TC_INIT			ip6tc_init
+#define TC_INIT_OFFLINE		ip6tc_init_offline
 #define TC_FREE			ip6tc_free
 #define TC_COMMIT		ip6tc_commit
 #define TC_STRERROR		ip6tc_strerror
+#define TC_SNAPSHOT		ip6tc_snapshot
+#define TC_SNAPSHOT_FREE	ip6tc_snapshot_free
+#define TC_SNAPSHOT_TABLE	ip6tc_snapshot_table
+#define TC_SNAPSHOT_SAVE	ip6tc_snapshot_save
+#define TC_SNAPSHOT_LOAD	ip6tc_snapshot_load
+#define TC_ROLLBACK		ip6tc_rollback
+#define TC_CHECK_PACKET		ip6tc_check_packet
+#define TC_TRACE_PACKET		ip6tc_trace_packet
+#define TC_REGISTER_MATCH_EVAL	ip6tc_register_match_eval
+#define TC_BUILD_CLASSIFIER	ip6tc_build_classifier
+#define TC_REORDER_CHAIN	ip6tc_reorder_chain
+#define TC_BISECT_CHAIN		ip6tc_bisect_chain
+#define TC_FACTOR_CHAIN		ip6tc_factor_chain
+#define TC_ANALYZE_CHAIN	ip6tc_analyze_chain
+#define TC_COMPACT_CHAIN	ip6tc_compact_chain
+#define TC_MULTIPORT_CHAIN	ip6tc_multiport_chain
 #define TC_NUM_RULES		ip6tc_num_rules
 #define TC_GET_RULE		ip6tc_get_rule
 
@@ -109,6 +128,14 @@ typedef unsigned int socklen_t;
 
 #define ALIGN			XT_ALIGN
 #define RETURN			IP6T_RETURN
+#define ICMP_INV		IP6T_ICMP_INV
+
+/* Classifier fields: both halves of source and destination, protocol,
+ * in and out interface */
+#define IPTCC_DT_DIMS		7
+#define IPTCC_ADDR_BITS		128
+#define IPTCC_ADDR_WORDS	2
+#define ENTRY_GOTO(e)		((e)->ipv6.flags & IP6T_F_GOTO)
 
 #include "libiptc.c"
 
@@ -246,6 +273,279 @@ is_same(const STRUCT_ENTRY *a, const STRUCT_ENTRY *b,
 	return mptr;
 }
 
+static void
+packet_fill(struct xtc_packet *p, const STRUCT_ENTRY *e)
+{
+	p->family = NFPROTO_IPV6;
+	p->src.in6 = e->ipv6.src;
+	p->dst.in6 = e->ipv6.dst;
+}
+
+static int
+masked_addr_differ(const struct in6_addr *a, const struct in6_addr *mask,
+		   const struct in6_addr *b)
+{
+	unsigned int i;
+
+	for (i = 0; i < 16; i++)
+		if ((a->s6_addr[i] & mask->s6_addr[i]) != b->s6_addr[i])
+			return 1;
+	return 0;
+}
+
+static uint64_t addr_half(const struct in6_addr *a, unsigned int half)
+{
+	uint64_t v = 0;
+	unsigned int i;
+
+	for (i = 8 * half; i < 8 * half + 8; i++)
+		v = v << 8 | a->s6_addr[i];
+	return v;
+}
+
+static void
+packet_keys(const STRUCT_ENTRY *e, uint64_t *key)
+{
+	key[0] = addr_half(&e->ipv6.src, 0);
+	key[1] = addr_half(&e->ipv6.src, 1);
+	key[2] = addr_half(&e->ipv6.dst, 0);
+	key[3] = addr_half(&e->ipv6.dst, 1);
+	key[4] = e->ipv6.proto;
+	key[5] = iptcc_iface_key(e->ipv6.iniface);
+	key[6] = iptcc_iface_key(e->ipv6.outiface);
+}
+
+static void
+rule_box(const STRUCT_ENTRY *r, uint64_t *lo, uint64_t *hi)
+{
+	const struct ip6t_ip6 *ip = &r->ipv6;
+	unsigned int i;
+
+	for (i = 0; i < 2; i++) {
+		iptcc_mask_range(addr_half(&ip->src, i),
+				 addr_half(&ip->smsk, i), ~(uint64_t)0,
+				 ip->invflags & IP6T_INV_SRCIP,
+				 &lo[i], &hi[i]);
+		iptcc_mask_range(addr_half(&ip->dst, i),
+				 addr_half(&ip->dmsk, i), ~(uint64_t)0,
+				 ip->invflags & IP6T_INV_DSTIP,
+				 &lo[2 + i], &hi[2 + i]);
+	}
+	if (!(ip->flags & IP6T_F_PROTO) || ip->proto == 0 ||
+	    (ip->invflags & IP6T_INV_PROTO)) {
+		lo[4] = 0;
+		hi[4] = ~(uint64_t)0;
+	} else {
+		lo[4] = hi[4] = ip->proto;
+	}
+	iptcc_iface_range(ip->iniface, ip->iniface_mask,
+			  ip->invflags & IP6T_INV_VIA_IN, &lo[5], &hi[5]);
+	iptcc_iface_range(ip->outiface, ip->outiface_mask,
+			  ip->invflags & IP6T_INV_VIA_OUT, &lo[6], &hi[6]);
+}
+
+/* The source (or destination) of a rule as a prefix; false if it is
+ * inverted or the mask isn't one. */
+static bool
+rule_prefix(const STRUCT_ENTRY *e, bool dst, union nf_inet_addr *addr,
+	    unsigned int *len)
+{
+	const struct in6_addr *mask = dst ? &e->ipv6.dmsk : &e->ipv6.smsk;
+	unsigned int i;
+
+	if (e->ipv6.invflags & (dst ? IP6T_INV_DSTIP : IP6T_INV_SRCIP))
+		return false;
+	for (i = 0; i < 128 && (mask->s6_addr[i / 8] & (0x80 >> i % 8)); i++)
+		;
+	*len = i;
+	for (; i < 128; i++)
+		if (mask->s6_addr[i / 8] & (0x80 >> i % 8))
+			return false;
+	addr->in6 = dst ? e->ipv6.dst : e->ipv6.src;
+	return true;
+}
+
+static void
+entry_set_prefix(STRUCT_ENTRY *e, bool dst, const union nf_inet_addr *addr,
+		 unsigned int len, bool inv)
+{
+	struct in6_addr *a = dst ? &e->ipv6.dst : &e->ipv6.src;
+	struct in6_addr *mask = dst ? &e->ipv6.dmsk : &e->ipv6.smsk;
+	unsigned int i;
+
+	memset(mask, 0, sizeof(*mask));
+	for (i = 0; i < len; i++)
+		mask->s6_addr[i / 8] |= 0x80 >> i % 8;
+	for (i = 0; i < 16; i++)
+		a->s6_addr[i] = addr->in6.s6_addr[i] & mask->s6_addr[i];
+	e->ipv6.invflags &= ~(dst ? IP6T_INV_DSTIP : IP6T_INV_SRCIP);
+	if (inv)
+		e->ipv6.invflags |= dst ? IP6T_INV_DSTIP : IP6T_INV_SRCIP;
+}
+
+/* Whether the headers of two rules differ in the source (destination)
+ * only */
+static bool
+header_same_but_prefix(const STRUCT_ENTRY *a, const STRUCT_ENTRY *b,
+		       bool dst)
+{
+	struct ip6t_ip6 x = a->ipv6, y = b->ipv6;
+
+	if (dst) {
+		memset(&x.dst, 0, sizeof(x.dst));
+		memset(&x.dmsk, 0, sizeof(x.dmsk));
+		memset(&y.dst, 0, sizeof(y.dst));
+		memset(&y.dmsk, 0, sizeof(y.dmsk));
+	} else {
+		memset(&x.src, 0, sizeof(x.src));
+		memset(&x.smsk, 0, sizeof(x.smsk));
+		memset(&y.src, 0, sizeof(y.src));
+		memset(&y.smsk, 0, sizeof(y.smsk));
+	}
+	return memcmp(&x, &y, sizeof(x)) == 0;
+}
+
+/* Whether rule_box() is all the header of a rule tests: nothing
+ * inverted, prefixes for the addresses, and interface names that fit
+ * the keys */
+static bool
+header_exact(const STRUCT_ENTRY *e)
+{
+	union nf_inet_addr addr;
+	unsigned int len;
+
+	return e->ipv6.invflags == 0 && !(e->ipv6.flags & IP6T_F_TOS) &&
+	       rule_prefix(e, false, &addr, &len) &&
+	       rule_prefix(e, true, &addr, &len) &&
+	       e->ipv6.iniface_mask[8] == 0 && e->ipv6.outiface_mask[8] == 0;
+}
+
+/* The fields both rules test, and test the same way */
+static unsigned int
+header_same_fields(const STRUCT_ENTRY *a, const STRUCT_ENTRY *b)
+{
+	const struct ip6t_ip6 *x = &a->ipv6, *y = &b->ipv6;
+	unsigned int inv = x->invflags ^ y->invflags, fields = 0;
+
+	if ((!IN6_IS_ADDR_UNSPECIFIED(&x->smsk) ||
+	     (x->invflags & IP6T_INV_SRCIP)) &&
+	    memcmp(&x->src, &y->src, sizeof(x->src)) == 0 &&
+	    memcmp(&x->smsk, &y->smsk, sizeof(x->smsk)) == 0 &&
+	    !(inv & IP6T_INV_SRCIP))
+		fields |= IPTCC_H_SRC;
+	if ((!IN6_IS_ADDR_UNSPECIFIED(&x->dmsk) ||
+	     (x->invflags & IP6T_INV_DSTIP)) &&
+	    memcmp(&x->dst, &y->dst, sizeof(x->dst)) == 0 &&
+	    memcmp(&x->dmsk, &y->dmsk, sizeof(x->dmsk)) == 0 &&
+	    !(inv & IP6T_INV_DSTIP))
+		fields |= IPTCC_H_DST;
+	if ((x->iniface[0] || (x->invflags & IP6T_INV_VIA_IN)) &&
+	    memcmp(x->iniface, y->iniface, sizeof(x->iniface)) == 0 &&
+	    memcmp(x->iniface_mask, y->iniface_mask,
+		   sizeof(x->iniface_mask)) == 0 && !(inv & IP6T_INV_VIA_IN))
+		fields |= IPTCC_H_IN;
+	if ((x->outiface[0] || (x->invflags & IP6T_INV_VIA_OUT)) &&
+	    memcmp(x->outiface, y->outiface, sizeof(x->outiface)) == 0 &&
+	    memcmp(x->outiface_mask, y->outiface_mask,
+		   sizeof(x->outiface_mask)) == 0 && !(inv & IP6T_INV_VIA_OUT))
+		fields |= IPTCC_H_OUT;
+	if ((x->flags & IP6T_F_PROTO) && (y->flags & IP6T_F_PROTO) &&
+	    x->proto == y->proto && !(inv & IP6T_INV_PROTO))
+		fields |= IPTCC_H_PROTO;
+	return fields;
+}
+
+/* Copy `fields' of the header of `from' to `to' (if not NULL), and take
+ * them out of `from'.  The protocol stays, the matches may need it. */
+static void
+header_move(STRUCT_ENTRY *to, STRUCT_ENTRY *from, unsigned int fields)
+{
+	struct ip6t_ip6 *x = &from->ipv6, *y = to != NULL ? &to->ipv6 : NULL;
+
+	if (fields & IPTCC_H_SRC) {
+		if (y != NULL) {
+			y->src = x->src;
+			y->smsk = x->smsk;
+			y->invflags |= x->invflags & IP6T_INV_SRCIP;
+		}
+		memset(&x->src, 0, sizeof(x->src));
+		memset(&x->smsk, 0, sizeof(x->smsk));
+		x->invflags &= ~IP6T_INV_SRCIP;
+	}
+	if (fields & IPTCC_H_DST) {
+		if (y != NULL) {
+			y->dst = x->dst;
+			y->dmsk = x->dmsk;
+			y->invflags |= x->invflags & IP6T_INV_DSTIP;
+		}
+		memset(&x->dst, 0, sizeof(x->dst));
+		memset(&x->dmsk, 0, sizeof(x->dmsk));
+		x->invflags &= ~IP6T_INV_DSTIP;
+	}
+	if (fields & IPTCC_H_IN) {
+		if (y != NULL) {
+			memcpy(y->iniface, x->iniface, sizeof(y->iniface));
+			memcpy(y->iniface_mask, x->iniface_mask,
+			       sizeof(y->iniface_mask));
+			y->invflags |= x->invflags & IP6T_INV_VIA_IN;
+		}
+		memset(x->iniface, 0, sizeof(x->iniface));
+		memset(x->iniface_mask, 0, sizeof(x->iniface_mask));
+		x->invflags &= ~IP6T_INV_VIA_IN;
+	}
+	if (fields & IPTCC_H_OUT) {
+		if (y != NULL) {
+			memcpy(y->outiface, x->outiface, sizeof(y->outiface));
+			memcpy(y->outiface_mask, x->outiface_mask,
+			       sizeof(y->outiface_mask));
+			y->invflags |= x->invflags & IP6T_INV_VIA_OUT;
+		}
+		memset(x->outiface, 0, sizeof(x->outiface));
+		memset(x->outiface_mask, 0, sizeof(x->outiface_mask));
+		x->invflags &= ~IP6T_INV_VIA_OUT;
+	}
+	if ((fields & IPTCC_H_PROTO) && y != NULL) {
+		y->proto = x->proto;
+		y->flags |= IP6T_F_PROTO;
+		y->invflags |= x->invflags & IP6T_INV_PROTO;
+	}
+}
+
+#define FWINV(bool, invflg) ((bool) ^ !!(ip->invflags & (invflg)))
+
+/* Same test as ip6_packet_match() in the kernel; the protocol of the
+ * entry is taken to be the last header, extension headers skipped. */
+static int
+packet_header_match(const STRUCT_ENTRY *r, const STRUCT_ENTRY *e,
+		    const struct xtc_packet *p)
+{
+	const struct ip6t_ip6 *ip = &r->ipv6;
+
+	if (FWINV(masked_addr_differ(&e->ipv6.src, &ip->smsk, &ip->src),
+		  IP6T_INV_SRCIP)
+	    || FWINV(masked_addr_differ(&e->ipv6.dst, &ip->dmsk, &ip->dst),
+		     IP6T_INV_DSTIP))
+		return 0;
+
+	if (FWINV(!iptcc_iface_match(e->ipv6.iniface, ip->iniface,
+				     ip->iniface_mask), IP6T_INV_VIA_IN)
+	    || FWINV(!iptcc_iface_match(e->ipv6.outiface, ip->outiface,
+					ip->outiface_mask), IP6T_INV_VIA_OUT))
+		return 0;
+
+	if (ip->flags & IP6T_F_PROTO) {
+		if (e->ipv6.proto == ip->proto)
+			return !(ip->invflags & IP6T_INV_PROTO);
+		/* -p all matches, too */
+		if (ip->proto != 0 && !(ip->invflags & IP6T_INV_PROTO))
+			return 0;
+	}
+
+	return 1;
+}
+
+#undef FWINV
+
 /* All zeroes == unconditional rule. */
 static inline int
 unconditional(const struct ip6t_ip6 *ipv6)
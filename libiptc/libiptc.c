@@ -32,7 +32,13 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <xtables.h>
+#include <linux/netfilter/xt_iprange.h>
+#include <linux/netfilter/xt_length.h>
+#include <linux/netfilter/xt_mark.h>
+#include <linux/netfilter/xt_multiport.h>
+#include <linux/netfilter/xt_tcpudp.h>
 
 #include "linux_list.h"
 
@@ -75,6 +81,7 @@ struct ipt_error_target
 
 struct chain_head;
 struct rule_head;
+struct iptcc_dtree;
 
 struct counter_map
 {
@@ -128,6 +135,8 @@ struct chain_head
 	unsigned int head_offset;	/* offset in rule blob */
 	unsigned int foot_index;	/* index (needed for counter_map) */
 	unsigned int foot_offset;	/* offset in rule blob */
+
+	struct iptcc_dtree *dtree;	/* see TC_BUILD_CLASSIFIER */
 };
 
 STRUCT_TC_HANDLE
@@ -152,6 +161,8 @@ STRUCT_TC_HANDLE
 
 	STRUCT_GETINFO info;
 	STRUCT_GET_ENTRIES *entries;
+
+	unsigned int num_dtrees;	/* chains with a decision tree */
 };
 
 enum bsearch_type {
@@ -188,11 +199,15 @@ static struct rule_head *iptcc_alloc_rule(struct chain_head *c, unsigned int siz
 	return r;
 }
 
+static void iptcc_dtree_drop(struct xtc_handle *h);
+
 /* notify us that the ruleset has been modified by the user */
 static inline void
 set_changed(struct xtc_handle *h)
 {
 	h->changed = 1;
+	if (h->num_dtrees != 0)
+		iptcc_dtree_drop(h);
 }
 
 #ifdef IPTC_DEBUG
@@ -1378,6 +1393,88 @@ error:
 	return NULL;
 }
 
+/* Built-in chains of the standard tables, for TC_INIT_OFFLINE */
+static const struct {
+	const char *name;
+	unsigned int hooks;
+} iptcc_offline_tables[] = {
+	{"filter",   1 << HOOK_LOCAL_IN | 1 << HOOK_FORWARD |
+		     1 << HOOK_LOCAL_OUT},
+	{"mangle",   1 << HOOK_PRE_ROUTING | 1 << HOOK_LOCAL_IN |
+		     1 << HOOK_FORWARD | 1 << HOOK_LOCAL_OUT |
+		     1 << HOOK_POST_ROUTING},
+	{"nat",      1 << HOOK_PRE_ROUTING | 1 << HOOK_LOCAL_IN |
+		     1 << HOOK_LOCAL_OUT | 1 << HOOK_POST_ROUTING},
+	{"raw",      1 << HOOK_PRE_ROUTING | 1 << HOOK_LOCAL_OUT},
+	{"security", 1 << HOOK_LOCAL_IN | 1 << HOOK_FORWARD |
+		     1 << HOOK_LOCAL_OUT},
+};
+
+/* An empty table as the kernel would hand it out, without asking the
+ * kernel: for working on rulesets offline.  Such a handle can't be
+ * committed. */
+struct xtc_handle *
+TC_INIT_OFFLINE(const char *tablename)
+{
+	struct iptcb_chain_error *error;
+	struct iptcb_chain_foot *foot;
+	unsigned int i, hooks = 0, num = 0, size;
+	struct xtc_handle *h;
+
+	iptc_fn = TC_INIT_OFFLINE;
+
+	for (i = 0; i < ARRAY_SIZE(iptcc_offline_tables); i++)
+		if (strcmp(tablename, iptcc_offline_tables[i].name) == 0)
+			hooks = iptcc_offline_tables[i].hooks;
+	if (hooks == 0) {
+		errno = ENOENT;
+		return NULL;
+	}
+	for (i = 0; i < NUMHOOKS; i++)
+		if (hooks & (1 << i))
+			num++;
+
+	size = num * IPTCB_CHAIN_FOOT_SIZE + IPTCB_CHAIN_ERROR_SIZE;
+	if ((h = alloc_handle(tablename, size, num + 1)) == NULL)
+		return NULL;
+	h->sockfd = -1;
+	h->info.valid_hooks = hooks;
+	h->info.num_entries = num + 1;
+	h->info.size = size;
+	memset(h->entries->entrytable, 0, size);
+
+	size = 0;
+	for (i = 0; i < NUMHOOKS; i++) {
+		if (!(hooks & (1 << i)))
+			continue;
+		h->info.hook_entry[i] = h->info.underflow[i] = size;
+		foot = (void *)h->entries->entrytable + size;
+		foot->e.target_offset = sizeof(STRUCT_ENTRY);
+		foot->e.next_offset = IPTCB_CHAIN_FOOT_SIZE;
+		strcpy(foot->target.target.u.user.name, STANDARD_TARGET);
+		foot->target.target.u.target_size =
+			ALIGN(sizeof(STRUCT_STANDARD_TARGET));
+		foot->target.verdict = -NF_ACCEPT - 1;
+		size += IPTCB_CHAIN_FOOT_SIZE;
+	}
+
+	error = (void *)h->entries->entrytable + size;
+	error->entry.target_offset = sizeof(STRUCT_ENTRY);
+	error->entry.next_offset = IPTCB_CHAIN_ERROR_SIZE;
+	error->target.t.u.user.target_size =
+		ALIGN(sizeof(struct ipt_error_target));
+	strcpy((char *)&error->target.t.u.user.name, ERROR_TARGET);
+	strcpy((char *)&error->target.error, "ERROR");
+
+	if (parse_table(h) < 0) {
+		TC_FREE(h);
+		return NULL;
+	}
+
+	CHECK(h);
+	return h;
+}
+
 void
 TC_FREE(struct xtc_handle *h)
 {
@@ -1385,6 +1482,7 @@ TC_FREE(struct xtc_handle *h)
 
 	iptc_fn = TC_FREE;
 	close(h->sockfd);
+	iptcc_dtree_drop(h);
 
 	list_for_each_entry_safe(c, tmp, &h->chains, list) {
 		struct rule_head *r, *rtmp;
@@ -2086,214 +2184,3403 @@ TC_DELETE_NUM_ENTRY(const IPT_CHAINLABEL chain,
 	return 1;
 }
 
-/* Flushes the entries in the given chain (ie. empties chain). */
-int
-TC_FLUSH_ENTRIES(const IPT_CHAINLABEL chain, struct xtc_handle *handle)
-{
-	struct chain_head *c;
-	struct rule_head *r, *tmp;
+/**********************************************************************
+ * Userspace packet evaluation
+ *
+ * The layer 3 header and the interfaces of a packet are given as an
+ * entry, as for TC_CHECK_ENTRY; everything else as struct xtc_packet.
+ * Rules are walked the way the kernel does (jumps, RETURN, policies),
+ * with the matches evaluated by the xtc_match_eval registered for them.
+ **********************************************************************/
 
-	iptc_fn = TC_FLUSH_ENTRIES;
-	if (!(c = iptcc_find_label(chain, handle))) {
-		errno = ENOENT;
-		return 0;
-	}
+static void packet_fill(struct xtc_packet *p, const STRUCT_ENTRY *e);
+static int packet_header_match(const STRUCT_ENTRY *r, const STRUCT_ENTRY *e,
+			       const struct xtc_packet *p);
+static void packet_keys(const STRUCT_ENTRY *e, uint64_t *key);
+static void rule_box(const STRUCT_ENTRY *r, uint64_t *lo, uint64_t *hi);
+static bool rule_prefix(const STRUCT_ENTRY *e, bool dst,
+			union nf_inet_addr *addr, unsigned int *len);
+static void entry_set_prefix(STRUCT_ENTRY *e, bool dst,
+			     const union nf_inet_addr *addr, unsigned int len,
+			     bool inv);
+static bool header_same_but_prefix(const STRUCT_ENTRY *a,
+				   const STRUCT_ENTRY *b, bool dst);
+
+/* Fields of the layer 3 header of a rule, see header_same_fields() */
+enum {
+	IPTCC_H_SRC	= 1 << 0,
+	IPTCC_H_DST	= 1 << 1,
+	IPTCC_H_IN	= 1 << 2,
+	IPTCC_H_OUT	= 1 << 3,
+	IPTCC_H_PROTO	= 1 << 4,
+	IPTCC_H_FRAG	= 1 << 5,
+};
 
-	list_for_each_entry_safe(r, tmp, &c->rules, list) {
-		iptcc_delete_rule(r);
-	}
+static unsigned int header_same_fields(const STRUCT_ENTRY *a,
+				       const STRUCT_ENTRY *b);
+static void header_move(STRUCT_ENTRY *to, STRUCT_ENTRY *from,
+			unsigned int fields);
+static bool header_exact(const STRUCT_ENTRY *e);
 
-	c->num_rules = 0;
+/* Jumps deeper than this are taken to be a loop. */
+#define IPTCC_EVAL_MAXDEPTH	64
 
-	set_changed(handle);
+static int
+iptcc_iface_match(const char *dev, const char *iface,
+		  const unsigned char *mask)
+{
+	char name[IFNAMSIZ] = "";
+	unsigned int i;
 
+	for (i = 0; i < IFNAMSIZ - 1 && dev[i] != '\0'; i++)
+		name[i] = dev[i];
+	for (i = 0; i < IFNAMSIZ; i++)
+		if ((name[i] ^ iface[i]) & mask[i])
+			return 0;
 	return 1;
 }
 
-/* Zeroes the counters in a chain. */
-int
-TC_ZERO_ENTRIES(const IPT_CHAINLABEL chain, struct xtc_handle *handle)
+/* Decision tree key of an interface name: its first 8 bytes */
+static uint64_t iptcc_iface_key(const char *dev)
 {
-	struct chain_head *c;
-	struct rule_head *r;
+	uint64_t key = 0;
+	unsigned int i;
+	bool end = false;
 
-	iptc_fn = TC_ZERO_ENTRIES;
-	if (!(c = iptcc_find_label(chain, handle))) {
-		errno = ENOENT;
-		return 0;
+	for (i = 0; i < 8; i++) {
+		if (dev[i] == '\0')
+			end = true;
+		key = key << 8 | (end ? 0 : (unsigned char)dev[i]);
 	}
+	return key;
+}
 
-	if (c->counter_map.maptype == COUNTER_MAP_NORMAL_MAP)
-		c->counter_map.maptype = COUNTER_MAP_ZEROED;
+/* Keys of all names a rule's interface and mask can match */
+static void
+iptcc_iface_range(const char *iface, const unsigned char *mask, bool inv,
+		  uint64_t *lo, uint64_t *hi)
+{
+	unsigned int i;
 
-	list_for_each_entry(r, &c->rules, list) {
-		if (r->counter_map.maptype == COUNTER_MAP_NORMAL_MAP)
-			r->counter_map.maptype = COUNTER_MAP_ZEROED;
+	*lo = 0;
+	*hi = ~(uint64_t)0;
+	if (inv)
+		return;
+	for (i = 0; i < 8 && mask[i] == 0xff; i++) {
+		*lo |= (uint64_t)(unsigned char)iface[i] << (56 - 8 * i);
+		*hi &= ~((uint64_t)(unsigned char)~iface[i] << (56 - 8 * i));
 	}
+}
 
-	set_changed(handle);
+/* Range of the values of an address word that can match under a mask */
+static void
+iptcc_mask_range(uint64_t addr, uint64_t mask, uint64_t full, bool inv,
+		 uint64_t *lo, uint64_t *hi)
+{
+	uint64_t prefix = 0, bit;
 
-	return 1;
+	if (inv) {
+		*lo = 0;
+		*hi = ~(uint64_t)0;
+		return;
+	}
+	/* the leading ones of the mask give a range of all matches */
+	for (bit = (full >> 1) + 1; bit != 0 && (mask & bit); bit >>= 1)
+		prefix |= bit;
+	*lo = addr & prefix;
+	*hi = *lo | (~prefix & full);
+	/* no prefix: any key, as for the other fields */
+	if (prefix == 0)
+		*hi = ~(uint64_t)0;
 }
 
-STRUCT_COUNTERS *
-TC_READ_COUNTER(const IPT_CHAINLABEL chain,
-		unsigned int rulenum,
-		struct xtc_handle *handle)
+static inline bool
+iptcc_port_match(const __u16 *range, __u16 port, bool invert)
 {
-	struct chain_head *c;
-	struct rule_head *r;
-
-	iptc_fn = TC_READ_COUNTER;
-	CHECK(*handle);
+	return (port >= range[0] && port <= range[1]) ^ invert;
+}
 
-	if (!(c = iptcc_find_label(chain, handle))) {
-		errno = ENOENT;
-		return NULL;
+static enum xtc_eval_result
+eval_tcp(const struct xt_entry_match *m, const struct xtc_packet *p)
+{
+	const struct xt_tcp *info = (const void *)m->data;
+
+	if (p->fragment)
+		return XTC_EVAL_NOMATCH;
+	if (!(p->valid & XTC_PKT_PORTS))
+		return XTC_EVAL_INDETERMINATE;
+	if (!iptcc_port_match(info->spts, p->sport,
+			      info->invflags & XT_TCP_INV_SRCPT) ||
+	    !iptcc_port_match(info->dpts, p->dport,
+			      info->invflags & XT_TCP_INV_DSTPT))
+		return XTC_EVAL_NOMATCH;
+	if (info->flg_mask != 0) {
+		if (!(p->valid & XTC_PKT_TCPFLAGS))
+			return XTC_EVAL_INDETERMINATE;
+		if (((p->tcp_flags & info->flg_mask) == info->flg_cmp) ==
+		    !!(info->invflags & XT_TCP_INV_FLAGS))
+			return XTC_EVAL_NOMATCH;
 	}
+	/* --tcp-option needs the whole header */
+	return info->option ? XTC_EVAL_INDETERMINATE : XTC_EVAL_MATCH;
+}
 
-	if (!(r = iptcc_get_rule_num(c, rulenum))) {
-		errno = E2BIG;
-		return NULL;
-	}
+static enum xtc_eval_result
+eval_udp(const struct xt_entry_match *m, const struct xtc_packet *p)
+{
+	const struct xt_udp *info = (const void *)m->data;
+
+	if (p->fragment)
+		return XTC_EVAL_NOMATCH;
+	if (!(p->valid & XTC_PKT_PORTS))
+		return XTC_EVAL_INDETERMINATE;
+	if (!iptcc_port_match(info->spts, p->sport,
+			      info->invflags & XT_UDP_INV_SRCPT) ||
+	    !iptcc_port_match(info->dpts, p->dport,
+			      info->invflags & XT_UDP_INV_DSTPT))
+		return XTC_EVAL_NOMATCH;
+	return XTC_EVAL_MATCH;
+}
 
-	return &r->entry[0].counters;
+static enum xtc_eval_result
+eval_icmp(const struct xt_entry_match *m, const struct xtc_packet *p)
+{
+	const STRUCT_ICMP *info = (const void *)m->data;
+	bool match;
+
+	if (p->fragment)
+		return XTC_EVAL_NOMATCH;
+	if (!(p->valid & XTC_PKT_ICMP))
+		return XTC_EVAL_INDETERMINATE;
+	match = info->type == 0xFF ||
+		(p->icmp_type == info->type &&
+		 p->icmp_code >= info->code[0] &&
+		 p->icmp_code <= info->code[1]);
+	return match ^ !!(info->invflags & ICMP_INV);
 }
 
-int
-TC_ZERO_COUNTER(const IPT_CHAINLABEL chain,
-		unsigned int rulenum,
-		struct xtc_handle *handle)
+static bool
+multiport_match(__u8 flags, __u16 min, __u16 max, const struct xtc_packet *p)
 {
-	struct chain_head *c;
-	struct rule_head *r;
+	bool src = p->sport >= min && p->sport <= max;
+	bool dst = p->dport >= min && p->dport <= max;
+
+	switch (flags) {
+	case XT_MULTIPORT_SOURCE:
+		return src;
+	case XT_MULTIPORT_DESTINATION:
+		return dst;
+	default:
+		return src || dst;
+	}
+}
 
-	iptc_fn = TC_ZERO_COUNTER;
-	CHECK(handle);
+static enum xtc_eval_result
+eval_multiport(const struct xt_entry_match *m, const struct xtc_packet *p)
+{
+	const struct xt_multiport *info = (const void *)m->data;
+	unsigned int i;
 
-	if (!(c = iptcc_find_label(chain, handle))) {
-		errno = ENOENT;
-		return 0;
+	if (p->fragment)
+		return XTC_EVAL_NOMATCH;
+	if (!(p->valid & XTC_PKT_PORTS))
+		return XTC_EVAL_INDETERMINATE;
+	for (i = 0; i < info->count && i < XT_MULTI_PORTS; i++)
+		if (multiport_match(info->flags, info->ports[i],
+				    info->ports[i], p))
+			return XTC_EVAL_MATCH;
+	return XTC_EVAL_NOMATCH;
+}
+
+static enum xtc_eval_result
+eval_multiport_v1(const struct xt_entry_match *m, const struct xtc_packet *p)
+{
+	const struct xt_multiport_v1 *info = (const void *)m->data;
+	unsigned int i;
+	__u16 min, max;
+
+	if (p->fragment)
+		return XTC_EVAL_NOMATCH;
+	if (!(p->valid & XTC_PKT_PORTS))
+		return XTC_EVAL_INDETERMINATE;
+	for (i = 0; i < info->count && i < XT_MULTI_PORTS; i++) {
+		min = max = info->ports[i];
+		if (info->pflags[i] && i + 1 < XT_MULTI_PORTS)
+			max = info->ports[++i];
+		if (multiport_match(info->flags, min, max, p))
+			return info->invert ? XTC_EVAL_NOMATCH : XTC_EVAL_MATCH;
 	}
+	return info->invert ? XTC_EVAL_MATCH : XTC_EVAL_NOMATCH;
+}
 
-	if (!(r = iptcc_get_rule_num(c, rulenum))) {
-		errno = E2BIG;
+static int
+inet_addr_cmp(__u8 family, const union nf_inet_addr *a,
+	      const union nf_inet_addr *b)
+{
+	if (family == NFPROTO_IPV4) {
+		if (ntohl(a->ip) != ntohl(b->ip))
+			return ntohl(a->ip) < ntohl(b->ip) ? -1 : 1;
 		return 0;
 	}
+	return memcmp(&a->in6, &b->in6, sizeof(a->in6));
+}
 
-	if (r->counter_map.maptype == COUNTER_MAP_NORMAL_MAP)
-		r->counter_map.maptype = COUNTER_MAP_ZEROED;
+static enum xtc_eval_result
+eval_iprange(const struct xt_entry_match *m, const struct xtc_packet *p)
+{
+	const struct xt_iprange_mtinfo *info = (const void *)m->data;
+	bool out;
+
+	if (info->flags & IPRANGE_SRC) {
+		out = inet_addr_cmp(p->family, &p->src, &info->src_min) < 0 ||
+		      inet_addr_cmp(p->family, &p->src, &info->src_max) > 0;
+		if (out ^ !!(info->flags & IPRANGE_SRC_INV))
+			return XTC_EVAL_NOMATCH;
+	}
+	if (info->flags & IPRANGE_DST) {
+		out = inet_addr_cmp(p->family, &p->dst, &info->dst_min) < 0 ||
+		      inet_addr_cmp(p->family, &p->dst, &info->dst_max) > 0;
+		if (out ^ !!(info->flags & IPRANGE_DST_INV))
+			return XTC_EVAL_NOMATCH;
+	}
+	return XTC_EVAL_MATCH;
+}
 
-	set_changed(handle);
+static enum xtc_eval_result
+eval_mark(const struct xt_entry_match *m, const struct xtc_packet *p)
+{
+	const struct xt_mark_mtinfo1 *info = (const void *)m->data;
 
-	return 1;
+	if (!(p->valid & XTC_PKT_MARK))
+		return XTC_EVAL_INDETERMINATE;
+	return ((p->mark & info->mask) == info->mark) ^ !!info->invert;
 }
 
-int
-TC_SET_COUNTER(const IPT_CHAINLABEL chain,
-	       unsigned int rulenum,
-	       STRUCT_COUNTERS *counters,
-	       struct xtc_handle *handle)
+static enum xtc_eval_result
+eval_comment(const struct xt_entry_match *m, const struct xtc_packet *p)
 {
-	struct chain_head *c;
-	struct rule_head *r;
-	STRUCT_ENTRY *e;
+	return XTC_EVAL_MATCH;
+}
 
-	iptc_fn = TC_SET_COUNTER;
-	CHECK(handle);
+static enum xtc_eval_result
+eval_length(const struct xt_entry_match *m, const struct xtc_packet *p)
+{
+	const struct xt_length_info *info = (const void *)m->data;
 
-	if (!(c = iptcc_find_label(chain, handle))) {
-		errno = ENOENT;
-		return 0;
-	}
+	if (!(p->valid & XTC_PKT_LENGTH))
+		return XTC_EVAL_INDETERMINATE;
+	return (p->length >= info->min && p->length <= info->max) ^
+	       !!info->invert;
+}
 
-	if (!(r = iptcc_get_rule_num(c, rulenum))) {
-		errno = E2BIG;
-		return 0;
-	}
+static struct xtc_match_eval iptcc_match_evals[] = {
+	{.name = "tcp",       .revision = 0, .eval = eval_tcp},
+	{.name = "udp",       .revision = 0, .eval = eval_udp},
+	{.name = "icmp",      .revision = 0, .family = NFPROTO_IPV4,
+	 .eval = eval_icmp},
+	{.name = "icmp6",     .revision = 0, .family = NFPROTO_IPV6,
+	 .eval = eval_icmp},
+	{.name = "multiport", .revision = 0, .eval = eval_multiport},
+	{.name = "multiport", .revision = 1, .eval = eval_multiport_v1},
+	{.name = "iprange",   .revision = 1, .eval = eval_iprange},
+	{.name = "mark",      .revision = 1, .eval = eval_mark},
+	{.name = "comment",   .revision = 0, .eval = eval_comment},
+	{.name = "length",    .revision = 0, .eval = eval_length},
+};
 
-	e = r->entry;
-	r->counter_map.maptype = COUNTER_MAP_SET;
+static struct xtc_match_eval *iptcc_match_eval_list;
 
-	memcpy(&e->counters, counters, sizeof(STRUCT_COUNTERS));
+/* Register a match evaluator; later ones override earlier and built-in
+ * ones for the same name and revision. */
+void TC_REGISTER_MATCH_EVAL(struct xtc_match_eval *me)
+{
+	me->next = iptcc_match_eval_list;
+	iptcc_match_eval_list = me;
+}
 
-	set_changed(handle);
+static const struct xtc_match_eval *
+iptcc_find_match_eval(const struct xt_entry_match *m)
+{
+	const struct xtc_match_eval *me;
+	unsigned int i;
 
-	return 1;
+	for (me = iptcc_match_eval_list; me != NULL; me = me->next)
+		if ((me->family == NFPROTO_UNSPEC || me->family == TC_AF) &&
+		    me->revision == m->u.user.revision &&
+		    strcmp(me->name, m->u.user.name) == 0)
+			return me;
+	for (i = 0; i < ARRAY_SIZE(iptcc_match_evals); i++) {
+		me = &iptcc_match_evals[i];
+		if ((me->family == NFPROTO_UNSPEC || me->family == TC_AF) &&
+		    me->revision == m->u.user.revision &&
+		    strcmp(me->name, m->u.user.name) == 0)
+			return me;
+	}
+	return NULL;
 }
 
-/* Creates a new chain. */
-/* To create a chain, create two rules: error node and unconditional
- * return. */
-int
-TC_CREATE_CHAIN(const IPT_CHAINLABEL chain, struct xtc_handle *handle)
+/* A rule matches if all of its matches do, and doesn't if any does not;
+ * otherwise it is indeterminate. */
+static enum xtc_eval_result
+iptcc_eval_rule(const struct rule_head *r, const STRUCT_ENTRY *e,
+		const struct xtc_packet *p)
 {
-	static struct chain_head *c;
-	int capacity;
-	int exceeded;
+	enum xtc_eval_result res = XTC_EVAL_MATCH, mres;
+	const struct xtc_match_eval *me;
+	const STRUCT_ENTRY_MATCH *m;
+	unsigned int off;
+
+	if (!packet_header_match(r->entry, e, p))
+		return XTC_EVAL_NOMATCH;
+
+	for (off = sizeof(STRUCT_ENTRY); off < r->entry->target_offset;
+	     off += m->u.match_size) {
+		m = (const void *)((const char *)r->entry + off);
+		if (m->u.match_size < sizeof(*m))
+			return XTC_EVAL_INDETERMINATE;
+		me = iptcc_find_match_eval(m);
+		mres = me != NULL ? me->eval(m, p) : XTC_EVAL_INDETERMINATE;
+		if (mres == XTC_EVAL_NOMATCH)
+			return XTC_EVAL_NOMATCH;
+		if (mres == XTC_EVAL_INDETERMINATE)
+			res = XTC_EVAL_INDETERMINATE;
+	}
+	return res;
+}
 
-	iptc_fn = TC_CREATE_CHAIN;
+/* Targets that let the packet go on to the next rule; the ones that
+ * change what the evaluated matches see are handled in iptcc_eval_chain. */
+static const char *const iptcc_continue_targets[] = {
+	"AUDIT", "CHECKSUM", "CLASSIFY", "CLUSTERIP", "CONNMARK",
+	"CONNSECMARK", "CT", "DSCP", "ECN", "HL", "IDLETIMER", "LED", "LOG",
+	"MARK", "MPLS", "NFLOG", "NOTRACK", "RATEEST", "SECMARK", "SET",
+	"TCPMSS", "TCPOPTSTRIP", "TEE", "TOS", "TRACE", "TTL", "ULOG",
+};
 
-	/* find_label doesn't cover built-in targets: DROP, ACCEPT,
-           QUEUE, RETURN. */
-	if (iptcc_find_label(chain, handle)
-	    || strcmp(chain, LABEL_DROP) == 0
-	    || strcmp(chain, LABEL_ACCEPT) == 0
-	    || strcmp(chain, LABEL_QUEUE) == 0
-	    || strcmp(chain, LABEL_RETURN) == 0) {
-		DEBUGP("Chain `%s' already exists\n", chain);
-		errno = EEXIST;
-		return 0;
-	}
+/* Targets that end the traversal; their name is the verdict.  Anything
+ * in neither list may do either, and makes the verdict indeterminate. */
+static const char *const iptcc_final_targets[] = {
+	"DNAT", "MASQUERADE", "MIRROR", "NETMAP", "NFQUEUE", "REDIRECT",
+	"REJECT", "SAME", "SNAT", "TPROXY",
+};
 
-	if (strlen(chain)+1 > sizeof(IPT_CHAINLABEL)) {
-		DEBUGP("Chain name `%s' too long\n", chain);
-		errno = EINVAL;
-		return 0;
-	}
+static bool
+iptcc_target_in(const char *name, const char *const *list, unsigned int n)
+{
+	unsigned int i;
 
-	c = iptcc_alloc_chain_head(chain, 0);
-	if (!c) {
-		DEBUGP("Cannot allocate memory for chain `%s'\n", chain);
-		errno = ENOMEM;
-		return 0;
+	for (i = 0; i < n; i++)
+		if (strcmp(name, list[i]) == 0)
+			return true;
+	return false;
+}
+
+#define iptcc_is_continue_target(name) \
+	iptcc_target_in((name), iptcc_continue_targets, \
+			ARRAY_SIZE(iptcc_continue_targets))
+#define iptcc_is_final_target(name) \
+	iptcc_target_in((name), iptcc_final_targets, \
+			ARRAY_SIZE(iptcc_final_targets))
 
+/* Apply a non-terminating target to what we know of the packet. */
+static void
+iptcc_eval_target(const STRUCT_ENTRY_TARGET *t, enum xtc_eval_result res,
+		  struct xtc_packet *p)
+{
+	const struct xt_mark_tginfo2 *info = (const void *)t->data;
+
+	if (strcmp(t->u.user.name, "MARK") == 0) {
+		if (res == XTC_EVAL_MATCH && t->u.user.revision == 2 &&
+		    info->mask == ~0U) {
+			p->mark = info->mark;
+			p->valid |= XTC_PKT_MARK;
+		} else if (res == XTC_EVAL_MATCH && t->u.user.revision == 2) {
+			p->mark = (p->mark & ~info->mask) ^ info->mark;
+		} else {
+			p->valid &= ~XTC_PKT_MARK;
+		}
+	} else if (strcmp(t->u.user.name, "CONNMARK") == 0) {
+		/* --restore-mark: the conntrack entry is unknown */
+		p->valid &= ~XTC_PKT_MARK;
 	}
-	handle->num_chains++; /* New user defined chain */
+}
 
-	DEBUGP("Creating chain `%s'\n", chain);
-	iptc_insert_chain(handle, c); /* Insert sorted */
+/*
+ * Decision tree over the header fields of a chain (HyperSplit): every
+ * field is a 64-bit key, every rule a box of key ranges.  Inner nodes
+ * split one field at a point; each leaf lists, in chain order, the rules
+ * whose box overlaps it.  Rules outside the leaf can't match the packet,
+ * so walking the leaf gives the same first match as walking the chain.
+ *
+ * A rule that doesn't care about the field split on ends up in both
+ * halves, so rules are first grouped by the fields they do test, and
+ * each group gets a tree of its own.  The leaves of all trees are then
+ * merged by rule number.
+ */
 
-	/* Inserting chains don't change the correctness of the chain
-	 * index (except if its smaller than index[0], but that
-	 * handled by iptc_insert_chain).  It only causes longer lists
-	 * in the buckets. Thus, only rebuild chain index when the
-	 * capacity is exceed with CHAIN_INDEX_INSERT_MAX chains.
-	 */
-	capacity = handle->chain_index_sz * CHAIN_INDEX_BUCKET_LEN;
-	exceeded = handle->num_chains - capacity;
-	if (exceeded > CHAIN_INDEX_INSERT_MAX) {
-		debug("Capacity(%d) exceeded(%d) rebuild (chains:%d)\n",
-		      capacity, exceeded, handle->num_chains);
-		iptcc_chain_index_rebuild(handle);
-	}
+/* Leaves hold at most this many rules, unless splitting doesn't help */
+#define IPTCC_DT_LEAF		8
+#define IPTCC_DT_MAXDEPTH	48
+/* Give up splitting when rules get copied into too many leaves */
+#define IPTCC_DT_MAXCOPIES	16
+/* Rules testing other fields than the biggest groups share the last one */
+#define IPTCC_DT_GROUPS		8
+
+struct iptcc_dt_node {
+	uint64_t point;			/* go left if key <= point */
+	unsigned int dim;		/* IPTCC_DT_DIMS for a leaf */
+	unsigned int left, right;	/* children, or leaf range in rules */
+};
 
-	set_changed(handle);
+struct iptcc_dtree {
+	struct iptcc_dt_node *nodes;
+	unsigned int num_nodes, max_nodes;
+	struct rule_head **rules;	/* rules of all leaves */
+	unsigned int *nums;		/* their positions in the chain */
+	unsigned int num_rules, max_rules;
+	unsigned int num_roots;
+	unsigned int roots[IPTCC_DT_GROUPS];
+};
 
-	return 1;
+struct iptcc_dt_rule {
+	struct rule_head *r;
+	unsigned int num;
+	unsigned int fields;		/* bit set for each field tested */
+	uint64_t lo[IPTCC_DT_DIMS], hi[IPTCC_DT_DIMS];
+};
+
+struct iptcc_dt_build {
+	struct iptcc_dtree *t;
+	struct iptcc_dt_rule *rules;
+	unsigned int max_copies;
+	uint64_t *points;		/* scratch for choosing splits */
+};
+
+static void iptcc_dtree_free(struct iptcc_dtree *t)
+{
+	if (t == NULL)
+		return;
+	free(t->nodes);
+	free(t->rules);
+	free(t->nums);
+	free(t);
 }
 
-/* Get the number of references to this chain. */
-int
-TC_GET_REFERENCES(unsigned int *ref, const IPT_CHAINLABEL chain,
-		  struct xtc_handle *handle)
+static void iptcc_dtree_drop(struct xtc_handle *h)
 {
 	struct chain_head *c;
 
-	iptc_fn = TC_GET_REFERENCES;
-	if (!(c = iptcc_find_label(chain, handle))) {
-		errno = ENOENT;
-		return 0;
+	list_for_each_entry(c, &h->chains, list) {
+		iptcc_dtree_free(c->dtree);
+		c->dtree = NULL;
+	}
+	h->num_dtrees = 0;
+}
+
+static int iptcc_dt_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int iptcc_dt_new_node(struct iptcc_dtree *t)
+{
+	struct iptcc_dt_node *n;
+
+	if (t->num_nodes == t->max_nodes) {
+		t->max_nodes = t->max_nodes ? 2 * t->max_nodes : 64;
+		n = realloc(t->nodes, t->max_nodes * sizeof(*n));
+		if (n == NULL)
+			return -1;
+		t->nodes = n;
+	}
+	return t->num_nodes++;
+}
+
+static int
+iptcc_dt_leaf(struct iptcc_dt_build *b, unsigned int node,
+	      const unsigned int *idx, unsigned int n)
+{
+	struct iptcc_dtree *t = b->t;
+	struct rule_head **r;
+	unsigned int i, *nums;
+
+	if (t->num_rules + n > t->max_rules) {
+		t->max_rules = 2 * (t->num_rules + n);
+		r = realloc(t->rules, t->max_rules * sizeof(*r));
+		if (r == NULL)
+			return -1;
+		t->rules = r;
+		nums = realloc(t->nums, t->max_rules * sizeof(*nums));
+		if (nums == NULL)
+			return -1;
+		t->nums = nums;
+	}
+	t->nodes[node].dim = IPTCC_DT_DIMS;
+	t->nodes[node].left = t->num_rules;
+	t->nodes[node].right = t->num_rules + n;
+	for (i = 0; i < n; i++) {
+		t->rules[t->num_rules] = b->rules[idx[i]].r;
+		t->nums[t->num_rules++] = b->rules[idx[i]].num;
+	}
+	return 0;
+}
+
+/* For every field, try the range end in the middle of those inside the
+ * node as split point; keep the one that leaves the fewest rules in the
+ * bigger half. */
+static bool
+iptcc_dt_split(struct iptcc_dt_build *b, const uint64_t *lo,
+	       const uint64_t *hi, const unsigned int *idx, unsigned int n,
+	       unsigned int *dim, uint64_t *point)
+{
+	const struct iptcc_dt_rule *dr;
+	unsigned int d, i, k, nl, nr, m, best = n, best_sum = 2 * n;
+	uint64_t v;
+
+	for (d = 0; d < IPTCC_DT_DIMS; d++) {
+		k = 0;
+		for (i = 0; i < n; i++) {
+			dr = &b->rules[idx[i]];
+			/* a range [l, h] ends a segment at l - 1 and at h */
+			if (dr->lo[d] > lo[d])
+				b->points[k++] = dr->lo[d] - 1;
+			if (dr->hi[d] < hi[d])
+				b->points[k++] = dr->hi[d];
+		}
+		if (k == 0)
+			continue;
+		qsort(b->points, k, sizeof(*b->points), iptcc_dt_cmp);
+		v = b->points[k / 2];
+
+		nl = nr = 0;
+		for (i = 0; i < n; i++) {
+			dr = &b->rules[idx[i]];
+			nl += dr->lo[d] <= v;
+			nr += dr->hi[d] > v;
+		}
+		m = nl > nr ? nl : nr;
+		if (m > best || (m == best && nl + nr >= best_sum))
+			continue;
+		best = m;
+		best_sum = nl + nr;
+		*dim = d;
+		*point = v;
+	}
+	return *dim != IPTCC_DT_DIMS;
+}
+
+static int
+iptcc_dt_build(struct iptcc_dt_build *b, uint64_t *lo, uint64_t *hi,
+	       unsigned int *idx, unsigned int n, unsigned int depth)
+{
+	unsigned int dim = IPTCC_DT_DIMS, nl = 0, nr = 0, i;
+	unsigned int *left, *right;
+	uint64_t point = 0, save;
+	int node, child, ret = -1;
+
+	node = iptcc_dt_new_node(b->t);
+	if (node < 0)
+		return -1;
+
+	if (n <= IPTCC_DT_LEAF || depth >= IPTCC_DT_MAXDEPTH ||
+	    b->t->num_rules + 2 * n > b->max_copies ||
+	    !iptcc_dt_split(b, lo, hi, idx, n, &dim, &point))
+		return iptcc_dt_leaf(b, node, idx, n) < 0 ? -1 : node;
+
+	left = malloc(2 * n * sizeof(*left));
+	if (left == NULL)
+		return -1;
+	right = left + n;
+	for (i = 0; i < n; i++) {
+		if (b->rules[idx[i]].lo[dim] <= point)
+			left[nl++] = idx[i];
+		if (b->rules[idx[i]].hi[dim] > point)
+			right[nr++] = idx[i];
+	}
+	if (nl == n && nr == n) {
+		ret = iptcc_dt_leaf(b, node, idx, n) < 0 ? -1 : node;
+		goto out;
+	}
+
+	b->t->nodes[node].dim = dim;
+	b->t->nodes[node].point = point;
+
+	save = hi[dim];
+	hi[dim] = point;
+	child = iptcc_dt_build(b, lo, hi, left, nl, depth + 1);
+	hi[dim] = save;
+	if (child < 0)
+		goto out;
+	b->t->nodes[node].left = child;
+
+	save = lo[dim];
+	lo[dim] = point + 1;
+	child = iptcc_dt_build(b, lo, hi, right, nr, depth + 1);
+	lo[dim] = save;
+	if (child < 0)
+		goto out;
+	b->t->nodes[node].right = child;
+	ret = node;
+out:
+	free(left);
+	return ret;
+}
+
+struct iptcc_dt_group {
+	unsigned int fields, count;
+};
+
+static int iptcc_dt_group_cmp(const void *a, const void *b)
+{
+	const struct iptcc_dt_group *x = a, *y = b;
+
+	return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static struct iptcc_dtree *iptcc_dtree_build(struct chain_head *c)
+{
+	uint64_t lo[IPTCC_DT_DIMS], hi[IPTCC_DT_DIMS];
+	struct iptcc_dt_group *groups = NULL;
+	struct iptcc_dt_build b = {};
+	struct rule_head *r;
+	unsigned int i, d, g, k, n = 0, num_groups = 0, *idx = NULL;
+	int root;
+
+	b.t = calloc(1, sizeof(*b.t));
+	b.rules = malloc(c->num_rules * sizeof(*b.rules));
+	b.points = malloc(2 * c->num_rules * sizeof(*b.points));
+	idx = malloc(c->num_rules * sizeof(*idx));
+	groups = malloc(c->num_rules * sizeof(*groups));
+	if (b.t == NULL || b.rules == NULL || b.points == NULL ||
+	    idx == NULL || groups == NULL)
+		goto error;
+
+	list_for_each_entry(r, &c->rules, list) {
+		b.rules[n].r = r;
+		b.rules[n].num = n + 1;
+		rule_box(r->entry, b.rules[n].lo, b.rules[n].hi);
+		b.rules[n].fields = 0;
+		for (d = 0; d < IPTCC_DT_DIMS; d++)
+			if (b.rules[n].lo[d] != 0 ||
+			    b.rules[n].hi[d] != ~(uint64_t)0)
+				b.rules[n].fields |= 1 << d;
+		for (g = 0; g < num_groups; g++)
+			if (groups[g].fields == b.rules[n].fields)
+				break;
+		if (g == num_groups) {
+			groups[num_groups].fields = b.rules[n].fields;
+			groups[num_groups++].count = 0;
+		}
+		groups[g].count++;
+		n++;
+	}
+	qsort(groups, num_groups, sizeof(*groups), iptcc_dt_group_cmp);
+	if (num_groups > IPTCC_DT_GROUPS)
+		num_groups = IPTCC_DT_GROUPS;
+
+	for (g = 0; g < num_groups; g++) {
+		/* pick the rules of the group, in chain order */
+		for (i = 0, k = 0; i < n; i++) {
+			for (d = 0; d < g; d++)
+				if (b.rules[i].fields == groups[d].fields)
+					break;
+			if (d < g)
+				continue;
+			if (g < num_groups - 1 &&
+			    b.rules[i].fields != groups[g].fields)
+				continue;
+			idx[k++] = i;
+		}
+
+		for (d = 0; d < IPTCC_DT_DIMS; d++) {
+			lo[d] = 0;
+			hi[d] = ~(uint64_t)0;
+		}
+		b.max_copies = b.t->num_rules + IPTCC_DT_MAXCOPIES * k;
+		root = iptcc_dt_build(&b, lo, hi, idx, k, 0);
+		if (root < 0)
+			goto error;
+		b.t->roots[b.t->num_roots++] = root;
+	}
+
+	free(b.rules);
+	free(b.points);
+	free(idx);
+	free(groups);
+	return b.t;
+error:
+	iptcc_dtree_free(b.t);
+	free(b.rules);
+	free(b.points);
+	free(idx);
+	free(groups);
+	errno = ENOMEM;
+	return NULL;
+}
+
+static const struct iptcc_dt_node *
+iptcc_dtree_lookup(const struct iptcc_dtree *t, unsigned int root,
+		   const uint64_t *key)
+{
+	const struct iptcc_dt_node *n = &t->nodes[root];
+
+	while (n->dim != IPTCC_DT_DIMS)
+		n = &t->nodes[key[n->dim] <= n->point ? n->left : n->right];
+	return n;
+}
+
+/* Build decision trees for all chains long enough to benefit; they are
+ * used by TC_TRACE_PACKET until the handle is changed. */
+int TC_BUILD_CLASSIFIER(struct xtc_handle *handle)
+{
+	struct chain_head *c;
+
+	iptc_fn = TC_BUILD_CLASSIFIER;
+
+	iptcc_dtree_drop(handle);
+	list_for_each_entry(c, &handle->chains, list) {
+		if (c->num_rules <= 2 * IPTCC_DT_LEAF)
+			continue;
+		c->dtree = iptcc_dtree_build(c);
+		if (c->dtree == NULL) {
+			iptcc_dtree_drop(handle);
+			return 0;
+		}
+		handle->num_dtrees++;
+	}
+	return 1;
+}
+
+struct iptcc_eval {
+	const STRUCT_ENTRY *entry;
+	struct xtc_packet *pkt;
+	xtc_trace_fn trace;
+	void *data;
+	uint64_t key[IPTCC_DT_DIMS];
+	const char *verdict;
+};
+
+enum {
+	IPTCC_EVAL_ERROR = -1,
+	IPTCC_EVAL_NEXT,
+	IPTCC_EVAL_VERDICT,
+	IPTCC_EVAL_RETURN,
+};
+
+static int iptcc_eval_chain(struct iptcc_eval *ev, struct chain_head *c,
+			    unsigned int depth);
+
+/* Rule `num' of chain `c' */
+static int
+iptcc_eval_step(struct iptcc_eval *ev, struct chain_head *c,
+		struct rule_head *r, unsigned int num, unsigned int depth)
+{
+	enum xtc_eval_result res;
+	const STRUCT_ENTRY_TARGET *t;
+	int ret, v;
+
+	res = iptcc_eval_rule(r, ev->entry, ev->pkt);
+	if (ev->trace != NULL)
+		ev->trace(c->name, num, res, ev->data);
+	if (res == XTC_EVAL_NOMATCH || r->type == IPTCC_R_FALLTHROUGH)
+		return IPTCC_EVAL_NEXT;
+
+	t = GET_TARGET(r->entry);
+	if (r->type == IPTCC_R_MODULE &&
+	    iptcc_is_continue_target(t->u.user.name)) {
+		iptcc_eval_target(t, res, ev->pkt);
+		return IPTCC_EVAL_NEXT;
+	}
+	if (res == XTC_EVAL_INDETERMINATE) {
+		ev->verdict = XTC_LABEL_INDETERMINATE;
+		return IPTCC_EVAL_VERDICT;
+	}
+
+	switch (r->type) {
+	case IPTCC_R_JUMP:
+		ret = iptcc_eval_chain(ev, r->jump, depth + 1);
+		/* A goto leaves no way back to `c': when the chain gone to
+		 * returns, so does `c', to its caller or to the policy. */
+		if (ENTRY_GOTO(r->entry))
+			return ret;
+		return ret == IPTCC_EVAL_RETURN ? IPTCC_EVAL_NEXT : ret;
+	case IPTCC_R_STANDARD:
+		v = *(const int *)t->data;
+		if (v == RETURN)
+			return IPTCC_EVAL_RETURN;
+		ev->verdict = standard_target_map(v);
+		return IPTCC_EVAL_VERDICT;
+	default:
+		if (iptcc_is_final_target(t->u.user.name))
+			ev->verdict = t->u.user.name;
+		else
+			ev->verdict = XTC_LABEL_INDETERMINATE;
+		return IPTCC_EVAL_VERDICT;
+	}
+}
+
+static int
+iptcc_eval_chain(struct iptcc_eval *ev, struct chain_head *c,
+		 unsigned int depth)
+{
+	unsigned int cur[IPTCC_DT_GROUPS], end[IPTCC_DT_GROUPS];
+	const struct iptcc_dt_node *leaf;
+	const struct iptcc_dtree *t = c->dtree;
+	struct rule_head *r;
+	unsigned int num = 0, g, i, best;
+	int ret;
+
+	if (depth > IPTCC_EVAL_MAXDEPTH) {
+		errno = ELOOP;
+		return IPTCC_EVAL_ERROR;
+	}
+
+	if (t != NULL) {
+		for (g = 0; g < t->num_roots; g++) {
+			leaf = iptcc_dtree_lookup(t, t->roots[g], ev->key);
+			cur[g] = leaf->left;
+			end[g] = leaf->right;
+		}
+		/* merge the leaves back into chain order */
+		for (;;) {
+			best = t->num_roots;
+			for (g = 0; g < t->num_roots; g++)
+				if (cur[g] < end[g] &&
+				    (best == t->num_roots ||
+				     t->nums[cur[g]] < t->nums[cur[best]]))
+					best = g;
+			if (best == t->num_roots)
+				return IPTCC_EVAL_RETURN;
+			i = cur[best]++;
+			ret = iptcc_eval_step(ev, c, t->rules[i], t->nums[i],
+					      depth);
+			if (ret != IPTCC_EVAL_NEXT)
+				return ret;
+		}
+	}
+
+	list_for_each_entry(r, &c->rules, list) {
+		ret = iptcc_eval_step(ev, c, r, ++num, depth);
+		if (ret != IPTCC_EVAL_NEXT)
+			return ret;
+	}
+	return IPTCC_EVAL_RETURN;
+}
+
+/* Walk `chain' for a packet with the header in `entry' and the rest in
+ * `pkt', reporting every rule compared to `trace'.  Rules that a
+ * classifier (TC_BUILD_CLASSIFIER) rules out are not compared. */
+const char *
+TC_TRACE_PACKET(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *entry,
+		const struct xtc_packet *pkt, xtc_trace_fn trace, void *data,
+		struct xtc_handle *handle)
+{
+	struct iptcc_eval ev;
+	struct xtc_packet p;
+	struct chain_head *c;
+
+	iptc_fn = TC_TRACE_PACKET;
+
+	if (!(c = iptcc_find_label(chain, handle))) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	if (pkt != NULL)
+		p = *pkt;
+	else
+		memset(&p, 0, sizeof(p));
+	packet_fill(&p, entry);
+
+	ev.entry = entry;
+	ev.pkt = &p;
+	ev.trace = trace;
+	ev.data = data;
+	if (handle->num_dtrees != 0)
+		packet_keys(entry, ev.key);
+
+	switch (iptcc_eval_chain(&ev, c, 0)) {
+	case IPTCC_EVAL_ERROR:
+		return NULL;
+	case IPTCC_EVAL_VERDICT:
+		return ev.verdict;
+	}
+	if (!iptcc_is_builtin(c))
+		return LABEL_RETURN;
+	if (trace != NULL)
+		trace(c->name, 0, XTC_EVAL_MATCH, data);
+	return standard_target_map(c->verdict);
+}
+
+/* Check the packet `entry' on chain `chain'; only the header of the
+ * entry is known, so matches on anything else are indeterminate. */
+const char *
+TC_CHECK_PACKET(const IPT_CHAINLABEL chain, STRUCT_ENTRY *entry,
+		struct xtc_handle *handle)
+{
+	const char *verdict;
+
+	verdict = TC_TRACE_PACKET(chain, entry, NULL, NULL, NULL, handle);
+	iptc_fn = TC_CHECK_PACKET;
+	return verdict;
+}
+
+/* Matches whose result depends on nothing but the packet; trying rules
+ * that only use these in another order can't change what they see. */
+static const char *const iptcc_stateless_matches[] = {
+	"addrtype", "ah", "comment", "conntrack", "dscp", "ecn", "esp",
+	"icmp", "icmp6", "iprange", "length", "mac", "mark", "multiport",
+	"physdev", "pkttype", "set", "state", "tcp", "tos", "ttl", "hl",
+	"udp",
+};
+
+static bool iptcc_rule_stateless(const struct rule_head *r)
+{
+	const STRUCT_ENTRY_MATCH *m;
+	unsigned int off, i;
+
+	for (off = sizeof(STRUCT_ENTRY); off < r->entry->target_offset;
+	     off += m->u.match_size) {
+		m = (const void *)((const char *)r->entry + off);
+		if (m->u.match_size < sizeof(*m))
+			return false;
+		for (i = 0; i < ARRAY_SIZE(iptcc_stateless_matches); i++)
+			if (strcmp(m->u.user.name,
+				   iptcc_stateless_matches[i]) == 0)
+				break;
+		if (i == ARRAY_SIZE(iptcc_stateless_matches))
+			return false;
+	}
+	return true;
+}
+
+struct iptcc_order_rule {
+	struct rule_head *r;
+	uint64_t hits;
+	unsigned int pos;		/* in the chain, from 1 */
+	bool stateless;
+	uint64_t lo[IPTCC_DT_DIMS], hi[IPTCC_DT_DIMS];
+};
+
+/* Whether the two rules may swap places: no packet can match both, or
+ * both end evaluation with the same verdict, whichever matches first. */
+static bool
+iptcc_rules_independent(const struct iptcc_order_rule *a,
+			const struct iptcc_order_rule *b)
+{
+	unsigned int d;
+
+	for (d = 0; d < IPTCC_DT_DIMS; d++)
+		if (a->hi[d] < b->lo[d] || b->hi[d] < a->lo[d])
+			return true;
+
+	return a->r->type == IPTCC_R_STANDARD &&
+	       b->r->type == IPTCC_R_STANDARD &&
+	       a->stateless && b->stateless &&
+	       *(const int *)GET_TARGET(a->r->entry)->data ==
+	       *(const int *)GET_TARGET(b->r->entry)->data;
+}
+
+/* Move the rules of `chain' that matched more packets ahead of those
+ * that matched fewer, as far as they may swap places.  Each rule keeps
+ * its counters; `stats' (may be NULL) tells how much it helped. */
+int TC_REORDER_CHAIN(const IPT_CHAINLABEL chain,
+		     struct xtc_reorder_stats *stats,
+		     struct xtc_handle *handle)
+{
+	struct iptcc_order_rule *rules, cur;
+	struct xtc_reorder_stats st = {};
+	struct chain_head *c;
+	struct rule_head *r;
+	unsigned int i, k, n = 0;
+
+	iptc_fn = TC_REORDER_CHAIN;
+
+	if (!(c = iptcc_find_label(chain, handle))) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	rules = malloc((c->num_rules + 1) * sizeof(*rules));
+	if (rules == NULL) {
+		errno = ENOMEM;
+		return 0;
+	}
+
+	/* insertion sort by hits, stopping at the first rule in the way */
+	list_for_each_entry(r, &c->rules, list) {
+		cur.r = r;
+		cur.hits = r->entry->counters.pcnt;
+		cur.pos = n + 1;
+		cur.stateless = iptcc_rule_stateless(r);
+		rule_box(r->entry, cur.lo, cur.hi);
+		for (k = n; k > 0 && rules[k - 1].hits < cur.hits &&
+		     iptcc_rules_independent(&rules[k - 1], &cur); k--)
+			rules[k] = rules[k - 1];
+		rules[k] = cur;
+		n++;
+	}
+
+	for (i = 0; i < n; i++) {
+		st.packets += rules[i].hits;
+		st.depth_before += rules[i].hits * rules[i].pos;
+		st.depth_after += rules[i].hits * (i + 1);
+		if (rules[i].pos != i + 1)
+			st.moved++;
+	}
+
+	if (st.moved != 0) {
+		for (i = 0; i < n; i++) {
+			list_del(&rules[i].r->list);
+			list_add_tail(&rules[i].r->list, &c->rules);
+		}
+		set_changed(handle);
+	}
+	free(rules);
+
+	if (stats != NULL)
+		*stats = st;
+	return 1;
+}
+
+/*
+ * Address bisection: a run of rules that differ in their source (or
+ * destination) prefix only is replaced by a jump into a tree of new
+ * chains.  Each chain of the tree jumps on the two halves of the
+ * longest prefix its rules share, so a packet takes a single path, to
+ * a leaf holding, in their old order, all the rules whose prefix
+ * contains it.  Rules it can't match are skipped; since the kernel
+ * checks the addresses before any match, nothing else changes.
+ */
+
+/* Leaves hold at most this many rules, unless they can't be split */
+#define IPTCC_BISECT_LEAF	8
+
+struct iptcc_bis_rule {
+	struct rule_head *r;
+	union nf_inet_addr addr;
+	unsigned int len;
+	bool placed;
+};
+
+struct iptcc_bisect {
+	struct xtc_handle *h;
+	const char *chain;		/* the one being rewritten */
+	bool dst;
+	struct iptcc_bis_rule *rules;
+	unsigned int serial;
+	struct chain_head **made;	/* chains of the current run */
+	unsigned int num_made, max_made;
+	struct xtc_bisect_stats *st;
+};
+
+static inline unsigned int
+iptcc_addr_bit(const union nf_inet_addr *a, unsigned int bit)
+{
+	return (ntohl(a->all[bit / 32]) >> (31 - bit % 32)) & 1;
+}
+
+/* `a' cut to `len' bits, followed by `bit' */
+static void
+iptcc_addr_half(union nf_inet_addr *half, const union nf_inet_addr *a,
+		unsigned int len, unsigned int bit)
+{
+	unsigned int i;
+
+	*half = *a;
+	for (i = len; i < IPTCC_ADDR_BITS; i++)
+		half->all[i / 32] &= htonl(~(1U << (31 - i % 32)));
+	if (bit)
+		half->all[len / 32] |= htonl(1U << (31 - len % 32));
+}
+
+/* New chain named after `chain', "<chain>-<tag><serial>" */
+static struct chain_head *
+iptcc_new_sub_chain(struct xtc_handle *h, const char *chain, char tag,
+		    unsigned int *serial)
+{
+	IPT_CHAINLABEL name;
+	char suffix[16];
+	int n;
+
+	/* as long as iptables allows for user chains */
+	do {
+		n = snprintf(suffix, sizeof(suffix), "-%c%u", tag, ++*serial);
+		snprintf(name, XT_EXTENSION_MAXNAMELEN, "%.*s%s",
+			 XT_EXTENSION_MAXNAMELEN - 1 - n, chain, suffix);
+	} while (iptcc_find_label(name, h) != NULL);
+
+	if (!TC_CREATE_CHAIN(name, h))
+		return NULL;
+	return iptcc_find_label(name, h);
+}
+
+/* New chain of the tree, named after the chain being rewritten */
+static struct chain_head *iptcc_bisect_new_chain(struct iptcc_bisect *b)
+{
+	struct chain_head *c, **made;
+	unsigned int max;
+
+	/* room to remember it first, so that an error can undo it */
+	if (b->num_made == b->max_made) {
+		max = b->max_made ? 2 * b->max_made : 16;
+		made = realloc(b->made, max * sizeof(*made));
+		if (made == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		b->made = made;
+		b->max_made = max;
+	}
+	c = iptcc_new_sub_chain(b->h, b->chain, 'b', &b->serial);
+	if (c != NULL) {
+		b->made[b->num_made++] = c;
+		b->st->chains++;
+	}
+	return c;
+}
+
+/* Jump to `to' for packets with (`inv': without) the prefix */
+static STRUCT_ENTRY *
+iptcc_bisect_jump(const struct iptcc_bisect *b, const struct chain_head *to,
+		  const union nf_inet_addr *addr, unsigned int len, bool inv)
+{
+	unsigned int size = sizeof(STRUCT_ENTRY) +
+			    ALIGN(sizeof(STRUCT_STANDARD_TARGET));
+	STRUCT_STANDARD_TARGET *t;
+	STRUCT_ENTRY *e;
+
+	e = calloc(1, size);
+	if (e == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	e->target_offset = sizeof(STRUCT_ENTRY);
+	e->next_offset = size;
+	entry_set_prefix(e, b->dst, addr, len, inv);
+	t = (STRUCT_STANDARD_TARGET *)GET_TARGET(e);
+	t->target.u.user.target_size = ALIGN(sizeof(STRUCT_STANDARD_TARGET));
+	strcpy(t->target.u.user.name, to->name);
+	return e;
+}
+
+static int
+iptcc_bisect_append_jump(struct iptcc_bisect *b, struct chain_head *from,
+			 const struct chain_head *to,
+			 const union nf_inet_addr *addr, unsigned int len,
+			 bool inv)
+{
+	STRUCT_ENTRY *e;
+	int ret;
+
+	e = iptcc_bisect_jump(b, to, addr, len, inv);
+	if (e == NULL)
+		return 0;
+	ret = TC_APPEND_ENTRY(from->name, e, b->h);
+	free(e);
+	return ret;
+}
+
+/* A copy of the entry of `r' that TC_APPEND_ENTRY() takes, with the
+ * target named again and without counters */
+static STRUCT_ENTRY *iptcc_copy_entry(const struct rule_head *r)
+{
+	STRUCT_ENTRY_TARGET *t;
+	STRUCT_ENTRY *e;
+
+	e = malloc(r->size);
+	if (e == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memcpy(e, r->entry, r->size);
+	memset(&e->counters, 0, sizeof(e->counters));
+	t = GET_TARGET(e);
+	if (r->type == IPTCC_R_STANDARD)
+		strcpy(t->u.user.name,
+		       standard_target_map(*(const int *)t->data));
+	else if (r->type == IPTCC_R_JUMP)
+		strcpy(t->u.user.name, r->jump->name);
+	return e;
+}
+
+/* Put the rules `idx' in `c'; the first copy of a rule is the rule
+ * itself, so that it keeps its counters. */
+static int
+iptcc_bisect_leaf(struct iptcc_bisect *b, struct chain_head *c,
+		  const unsigned int *idx, unsigned int n)
+{
+	struct iptcc_bis_rule *br;
+	STRUCT_ENTRY *e;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < n; i++) {
+		br = &b->rules[idx[i]];
+		if (!br->placed) {
+			br->r->chain = c;
+			list_add_tail(&br->r->list, &c->rules);
+			c->num_rules++;
+			br->placed = true;
+			continue;
+		}
+		e = iptcc_copy_entry(br->r);
+		if (e == NULL)
+			return 0;
+		ret = TC_APPEND_ENTRY(c->name, e, b->h);
+		free(e);
+		if (!ret)
+			return 0;
+		b->st->copies++;
+	}
+	set_changed(b->h);
+	return 1;
+}
+
+/* Fill `c', entered by the packets within `addr'/`plen', with the rules
+ * `idx', which all overlap that prefix.  Returns the most rules a packet
+ * can be compared against from `c' down, 0 on error. */
+static unsigned int
+iptcc_bisect_node(struct iptcc_bisect *b, struct chain_head *c,
+		  unsigned int plen, const unsigned int *idx, unsigned int n)
+{
+	const struct iptcc_bis_rule *first = NULL, *br;
+	unsigned int cp = IPTCC_ADDR_BITS, side, i, k, depth, max = 0;
+	union nf_inet_addr half;
+	struct chain_head *child;
+	unsigned int *sub;
+
+	/* the longest prefix shared by the rules longer than `plen' */
+	for (i = 0; i < n; i++) {
+		br = &b->rules[idx[i]];
+		if (br->len <= plen)
+			continue;
+		if (first == NULL)
+			first = br;
+		if (br->len < cp)
+			cp = br->len;
+		for (k = plen; k < cp; k++)
+			if (iptcc_addr_bit(&br->addr, k) !=
+			    iptcc_addr_bit(&first->addr, k))
+				break;
+		cp = k;
+	}
+	/* split only if some rules are longer than that */
+	for (i = 0; i < n; i++)
+		if (b->rules[idx[i]].len > cp)
+			break;
+	if (n <= IPTCC_BISECT_LEAF || i == n)
+		return iptcc_bisect_leaf(b, c, idx, n) ? n : 0;
+
+	sub = malloc(n * sizeof(*sub));
+	if (sub == NULL) {
+		errno = ENOMEM;
+		return 0;
+	}
+
+	/* the halves of first->addr/cp get the rules that overlap them */
+	for (side = 0; side < 2; side++) {
+		for (i = 0, k = 0; i < n; i++) {
+			br = &b->rules[idx[i]];
+			if (br->len <= cp ||
+			    iptcc_addr_bit(&br->addr, cp) == side)
+				sub[k++] = idx[i];
+		}
+		if (k == 0)
+			continue;
+		iptcc_addr_half(&half, &first->addr, cp, side);
+		child = iptcc_bisect_new_chain(b);
+		if (child == NULL ||
+		    !iptcc_bisect_append_jump(b, c, child, &half, cp + 1, false))
+			goto error;
+		depth = iptcc_bisect_node(b, child, cp + 1, sub, k);
+		if (depth == 0)
+			goto error;
+		if (c->num_rules + depth > max)
+			max = c->num_rules + depth;
+	}
+
+	/* the rules as short as `plen' also match outside first->addr/cp */
+	for (i = 0, k = 0; i < n; i++)
+		if (b->rules[idx[i]].len <= plen)
+			sub[k++] = idx[i];
+	if (k != 0 && cp > plen) {
+		child = iptcc_bisect_new_chain(b);
+		if (child == NULL ||
+		    !iptcc_bisect_append_jump(b, c, child, &first->addr, cp,
+					      true) ||
+		    !iptcc_bisect_leaf(b, child, sub, k))
+			goto error;
+		if (c->num_rules + k > max)
+			max = c->num_rules + k;
+	}
+	if (c->num_rules > max)
+		max = c->num_rules;
+
+	free(sub);
+	return max;
+error:
+	free(sub);
+	return 0;
+}
+
+/* Undo a run that failed: put its `n' rules back into `c', in order,
+ * after `prev', and delete the chains made for it with what they got */
+static void
+iptcc_bisect_undo(struct iptcc_bisect *b, struct chain_head *c,
+		  struct list_head *prev, unsigned int n)
+{
+	struct rule_head *r;
+	unsigned int i;
+	int err = errno;
+
+	for (i = 0; i < n; i++) {
+		r = b->rules[i].r;
+		if (b->rules[i].placed) {
+			list_del(&r->list);
+			r->chain->num_rules--;
+		}
+		r->chain = c;
+		list_add(&r->list, prev);
+		prev = &r->list;
+		c->num_rules++;
+	}
+	/* all emptied first, so that none is still jumped to */
+	for (i = 0; i < b->num_made; i++)
+		TC_FLUSH_ENTRIES(b->made[i]->name, b->h);
+	for (i = 0; i < b->num_made; i++)
+		TC_DELETE_CHAIN(b->made[i]->name, b->h);
+	b->num_made = 0;
+	errno = err;
+}
+
+/* Replace the `n' rules from `run' on, the first being rule `pos' of
+ * `c', with a jump into a tree.  On error, the chain is left as it
+ * was. */
+static int
+iptcc_bisect_run(struct iptcc_bisect *b, struct chain_head *c,
+		 struct rule_head *run, unsigned int pos, unsigned int n)
+{
+	struct list_head *prev = run->list.prev;
+	struct rule_head *r, *next;
+	struct chain_head *root;
+	union nf_inet_addr any = {};
+	unsigned int i, depth = 0, *idx;
+	STRUCT_ENTRY *e = NULL;
+
+	b->rules = calloc(n, sizeof(*b->rules));
+	idx = malloc(n * sizeof(*idx));
+	if (b->rules == NULL || idx == NULL) {
+		free(b->rules);
+		free(idx);
+		errno = ENOMEM;
+		return 0;
+	}
+
+	/* take the rules out of the chain, they go into the leaves */
+	for (i = 0, r = run; i < n; i++, r = next) {
+		next = list_entry(r->list.next, struct rule_head, list);
+		b->rules[i].r = r;
+		rule_prefix(r->entry, b->dst, &b->rules[i].addr,
+			    &b->rules[i].len);
+		idx[i] = i;
+		list_del(&r->list);
+		c->num_rules--;
+	}
+
+	b->num_made = 0;
+	root = iptcc_bisect_new_chain(b);
+	if (root != NULL) {
+		depth = iptcc_bisect_node(b, root, 0, idx, n);
+		e = iptcc_bisect_jump(b, root, &any, 0, false);
+	}
+	if (depth == 0 || e == NULL || !TC_INSERT_ENTRY(c->name, e, pos, b->h))
+		depth = 0;
+
+	if (depth == 0)
+		iptcc_bisect_undo(b, c, prev, n);
+	free(b->rules);
+	free(idx);
+	free(e);
+	if (depth == 0)
+		return 0;
+
+	b->st->runs++;
+	b->st->rules += n;
+	if (n > b->st->depth_before)
+		b->st->depth_before = n;
+	if (depth + 1 > b->st->depth_after)
+		b->st->depth_after = depth + 1;
+	return 1;
+}
+
+/* Whether `b' can join a run of rules like `a' on the source (`dst':
+ * destination) prefix */
+static bool
+iptcc_bisect_same(const struct rule_head *a, const struct rule_head *b,
+		  bool dst)
+{
+	union nf_inet_addr addr;
+	unsigned int len;
+
+	return a->size == b->size &&
+	       rule_prefix(a->entry, dst, &addr, &len) &&
+	       rule_prefix(b->entry, dst, &addr, &len) &&
+	       header_same_but_prefix(a->entry, b->entry, dst) &&
+	       memcmp((const char *)a->entry + sizeof(STRUCT_ENTRY),
+		      (const char *)b->entry + sizeof(STRUCT_ENTRY),
+		      a->size - sizeof(STRUCT_ENTRY)) == 0;
+}
+
+/* Whether a rule can go into the tree: RETURN and goto would then act
+ * on the chains of the tree, not on the one the rule was in. */
+static bool iptcc_bisect_movable(struct rule_head *r)
+{
+	union nf_inet_addr addr;
+	unsigned int len;
+
+	if (ENTRY_GOTO(r->entry))
+		return false;
+	if (r->type == IPTCC_R_STANDARD &&
+	    *(const int *)GET_TARGET(r->entry)->data == RETURN)
+		return false;
+	return rule_prefix(r->entry, false, &addr, &len) ||
+	       rule_prefix(r->entry, true, &addr, &len);
+}
+
+/* Replace every run of at least `min_rules' rules of `chain' that only
+ * differ in their source, or destination, prefix with a jump into a
+ * tree of new chains, so that a packet goes through a number of rules
+ * logarithmic in the length of the run. */
+int TC_BISECT_CHAIN(const IPT_CHAINLABEL chain, unsigned int min_rules,
+		    struct xtc_bisect_stats *stats,
+		    struct xtc_handle *handle)
+{
+	struct iptcc_bisect b = { .h = handle, .chain = chain };
+	struct xtc_bisect_stats st = {};
+	struct rule_head *r, *start, *next;
+	struct chain_head *c;
+	unsigned int pos, n;
+	bool dst;
+
+	iptc_fn = TC_BISECT_CHAIN;
+
+	if (!(c = iptcc_find_label(chain, handle))) {
+		errno = ENOENT;
+		return 0;
+	}
+	b.st = &st;
+	if (min_rules < 2)
+		min_rules = 2;
+
+	pos = 0;
+	r = list_entry(c->rules.next, struct rule_head, list);
+	while (&r->list != &c->rules) {
+		start = r;
+		n = 1;
+		r = list_entry(r->list.next, struct rule_head, list);
+		if (!iptcc_bisect_movable(start)) {
+			pos++;
+			continue;
+		}
+		/* the second rule tells which prefix the run is on */
+		dst = &r->list != &c->rules &&
+		      !iptcc_bisect_same(start, r, false) &&
+		      iptcc_bisect_same(start, r, true);
+		for (; &r->list != &c->rules &&
+		       iptcc_bisect_same(start, r, dst); n++)
+			r = list_entry(r->list.next, struct rule_head, list);
+		if (n < min_rules) {
+			pos += n;
+			continue;
+		}
+		next = r;
+		b.dst = dst;
+		if (!iptcc_bisect_run(&b, c, start, pos, n)) {
+			free(b.made);
+			iptc_fn = TC_BISECT_CHAIN;
+			return 0;
+		}
+		r = next;
+		pos++;
+	}
+
+	free(b.made);
+	if (stats != NULL)
+		*stats = st;
+	return 1;
+}
+
+/* Matches that can be taken out of a run of rules into one jump: they
+ * neither keep state nor drop the packet themselves, so testing them
+ * once, ahead of the rest of the rules, gives the same answer.  The
+ * "fixed" ones only look at what no target changes on the way. */
+static const char *const iptcc_hoist_fixed_matches[] = {
+	"addrtype", "iprange", "mac", "physdev", "pkttype",
+};
+
+static const char *const iptcc_hoist_matches[] = {
+	"conntrack", "dscp", "hl", "length", "mark", "set", "state", "tos",
+	"ttl",
+};
+
+/* Targets that leave the packet, and its connection, as they are */
+static const char *const iptcc_pure_targets[] = {
+	"AUDIT", "LOG", "NFLOG", "NFQUEUE", "REJECT", "TRACE", "ULOG",
+};
+
+static bool iptcc_name_in(const char *name, const char *const *names,
+			  unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		if (strcmp(name, names[i]) == 0)
+			return true;
+	return false;
+}
+
+/* Leading tests rules of a run have in common */
+struct iptcc_hoist {
+	unsigned int fields;		/* IPTCC_H_* */
+	unsigned int matches, size;	/* the first matches, their bytes */
+	bool fixed;			/* none a target may change */
+};
+
+/* What `a' and `b' test in the same way, before anything they don't */
+static void
+iptcc_hoist_common(const struct rule_head *a, const struct rule_head *b,
+		   struct iptcc_hoist *p)
+{
+	const STRUCT_ENTRY_MATCH *m, *n;
+	unsigned int off = sizeof(STRUCT_ENTRY);
+
+	p->fields = header_same_fields(a->entry, b->entry);
+	p->matches = 0;
+	p->fixed = true;
+	while (off < a->entry->target_offset &&
+	       off < b->entry->target_offset) {
+		m = (const void *)((const char *)a->entry + off);
+		n = (const void *)((const char *)b->entry + off);
+		if (m->u.match_size < sizeof(*m) ||
+		    m->u.match_size != n->u.match_size ||
+		    memcmp(m, n, m->u.match_size) != 0)
+			break;
+		if (iptcc_name_in(m->u.user.name, iptcc_hoist_matches,
+				  ARRAY_SIZE(iptcc_hoist_matches)))
+			p->fixed = false;
+		else if (!iptcc_name_in(m->u.user.name,
+					iptcc_hoist_fixed_matches,
+					ARRAY_SIZE(iptcc_hoist_fixed_matches)))
+			break;
+		p->matches++;
+		off += m->u.match_size;
+	}
+	p->size = off - sizeof(STRUCT_ENTRY);
+}
+
+/* Whether `r' tests all of `p', which comes from `first' */
+static bool
+iptcc_hoist_has(const struct rule_head *first, const struct rule_head *r,
+		const struct iptcc_hoist *p)
+{
+	return (header_same_fields(first->entry, r->entry) & p->fields) ==
+	       p->fields &&
+	       r->entry->target_offset >= sizeof(STRUCT_ENTRY) + p->size &&
+	       memcmp((const char *)first->entry + sizeof(STRUCT_ENTRY),
+		      (const char *)r->entry + sizeof(STRUCT_ENTRY),
+		      p->size) == 0;
+}
+
+/* Whether the target of `r' can't change the packet, or its connection,
+ * for the rules after it */
+static bool iptcc_target_pure(struct rule_head *r, unsigned int depth)
+{
+	struct rule_head *j;
+
+	switch (r->type) {
+	case IPTCC_R_FALLTHROUGH:
+	case IPTCC_R_STANDARD:
+		return true;
+	case IPTCC_R_MODULE:
+		return iptcc_name_in(GET_TARGET(r->entry)->u.user.name,
+				     iptcc_pure_targets,
+				     ARRAY_SIZE(iptcc_pure_targets));
+	case IPTCC_R_JUMP:
+		if (depth >= IPTCC_EVAL_MAXDEPTH)
+			return false;
+		list_for_each_entry(j, &r->jump->rules, list)
+			if (!iptcc_target_pure(j, depth + 1))
+				return false;
+		return true;
+	}
+	return false;
+}
+
+/* Whether `r' can be put in another chain: RETURN and goto would act
+ * on that one instead. */
+static bool iptcc_factor_movable(struct rule_head *r)
+{
+	return !ENTRY_GOTO(r->entry) &&
+	       !(r->type == IPTCC_R_STANDARD &&
+		 *(const int *)GET_TARGET(r->entry)->data == RETURN);
+}
+
+struct iptcc_factor {
+	struct xtc_handle *h;
+	const char *chain;		/* the one being rewritten */
+	unsigned int min_rules;
+	unsigned int serial;
+	struct xtc_factor_stats *st;
+};
+
+static int iptcc_factor_chain(struct iptcc_factor *f, struct chain_head *c,
+			      unsigned int tested);
+
+/* Move the `n' rules from `run', at `pos' of `c', into a new chain that
+ * the rules testing `p' jump to, and take `p' out of them */
+static int
+iptcc_factor_run(struct iptcc_factor *f, struct chain_head *c,
+		 struct rule_head *run, unsigned int pos, unsigned int n,
+		 const struct iptcc_hoist *p, unsigned int tested)
+{
+	unsigned int size = sizeof(STRUCT_ENTRY) + p->size +
+			    ALIGN(sizeof(STRUCT_STANDARD_TARGET));
+	STRUCT_STANDARD_TARGET *t;
+	struct rule_head *r, *next;
+	struct chain_head *sub;
+	unsigned int i, tests;
+	STRUCT_ENTRY *e;
+	int ret;
+
+	sub = iptcc_new_sub_chain(f->h, f->chain, 'f', &f->serial);
+	if (sub == NULL)
+		return 0;
+
+	e = calloc(1, size);
+	if (e == NULL) {
+		errno = ENOMEM;
+		return 0;
+	}
+	e->target_offset = sizeof(STRUCT_ENTRY) + p->size;
+	e->next_offset = size;
+	memcpy((char *)e + sizeof(STRUCT_ENTRY),
+	       (const char *)run->entry + sizeof(STRUCT_ENTRY), p->size);
+	t = (STRUCT_STANDARD_TARGET *)GET_TARGET(e);
+	t->target.u.user.target_size = ALIGN(sizeof(STRUCT_STANDARD_TARGET));
+	strcpy(t->target.u.user.name, sub->name);
+
+	/* the rules keep their counters, and the protocol */
+	for (i = 0, r = run; i < n; i++, r = next) {
+		next = list_entry(r->list.next, struct rule_head, list);
+		header_move(i == 0 ? e : NULL, r->entry, p->fields);
+		memmove((char *)r->entry + sizeof(STRUCT_ENTRY),
+			(char *)r->entry + sizeof(STRUCT_ENTRY) + p->size,
+			r->size - sizeof(STRUCT_ENTRY) - p->size);
+		r->entry->target_offset -= p->size;
+		r->entry->next_offset -= p->size;
+		r->size -= p->size;
+		list_del(&r->list);
+		c->num_rules--;
+		r->chain = sub;
+		list_add_tail(&r->list, &sub->rules);
+		sub->num_rules++;
+	}
+
+	ret = TC_INSERT_ENTRY(c->name, e, pos, f->h);
+	free(e);
+	if (!ret)
+		return 0;
+
+	tests = p->matches;
+	for (i = p->fields & ~IPTCC_H_PROTO; i != 0; i &= i - 1)
+		tests++;
+	f->st->runs++;
+	f->st->rules += n;
+	f->st->tests += n * tests;
+
+	/* what is left may have more in common */
+	return iptcc_factor_chain(f, sub, tested | p->fields);
+}
+
+/* `tested' are the header fields the jump to `c' tests already, the
+ * protocol that stays in the rules */
+static int iptcc_factor_chain(struct iptcc_factor *f, struct chain_head *c,
+			      unsigned int tested)
+{
+	struct rule_head *r, *start, *prev;
+	struct iptcc_hoist p;
+	unsigned int pos, n;
+
+	pos = 0;
+	r = list_entry(c->rules.next, struct rule_head, list);
+	while (&r->list != &c->rules) {
+		start = r;
+		r = list_entry(r->list.next, struct rule_head, list);
+		if (&r->list == &c->rules || !iptcc_factor_movable(start) ||
+		    !iptcc_factor_movable(r)) {
+			pos++;
+			continue;
+		}
+		/* the first two rules tell what the run has in common */
+		iptcc_hoist_common(start, r, &p);
+		p.fields &= ~tested;
+		if (p.fields == 0 && p.matches == 0) {
+			pos++;
+			continue;
+		}
+		/* a rule may only change what the next one tests if the
+		 * test stays in the rule */
+		n = 1;
+		prev = start;
+		while (&r->list != &c->rules && iptcc_factor_movable(r) &&
+		       iptcc_hoist_has(start, r, &p) &&
+		       (p.fixed || iptcc_target_pure(prev, 0))) {
+			prev = r;
+			r = list_entry(r->list.next, struct rule_head, list);
+			n++;
+		}
+		if (n < f->min_rules) {
+			r = list_entry(start->list.next, struct rule_head,
+				       list);
+			pos++;
+			continue;
+		}
+		if (!iptcc_factor_run(f, c, start, pos, n, &p, tested))
+			return 0;
+		pos++;
+	}
+	return 1;
+}
+
+/* Replace every run of at least `min_rules' rules of `chain' that start
+ * with the same tests with one rule making them, which jumps to a new
+ * chain holding what is left of the rules. */
+int TC_FACTOR_CHAIN(const IPT_CHAINLABEL chain, unsigned int min_rules,
+		    struct xtc_factor_stats *stats,
+		    struct xtc_handle *handle)
+{
+	struct iptcc_factor f = { .h = handle, .chain = chain };
+	struct xtc_factor_stats st = {};
+	struct chain_head *c;
+
+	iptc_fn = TC_FACTOR_CHAIN;
+
+	if (!(c = iptcc_find_label(chain, handle))) {
+		errno = ENOENT;
+		return 0;
+	}
+	f.st = &st;
+	f.min_rules = min_rules < 2 ? 2 : min_rules;
+
+	if (!iptcc_factor_chain(&f, c, 0)) {
+		iptc_fn = TC_FACTOR_CHAIN;
+		return 0;
+	}
+	if (stats != NULL)
+		*stats = st;
+	return 1;
+}
+
+/* Targets that end the evaluation of a packet */
+static const char *const iptcc_terminal_targets[] = {
+	"DNAT", "MASQUERADE", "NETMAP", "NFQUEUE", "REDIRECT", "REJECT",
+	"SNAT", "TPROXY",
+};
+
+#define IPTCC_WORD_BITS		(IPTCC_ADDR_BITS / IPTCC_ADDR_WORDS)
+
+/* A rule as the analysis sees it: the box of rule_box(), and the ports.
+ * Unless `exact', the rule may match less than that. */
+struct iptcc_ana_rule {
+	struct rule_head *r;
+	uint64_t lo[IPTCC_DT_DIMS], hi[IPTCC_DT_DIMS];
+	unsigned int slen, dlen;	/* the addresses as prefixes */
+	__u16 sport[2];
+	__u16 dports[XT_MULTI_PORTS][2];
+	unsigned int num_dports;
+	bool ports;			/* has a port match: no fragments */
+	bool exact;
+	bool terminal, stateless;
+	uint64_t hash;			/* of what the rule is */
+	unsigned int group;		/* as a cover, see iptcc_ana_insert() */
+	int finding;			/* enum xtc_rule_finding, -1 for none */
+	unsigned int by;
+	bool removable;
+};
+
+/* Rules with the same box but for the destination ports, which are
+ * merged into sorted, disjoint ranges */
+struct iptcc_ana_group {
+	unsigned int next;		/* with the same key, from 1 */
+	const struct iptcc_ana_rule *rep;
+	unsigned int last;		/* the last rule in it, from 1 */
+	bool needed;			/* leaves another rule dead */
+	__u16 (*dports)[2];
+	unsigned int num_dports, size_dports;
+};
+
+/* Groups by source and destination prefix.  A lookup tries every prefix
+ * length in use, so it costs a few hash probes rather than a walk. */
+struct iptcc_ana_index {
+	struct iptcc_ana_group *groups;
+	unsigned int num_groups, size_groups;
+	struct iptcc_ana_slot {
+		uint64_t key;
+		unsigned int group;	/* from 1, 0 for an empty slot */
+	} *slots;
+	unsigned int size_slots;
+	uint64_t slens[(IPTCC_ADDR_BITS + 64) / 64];
+	uint64_t dlens[(IPTCC_ADDR_BITS + 64) / 64];
+	bool decision;			/* groups only hold the same target */
+};
+
+static bool iptcc_rule_terminal(struct rule_head *r)
+{
+	switch (r->type) {
+	case IPTCC_R_STANDARD:
+		return true;
+	case IPTCC_R_JUMP:
+		return ENTRY_GOTO(r->entry);
+	case IPTCC_R_MODULE:
+		return iptcc_name_in(GET_TARGET(r->entry)->u.user.name,
+				     iptcc_terminal_targets,
+				     ARRAY_SIZE(iptcc_terminal_targets));
+	case IPTCC_R_FALLTHROUGH:
+		break;
+	}
+	return false;
+}
+
+/* Whether the two terminal rules do the same to a packet they match */
+static bool
+iptcc_same_decision(struct rule_head *a, struct rule_head *b)
+{
+	STRUCT_ENTRY_TARGET *x = GET_TARGET(a->entry);
+	STRUCT_ENTRY_TARGET *y = GET_TARGET(b->entry);
+
+	if (a->type != b->type)
+		return false;
+	switch (a->type) {
+	case IPTCC_R_STANDARD:
+		return *(const int *)x->data == *(const int *)y->data;
+	case IPTCC_R_JUMP:
+		return ENTRY_GOTO(a->entry) && ENTRY_GOTO(b->entry) &&
+		       a->jump == b->jump;
+	case IPTCC_R_MODULE:
+		return x->u.target_size == y->u.target_size &&
+		       memcmp(x, y, x->u.target_size) == 0;
+	case IPTCC_R_FALLTHROUGH:
+		break;
+	}
+	return false;
+}
+
+/* Length of the prefix the box gives for the address at `dim' */
+static unsigned int
+iptcc_box_len(const uint64_t *lo, const uint64_t *hi, unsigned int dim)
+{
+	unsigned int i, len = 0;
+	uint64_t x;
+
+	for (i = 0; i < IPTCC_ADDR_WORDS; i++) {
+		x = lo[dim + i] ^ hi[dim + i];
+		if (x == 0) {
+			len += IPTCC_WORD_BITS;
+			continue;
+		}
+		if (__builtin_clzll(x) > 64 - IPTCC_WORD_BITS)
+			len += __builtin_clzll(x) - (64 - IPTCC_WORD_BITS);
+		break;
+	}
+	return len;
+}
+
+/* The address at `dim' of the box cut to `len' bits */
+static void
+iptcc_box_mask(const uint64_t *lo, unsigned int dim, unsigned int len,
+	       uint64_t *key)
+{
+	unsigned int i, n;
+
+	for (i = 0; i < IPTCC_ADDR_WORDS; i++) {
+		n = len > i * IPTCC_WORD_BITS ? len - i * IPTCC_WORD_BITS : 0;
+		if (n >= IPTCC_WORD_BITS)
+			key[i] = lo[dim + i];
+		else if (n == 0)
+			key[i] = 0;
+		else
+			key[i] = lo[dim + i] &
+				 ~(~(uint64_t)0 >> (64 - IPTCC_WORD_BITS + n)) &
+				 (~(uint64_t)0 >> (64 - IPTCC_WORD_BITS));
+	}
+}
+
+static inline uint64_t iptcc_hash(uint64_t h, const void *p, size_t len)
+{
+	const unsigned char *c = p;
+
+	while (len-- > 0)
+		h = (h ^ *c++) * 0x100000001b3ULL;
+	return h;
+}
+
+#define IPTCC_HASH_INIT		0xcbf29ce484222325ULL
+
+static uint64_t
+iptcc_ana_key(const uint64_t *src, unsigned int slen, const uint64_t *dst,
+	      unsigned int dlen)
+{
+	uint64_t h = IPTCC_HASH_INIT;
+
+	h = iptcc_hash(h, src, IPTCC_ADDR_WORDS * sizeof(*src));
+	h = iptcc_hash(h, &slen, sizeof(slen));
+	h = iptcc_hash(h, dst, IPTCC_ADDR_WORDS * sizeof(*dst));
+	return iptcc_hash(h, &dlen, sizeof(dlen));
+}
+
+/* Ports of a tcp, udp or multiport match; false if that isn't all the
+ * match tests */
+static bool
+iptcc_ana_ports(struct iptcc_ana_rule *a, const STRUCT_ENTRY_MATCH *m)
+{
+	const char *name = m->u.user.name;
+	unsigned int i, n = 0;
+	__u16 min, max;
+
+	if (strcmp(name, "tcp") == 0) {
+		const struct xt_tcp *info = (const void *)m->data;
+
+		a->ports = true;
+		if (!(info->invflags & XT_TCP_INV_SRCPT))
+			memcpy(a->sport, info->spts, sizeof(a->sport));
+		if (!(info->invflags & XT_TCP_INV_DSTPT))
+			memcpy(a->dports[0], info->dpts, sizeof(a->dports[0]));
+		return info->invflags == 0 && info->option == 0 &&
+		       info->flg_mask == 0;
+	}
+	if (strcmp(name, "udp") == 0) {
+		const struct xt_udp *info = (const void *)m->data;
+
+		a->ports = true;
+		if (!(info->invflags & XT_UDP_INV_SRCPT))
+			memcpy(a->sport, info->spts, sizeof(a->sport));
+		if (!(info->invflags & XT_UDP_INV_DSTPT))
+			memcpy(a->dports[0], info->dpts, sizeof(a->dports[0]));
+		return info->invflags == 0;
+	}
+	if (strcmp(name, "multiport") == 0 && m->u.user.revision <= 1) {
+		const struct xt_multiport_v1 *info = (const void *)m->data;
+		unsigned int count = info->count;
+
+		/* revision 0 is the start of revision 1, without ranges */
+		a->ports = true;
+		if (count == 0 || count > XT_MULTI_PORTS)
+			return false;
+		if ((m->u.user.revision == 1 && info->invert) ||
+		    info->flags == XT_MULTIPORT_EITHER)
+			return false;
+		if (info->flags == XT_MULTIPORT_SOURCE) {
+			a->sport[0] = 0xffff;
+			a->sport[1] = 0;
+		}
+		for (i = 0; i < count; i++) {
+			min = max = info->ports[i];
+			if (m->u.user.revision == 1 && info->pflags[i] &&
+			    i + 1 < count)
+				max = info->ports[++i];
+			if (info->flags == XT_MULTIPORT_DESTINATION) {
+				a->dports[n][0] = min;
+				a->dports[n++][1] = max;
+				continue;
+			}
+			if (min < a->sport[0])
+				a->sport[0] = min;
+			if (max > a->sport[1])
+				a->sport[1] = max;
+			n++;
+		}
+		if (info->flags == XT_MULTIPORT_DESTINATION && n != 0)
+			a->num_dports = n;
+		/* a source list is only one range if it has one */
+		return info->flags == XT_MULTIPORT_DESTINATION || n == 1;
+	}
+	return false;
+}
+
+static void iptcc_ana_fill(struct iptcc_ana_rule *a, struct rule_head *r)
+{
+	const STRUCT_ENTRY_MATCH *m;
+	unsigned int off, port_matches = 0;
+	STRUCT_ENTRY *e = r->entry;
+	uint64_t h = IPTCC_HASH_INIT;
+
+	memset(a, 0, sizeof(*a));
+	a->r = r;
+	a->finding = -1;
+	rule_box(e, a->lo, a->hi);
+	a->slen = iptcc_box_len(a->lo, a->hi, 0);
+	a->dlen = iptcc_box_len(a->lo, a->hi, IPTCC_ADDR_WORDS);
+	a->sport[1] = 0xffff;
+	a->dports[0][1] = 0xffff;
+	a->num_dports = 1;
+	a->exact = header_exact(e);
+	a->terminal = iptcc_rule_terminal(r);
+	a->stateless = iptcc_rule_stateless(r);
+
+	for (off = sizeof(STRUCT_ENTRY); off < e->target_offset;
+	     off += m->u.match_size) {
+		m = (const void *)((const char *)e + off);
+		if (m->u.match_size < sizeof(*m)) {
+			a->exact = false;
+			break;
+		}
+		if (strcmp(m->u.user.name, "comment") == 0)
+			continue;
+		/* more than one port match is seen as the first one */
+		if (port_matches++ == 0 && iptcc_ana_ports(a, m))
+			continue;
+		a->exact = false;
+	}
+
+	/* what the rule is, for duplicates: header, matches and target */
+	h = iptcc_hash(h, e, offsetof(STRUCT_ENTRY, nfcache));
+	h = iptcc_hash(h, e->elems, e->target_offset - sizeof(STRUCT_ENTRY));
+	if (r->type == IPTCC_R_JUMP)
+		h = iptcc_hash(h, r->jump->name, strlen(r->jump->name));
+	else
+		h = iptcc_hash(h, GET_TARGET(e), GET_TARGET(e)->u.target_size);
+	a->hash = h;
+}
+
+static bool
+iptcc_ana_same_rule(const struct iptcc_ana_rule *a,
+		    const struct iptcc_ana_rule *b)
+{
+	const STRUCT_ENTRY *x = a->r->entry, *y = b->r->entry;
+
+	if (a->hash != b->hash || a->r->type != b->r->type ||
+	    a->r->size != b->r->size ||
+	    memcmp(x, y, offsetof(STRUCT_ENTRY, nfcache)) != 0 ||
+	    x->target_offset != y->target_offset ||
+	    memcmp(x->elems, y->elems,
+		   x->target_offset - sizeof(STRUCT_ENTRY)) != 0)
+		return false;
+	if (a->r->type == IPTCC_R_JUMP)
+		return a->r->jump == b->r->jump;
+	return memcmp((const char *)x + x->target_offset,
+		      (const char *)y + y->target_offset,
+		      x->next_offset - x->target_offset) == 0;
+}
+
+/* Whether the ranges `ports' cover [lo, hi] */
+static bool
+iptcc_ports_cover(__u16 (*ports)[2], unsigned int n, __u16 lo, __u16 hi)
+{
+	unsigned int l = 0, h = n, mid;
+
+	/* the last range starting at or below lo */
+	while (h - l > 1) {
+		mid = (l + h) / 2;
+		if (ports[mid][0] <= lo)
+			l = mid;
+		else
+			h = mid;
+	}
+	return n != 0 && ports[l][0] <= lo && ports[l][1] >= hi;
+}
+
+static int
+iptcc_ports_add(struct iptcc_ana_group *g, __u16 lo, __u16 hi)
+{
+	unsigned int i, j;
+	void *p;
+
+	if (g->num_dports == g->size_dports) {
+		g->size_dports = g->size_dports ? 2 * g->size_dports : 4;
+		p = realloc(g->dports, g->size_dports * sizeof(*g->dports));
+		if (p == NULL)
+			return 0;
+		g->dports = p;
+	}
+	/* first range that isn't before [lo, hi], and the first one after */
+	for (i = 0; i < g->num_dports && g->dports[i][1] + 1 < lo; i++)
+		;
+	for (j = i; j < g->num_dports && g->dports[j][0] <= hi + 1; j++) {
+		if (g->dports[j][0] < lo)
+			lo = g->dports[j][0];
+		if (g->dports[j][1] > hi)
+			hi = g->dports[j][1];
+	}
+	memmove(&g->dports[i + 1], &g->dports[j],
+		(g->num_dports - j) * sizeof(*g->dports));
+	g->num_dports = g->num_dports - (j - i) + 1;
+	g->dports[i][0] = lo;
+	g->dports[i][1] = hi;
+	return 1;
+}
+
+static inline void iptcc_lens_set(uint64_t *lens, unsigned int len)
+{
+	lens[len / 64] |= (uint64_t)1 << (len % 64);
+}
+
+static inline bool iptcc_lens_has(const uint64_t *lens, unsigned int len)
+{
+	return lens[len / 64] & ((uint64_t)1 << (len % 64));
+}
+
+/* Whether group `g' stands for a cover of `a' but for the addresses */
+static bool
+iptcc_ana_group_covers(const struct iptcc_ana_index *x,
+		       const struct iptcc_ana_group *g,
+		       const struct iptcc_ana_rule *a)
+{
+	const struct iptcc_ana_rule *c = g->rep;
+	unsigned int d;
+
+	for (d = 2 * IPTCC_ADDR_WORDS; d < IPTCC_DT_DIMS; d++)
+		if (c->lo[d] > a->lo[d] || a->hi[d] > c->hi[d])
+			return false;
+	if (c->sport[0] > a->sport[0] || a->sport[1] > c->sport[1])
+		return false;
+	if (c->ports && !a->ports)
+		return false;
+	if (x->decision && !iptcc_same_decision(c->r, a->r))
+		return false;
+	for (d = 0; d < a->num_dports; d++)
+		if (!iptcc_ports_cover(g->dports, g->num_dports,
+				       a->dports[d][0], a->dports[d][1]))
+			return false;
+	return true;
+}
+
+/* A group covering all `a' can match, or NULL */
+static struct iptcc_ana_group *
+iptcc_ana_lookup(const struct iptcc_ana_index *x,
+		 const struct iptcc_ana_rule *a)
+{
+	uint64_t src[IPTCC_ADDR_WORDS], dst[IPTCC_ADDR_WORDS], key;
+	struct iptcc_ana_group *g;
+	unsigned int sl, dl, s;
+
+	if (x->size_slots == 0)
+		return NULL;
+	for (sl = 0; sl <= a->slen; sl++) {
+		if (!iptcc_lens_has(x->slens, sl))
+			continue;
+		iptcc_box_mask(a->lo, 0, sl, src);
+		for (dl = 0; dl <= a->dlen; dl++) {
+			if (!iptcc_lens_has(x->dlens, dl))
+				continue;
+			iptcc_box_mask(a->lo, IPTCC_ADDR_WORDS, dl, dst);
+			key = iptcc_ana_key(src, sl, dst, dl);
+			for (s = key & (x->size_slots - 1);
+			     x->slots[s].group != 0;
+			     s = (s + 1) & (x->size_slots - 1)) {
+				if (x->slots[s].key != key)
+					continue;
+				for (g = &x->groups[x->slots[s].group - 1];;
+				     g = &x->groups[g->next - 1]) {
+					if (g->rep->slen == sl &&
+					    g->rep->dlen == dl &&
+					    memcmp(g->rep->lo, src,
+						   sizeof(src)) == 0 &&
+					    memcmp(g->rep->lo + IPTCC_ADDR_WORDS,
+						   dst, sizeof(dst)) == 0 &&
+					    iptcc_ana_group_covers(x, g, a))
+						return g;
+					if (g->next == 0)
+						break;
+				}
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+
+static bool
+iptcc_ana_same_group(const struct iptcc_ana_index *x,
+		     const struct iptcc_ana_group *g,
+		     const struct iptcc_ana_rule *a)
+{
+	const struct iptcc_ana_rule *c = g->rep;
+
+	return memcmp(c->lo, a->lo, sizeof(c->lo)) == 0 &&
+	       memcmp(c->hi, a->hi, sizeof(c->hi)) == 0 &&
+	       memcmp(c->sport, a->sport, sizeof(c->sport)) == 0 &&
+	       c->ports == a->ports &&
+	       (!x->decision || iptcc_same_decision(c->r, a->r));
+}
+
+static int iptcc_ana_grow(struct iptcc_ana_index *x)
+{
+	struct iptcc_ana_slot *slots = x->slots;
+	unsigned int size = x->size_slots, i, s;
+
+	x->size_slots = size ? 2 * size : 64;
+	x->slots = calloc(x->size_slots, sizeof(*x->slots));
+	if (x->slots == NULL) {
+		x->slots = slots;
+		x->size_slots = size;
+		return 0;
+	}
+	for (i = 0; i < size; i++) {
+		if (slots[i].group == 0)
+			continue;
+		for (s = slots[i].key & (x->size_slots - 1);
+		     x->slots[s].group != 0; s = (s + 1) & (x->size_slots - 1))
+			;
+		x->slots[s] = slots[i];
+	}
+	free(slots);
+	return 1;
+}
+
+/* Add `a', rule `num' of its chain, which must be exact and terminal */
+static int
+iptcc_ana_insert(struct iptcc_ana_index *x, struct iptcc_ana_rule *a,
+		 unsigned int num)
+{
+	struct iptcc_ana_group *g = NULL;
+	unsigned int s, i;
+	uint64_t key;
+	void *p;
+
+	if (2 * (x->num_groups + 1) > x->size_slots && !iptcc_ana_grow(x))
+		goto nomem;
+
+	key = iptcc_ana_key(a->lo, a->slen, a->lo + IPTCC_ADDR_WORDS,
+			    a->dlen);
+	for (s = key & (x->size_slots - 1); x->slots[s].group != 0;
+	     s = (s + 1) & (x->size_slots - 1))
+		if (x->slots[s].key == key)
+			break;
+	for (i = x->slots[s].group; i != 0; i = x->groups[i - 1].next)
+		if (iptcc_ana_same_group(x, &x->groups[i - 1], a)) {
+			g = &x->groups[i - 1];
+			break;
+		}
+
+	if (g == NULL) {
+		if (x->num_groups == x->size_groups) {
+			x->size_groups = x->size_groups ?
+					 2 * x->size_groups : 64;
+			p = realloc(x->groups,
+				    x->size_groups * sizeof(*x->groups));
+			if (p == NULL)
+				goto nomem;
+			x->groups = p;
+		}
+		g = &x->groups[x->num_groups++];
+		memset(g, 0, sizeof(*g));
+		g->rep = a;
+		g->next = x->slots[s].group;
+		x->slots[s].key = key;
+		x->slots[s].group = x->num_groups;
+		iptcc_lens_set(x->slens, a->slen);
+		iptcc_lens_set(x->dlens, a->dlen);
+	}
+
+	for (i = 0; i < a->num_dports; i++)
+		if (!iptcc_ports_add(g, a->dports[i][0], a->dports[i][1]))
+			goto nomem;
+	if (num > g->last)
+		g->last = num;
+	a->group = g - x->groups;
+	return 1;
+nomem:
+	errno = ENOMEM;
+	return 0;
+}
+
+static void iptcc_ana_index_free(struct iptcc_ana_index *x)
+{
+	unsigned int i;
+
+	for (i = 0; i < x->num_groups; i++)
+		free(x->groups[i].dports);
+	free(x->groups);
+	free(x->slots);
+	memset(x, 0, sizeof(*x));
+}
+
+/* Whether a packet can match both, as far as the boxes tell */
+static bool
+iptcc_ana_overlap(const struct iptcc_ana_rule *a,
+		  const struct iptcc_ana_rule *b)
+{
+	unsigned int d, i, j;
+
+	for (d = 0; d < IPTCC_DT_DIMS; d++)
+		if (a->hi[d] < b->lo[d] || b->hi[d] < a->lo[d])
+			return false;
+	if (a->sport[1] < b->sport[0] || b->sport[1] < a->sport[0])
+		return false;
+	for (i = 0; i < a->num_dports; i++)
+		for (j = 0; j < b->num_dports; j++)
+			if (a->dports[i][0] <= b->dports[j][1] &&
+			    b->dports[j][0] <= a->dports[i][1])
+				return true;
+	return false;
+}
+
+/* The rules sorted by the source, and by the destination, prefix: the
+ * rules whose prefix holds a given one are found by a search for each
+ * shorter prefix length, those within it are one range. */
+struct iptcc_ana_sorted {
+	const struct iptcc_ana_rule *rules;
+	unsigned int *idx;
+	unsigned int dim;
+	uint64_t lens[(IPTCC_ADDR_BITS + 64) / 64];
+};
+
+static int
+iptcc_ana_cmp(const struct iptcc_ana_rule *a, unsigned int dim,
+	      const uint64_t *key, unsigned int len)
+{
+	unsigned int alen = dim ? a->dlen : a->slen, i;
+
+	for (i = 0; i < IPTCC_ADDR_WORDS; i++)
+		if (a->lo[dim + i] != key[i])
+			return a->lo[dim + i] < key[i] ? -1 : 1;
+	return alen < len ? -1 : alen > len;
+}
+
+static const struct iptcc_ana_sorted *iptcc_ana_sorting;
+
+static int iptcc_ana_sort_cmp(const void *x, const void *y)
+{
+	const struct iptcc_ana_sorted *s = iptcc_ana_sorting;
+	const struct iptcc_ana_rule *b = &s->rules[*(const unsigned int *)y];
+	int ret;
+
+	ret = iptcc_ana_cmp(&s->rules[*(const unsigned int *)x], s->dim,
+			    b->lo + s->dim, s->dim ? b->dlen : b->slen);
+	if (ret == 0)
+		ret = *(const unsigned int *)x < *(const unsigned int *)y ?
+		      -1 : 1;
+	return ret;
+}
+
+static int
+iptcc_ana_sort(struct iptcc_ana_sorted *s, const struct iptcc_ana_rule *rules,
+	       unsigned int n, unsigned int dim)
+{
+	unsigned int i;
+
+	s->rules = rules;
+	s->dim = dim;
+	memset(s->lens, 0, sizeof(s->lens));
+	s->idx = malloc(n * sizeof(*s->idx));
+	if (s->idx == NULL) {
+		errno = ENOMEM;
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		s->idx[i] = i;
+		iptcc_lens_set(s->lens, dim ? rules[i].dlen : rules[i].slen);
+	}
+	iptcc_ana_sorting = s;
+	qsort(s->idx, n, sizeof(*s->idx), iptcc_ana_sort_cmp);
+	iptcc_ana_sorting = NULL;
+	return 1;
+}
+
+/* First place in `s' at or after the prefix `key'/`len' */
+static unsigned int
+iptcc_ana_find(const struct iptcc_ana_sorted *s, unsigned int n,
+	       const uint64_t *key, unsigned int len)
+{
+	unsigned int l = 0, h = n, mid;
+
+	while (l < h) {
+		mid = (l + h) / 2;
+		if (iptcc_ana_cmp(&s->rules[s->idx[mid]], s->dim, key,
+				  len) < 0)
+			l = mid + 1;
+		else
+			h = mid;
+	}
+	return l;
+}
+
+/* Whether rule `k' keeps a packet of rule `i' from getting the same
+ * decision further down, were rule `i' not there */
+static bool
+iptcc_ana_blocks(const struct iptcc_ana_rule *rules, unsigned int i,
+		 unsigned int k)
+{
+	const struct iptcc_ana_rule *a = &rules[i], *b = &rules[k];
+
+	return iptcc_ana_overlap(a, b) &&
+	       !(b->terminal && b->stateless &&
+		 iptcc_same_decision(a->r, b->r));
+}
+
+/* Whether any of rules `i' + 1 to `j' - 1 blocks rule `i' */
+static bool
+iptcc_ana_blocked(const struct iptcc_ana_rule *rules, unsigned int n,
+		  const struct iptcc_ana_sorted *sorted, unsigned int i,
+		  unsigned int j)
+{
+	const struct iptcc_ana_sorted *s;
+	const struct iptcc_ana_rule *a = &rules[i];
+	uint64_t key[IPTCC_ADDR_WORDS], end[IPTCC_ADDR_WORDS];
+	unsigned int len, l, p, k;
+
+	/* look by the longer prefix, or at every rule between */
+	s = &sorted[a->dlen > a->slen];
+	len = s->dim ? a->dlen : a->slen;
+	if (len == 0) {
+		for (k = i + 1; k < j; k++)
+			if (iptcc_ana_blocks(rules, i, k))
+				return true;
+		return false;
+	}
+
+	/* the prefixes holding it */
+	for (l = 0; l < len; l++) {
+		if (!iptcc_lens_has(s->lens, l))
+			continue;
+		iptcc_box_mask(a->lo, s->dim, l, key);
+		for (p = iptcc_ana_find(s, n, key, l);
+		     p < n && iptcc_ana_cmp(&rules[s->idx[p]], s->dim, key,
+					    l) == 0; p++) {
+			k = s->idx[p];
+			if (k > i && k < j && iptcc_ana_blocks(rules, i, k))
+				return true;
+		}
+	}
+	/* and those within it, up to its last address */
+	for (l = 0; l < IPTCC_ADDR_WORDS; l++)
+		end[l] = a->hi[s->dim + l];
+	for (p = iptcc_ana_find(s, n, a->lo + s->dim, len); p < n; p++) {
+		if (iptcc_ana_cmp(&rules[s->idx[p]], s->dim, end,
+				  IPTCC_ADDR_BITS) > 0)
+			break;
+		k = s->idx[p];
+		if (k > i && k < j && iptcc_ana_blocks(rules, i, k))
+			return true;
+	}
+	return false;
+}
+
+static void
+iptcc_ana_found(struct iptcc_ana_rule *a, enum xtc_rule_finding finding,
+		unsigned int by, bool removable)
+{
+	a->finding = finding;
+	a->by = by;
+	a->removable = removable;
+}
+
+static const struct iptcc_ana_rule *iptcc_ana_dup_rules;
+
+static int iptcc_ana_dup_cmp(const void *x, const void *y)
+{
+	const struct iptcc_ana_rule *a, *b;
+	unsigned int i = *(const unsigned int *)x, j = *(const unsigned int *)y;
+
+	a = &iptcc_ana_dup_rules[i];
+	b = &iptcc_ana_dup_rules[j];
+	if (a->hash != b->hash)
+		return a->hash < b->hash ? -1 : 1;
+	return i < j ? -1 : i > j;
+}
+
+/* Rules that are the same as an earlier one */
+static int iptcc_ana_duplicates(struct iptcc_ana_rule *rules, unsigned int n)
+{
+	unsigned int *idx, i, j, k;
+	struct iptcc_ana_rule *a, *b;
+
+	idx = malloc(n * sizeof(*idx));
+	if (idx == NULL) {
+		errno = ENOMEM;
+		return 0;
+	}
+	for (i = 0; i < n; i++)
+		idx[i] = i;
+	iptcc_ana_dup_rules = rules;
+	qsort(idx, n, sizeof(*idx), iptcc_ana_dup_cmp);
+	iptcc_ana_dup_rules = NULL;
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && rules[idx[j]].hash ==
+					 rules[idx[i]].hash; j++) {
+			b = &rules[idx[j]];
+			for (k = i; k < j; k++) {
+				a = &rules[idx[k]];
+				if (a->finding == XTC_RULE_DUPLICATE ||
+				    !iptcc_ana_same_rule(a, b))
+					continue;
+				/* the first one takes all its packets */
+				iptcc_ana_found(b, XTC_RULE_DUPLICATE,
+						idx[k] + 1,
+						a->terminal && a->stateless);
+				break;
+			}
+		}
+	}
+	free(idx);
+	return 1;
+}
+
+static int
+iptcc_analyze(struct chain_head *c, struct iptcc_ana_rule *rules,
+	      unsigned int n)
+{
+	struct iptcc_ana_index shadow = {}, later = { .decision = true };
+	struct iptcc_ana_sorted sorted[2] = {};
+	struct iptcc_ana_group *g;
+	struct iptcc_ana_rule *a;
+	bool *needed = NULL;
+	unsigned int i;
+	int verdict, ret = 0;
+
+	if (!iptcc_ana_duplicates(rules, n))
+		return 0;
+
+	/* shadowed: earlier exact, terminal rules take all the packets */
+	for (i = 0; i < n; i++) {
+		a = &rules[i];
+		if (!(a->finding == XTC_RULE_DUPLICATE && a->removable)) {
+			g = iptcc_ana_lookup(&shadow, a);
+			if (g != NULL) {
+				iptcc_ana_found(a, XTC_RULE_SHADOWED, g->last,
+						true);
+				g->needed = true;
+			}
+		}
+		if (a->exact && a->terminal && !a->removable &&
+		    !iptcc_ana_insert(&shadow, a, i + 1))
+			goto out;
+	}
+
+	/* the rules that make others dead have to stay */
+	needed = calloc(n, sizeof(*needed));
+	if (needed == NULL) {
+		errno = ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		a = &rules[i];
+		if (a->exact && a->terminal && !a->removable &&
+		    shadow.groups[a->group].needed)
+			needed[i] = true;
+		if (a->finding == XTC_RULE_DUPLICATE && a->removable)
+			needed[a->by - 1] = true;
+	}
+
+	if (!iptcc_ana_sort(&sorted[0], rules, n, 0) ||
+	    !iptcc_ana_sort(&sorted[1], rules, n, IPTCC_ADDR_WORDS))
+		goto out;
+
+	/* redundant: the rules after it, or the end of the chain, do the
+	 * same to all of its packets */
+	verdict = iptcc_is_builtin(c) ? c->verdict : RETURN;
+	for (i = n; i-- > 0;) {
+		a = &rules[i];
+		if (a->removable)
+			continue;
+		if (a->finding == -1 && !needed[i] && a->terminal &&
+		    a->stateless) {
+			g = iptcc_ana_lookup(&later, a);
+			if (g != NULL &&
+			    !iptcc_ana_blocked(rules, n, sorted, i, g->last - 1))
+				iptcc_ana_found(a, XTC_RULE_REDUNDANT, g->last,
+						true);
+			else if (a->r->type == IPTCC_R_STANDARD &&
+				 (*(const int *)GET_TARGET(a->r->entry)->data ==
+				  verdict ||
+				  *(const int *)GET_TARGET(a->r->entry)->data ==
+				  RETURN) &&
+				 !iptcc_ana_blocked(rules, n, sorted, i, n))
+				iptcc_ana_found(a, XTC_RULE_REDUNDANT, 0, true);
+		}
+		if (a->exact && a->terminal && !iptcc_ana_insert(&later, a, i + 1))
+			goto out;
+	}
+	ret = 1;
+out:
+	free(needed);
+	free(sorted[0].idx);
+	free(sorted[1].idx);
+	iptcc_ana_index_free(&shadow);
+	iptcc_ana_index_free(&later);
+	return ret;
+}
+
+/* Report the rules of `chain' that are shadowed, duplicate or redundant,
+ * in the order of the chain.  Rules are compared by their header and by
+ * the ports of tcp, udp and multiport; a rule with other matches can be
+ * found shadowed, but doesn't shadow others. */
+int TC_ANALYZE_CHAIN(const IPT_CHAINLABEL chain, xtc_finding_fn fn,
+		     void *data, struct xtc_handle *handle)
+{
+	struct iptcc_ana_rule *rules;
+	struct rule_head *r;
+	struct chain_head *c;
+	unsigned int i = 0;
+
+	iptc_fn = TC_ANALYZE_CHAIN;
+
+	if (!(c = iptcc_find_label(chain, handle))) {
+		errno = ENOENT;
+		return 0;
+	}
+	if (c->num_rules == 0)
+		return 1;
+
+	rules = malloc(c->num_rules * sizeof(*rules));
+	if (rules == NULL) {
+		errno = ENOMEM;
+		return 0;
+	}
+	list_for_each_entry(r, &c->rules, list)
+		iptcc_ana_fill(&rules[i++], r);
+
+	if (!iptcc_analyze(c, rules, c->num_rules)) {
+		free(rules);
+		iptc_fn = TC_ANALYZE_CHAIN;
+		return 0;
+	}
+	for (i = 0; i < c->num_rules; i++)
+		if (rules[i].finding != -1)
+			fn(chain, i + 1, rules[i].finding, rules[i].by,
+			   rules[i].removable, data);
+	free(rules);
+	return 1;
+}
+
+/* Whether `r' can be merged with rules like it into one testing a set
+ * of their prefixes: matches with state would then share it. */
+static bool iptcc_compact_movable(struct rule_head *r)
+{
+	struct xtc_prefix p;
+
+	if (!iptcc_rule_stateless(r))
+		return false;
+	return (rule_prefix(r->entry, false, &p.addr, &p.len) && p.len > 0) ||
+	       (rule_prefix(r->entry, true, &p.addr, &p.len) && p.len > 0);
+}
+
+/* Whether `b' can join a run of rules like `a' on the source (`dst':
+ * destination) prefix.  A set can't hold the prefix of length 0. */
+static bool
+iptcc_compact_same(const struct rule_head *a, const struct rule_head *b,
+		   bool dst)
+{
+	struct xtc_prefix p, q;
+
+	return iptcc_bisect_same(a, b, dst) &&
+	       rule_prefix(a->entry, dst, &p.addr, &p.len) && p.len > 0 &&
+	       rule_prefix(b->entry, dst, &q.addr, &q.len) && q.len > 0;
+}
+
+static int iptcc_compact_cmp(const void *x, const void *y)
+{
+	const struct xtc_prefix *a = x, *b = y;
+	int d = memcmp(&a->addr, &b->addr, sizeof(a->addr));
+
+	if (d != 0)
+		return d;
+	return (a->len > b->len) - (a->len < b->len);
+}
+
+/* Whether no two of the prefixes overlap.  Sorted by address, a prefix
+ * containing others is followed by one of them. */
+static bool iptcc_compact_disjoint(const struct xtc_prefix *prefixes,
+				   unsigned int n)
+{
+	union nf_inet_addr a, b;
+	struct xtc_prefix *p;
+	unsigned int i;
+	bool ret = true;
+
+	p = malloc(n * sizeof(*p));
+	if (p == NULL)
+		return false;
+	memcpy(p, prefixes, n * sizeof(*p));
+	qsort(p, n, sizeof(*p), iptcc_compact_cmp);
+	for (i = 1; i < n && ret; i++) {
+		iptcc_addr_half(&a, &p[i - 1].addr, p[i - 1].len, 0);
+		iptcc_addr_half(&b, &p[i].addr, p[i - 1].len, 0);
+		ret = memcmp(&a, &b, sizeof(a)) != 0;
+	}
+	free(p);
+	return ret;
+}
+
+/* Put one rule testing the match from `fn' in place of the `n' rules
+ * from `run' on, the first being rule `pos' of `c'.  It gets their
+ * counters added up.  Returns 1 also if the run stays, 0 on error. */
+static int
+iptcc_compact_run(struct xtc_handle *h, struct chain_head *c,
+		  struct rule_head *run, unsigned int pos, unsigned int n,
+		  bool dst, xtc_compact_fn fn, void *data,
+		  struct xtc_compact_stats *st)
+{
+	const STRUCT_ENTRY_MATCH *m;
+	struct xtc_prefix *prefixes;
+	struct rule_head *r, *next;
+	union nf_inet_addr any = {};
+	STRUCT_ENTRY *e, *copy;
+	unsigned int i;
+	int ret = 1;
+
+	prefixes = malloc(n * sizeof(*prefixes));
+	if (prefixes == NULL) {
+		errno = ENOMEM;
+		return 0;
+	}
+	for (i = 0, r = run; i < n; i++) {
+		rule_prefix(r->entry, dst, &prefixes[i].addr, &prefixes[i].len);
+		r = list_entry(r->list.next, struct rule_head, list);
+	}
+
+	/* once in the set, a packet in several prefixes matches once */
+	if (!iptcc_rule_terminal(run) && !iptcc_compact_disjoint(prefixes, n))
+		goto out;
+	m = fn(c->name, dst, prefixes, n, data);
+	if (m == NULL)
+		goto out;
+
+	copy = iptcc_copy_entry(run);
+	e = copy == NULL ? NULL : malloc(run->size + m->u.match_size);
+	if (e == NULL) {
+		free(copy);
+		errno = ENOMEM;
+		ret = 0;
+		goto out;
+	}
+	memcpy(e, copy, sizeof(STRUCT_ENTRY));
+	memcpy((char *)e + sizeof(STRUCT_ENTRY), m, m->u.match_size);
+	memcpy((char *)e + sizeof(STRUCT_ENTRY) + m->u.match_size,
+	       (char *)copy + sizeof(STRUCT_ENTRY),
+	       run->size - sizeof(STRUCT_ENTRY));
+	e->target_offset += m->u.match_size;
+	e->next_offset += m->u.match_size;
+	entry_set_prefix(e, dst, &any, 0, false);
+	for (i = 0, r = run; i < n; i++) {
+		e->counters.pcnt += r->entry->counters.pcnt;
+		e->counters.bcnt += r->entry->counters.bcnt;
+		r = list_entry(r->list.next, struct rule_head, list);
+	}
+
+	/* in front of the run, so that an error leaves the chain whole */
+	ret = TC_INSERT_ENTRY(c->name, e, pos, h);
+	free(copy);
+	free(e);
+	if (!ret)
+		goto out;
+	for (i = 0, r = run; i < n; i++, r = next) {
+		next = list_entry(r->list.next, struct rule_head, list);
+		iptcc_delete_rule(r);
+		c->num_rules--;
+	}
+	set_changed(h);
+	st->runs++;
+	st->rules += n;
+out:
+	free(prefixes);
+	return ret;
+}
+
+/* Replace every run of at least `min_rules' rules of `chain' that only
+ * differ in their source, or destination, prefix with one rule that
+ * tests the match `fn' makes of the prefixes: n comparisons become one
+ * lookup.  Runs are left alone where that would not be equivalent. */
+int TC_COMPACT_CHAIN(const IPT_CHAINLABEL chain, unsigned int min_rules,
+		     xtc_compact_fn fn, void *data,
+		     struct xtc_compact_stats *stats,
+		     struct xtc_handle *handle)
+{
+	struct xtc_compact_stats st = {};
+	struct rule_head *r, *start, *next;
+	struct chain_head *c;
+	unsigned int pos, n, runs;
+	bool dst;
+
+	iptc_fn = TC_COMPACT_CHAIN;
+
+	if (!(c = iptcc_find_label(chain, handle))) {
+		errno = ENOENT;
+		return 0;
+	}
+	if (min_rules < 2)
+		min_rules = 2;
+
+	pos = 0;
+	r = list_entry(c->rules.next, struct rule_head, list);
+	while (&r->list != &c->rules) {
+		start = r;
+		n = 1;
+		r = list_entry(r->list.next, struct rule_head, list);
+		if (!iptcc_compact_movable(start)) {
+			pos++;
+			continue;
+		}
+		dst = &r->list != &c->rules &&
+		      !iptcc_compact_same(start, r, false) &&
+		      iptcc_compact_same(start, r, true);
+		for (; &r->list != &c->rules &&
+		       iptcc_compact_same(start, r, dst); n++)
+			r = list_entry(r->list.next, struct rule_head, list);
+		if (n < min_rules) {
+			pos += n;
+			continue;
+		}
+		next = r;
+		runs = st.runs;
+		if (!iptcc_compact_run(handle, c, start, pos, n, dst, fn, data,
+				       &st)) {
+			iptc_fn = TC_COMPACT_CHAIN;
+			return 0;
+		}
+		pos += st.runs != runs ? 1 : n;
+		r = next;
+	}
+
+	if (stats != NULL)
+		*stats = st;
+	return 1;
+}
+
+/* A rule whose only port test is one tcp, udp or multiport match on the
+ * source or destination port: where it is, and the ports */
+struct iptcc_mp_rule {
+	struct rule_head *r;
+	unsigned int off, size;		/* of the match in the entry */
+	bool dst;
+	__u16 ranges[XT_MULTI_PORTS][2];
+	unsigned int n;
+};
+
+static bool
+iptcc_mp_range(struct iptcc_mp_rule *p, const __u16 *spts,
+		 const __u16 *dpts)
+{
+	bool sany = spts[0] == 0 && spts[1] == 0xffff;
+	bool dany = dpts[0] == 0 && dpts[1] == 0xffff;
+
+	if (sany == dany || spts[0] > spts[1] || dpts[0] > dpts[1])
+		return false;
+	p->dst = sany;
+	memcpy(p->ranges[0], p->dst ? dpts : spts, sizeof(p->ranges[0]));
+	p->n = 1;
+	return true;
+}
+
+/* Whether `m' only tests the ports of one side, and which */
+static bool
+iptcc_mp_match(struct iptcc_mp_rule *p, const STRUCT_ENTRY_MATCH *m)
+{
+	const char *name = m->u.user.name;
+	unsigned int i;
+
+	if (strcmp(name, "tcp") == 0) {
+		const struct xt_tcp *info = (const void *)m->data;
+
+		return info->invflags == 0 && info->option == 0 &&
+		       info->flg_mask == 0 &&
+		       iptcc_mp_range(p, info->spts, info->dpts);
+	}
+	if (strcmp(name, "udp") == 0) {
+		const struct xt_udp *info = (const void *)m->data;
+
+		return info->invflags == 0 &&
+		       iptcc_mp_range(p, info->spts, info->dpts);
+	}
+	if (strcmp(name, "multiport") == 0 && m->u.user.revision <= 1) {
+		const struct xt_multiport_v1 *info = (const void *)m->data;
+
+		if (info->count == 0 || info->count > XT_MULTI_PORTS ||
+		    (m->u.user.revision == 1 && info->invert) ||
+		    info->flags == XT_MULTIPORT_EITHER)
+			return false;
+		p->dst = info->flags == XT_MULTIPORT_DESTINATION;
+		for (i = 0, p->n = 0; i < info->count; i++, p->n++) {
+			p->ranges[p->n][0] = p->ranges[p->n][1] =
+				info->ports[i];
+			if (m->u.user.revision == 1 && info->pflags[i] &&
+			    i + 1 < info->count)
+				p->ranges[p->n][1] = info->ports[++i];
+		}
+		return true;
+	}
+	return false;
+}
+
+/* Find the port test of `r'; false if it has none, or more than one */
+static bool iptcc_mp_fill(struct iptcc_mp_rule *p, struct rule_head *r)
+{
+	const STRUCT_ENTRY_MATCH *m;
+	STRUCT_ENTRY *e = r->entry;
+	unsigned int off;
+
+	p->r = r;
+	p->size = 0;
+	for (off = sizeof(STRUCT_ENTRY); off < e->target_offset;
+	     off += m->u.match_size) {
+		m = (const void *)((const char *)e + off);
+		if (m->u.match_size < sizeof(*m))
+			return false;
+		if (strcmp(m->u.user.name, "tcp") != 0 &&
+		    strcmp(m->u.user.name, "udp") != 0 &&
+		    strcmp(m->u.user.name, "multiport") != 0)
+			continue;
+		if (p->size != 0 || !iptcc_mp_match(p, m))
+			return false;
+		p->off = off;
+		p->size = m->u.match_size;
+	}
+	return p->size != 0 && iptcc_rule_stateless(r);
+}
+
+/* Whether the rules only differ in the ports of the same side */
+static bool
+iptcc_mp_same(const struct iptcc_mp_rule *a,
+		const struct iptcc_mp_rule *b)
+{
+	const char *x = (const char *)a->r->entry;
+	const char *y = (const char *)b->r->entry;
+	unsigned int rest = a->r->size - a->off - a->size;
+	STRUCT_ENTRY_TARGET *t = GET_TARGET(a->r->entry);
+
+	if (a->dst != b->dst || a->r->type != b->r->type ||
+	    a->off != b->off || rest != b->r->size - b->off - b->size)
+		return false;
+	if (memcmp(x, y, offsetof(STRUCT_ENTRY, nfcache)) != 0 ||
+	    memcmp(x + sizeof(STRUCT_ENTRY), y + sizeof(STRUCT_ENTRY),
+		   a->off - sizeof(STRUCT_ENTRY)) != 0)
+		return false;
+	/* jumps are told apart by the chain, not by the target data */
+	if (a->r->type == IPTCC_R_JUMP) {
+		if (a->r->jump != b->r->jump)
+			return false;
+		rest -= t->u.target_size;
+	}
+	return memcmp(x + a->off + a->size, y + b->off + b->size, rest) == 0;
+}
+
+static int iptcc_mp_cmp(const void *x, const void *y)
+{
+	const __u16 *a = x, *b = y;
+
+	if (a[0] != b[0])
+		return a[0] < b[0] ? -1 : 1;
+	return (a[1] > b[1]) - (a[1] < b[1]);
+}
+
+/* A multiport rule in place of the port match of `p', for `n' of the
+ * sorted, disjoint `ranges' */
+static STRUCT_ENTRY *
+iptcc_mp_entry(const struct iptcc_mp_rule *p, const STRUCT_ENTRY *copy,
+		 const __u16 (*ranges)[2], unsigned int n)
+{
+	unsigned int msize = ALIGN(sizeof(STRUCT_ENTRY_MATCH)) +
+			     ALIGN(sizeof(struct xt_multiport_v1));
+	struct xt_multiport_v1 *info;
+	STRUCT_ENTRY_MATCH *m;
+	unsigned int i, k;
+	STRUCT_ENTRY *e;
+
+	e = calloc(1, p->r->size - p->size + msize);
+	if (e == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memcpy(e, copy, p->off);
+	memcpy((char *)e + p->off + msize, (const char *)copy + p->off +
+	       p->size, p->r->size - p->off - p->size);
+	e->target_offset += msize - p->size;
+	e->next_offset += msize - p->size;
+	memset(&e->counters, 0, sizeof(e->counters));
+
+	m = (STRUCT_ENTRY_MATCH *)((char *)e + p->off);
+	m->u.user.match_size = msize;
+	strcpy(m->u.user.name, "multiport");
+	m->u.user.revision = 1;
+	info = (struct xt_multiport_v1 *)m->data;
+	info->flags = p->dst ? XT_MULTIPORT_DESTINATION : XT_MULTIPORT_SOURCE;
+	for (i = 0, k = 0; i < n; i++) {
+		info->ports[k] = ranges[i][0];
+		if (ranges[i][0] != ranges[i][1]) {
+			info->pflags[k++] = 1;
+			info->ports[k] = ranges[i][1];
+		}
+		k++;
+	}
+	info->count = k;
+	return e;
+}
+
+/* Put as few multiport rules as the ports take in place of the `n'
+ * rules of `p', the first being rule `pos' of `c'.  The first of them
+ * gets the counters of the run.  Returns 1 also if the run stays. */
+static int
+iptcc_mp_run(struct xtc_handle *h, struct chain_head *c,
+	       struct iptcc_mp_rule *p, unsigned int pos, unsigned int n,
+	       struct xtc_ports_stats *st)
+{
+	unsigned int i, k, num = 0, slots, rules, start;
+	__u16 (*ranges)[2];
+	STRUCT_ENTRY *copy, *e;
+	int ret = 1;
+
+	for (i = 0; i < n; i++)
+		num += p[i].n;
+	ranges = malloc(num * sizeof(*ranges));
+	if (ranges == NULL) {
+		errno = ENOMEM;
+		return 0;
+	}
+	for (i = 0, num = 0; i < n; i++)
+		for (k = 0; k < p[i].n; k++, num++)
+			memcpy(ranges[num], p[i].ranges[k], sizeof(ranges[0]));
+	qsort(ranges, num, sizeof(*ranges), iptcc_mp_cmp);
+
+	/* a packet in two of the rules would go through the target once */
+	if (!iptcc_rule_terminal(p[0].r))
+		for (i = 1; i < num; i++)
+			if (ranges[i][0] <= ranges[i - 1][1])
+				goto out;
+
+	/* join what overlaps or touches */
+	for (i = 1, k = 0; i < num; i++) {
+		if ((unsigned int)ranges[k][1] + 1 >= ranges[i][0]) {
+			if (ranges[i][1] > ranges[k][1])
+				ranges[k][1] = ranges[i][1];
+			continue;
+		}
+		memcpy(ranges[++k], ranges[i], sizeof(ranges[0]));
+	}
+	num = k + 1;
+
+	for (i = 0, rules = 1, slots = 0; i < num; i++) {
+		k = ranges[i][0] == ranges[i][1] ? 1 : 2;
+		if (slots + k > XT_MULTI_PORTS) {
+			rules++;
+			slots = 0;
+		}
+		slots += k;
+	}
+	if (rules >= n)
+		goto out;
+
+	copy = iptcc_copy_entry(p[0].r);
+	if (copy == NULL) {
+		ret = 0;
+		goto out;
+	}
+	for (i = 0, k = 0; i < num && ret; i = start, k++) {
+		for (start = i, slots = 0; start < num; start++) {
+			slots += ranges[start][0] == ranges[start][1] ? 1 : 2;
+			if (slots > XT_MULTI_PORTS)
+				break;
+		}
+		e = iptcc_mp_entry(&p[0], copy, ranges + i, start - i);
+		if (e == NULL) {
+			ret = 0;
+			break;
+		}
+		if (k == 0)
+			for (slots = 0; slots < n; slots++) {
+				e->counters.pcnt +=
+					p[slots].r->entry->counters.pcnt;
+				e->counters.bcnt +=
+					p[slots].r->entry->counters.bcnt;
+			}
+		/* in front of the run, so that an error leaves it whole */
+		ret = TC_INSERT_ENTRY(c->name, e, pos + k, h);
+		free(e);
+	}
+	free(copy);
+	if (!ret)
+		goto out;
+	for (i = 0; i < n; i++) {
+		iptcc_delete_rule(p[i].r);
+		c->num_rules--;
+	}
+	set_changed(h);
+	st->runs++;
+	st->rules += n;
+	st->merged += rules;
+out:
+	free(ranges);
+	return ret;
+}
+
+/* Replace every run of rules of `chain' that only differ in the ports
+ * they test on one side, with tcp, udp or multiport, with as few
+ * multiport rules as the ports take: ports sorted, and those next to
+ * each other joined into ranges. */
+int TC_MULTIPORT_CHAIN(const IPT_CHAINLABEL chain,
+		       struct xtc_ports_stats *stats,
+		       struct xtc_handle *handle)
+{
+	struct xtc_ports_stats st = {};
+	struct iptcc_mp_rule *p;
+	struct rule_head *r, *next;
+	struct chain_head *c;
+	unsigned int pos, n, runs, merged;
+
+	iptc_fn = TC_MULTIPORT_CHAIN;
+
+	if (!(c = iptcc_find_label(chain, handle))) {
+		errno = ENOENT;
+		return 0;
+	}
+	p = malloc((c->num_rules + 1) * sizeof(*p));
+	if (p == NULL) {
+		errno = ENOMEM;
+		return 0;
+	}
+
+	pos = 0;
+	r = list_entry(c->rules.next, struct rule_head, list);
+	while (&r->list != &c->rules) {
+		next = list_entry(r->list.next, struct rule_head, list);
+		if (!iptcc_mp_fill(&p[0], r)) {
+			r = next;
+			pos++;
+			continue;
+		}
+		for (n = 1, r = next; &r->list != &c->rules &&
+		     iptcc_mp_fill(&p[n], r) && iptcc_mp_same(&p[0], &p[n]);
+		     n++)
+			r = list_entry(r->list.next, struct rule_head, list);
+		next = r;
+		runs = st.runs;
+		merged = st.merged;
+		if (n > 1 && !iptcc_mp_run(handle, c, p, pos, n, &st)) {
+			free(p);
+			iptc_fn = TC_MULTIPORT_CHAIN;
+			return 0;
+		}
+		pos += st.runs != runs ? st.merged - merged : n;
+		r = next;
+	}
+	free(p);
+
+	if (stats != NULL)
+		*stats = st;
+	return 1;
+}
+
+/* Flushes the entries in the given chain (ie. empties chain). */
+int
+TC_FLUSH_ENTRIES(const IPT_CHAINLABEL chain, struct xtc_handle *handle)
+{
+	struct chain_head *c;
+	struct rule_head *r, *tmp;
+
+	iptc_fn = TC_FLUSH_ENTRIES;
+	if (!(c = iptcc_find_label(chain, handle))) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	list_for_each_entry_safe(r, tmp, &c->rules, list) {
+		iptcc_delete_rule(r);
+	}
+
+	c->num_rules = 0;
+
+	set_changed(handle);
+
+	return 1;
+}
+
+/* Zeroes the counters in a chain. */
+int
+TC_ZERO_ENTRIES(const IPT_CHAINLABEL chain, struct xtc_handle *handle)
+{
+	struct chain_head *c;
+	struct rule_head *r;
+
+	iptc_fn = TC_ZERO_ENTRIES;
+	if (!(c = iptcc_find_label(chain, handle))) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	if (c->counter_map.maptype == COUNTER_MAP_NORMAL_MAP)
+		c->counter_map.maptype = COUNTER_MAP_ZEROED;
+
+	list_for_each_entry(r, &c->rules, list) {
+		if (r->counter_map.maptype == COUNTER_MAP_NORMAL_MAP)
+			r->counter_map.maptype = COUNTER_MAP_ZEROED;
+	}
+
+	set_changed(handle);
+
+	return 1;
+}
+
+STRUCT_COUNTERS *
+TC_READ_COUNTER(const IPT_CHAINLABEL chain,
+		unsigned int rulenum,
+		struct xtc_handle *handle)
+{
+	struct chain_head *c;
+	struct rule_head *r;
+
+	iptc_fn = TC_READ_COUNTER;
+	CHECK(*handle);
+
+	if (!(c = iptcc_find_label(chain, handle))) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	if (!(r = iptcc_get_rule_num(c, rulenum))) {
+		errno = E2BIG;
+		return NULL;
+	}
+
+	return &r->entry[0].counters;
+}
+
+int
+TC_ZERO_COUNTER(const IPT_CHAINLABEL chain,
+		unsigned int rulenum,
+		struct xtc_handle *handle)
+{
+	struct chain_head *c;
+	struct rule_head *r;
+
+	iptc_fn = TC_ZERO_COUNTER;
+	CHECK(handle);
+
+	if (!(c = iptcc_find_label(chain, handle))) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	if (!(r = iptcc_get_rule_num(c, rulenum))) {
+		errno = E2BIG;
+		return 0;
+	}
+
+	if (r->counter_map.maptype == COUNTER_MAP_NORMAL_MAP)
+		r->counter_map.maptype = COUNTER_MAP_ZEROED;
+
+	set_changed(handle);
+
+	return 1;
+}
+
+int
+TC_SET_COUNTER(const IPT_CHAINLABEL chain,
+	       unsigned int rulenum,
+	       STRUCT_COUNTERS *counters,
+	       struct xtc_handle *handle)
+{
+	struct chain_head *c;
+	struct rule_head *r;
+	STRUCT_ENTRY *e;
+
+	iptc_fn = TC_SET_COUNTER;
+	CHECK(handle);
+
+	if (!(c = iptcc_find_label(chain, handle))) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	if (!(r = iptcc_get_rule_num(c, rulenum))) {
+		errno = E2BIG;
+		return 0;
+	}
+
+	e = r->entry;
+	r->counter_map.maptype = COUNTER_MAP_SET;
+
+	memcpy(&e->counters, counters, sizeof(STRUCT_COUNTERS));
+
+	set_changed(handle);
+
+	return 1;
+}
+
+/* Creates a new chain. */
+/* To create a chain, create two rules: error node and unconditional
+ * return. */
+int
+TC_CREATE_CHAIN(const IPT_CHAINLABEL chain, struct xtc_handle *handle)
+{
+	static struct chain_head *c;
+	int capacity;
+	int exceeded;
+
+	iptc_fn = TC_CREATE_CHAIN;
+
+	/* find_label doesn't cover built-in targets: DROP, ACCEPT,
+           QUEUE, RETURN. */
+	if (iptcc_find_label(chain, handle)
+	    || strcmp(chain, LABEL_DROP) == 0
+	    || strcmp(chain, LABEL_ACCEPT) == 0
+	    || strcmp(chain, LABEL_QUEUE) == 0
+	    || strcmp(chain, LABEL_RETURN) == 0) {
+		DEBUGP("Chain `%s' already exists\n", chain);
+		errno = EEXIST;
+		return 0;
+	}
+
+	if (strlen(chain)+1 > sizeof(IPT_CHAINLABEL)) {
+		DEBUGP("Chain name `%s' too long\n", chain);
+		errno = EINVAL;
+		return 0;
+	}
+
+	c = iptcc_alloc_chain_head(chain, 0);
+	if (!c) {
+		DEBUGP("Cannot allocate memory for chain `%s'\n", chain);
+		errno = ENOMEM;
+		return 0;
+
+	}
+	handle->num_chains++; /* New user defined chain */
+
+	DEBUGP("Creating chain `%s'\n", chain);
+	iptc_insert_chain(handle, c); /* Insert sorted */
+
+	/* Inserting chains don't change the correctness of the chain
+	 * index (except if its smaller than index[0], but that
+	 * handled by iptc_insert_chain).  It only causes longer lists
+	 * in the buckets. Thus, only rebuild chain index when the
+	 * capacity is exceed with CHAIN_INDEX_INSERT_MAX chains.
+	 */
+	capacity = handle->chain_index_sz * CHAIN_INDEX_BUCKET_LEN;
+	exceeded = handle->num_chains - capacity;
+	if (exceeded > CHAIN_INDEX_INSERT_MAX) {
+		debug("Capacity(%d) exceeded(%d) rebuild (chains:%d)\n",
+		      capacity, exceeded, handle->num_chains);
+		iptcc_chain_index_rebuild(handle);
+	}
+
+	set_changed(handle);
+
+	return 1;
+}
+
+/* Get the number of references to this chain. */
+int
+TC_GET_REFERENCES(unsigned int *ref, const IPT_CHAINLABEL chain,
+		  struct xtc_handle *handle)
+{
+	struct chain_head *c;
+
+	iptc_fn = TC_GET_REFERENCES;
+	if (!(c = iptcc_find_label(chain, handle))) {
+		errno = ENOENT;
+		return 0;
 	}
 
 	*ref = c->references;
@@ -2346,14 +5633,14 @@ TC_DELETE_CHAIN(const IPT_CHAINLABEL chain, struct xtc_handle *handle)
 
 	handle->num_chains--; /* One user defined chain deleted */
 
+	set_changed(handle);
+
 	//list_del(&c->list); /* Done in iptcc_chain_index_delete_chain() */
 	iptcc_chain_index_delete_chain(c, handle);
 	free(c);
 
 	DEBUGP("chain `%s' deleted\n", chain);
 
-	set_changed(handle);
-
 	return 1;
 }
 
@@ -2692,6 +5979,271 @@ out_zero:
 	return 0;
 }
 
+/* Raw copy of a table as read from the kernel, see TC_SNAPSHOT. */
+struct xtc_snapshot {
+	STRUCT_GETINFO info;
+	STRUCT_GET_ENTRIES *entries;
+};
+
+/* Header of a snapshot written by TC_SNAPSHOT_SAVE */
+struct xtc_snapshot_hdr {
+	uint32_t magic;
+	uint32_t family;
+	uint32_t info_size;
+	uint32_t entries_size;
+};
+
+#define SNAPSHOT_MAGIC	0x58544353	/* "XTCS" */
+
+/* Copy the blob, hooks and counters that TC_INIT read from the kernel.
+ * Changes made to the handle since are not part of the snapshot. */
+struct xtc_snapshot *
+TC_SNAPSHOT(struct xtc_handle *handle)
+{
+	struct xtc_snapshot *snap;
+	size_t len = sizeof(STRUCT_GET_ENTRIES) + handle->info.size;
+
+	iptc_fn = TC_SNAPSHOT;
+
+	snap = malloc(sizeof(*snap));
+	if (snap == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	snap->info = handle->info;
+	snap->entries = malloc(len);
+	if (snap->entries == NULL) {
+		free(snap);
+		errno = ENOMEM;
+		return NULL;
+	}
+	memcpy(snap->entries, handle->entries, len);
+	return snap;
+}
+
+void
+TC_SNAPSHOT_FREE(struct xtc_snapshot *snap)
+{
+	if (snap == NULL)
+		return;
+	free(snap->entries);
+	free(snap);
+}
+
+const char *
+TC_SNAPSHOT_TABLE(const struct xtc_snapshot *snap)
+{
+	return snap->info.name;
+}
+
+static int snapshot_write(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (const char *)buf + ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Returns 1 on success, 0 on EOF before the first byte, -1 on error */
+static int snapshot_read(int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = read(fd, (char *)buf + done, len - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0) {
+			if (done == 0)
+				return 0;
+			errno = EINVAL;
+			return -1;
+		}
+		done += ret;
+	}
+	return 1;
+}
+
+/* Append the snapshot to fd.  The format is the kernel's binary one, so
+ * it can only be loaded again on the same architecture. */
+int
+TC_SNAPSHOT_SAVE(const struct xtc_snapshot *snap, int fd)
+{
+	struct xtc_snapshot_hdr hdr = {
+		.magic		= SNAPSHOT_MAGIC,
+		.family		= TC_AF,
+		.info_size	= sizeof(snap->info),
+		.entries_size	= snap->info.size,
+	};
+
+	iptc_fn = TC_SNAPSHOT_SAVE;
+
+	if (snapshot_write(fd, &hdr, sizeof(hdr)) < 0 ||
+	    snapshot_write(fd, &snap->info, sizeof(snap->info)) < 0 ||
+	    snapshot_write(fd, snap->entries, sizeof(STRUCT_GET_ENTRIES) +
+			   snap->info.size) < 0)
+		return 0;
+	return 1;
+}
+
+/* Read the next snapshot from fd.  Returns NULL and sets errno to 0 at
+ * the end of the file. */
+struct xtc_snapshot *
+TC_SNAPSHOT_LOAD(int fd)
+{
+	struct xtc_snapshot_hdr hdr;
+	struct xtc_snapshot *snap;
+	int ret;
+
+	iptc_fn = TC_SNAPSHOT_LOAD;
+
+	ret = snapshot_read(fd, &hdr, sizeof(hdr));
+	if (ret <= 0) {
+		if (ret == 0)
+			errno = 0;
+		return NULL;
+	}
+	if (hdr.magic != SNAPSHOT_MAGIC || hdr.family != TC_AF ||
+	    hdr.info_size != sizeof(snap->info)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	snap = malloc(sizeof(*snap));
+	if (snap == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	snap->entries = NULL;
+	if (snapshot_read(fd, &snap->info, sizeof(snap->info)) <= 0 ||
+	    snap->info.size != hdr.entries_size)
+		goto error;
+	snap->entries = malloc(sizeof(STRUCT_GET_ENTRIES) + snap->info.size);
+	if (snap->entries == NULL) {
+		errno = ENOMEM;
+		goto error;
+	}
+	if (snapshot_read(fd, snap->entries, sizeof(STRUCT_GET_ENTRIES) +
+			  snap->info.size) <= 0)
+		goto error;
+	if (snap->entries->size != snap->info.size ||
+	    strcmp(snap->entries->name, snap->info.name) != 0)
+		goto error;
+	return snap;
+
+error:
+	if (errno == 0)
+		errno = EINVAL;
+	TC_SNAPSHOT_FREE(snap);
+	return NULL;
+}
+
+/* Put the table back exactly as it was when the snapshot was taken,
+ * counters included.  The blob goes to the kernel as is; there is no
+ * parsing or compiling involved. */
+int
+TC_ROLLBACK(const struct xtc_snapshot *snap)
+{
+	STRUCT_GETINFO info;
+	STRUCT_REPLACE *repl;
+	STRUCT_COUNTERS_INFO *newcounters;
+	STRUCT_ENTRY *e;
+	unsigned int i, off, tries;
+	size_t counterlen;
+	socklen_t s;
+	int sockfd, ret = 0;
+
+	iptc_fn = TC_ROLLBACK;
+
+	sockfd = socket(TC_AF, SOCK_RAW, IPPROTO_RAW);
+	if (sockfd < 0)
+		return 0;
+
+	repl = malloc(sizeof(*repl) + snap->info.size);
+	if (repl == NULL) {
+		errno = ENOMEM;
+		goto out_close;
+	}
+	memset(repl, 0, sizeof(*repl));
+	strcpy(repl->name, snap->info.name);
+	repl->valid_hooks = snap->info.valid_hooks;
+	repl->num_entries = snap->info.num_entries;
+	repl->size = snap->info.size;
+	memcpy(repl->hook_entry, snap->info.hook_entry,
+	       sizeof(repl->hook_entry));
+	memcpy(repl->underflow, snap->info.underflow,
+	       sizeof(repl->underflow));
+	memcpy(repl->entries, snap->entries->entrytable, snap->info.size);
+
+	/* The kernel wants to hand back the counters of what it replaces,
+	 * so it needs the current number of entries. */
+	for (tries = 0; tries < 3; ++tries) {
+		s = sizeof(info);
+		strcpy(info.name, snap->info.name);
+		if (getsockopt(sockfd, TC_IPPROTO, SO_GET_INFO, &info, &s) < 0)
+			goto out_free_repl;
+
+		free(repl->counters);
+		repl->counters = malloc(sizeof(STRUCT_COUNTERS)
+					* (info.num_entries + 1));
+		if (repl->counters == NULL) {
+			errno = ENOMEM;
+			goto out_free_repl;
+		}
+		repl->num_counters = info.num_entries;
+
+		if (setsockopt(sockfd, TC_IPPROTO, SO_SET_REPLACE, repl,
+			       sizeof(*repl) + repl->size) == 0)
+			break;
+		if (errno != EAGAIN)
+			goto out_free_repl;
+	}
+	if (tries == 3)
+		goto out_free_repl;
+
+	/* Replacing zeroes the counters; add back those of the snapshot. */
+	counterlen = sizeof(STRUCT_COUNTERS_INFO)
+			+ sizeof(STRUCT_COUNTERS) * snap->info.num_entries;
+	newcounters = malloc(counterlen);
+	if (newcounters == NULL) {
+		errno = ENOMEM;
+		goto out_free_repl;
+	}
+	memset(newcounters, 0, counterlen);
+	strcpy(newcounters->name, snap->info.name);
+	newcounters->num_counters = snap->info.num_entries;
+	for (i = 0, off = 0; i < snap->info.num_entries &&
+	     off < snap->info.size; ++i, off += e->next_offset) {
+		e = (void *)snap->entries->entrytable + off;
+		newcounters->counters[i] = e->counters;
+	}
+
+	if (setsockopt(sockfd, TC_IPPROTO, SO_SET_ADD_COUNTERS,
+		       newcounters, counterlen) == 0)
+		ret = 1;
+	free(newcounters);
+
+out_free_repl:
+	free(repl->counters);
+	free(repl);
+out_close:
+	close(sockfd);
+	return ret;
+}
+
 /* Translates errno numbers into more human-readable form than strerror. */
 const char *
 TC_STRERROR(int err)
@@ -2706,6 +6258,13 @@ TC_STRERROR(int err)
 	    { TC_INIT, EINVAL, "Module is wrong version" },
 	    { TC_INIT, ENOENT,
 		    "Table does not exist (do you need to insmod?)" },
+	    { TC_INIT_OFFLINE, ENOENT, "Unknown table" },
+	    { TC_SNAPSHOT_LOAD, EINVAL, "Not a snapshot of this kind of table" },
+	    { TC_ROLLBACK, ENOENT,
+		    "Table does not exist (do you need to insmod?)" },
+	    { TC_ROLLBACK, EAGAIN, "Table kept changing during rollback" },
+	    { TC_TRACE_PACKET, ELOOP, "Loop found in table" },
+	    { TC_CHECK_PACKET, ELOOP, "Loop found in table" },
 	    { TC_DELETE_CHAIN, ENOTEMPTY, "Chain is not empty" },
 	    { TC_DELETE_CHAIN, EINVAL, "Can't delete built-in chain" },
 	    { TC_DELETE_CHAIN, EMLINK,
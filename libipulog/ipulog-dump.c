@@ -0,0 +1,240 @@
+/*
+ * ipulog-dump: print the packets logged by ULOG rules, as they come or
+ * from a capture of the ULOG netlink messages.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <libipulog/libipulog.h>
+#include <netinet/in.h>
+
+#define DUMP_READ	16	/* messages read at once */
+
+static const struct option dump_opts[] = {
+	{.name = "group",   .has_arg = true,  .val = 'g'},
+	{.name = "read",    .has_arg = true,  .val = 'r'},
+	{.name = "threads", .has_arg = true,  .val = 't'},
+	{.name = "rcvbuf",  .has_arg = true,  .val = 'b'},
+	{.name = "count",   .has_arg = true,  .val = 'c'},
+	{.name = "help",    .has_arg = false, .val = 'h'},
+	{NULL},
+};
+
+static void dump_usage(void)
+{
+	printf(
+"Usage: ipulog-dump [-g group]... [-t threads] [-b bytes] [-c count]\n"
+"       ipulog-dump -r capture [-c count]\n"
+"\n"
+"  -g, --group group     netlink group to read, 1 to 32 (default 1)\n"
+"  -r, --read capture    read a capture taken on an nlmon device\n"
+"  -t, --threads n       spread the groups over n threads\n"
+"  -b, --rcvbuf bytes    size of the receive buffer of each socket\n"
+"  -c, --count n         stop after n packets\n");
+}
+
+static unsigned long dump_number(const char *arg, const char *what,
+				 unsigned long max)
+{
+	unsigned long n;
+	char *end;
+
+	n = strtoul(arg, &end, 0);
+	if (end == arg || *end != '\0' || n == 0 || n > max) {
+		fprintf(stderr, "ipulog-dump: bad %s `%s'\n", what, arg);
+		exit(1);
+	}
+	return n;
+}
+
+/* One line for each packet, much as the LOG target would */
+static void dump_packet(const ulog_packet_msg_t *upkt, u_int32_t group,
+			void *data)
+{
+	const unsigned char *p = upkt->payload;
+	char line[512], src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+	size_t hlen = 0, n;
+	int proto = -1;
+
+	n = snprintf(line, sizeof(line), "%s IN=%.*s OUT=%.*s MARK=0x%lx "
+		     "LEN=%zu", upkt->prefix, IFNAMSIZ, upkt->indev_name,
+		     IFNAMSIZ, upkt->outdev_name, upkt->mark, upkt->data_len);
+	if (group != 0)
+		n += snprintf(line + n, sizeof(line) - n, " GROUP=%u",
+			      __builtin_ffs(group));
+	if (upkt->data_len >= 20 && p[0] >> 4 == 4) {
+		hlen = (p[0] & 0x0f) * 4;
+		inet_ntop(AF_INET, p + 12, src, sizeof(src));
+		inet_ntop(AF_INET, p + 16, dst, sizeof(dst));
+		proto = p[9];
+		/* Ports only in the first fragment */
+		if ((p[6] & 0x1f) != 0 || p[7] != 0)
+			hlen = upkt->data_len;
+	} else if (upkt->data_len >= 40 && p[0] >> 4 == 6) {
+		hlen = 40;
+		inet_ntop(AF_INET6, p + 8, src, sizeof(src));
+		inet_ntop(AF_INET6, p + 24, dst, sizeof(dst));
+		proto = p[6];
+	}
+	if (proto >= 0) {
+		n += snprintf(line + n, sizeof(line) - n,
+			      " SRC=%s DST=%s PROTO=%d", src, dst, proto);
+		if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP) &&
+		    hlen + 4 <= upkt->data_len)
+			snprintf(line + n, sizeof(line) - n, " SPT=%u DPT=%u",
+				 p[hlen] << 8 | p[hlen + 1],
+				 p[hlen + 2] << 8 | p[hlen + 3]);
+	}
+	puts(line);
+}
+
+/* Read the groups, or the capture, on this thread */
+static int dump_read(struct ipulog_handle *h, unsigned long count)
+{
+	struct ipulog_msgbuf msgs[DUMP_READ];
+	const ulog_packet_msg_t *upkt;
+	struct ipulog_iter it;
+	unsigned long seen = 0;
+	unsigned char *bufs;
+	int i, n;
+
+	bufs = malloc(DUMP_READ * IPULOG_BUFSIZE);
+	if (bufs == NULL) {
+		perror("ipulog-dump");
+		return -1;
+	}
+	for (i = 0; i < DUMP_READ; i++) {
+		msgs[i].buf = bufs + i * IPULOG_BUFSIZE;
+		msgs[i].len = IPULOG_BUFSIZE;
+	}
+	while ((n = ipulog_read_batch(h, msgs, DUMP_READ, 0)) != 0) {
+		if (n < 0) {
+			ipulog_perror("ipulog-dump");
+			if (errno == EBADMSG || errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			ipulog_iter_init(&it, msgs[i].buf, msgs[i].size);
+			while ((upkt = ipulog_iter_next(&it)) != NULL) {
+				dump_packet(upkt, msgs[i].group, NULL);
+				if (++seen == count)
+					goto out;
+			}
+			if (it.invalid > 0)
+				fprintf(stderr, "ipulog-dump: %u malformed "
+					"part%s left out\n", it.invalid,
+					it.invalid == 1 ? "" : "s");
+		}
+	}
+ out:
+	free(bufs);
+	if (ipulog_get_drops(h) > 0)
+		fprintf(stderr, "ipulog-dump: %lu overruns\n",
+			ipulog_get_drops(h));
+	return n < 0 ? -1 : 0;
+}
+
+/* Until SIGINT or SIGTERM, which only this thread takes */
+static int dump_threads(u_int32_t gmask, unsigned int nthreads,
+			size_t rcvbuf)
+{
+	struct ipulog_threads *t;
+	unsigned long drops;
+	sigset_t set;
+	int sig;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	t = ipulog_threads_start(gmask, nthreads, rcvbuf, dump_packet, NULL);
+	if (t == NULL) {
+		ipulog_perror("ipulog-dump");
+		return -1;
+	}
+	sigwait(&set, &sig);
+	drops = ipulog_threads_drops(t);
+	if (ipulog_threads_stop(t) < 0) {
+		perror("ipulog-dump");
+		return -1;
+	}
+	if (drops > 0)
+		fprintf(stderr, "ipulog-dump: %lu overruns\n", drops);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *capture = NULL;
+	unsigned long count = 0, rcvbuf = 0;
+	unsigned int nthreads = 0;
+	struct ipulog_handle *h;
+	u_int32_t gmask = 0;
+	int c, ret;
+
+	while ((c = getopt_long(argc, argv, "g:r:t:b:c:h", dump_opts,
+				NULL)) != -1) {
+		switch (c) {
+		case 'g':
+			gmask |= ipulog_group2gmask(dump_number(optarg,
+							"group", 32));
+			break;
+		case 'r':
+			capture = optarg;
+			break;
+		case 't':
+			nthreads = dump_number(optarg, "thread count", 32);
+			break;
+		case 'b':
+			rcvbuf = dump_number(optarg, "size", 1 << 30);
+			break;
+		case 'c':
+			count = dump_number(optarg, "count", ~0UL);
+			break;
+		case 'h':
+			dump_usage();
+			exit(0);
+		default:
+			dump_usage();
+			exit(1);
+		}
+	}
+	if (optind != argc || (nthreads != 0 && count != 0) ||
+	    (capture != NULL && (gmask | nthreads | rcvbuf) != 0)) {
+		dump_usage();
+		exit(1);
+	}
+	if (gmask == 0)
+		gmask = ipulog_group2gmask(ULOG_DEFAULT_NLGROUP);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	if (nthreads != 0)
+		return dump_threads(gmask, nthreads, rcvbuf) < 0;
+
+	h = capture != NULL ? ipulog_open_capture(capture) :
+			      ipulog_create_handle(gmask);
+	if (h == NULL) {
+		ipulog_perror(capture != NULL ? capture : "ipulog-dump");
+		exit(1);
+	}
+	if (rcvbuf != 0 && ipulog_set_rcvbuf(h, rcvbuf) < 0)
+		ipulog_perror("ipulog-dump");
+	ret = dump_read(h, count);
+	ipulog_destroy_handle(h);
+	return ret < 0;
+}
@@ -0,0 +1,250 @@
+/*
+ * ipulog_bench.c
+ *
+ * Batches of ULOG_MAX_QLEN packets, as the kernel sends them with
+ * --ulog-qthreshold 50, walked with ipulog_get_packet and with the
+ * iterator, in memory, then written to a capture and read back with
+ * ipulog_read and with ipulog_read_batch.  The capture may be kept,
+ * to be read by ipulog-dump -r.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <libipulog/libipulog.h>
+#include <netinet/in.h>
+
+#define BENCH_ROUNDS	20	/* walks of the batches in memory */
+#define BENCH_PAYLOAD	128
+#define BENCH_READ	64	/* messages read at once */
+#define ULOG_NL_EVENT	111	/* the type the kernel gives the parts */
+
+struct bench_msg {
+	unsigned char *buf;
+	size_t len;
+};
+
+static void bench_fail(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A UDP packet from 10.0.0.x to 192.0.2.1, logged on FORWARD */
+static size_t bench_part(unsigned char *buf, unsigned int seq, int last)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	ulog_packet_msg_t *upkt = NLMSG_DATA(nlh);
+	unsigned char *p = upkt->payload;
+
+	memset(nlh, 0, NLMSG_SPACE(sizeof(*upkt) + BENCH_PAYLOAD));
+	nlh->nlmsg_len = NLMSG_LENGTH(sizeof(*upkt) + BENCH_PAYLOAD);
+	nlh->nlmsg_type = last ? NLMSG_DONE : ULOG_NL_EVENT;
+	nlh->nlmsg_flags = NLM_F_MULTI;
+	nlh->nlmsg_seq = seq;
+	upkt->mark = seq;
+	upkt->timestamp_sec = 1000000000 + seq / 1000;
+	upkt->hook = 2;
+	strcpy(upkt->indev_name, "eth0");
+	strcpy(upkt->outdev_name, "eth1");
+	strcpy(upkt->prefix, "bench");
+	upkt->data_len = BENCH_PAYLOAD;
+	p[0] = 0x45;
+	p[2] = BENCH_PAYLOAD >> 8;
+	p[3] = BENCH_PAYLOAD & 0xff;
+	p[8] = 64;
+	p[9] = IPPROTO_UDP;
+	p[12] = 10;
+	p[15] = seq & 0xff;
+	p[16] = 192;
+	p[18] = 2;
+	p[19] = 1;
+	p[20] = 0x04;
+	p[23] = 53;
+	return NLMSG_SPACE(sizeof(*upkt) + BENCH_PAYLOAD);
+}
+
+static struct bench_msg *bench_build(unsigned int n)
+{
+	size_t size = ULOG_MAX_QLEN *
+		      NLMSG_SPACE(sizeof(ulog_packet_msg_t) + BENCH_PAYLOAD);
+	struct bench_msg *msgs;
+	unsigned int i, j;
+
+	msgs = calloc(n, sizeof(*msgs));
+	if (msgs == NULL)
+		bench_fail("calloc");
+	for (i = 0; i < n; i++) {
+		msgs[i].buf = malloc(size);
+		if (msgs[i].buf == NULL)
+			bench_fail("malloc");
+		for (j = 0; j < ULOG_MAX_QLEN; j++)
+			msgs[i].len += bench_part(msgs[i].buf + msgs[i].len,
+						  i * ULOG_MAX_QLEN + j,
+						  j == ULOG_MAX_QLEN - 1);
+	}
+	return msgs;
+}
+
+/* A pcap file of LINKTYPE_NETLINK, as tcpdump -i nlmon0 writes it */
+static void bench_write(const char *file, const struct bench_msg *msgs,
+			unsigned int n)
+{
+	u_int32_t hdr[6] = {0xa1b2c3d4, 2 | 4 << 16, 0, 0, 262144, 253};
+	unsigned char cooked[16];
+	u_int32_t rec[4];
+	unsigned int i;
+	FILE *f;
+
+	f = fopen(file, "we");
+	if (f == NULL)
+		bench_fail(file);
+	memset(cooked, 0, sizeof(cooked));
+	*(u_int16_t *)&cooked[0] = htons(4);		/* outgoing */
+	*(u_int16_t *)&cooked[2] = htons(824);		/* ARPHRD_NETLINK */
+	*(u_int16_t *)&cooked[14] = htons(NETLINK_NFLOG);
+	fwrite(hdr, sizeof(hdr), 1, f);
+	for (i = 0; i < n; i++) {
+		rec[0] = 1000000000 + i;
+		rec[1] = 0;
+		rec[2] = rec[3] = sizeof(cooked) + msgs[i].len;
+		fwrite(rec, sizeof(rec), 1, f);
+		fwrite(cooked, sizeof(cooked), 1, f);
+		fwrite(msgs[i].buf, msgs[i].len, 1, f);
+	}
+	if (fclose(f) != 0)
+		bench_fail(file);
+}
+
+static void bench_report(const char *what, unsigned long pkts,
+			 unsigned long expect, double t)
+{
+	printf("%-34s %9lu packets  %7.3f s  %6.1f ns each\n", what, pkts, t,
+	       pkts ? t * 1e9 / pkts : 0);
+	if (pkts != expect) {
+		fprintf(stderr, "ipulog_bench: %lu packets, not %lu\n",
+			pkts, expect);
+		exit(1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int n = argc > 1 ? strtoul(argv[1], NULL, 0) : 2000;
+	char tmp[] = "/tmp/ipulog_bench.XXXXXX";
+	const char *file = argc > 2 ? argv[2] : tmp;
+	unsigned char *bufs;
+	struct ipulog_msgbuf rd[BENCH_READ];
+	struct ipulog_handle *h;
+	struct ipulog_iter it;
+	struct bench_msg *msgs;
+	unsigned long pkts, expect = (unsigned long)n * ULOG_MAX_QLEN;
+	unsigned int i, r;
+	ssize_t len;
+	double t;
+	int k, fd;
+
+	if (n == 0 || argc > 3) {
+		fprintf(stderr, "Usage: %s [batches [capture]]\n", argv[0]);
+		exit(1);
+	}
+	if (argc <= 2) {
+		fd = mkstemp(tmp);
+		if (fd < 0)
+			bench_fail("mkstemp");
+		close(fd);
+	}
+	msgs = bench_build(n);
+	bench_write(file, msgs, n);
+	h = ipulog_open_capture(file);
+	if (h == NULL) {
+		ipulog_perror(file);
+		exit(1);
+	}
+
+	t = bench_now();
+	for (pkts = 0, r = 0; r < BENCH_ROUNDS; r++)
+		for (i = 0; i < n; i++)
+			while (ipulog_get_packet(h, msgs[i].buf,
+						 msgs[i].len) != NULL)
+				pkts++;
+	bench_report("in memory, ipulog_get_packet", pkts,
+		     expect * BENCH_ROUNDS, bench_now() - t);
+
+	t = bench_now();
+	for (pkts = 0, r = 0; r < BENCH_ROUNDS; r++)
+		for (i = 0; i < n; i++) {
+			ipulog_iter_init(&it, msgs[i].buf, msgs[i].len);
+			while (ipulog_iter_next(&it) != NULL)
+				pkts++;
+		}
+	bench_report("in memory, ipulog_iter_next", pkts,
+		     expect * BENCH_ROUNDS, bench_now() - t);
+
+	bufs = malloc(BENCH_READ * IPULOG_BUFSIZE);
+	if (bufs == NULL)
+		bench_fail("malloc");
+
+	t = bench_now();
+	pkts = 0;
+	while ((len = ipulog_read(h, bufs, IPULOG_BUFSIZE, 0)) > 0)
+		while (ipulog_get_packet(h, bufs, len) != NULL)
+			pkts++;
+	if (len < 0) {
+		ipulog_perror("ipulog_read");
+		exit(1);
+	}
+	bench_report("capture, ipulog_read", pkts, expect, bench_now() - t);
+	ipulog_destroy_handle(h);
+
+	h = ipulog_open_capture(file);
+	if (h == NULL) {
+		ipulog_perror(file);
+		exit(1);
+	}
+	for (i = 0; i < BENCH_READ; i++) {
+		rd[i].buf = bufs + i * IPULOG_BUFSIZE;
+		rd[i].len = IPULOG_BUFSIZE;
+	}
+	t = bench_now();
+	pkts = 0;
+	while ((k = ipulog_read_batch(h, rd, BENCH_READ, 0)) > 0)
+		for (i = 0; i < (unsigned int)k; i++) {
+			ipulog_iter_init(&it, rd[i].buf, rd[i].size);
+			while (ipulog_iter_next(&it) != NULL)
+				pkts++;
+		}
+	if (k < 0) {
+		ipulog_perror("ipulog_read_batch");
+		exit(1);
+	}
+	bench_report("capture, ipulog_read_batch", pkts, expect,
+		     bench_now() - t);
+	ipulog_destroy_handle(h);
+
+	if (argc <= 2)
+		unlink(tmp);
+	for (i = 0; i < n; i++)
+		free(msgs[i].buf);
+	free(msgs);
+	free(bufs);
+	return 0;
+}
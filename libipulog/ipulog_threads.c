@@ -0,0 +1,199 @@
+/*
+ * ipulog_threads.c
+ *
+ * The multicast groups of a mask spread over threads, each with a
+ * socket bound to its own groups, so that rules logging to different
+ * groups are read, and their packets handled, at once.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <libipulog/libipulog.h>
+
+#define IPULOG_THREADS_MAX	32	/* one a group at most */
+#define IPULOG_THREAD_BATCH	8	/* messages read at once, of IPULOG_BUFSIZE */
+
+struct ipulog_thread {
+	struct ipulog_threads *t;
+	struct ipulog_handle *h;
+	u_int32_t gmask;
+	int error;			/* errno it stopped on, or 0 */
+	pthread_t thread;
+};
+
+struct ipulog_threads {
+	unsigned int nthreads;
+	ipulog_fn *fn;
+	void *data;
+	int efd;			/* readable once told to stop */
+	struct ipulog_thread thread[IPULOG_THREADS_MAX];
+};
+
+static void *ipulog_thread_run(void *arg)
+{
+	struct ipulog_thread *th = arg;
+	struct ipulog_threads *t = th->t;
+	struct ipulog_msgbuf msgs[IPULOG_THREAD_BATCH];
+	const ulog_packet_msg_t *upkt;
+	struct ipulog_iter it;
+	struct pollfd pfd[2];
+	unsigned char *bufs;
+	int i, n;
+
+	bufs = malloc(IPULOG_THREAD_BATCH * IPULOG_BUFSIZE);
+	if (bufs == NULL) {
+		th->error = errno;
+		return NULL;
+	}
+	for (i = 0; i < IPULOG_THREAD_BATCH; i++) {
+		msgs[i].buf = bufs + i * IPULOG_BUFSIZE;
+		msgs[i].len = IPULOG_BUFSIZE;
+	}
+	pfd[0].fd = t->efd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ipulog_fd(th->h);
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			th->error = errno;
+			break;
+		}
+		if (pfd[0].revents)
+			break;
+		if (!pfd[1].revents)
+			continue;
+		/* Not waiting: an overrun makes it readable with nothing */
+		n = ipulog_read_batch(th->h, msgs, IPULOG_THREAD_BATCH, -1);
+		if (n < 0) {
+			if (errno == EBADMSG || errno == EINTR)
+				continue;
+			th->error = errno;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			ipulog_iter_init(&it, msgs[i].buf, msgs[i].size);
+			while ((upkt = ipulog_iter_next(&it)) != NULL)
+				t->fn(upkt, msgs[i].group, t->data);
+		}
+	}
+	free(bufs);
+	return NULL;
+}
+
+/*
+ * Read the groups of gmask on up to nthreads threads, a thread having
+ * the groups that are i, i + nthreads, i + 2 * nthreads, ... of gmask,
+ * and call fn with each packet on the thread that read it.  rcvbuf, if
+ * not 0, sizes the receive buffer of each socket.
+ */
+struct ipulog_threads *ipulog_threads_start(u_int32_t gmask,
+					    unsigned int nthreads,
+					    size_t rcvbuf,
+					    ipulog_fn *fn, void *data)
+{
+	struct ipulog_threads *t;
+	unsigned int i, k, ngroups;
+	int err;
+
+	ngroups = __builtin_popcount(gmask);
+	if (gmask == 0 || nthreads == 0 || fn == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (nthreads > ngroups)
+		nthreads = ngroups;
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return NULL;
+	t->fn = fn;
+	t->data = data;
+	for (i = 0, k = 0; i < 32; i++)
+		if (gmask & (1U << i))
+			t->thread[k++ % nthreads].gmask |= 1U << i;
+
+	t->efd = eventfd(0, EFD_CLOEXEC);
+	if (t->efd < 0)
+		goto fail;
+	for (i = 0; i < nthreads; i++) {
+		struct ipulog_thread *th = &t->thread[i];
+
+		th->t = t;
+		th->h = ipulog_create_handle(th->gmask);
+		if (th->h == NULL)
+			goto fail;
+		if (rcvbuf != 0 && ipulog_set_rcvbuf(th->h, rcvbuf) < 0) {
+			ipulog_destroy_handle(th->h);
+			goto fail;
+		}
+		errno = pthread_create(&th->thread, NULL, ipulog_thread_run,
+				       th);
+		if (errno != 0) {
+			ipulog_destroy_handle(th->h);
+			goto fail;
+		}
+		t->nthreads++;
+	}
+	return t;
+
+ fail:
+	err = errno;
+	ipulog_threads_stop(t);
+	errno = err;
+	return NULL;
+}
+
+/* The overruns of all the sockets, see ipulog_get_drops() */
+unsigned long ipulog_threads_drops(const struct ipulog_threads *t)
+{
+	unsigned long drops = 0;
+	unsigned int i;
+
+	for (i = 0; i < t->nthreads; i++)
+		drops += ipulog_get_drops(t->thread[i].h);
+	return drops;
+}
+
+/*
+ * Stop the threads, once they are done with the messages they have
+ * read, and free them.  Returns -1, with errno, if one of them had
+ * stopped on an error.
+ */
+int ipulog_threads_stop(struct ipulog_threads *t)
+{
+	u_int64_t one = 1;
+	unsigned int i;
+	int err = 0;
+
+	if (t->efd >= 0 && write(t->efd, &one, sizeof(one)) < 0)
+		err = errno;
+	for (i = 0; i < t->nthreads; i++) {
+		pthread_join(t->thread[i].thread, NULL);
+		if (t->thread[i].error != 0)
+			err = t->thread[i].error;
+		ipulog_destroy_handle(t->thread[i].h);
+	}
+	if (t->efd >= 0)
+		close(t->efd);
+	free(t);
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,714 @@
+/*
+ * libipulog.c
+ *
+ * netfilter ULOG userspace library.
+ *
+ * Based on the libipulog of ulogd by Harald Welte <laforge@gnumonks.org>
+ *
+ * The kernel queues up to --ulog-qthreshold packets and sends them in
+ * one multipart netlink message, the last part of which has the type
+ * NLMSG_DONE and still a packet.  Messages are read whole into the
+ * caller's buffers and their packets handed out where they are.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#define _GNU_SOURCE 1		/* recvmmsg */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+#include <libipulog/libipulog.h>
+
+/****************************************************************************
+ *
+ * Private interface
+ *
+ ****************************************************************************/
+
+enum {
+	IPULOG_ERR_NONE = 0,
+	IPULOG_ERR_IMPL,
+	IPULOG_ERR_HANDLE,
+	IPULOG_ERR_SOCKET,
+	IPULOG_ERR_BIND,
+	IPULOG_ERR_RECVBUF,
+	IPULOG_ERR_RECV,
+	IPULOG_ERR_NLEOF,
+	IPULOG_ERR_TRUNC,
+	IPULOG_ERR_INVGR,
+	IPULOG_ERR_INVNL,
+	IPULOG_ERR_TIMEOUT,
+	IPULOG_ERR_SOCKOPT,
+	IPULOG_ERR_CAPTURE,
+};
+
+#define IPULOG_MAXERR IPULOG_ERR_CAPTURE
+
+static struct ipulog_errmap_t {
+	int errcode;
+	char *message;
+} ipulog_errmap[] = {
+	{ IPULOG_ERR_NONE, "No error" },
+	{ IPULOG_ERR_IMPL, "Not implemented yet" },
+	{ IPULOG_ERR_HANDLE, "Unable to create netlink handle" },
+	{ IPULOG_ERR_SOCKET, "Unable to create netlink socket" },
+	{ IPULOG_ERR_BIND, "Unable to bind netlink socket" },
+	{ IPULOG_ERR_RECVBUF, "Receive buffer size invalid" },
+	{ IPULOG_ERR_RECV, "Error during netlink receive" },
+	{ IPULOG_ERR_NLEOF, "Received EOF on netlink socket" },
+	{ IPULOG_ERR_TRUNC, "Receive message truncated" },
+	{ IPULOG_ERR_INVGR, "Invalid group specified" },
+	{ IPULOG_ERR_INVNL, "Invalid netlink message" },
+	{ IPULOG_ERR_TIMEOUT, "Timeout" },
+	{ IPULOG_ERR_SOCKOPT, "Unable to set socket option" },
+	{ IPULOG_ERR_CAPTURE, "Unable to read capture file" },
+};
+
+/* Per thread, for the threads of ipulog_threads_start() */
+static __thread int ipulog_errno = IPULOG_ERR_NONE;
+
+/* Most messages read by one call of ipulog_read_batch() */
+#define IPULOG_BATCH_MAX	64
+
+/*
+ * A capture file, as tcpdump writes it from an nlmon device: a pcap
+ * file header, then a record header, a cooked header and the message
+ * for each netlink message, of any family.
+ */
+#define IPULOG_PCAP_MAGIC	0xa1b2c3d4
+#define IPULOG_PCAP_MAGIC_NS	0xa1b23c4d
+#define IPULOG_LINKTYPE_NETLINK	253
+#define IPULOG_COOKED_LEN	16	/* netlink family in the last two */
+
+struct ipulog_pcap_hdr {
+	u_int32_t magic;
+	u_int16_t version_major, version_minor;
+	int32_t thiszone;
+	u_int32_t sigfigs, snaplen, linktype;
+};
+
+struct ipulog_pcap_rec {
+	u_int32_t sec, usec, caplen, len;
+};
+
+struct ipulog_handle {
+	int fd;
+	u_int8_t blocking;
+	struct sockaddr_nl local;
+	struct sockaddr_nl peer;
+	struct nlmsghdr *last_nlhdr;	/* part ipulog_get_packet() is at */
+	unsigned long drops;		/* overruns of the receive buffer */
+	FILE *capture;			/* read instead of the socket */
+	int swapped;			/* written the other way round */
+};
+
+static char *ipulog_strerror(int errcode)
+{
+	if (errcode < 0 || errcode > IPULOG_MAXERR)
+		errcode = IPULOG_ERR_IMPL;
+	return ipulog_errmap[errcode].message;
+}
+
+/*
+ * Wait for a message for timeout microseconds, or not at all if it is
+ * negative: 1 if one came, 0 on timeout or a signal, -1 on error.
+ */
+static int ipulog_netlink_wait(const struct ipulog_handle *h, int timeout)
+{
+	struct timeval tv;
+	fd_set read_fds;
+	int ret;
+
+	if (timeout < 0) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+	} else {
+		tv.tv_sec = timeout / 1000000;
+		tv.tv_usec = timeout % 1000000;
+	}
+	FD_ZERO(&read_fds);
+	FD_SET(h->fd, &read_fds);
+	ret = select(h->fd + 1, &read_fds, NULL, NULL, &tv);
+	if (ret < 0) {
+		if (errno == EINTR)
+			return 0;
+		ipulog_errno = IPULOG_ERR_RECV;
+		return -1;
+	}
+	if (!FD_ISSET(h->fd, &read_fds)) {
+		ipulog_errno = IPULOG_ERR_TIMEOUT;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * The kernel tells of packets it dropped for want of room in the
+ * receive buffer with ENOBUFS, once; the socket is fine afterwards.
+ */
+static int ipulog_overrun(struct ipulog_handle *h)
+{
+	if (errno != ENOBUFS)
+		return 0;
+	__atomic_add_fetch(&h->drops, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/* Whether a message read from addr, of size bytes, is whole and ours */
+static int ipulog_netlink_ok(const struct sockaddr_nl *addr,
+			     socklen_t addrlen, const unsigned char *buf,
+			     ssize_t size, int flags)
+{
+	const struct nlmsghdr *nlh = (const struct nlmsghdr *)buf;
+
+	if (addrlen != sizeof(*addr) || addr->nl_pid != 0) {
+		ipulog_errno = IPULOG_ERR_RECV;
+		return 0;
+	}
+	if (size == 0) {
+		ipulog_errno = IPULOG_ERR_NLEOF;
+		return 0;
+	}
+	if (flags & MSG_TRUNC || size < (ssize_t)sizeof(*nlh) ||
+	    nlh->nlmsg_len > size) {
+		ipulog_errno = IPULOG_ERR_TRUNC;
+		return 0;
+	}
+	return 1;
+}
+
+static u_int32_t ipulog_capture32(const struct ipulog_handle *h,
+				  u_int32_t x)
+{
+	return h->swapped ? __builtin_bswap32(x) : x;
+}
+
+/* Read and drop len bytes, since a capture may come through a pipe */
+static int ipulog_capture_skip(struct ipulog_handle *h, size_t len)
+{
+	char junk[4096];
+	size_t n;
+
+	while (len > 0) {
+		n = len < sizeof(junk) ? len : sizeof(junk);
+		if (fread(junk, 1, n, h->capture) != n)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * The next message of the ULOG family in the capture: its size, 0 at
+ * the end of the file, -1 on error.
+ */
+static ssize_t ipulog_capture_read(struct ipulog_handle *h,
+				   unsigned char *buf, size_t len)
+{
+	unsigned char cooked[IPULOG_COOKED_LEN];
+	struct ipulog_pcap_rec rec;
+	size_t caplen;
+
+	for (;;) {
+		if (fread(&rec, sizeof(rec), 1, h->capture) != 1) {
+			if (ferror(h->capture))
+				break;
+			return 0;
+		}
+		caplen = ipulog_capture32(h, rec.caplen);
+		if (caplen < sizeof(cooked) ||
+		    fread(cooked, sizeof(cooked), 1, h->capture) != 1)
+			break;
+		caplen -= sizeof(cooked);
+		/* nlmon sees the messages of every family */
+		if ((cooked[14] << 8 | cooked[15]) != NETLINK_NFLOG) {
+			if (ipulog_capture_skip(h, caplen) < 0)
+				break;
+			continue;
+		}
+		if (caplen > len ||
+		    ipulog_capture32(h, rec.len) != caplen + sizeof(cooked) ||
+		    caplen < sizeof(struct nlmsghdr)) {
+			if (ipulog_capture_skip(h, caplen) < 0)
+				break;
+			ipulog_errno = IPULOG_ERR_TRUNC;
+			return -1;
+		}
+		if (fread(buf, caplen, 1, h->capture) != 1)
+			break;
+		if (((struct nlmsghdr *)buf)->nlmsg_len > caplen) {
+			ipulog_errno = IPULOG_ERR_TRUNC;
+			return -1;
+		}
+		return caplen;
+	}
+	ipulog_errno = IPULOG_ERR_CAPTURE;
+	return -1;
+}
+
+/*
+ * Read up to n messages from a capture, leaving out those that are not
+ * valid as ipulog_netlink_recvmmsg() does; -1 if none was.
+ */
+static int ipulog_capture_batch(struct ipulog_handle *h,
+				struct ipulog_msgbuf *msgs, unsigned int n)
+{
+	unsigned int got = 0;
+	int err = IPULOG_ERR_NONE;
+	ssize_t status;
+
+	while (got < n) {
+		status = ipulog_capture_read(h, msgs[got].buf, msgs[got].len);
+		if (status == 0)
+			break;
+		if (status < 0) {
+			if (ipulog_errno != IPULOG_ERR_TRUNC)
+				return got ? (int)got : -1;
+			err = ipulog_errno;
+			continue;
+		}
+		msgs[got].size = status;
+		msgs[got].group = 0;
+		got++;
+	}
+	if (got == 0 && err != IPULOG_ERR_NONE) {
+		ipulog_errno = err;
+		errno = EBADMSG;
+		return -1;
+	}
+	return got;
+}
+
+/*
+ * Read up to n messages with one recvmmsg.  The messages that are not
+ * valid are left out and the valid ones moved to the front, buffers
+ * and all; -1 if none was.
+ */
+static int ipulog_netlink_recvmmsg(struct ipulog_handle *h,
+				   struct ipulog_msgbuf *msgs,
+				   unsigned int n, int timeout)
+{
+	struct mmsghdr mmsg[IPULOG_BATCH_MAX];
+	struct sockaddr_nl addr[IPULOG_BATCH_MAX];
+	struct iovec iov[IPULOG_BATCH_MAX];
+	struct ipulog_msgbuf tmp;
+	unsigned int i, got = 0;
+	int status, err = IPULOG_ERR_NONE;
+
+	if (n > IPULOG_BATCH_MAX)
+		n = IPULOG_BATCH_MAX;
+	memset(mmsg, 0, n * sizeof(mmsg[0]));
+	for (i = 0; i < n; i++) {
+		if (msgs[i].len < sizeof(struct nlmsghdr)) {
+			ipulog_errno = IPULOG_ERR_RECVBUF;
+			return -1;
+		}
+		iov[i].iov_base = msgs[i].buf;
+		iov[i].iov_len = msgs[i].len;
+		mmsg[i].msg_hdr.msg_iov = &iov[i];
+		mmsg[i].msg_hdr.msg_iovlen = 1;
+		mmsg[i].msg_hdr.msg_name = &addr[i];
+		mmsg[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+	}
+
+	do {
+		if (timeout != 0) {
+			status = ipulog_netlink_wait(h, timeout);
+			if (status <= 0)
+				return status;
+		}
+		/* Block for the first only, then take what is already there */
+		status = recvmmsg(h->fd, mmsg, n, MSG_WAITFORONE, NULL);
+	} while (status < 0 && ipulog_overrun(h));
+	if (status < 0) {
+		ipulog_errno = IPULOG_ERR_RECV;
+		return -1;
+	}
+
+	for (i = 0; i < (unsigned int)status; i++) {
+		if (!ipulog_netlink_ok(&addr[i], mmsg[i].msg_hdr.msg_namelen,
+				       msgs[i].buf, mmsg[i].msg_len,
+				       mmsg[i].msg_hdr.msg_flags)) {
+			err = ipulog_errno;
+			continue;
+		}
+		msgs[i].size = mmsg[i].msg_len;
+		msgs[i].group = addr[i].nl_groups;
+		if (i != got) {
+			tmp = msgs[got];
+			msgs[got] = msgs[i];
+			msgs[i] = tmp;
+		}
+		got++;
+	}
+	if (got == 0 && err != IPULOG_ERR_NONE) {
+		ipulog_errno = err;
+		errno = EBADMSG;
+		return -1;
+	}
+	return got;
+}
+
+/*
+ * The packet of a part that is whole, or NULL: the packet and its data
+ * have to fit in the part, which has to fit in the len bytes left.
+ */
+static ulog_packet_msg_t *ipulog_part_packet(const struct nlmsghdr *nlh,
+					     size_t len)
+{
+	ulog_packet_msg_t *upkt;
+
+	if (!NLMSG_OK(nlh, len) ||
+	    nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*upkt)))
+		return NULL;
+	upkt = NLMSG_DATA(nlh);
+	if (upkt->data_len > nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*upkt)))
+		return NULL;
+	return upkt;
+}
+
+/****************************************************************************
+ *
+ * Public interface
+ *
+ ****************************************************************************/
+
+/* convert a netlink group (1-32) to a group_mask suitable for create_handle */
+u_int32_t ipulog_group2gmask(u_int32_t group)
+{
+	if (group < 1 || group > 32) {
+		ipulog_errno = IPULOG_ERR_INVGR;
+		return 0;
+	}
+	return (1 << (group - 1));
+}
+
+/* create a ipulog handle for the reception of packets sent to gmask */
+struct ipulog_handle *ipulog_create_handle(u_int32_t gmask)
+{
+	struct ipulog_handle *h;
+	socklen_t addrlen;
+	int status;
+
+	h = (struct ipulog_handle *)malloc(sizeof(struct ipulog_handle));
+	if (h == NULL) {
+		ipulog_errno = IPULOG_ERR_HANDLE;
+		return NULL;
+	}
+	memset(h, 0, sizeof(struct ipulog_handle));
+	h->fd = socket(PF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NFLOG);
+	if (h->fd == -1) {
+		ipulog_errno = IPULOG_ERR_SOCKET;
+		free(h);
+		return NULL;
+	}
+	memset(&h->local, 0, sizeof(struct sockaddr_nl));
+	h->local.nl_family = AF_NETLINK;
+	/* Left to the kernel, so that a process may have many handles */
+	h->local.nl_pid = 0;
+	h->local.nl_groups = gmask;
+	status = bind(h->fd, (struct sockaddr *)&h->local, sizeof(h->local));
+	addrlen = sizeof(h->local);
+	if (status == -1 ||
+	    getsockname(h->fd, (struct sockaddr *)&h->local, &addrlen) < 0) {
+		ipulog_errno = IPULOG_ERR_BIND;
+		close(h->fd);
+		free(h);
+		return NULL;
+	}
+	memset(&h->peer, 0, sizeof(struct sockaddr_nl));
+	h->peer.nl_family = AF_NETLINK;
+	h->peer.nl_pid = 0;
+	h->peer.nl_groups = gmask;
+	return h;
+}
+
+/*
+ * A handle that reads the ULOG messages recorded in a capture file,
+ * or standard input if file is "-", instead of a socket.  The capture
+ * has to be taken on a machine of the same byte order and word size.
+ */
+struct ipulog_handle *ipulog_open_capture(const char *file)
+{
+	struct ipulog_pcap_hdr hdr;
+	struct ipulog_handle *h;
+
+	h = calloc(1, sizeof(*h));
+	if (h == NULL) {
+		ipulog_errno = IPULOG_ERR_HANDLE;
+		return NULL;
+	}
+	h->capture = strcmp(file, "-") == 0 ? stdin : fopen(file, "re");
+	if (h->capture == NULL) {
+		ipulog_errno = IPULOG_ERR_CAPTURE;
+		free(h);
+		return NULL;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, h->capture) != 1)
+		goto invalid;
+	if (hdr.magic == __builtin_bswap32(IPULOG_PCAP_MAGIC) ||
+	    hdr.magic == __builtin_bswap32(IPULOG_PCAP_MAGIC_NS))
+		h->swapped = 1;
+	else if (hdr.magic != IPULOG_PCAP_MAGIC &&
+		 hdr.magic != IPULOG_PCAP_MAGIC_NS)
+		goto invalid;
+	if (ipulog_capture32(h, hdr.linktype) != IPULOG_LINKTYPE_NETLINK)
+		goto invalid;
+	h->fd = fileno(h->capture);
+	return h;
+
+ invalid:
+	ipulog_errno = IPULOG_ERR_CAPTURE;
+	errno = EINVAL;
+	if (h->capture != stdin)
+		fclose(h->capture);
+	free(h);
+	return NULL;
+}
+
+/* destroy a ipulog handle */
+void ipulog_destroy_handle(struct ipulog_handle *h)
+{
+	if (h == NULL)
+		return;
+	if (h->capture == NULL)
+		close(h->fd);
+	else if (h->capture != stdin)
+		fclose(h->capture);
+	free(h);
+}
+
+/*
+ * Read one message, a whole batch of packets.  timeout is in
+ * microseconds, and 0 waits as long as it takes.  Overruns of the
+ * receive buffer are counted, see ipulog_get_drops(), and reading goes
+ * on.  Returns 0 at the end of a capture.
+ */
+ssize_t ipulog_read(struct ipulog_handle *h, unsigned char *buf,
+		    size_t len, int timeout)
+{
+	socklen_t addrlen;
+	ssize_t status;
+
+	if (h->capture != NULL)
+		return ipulog_capture_read(h, buf, len);
+	if (len < sizeof(struct nlmsghdr)) {
+		ipulog_errno = IPULOG_ERR_RECVBUF;
+		return -1;
+	}
+	do {
+		if (timeout != 0) {
+			status = ipulog_netlink_wait(h, timeout);
+			if (status <= 0)
+				return status;
+		}
+		addrlen = sizeof(h->peer);
+		/* MSG_TRUNC: the size it had, rather than what fitted */
+		status = recvfrom(h->fd, buf, len, MSG_TRUNC,
+				  (struct sockaddr *)&h->peer, &addrlen);
+	} while (status < 0 && ipulog_overrun(h));
+	if (status < 0) {
+		ipulog_errno = IPULOG_ERR_RECV;
+		return status;
+	}
+	if (!ipulog_netlink_ok(&h->peer, addrlen, buf, status,
+			       (size_t)status > len ? MSG_TRUNC : 0))
+		return -1;
+	return status;
+}
+
+/*
+ * Read up to n messages, as many as are there once the first is, with
+ * one system call.  timeout is that of ipulog_read().  Returns how many
+ * were read, each into the buffer of msgs[i] with its length in
+ * msgs[i].size.
+ */
+int ipulog_read_batch(struct ipulog_handle *h,
+		      struct ipulog_msgbuf *msgs, unsigned int n, int timeout)
+{
+	if (n == 0)
+		return 0;
+	if (h->capture != NULL)
+		return ipulog_capture_batch(h, msgs, n);
+	return ipulog_netlink_recvmmsg(h, msgs, n, timeout);
+}
+
+/* get a pointer to the actual start of the ipulog packet,
+   use this to strip netlink header */
+ulog_packet_msg_t *ipulog_get_packet(struct ipulog_handle *h,
+				     const unsigned char *buf,
+				     size_t len)
+{
+	struct nlmsghdr *nlh;
+	ulog_packet_msg_t *upkt;
+	size_t remain_len, step;
+
+	/* if last header in handle not inside this buffer,
+	 * drop reference to last header */
+	if ((unsigned char *)h->last_nlhdr > (buf + len) ||
+	    (unsigned char *)h->last_nlhdr < buf) {
+		h->last_nlhdr = NULL;
+	}
+
+	if (!h->last_nlhdr) {
+		/* fist message in buffer */
+		nlh = (struct nlmsghdr *)buf;
+		remain_len = len;
+	} else {
+		/* we are in n-th part of multilink message */
+		if (h->last_nlhdr->nlmsg_type == NLMSG_DONE ||
+		    !(h->last_nlhdr->nlmsg_flags & NLM_F_MULTI)) {
+			/* if last part in multipart message,
+			 * or no multipart message at all: return */
+			h->last_nlhdr = NULL;
+			return NULL;
+		}
+
+		/* calculate remaining lenght from lasthdr to end of buffer */
+		remain_len = len - ((unsigned char *)h->last_nlhdr - buf);
+		step = NLMSG_ALIGN(h->last_nlhdr->nlmsg_len);
+		if (step >= remain_len) {
+			h->last_nlhdr = NULL;
+			return NULL;
+		}
+		nlh = (struct nlmsghdr *)((unsigned char *)h->last_nlhdr +
+					  step);
+		remain_len -= step;
+	}
+
+	upkt = ipulog_part_packet(nlh, remain_len);
+	if (upkt == NULL) {
+		ipulog_errno = IPULOG_ERR_INVNL;
+		h->last_nlhdr = NULL;
+		return NULL;
+	}
+	h->last_nlhdr = nlh;
+	return upkt;
+}
+
+/*
+ * Walk the packets of the message of len bytes in buf, as read, with
+ * ipulog_iter_next().  Nothing is copied, and the iterator keeps no
+ * state in the handle, so that messages may be walked in any order.
+ */
+void ipulog_iter_init(struct ipulog_iter *it,
+		      const unsigned char *buf, size_t len)
+{
+	it->buf = buf;
+	it->len = len;
+	it->done = 0;
+	it->invalid = 0;
+}
+
+/*
+ * The next packet, or NULL after the last part.  Parts whose packet
+ * does not fit in them are left out and counted in it->invalid; a part
+ * whose length runs past the message ends it.
+ */
+ulog_packet_msg_t *ipulog_iter_next(struct ipulog_iter *it)
+{
+	const struct nlmsghdr *nlh;
+	ulog_packet_msg_t *upkt;
+	size_t step;
+
+	while (!it->done) {
+		nlh = (const struct nlmsghdr *)it->buf;
+		if (!NLMSG_OK(nlh, it->len)) {
+			if (it->len > 0)
+				it->invalid++;
+			it->done = 1;
+			break;
+		}
+		step = NLMSG_ALIGN(nlh->nlmsg_len);
+		if (step > it->len)
+			step = it->len;
+		it->buf += step;
+		it->len -= step;
+		/* The last part of a batch is NLMSG_DONE, with a packet */
+		if (nlh->nlmsg_type == NLMSG_DONE ||
+		    !(nlh->nlmsg_flags & NLM_F_MULTI))
+			it->done = 1;
+		if (nlh->nlmsg_type == NLMSG_NOOP ||
+		    nlh->nlmsg_type == NLMSG_ERROR)
+			continue;
+		upkt = ipulog_part_packet(nlh, nlh->nlmsg_len);
+		if (upkt != NULL)
+			return upkt;
+		it->invalid++;
+	}
+	return NULL;
+}
+
+/*
+ * The socket, for poll, epoll and the like.
+ */
+int ipulog_fd(const struct ipulog_handle *h)
+{
+	return h->fd;
+}
+
+/*
+ * Size the receive buffer, beyond the rmem_max limit if we are
+ * allowed to, so that bursts of batches are not dropped.  Returns the
+ * size granted.
+ */
+int ipulog_set_rcvbuf(const struct ipulog_handle *h, size_t size)
+{
+	int val, status;
+	socklen_t len = sizeof(val);
+
+	if (size > INT_MAX / 2 || h->capture != NULL) {
+		errno = EINVAL;
+		ipulog_errno = IPULOG_ERR_SOCKOPT;
+		return -1;
+	}
+	val = size;
+	status = setsockopt(h->fd, SOL_SOCKET, SO_RCVBUFFORCE,
+			    &val, sizeof(val));
+	if (status < 0)
+		status = setsockopt(h->fd, SOL_SOCKET, SO_RCVBUF,
+				    &val, sizeof(val));
+	if (status < 0 ||
+	    getsockopt(h->fd, SOL_SOCKET, SO_RCVBUF, &val, &len) < 0) {
+		ipulog_errno = IPULOG_ERR_SOCKOPT;
+		return -1;
+	}
+	return val;
+}
+
+/*
+ * How many times the kernel has dropped messages since the handle was
+ * created, for want of room in the receive buffer.  Each may have been
+ * many batches.
+ */
+unsigned long ipulog_get_drops(const struct ipulog_handle *h)
+{
+	return __atomic_load_n(&h->drops, __ATOMIC_RELAXED);
+}
+
+char *ipulog_errstr(void)
+{
+	return ipulog_strerror(ipulog_errno);
+}
+
+/* print a human readable description of the last error to stderr */
+void ipulog_perror(const char *s)
+{
+	if (s)
+		fputs(s, stderr);
+	else
+		fputs("ERROR", stderr);
+	if (ipulog_errno)
+		fprintf(stderr, ": %s", ipulog_errstr());
+	if (errno)
+		fprintf(stderr, ": %s", strerror(errno));
+	fputc('\n', stderr);
+}
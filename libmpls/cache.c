@@ -0,0 +1,199 @@
+/*
+ * cache.c
+ *
+ * The keys of the NHLFEs in the kernel, read with one dump and kept,
+ * so that a program checking thousands of keys, such as
+ * iptables-restore with as many -j MPLS rules, asks the kernel once.
+ * A key not among them is looked for in a new dump before it is
+ * refused, as a long running program such as iptables-daemon sees
+ * NHLFEs made after the first.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libmpls/libmpls.h>
+
+static struct {
+	u_int32_t *key;			/* sorted, unique */
+	unsigned int num, size;
+	int state;			/* 0 not read, 1 read, -1 failed */
+	int err;
+	bool reread;			/* read by mpls_nhlfe_cached() */
+} mpls_nhlfe_cache;
+
+static int mpls_cache_add(u_int32_t key)
+{
+	if (mpls_nhlfe_cache.num == mpls_nhlfe_cache.size) {
+		unsigned int size = mpls_nhlfe_cache.size ?
+				    mpls_nhlfe_cache.size * 2 : 256;
+		u_int32_t *k;
+
+		k = realloc(mpls_nhlfe_cache.key, size * sizeof(*k));
+		if (k == NULL)
+			return -1;
+		mpls_nhlfe_cache.key = k;
+		mpls_nhlfe_cache.size = size;
+	}
+	mpls_nhlfe_cache.key[mpls_nhlfe_cache.num++] = key;
+	return 0;
+}
+
+static int mpls_cache_cmp(const void *a, const void *b)
+{
+	u_int32_t x = *(const u_int32_t *)a, y = *(const u_int32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void mpls_cache_sort(void)
+{
+	unsigned int i, n = 0;
+
+	qsort(mpls_nhlfe_cache.key, mpls_nhlfe_cache.num,
+	      sizeof(u_int32_t), mpls_cache_cmp);
+	for (i = 0; i < mpls_nhlfe_cache.num; ++i)
+		if (n == 0 || mpls_nhlfe_cache.key[n-1] !=
+			      mpls_nhlfe_cache.key[i])
+			mpls_nhlfe_cache.key[n++] = mpls_nhlfe_cache.key[i];
+	mpls_nhlfe_cache.num = n;
+	mpls_nhlfe_cache.state = 1;
+}
+
+static int mpls_cache_fail(void)
+{
+	mpls_nhlfe_cache.num = 0;
+	mpls_nhlfe_cache.state = -1;
+	mpls_nhlfe_cache.err = errno;
+	return -1;
+}
+
+static void mpls_cache_dump(const void *obj, size_t len,
+			    const struct mpls_instr_req *instr, void *data)
+{
+	const struct mpls_out_label_req *nhlfe = obj;
+
+	if (len < sizeof(*nhlfe))
+		return;
+	if (mpls_cache_add(nhlfe->mol_label.u.ml_key) < 0)
+		*(int *)data = errno;
+}
+
+/*
+ * Read the keys from the NHLFE table of h, which may be on any transport.
+ */
+int mpls_nhlfe_cache_fill(struct mpls_handle *h)
+{
+	int err = 0;
+
+	mpls_nhlfe_cache.num = 0;
+	mpls_nhlfe_cache.reread = false;
+	if (mpls_dump(h, MPLS_CMD_GETNHLFE, mpls_cache_dump, &err) < 0)
+		return mpls_cache_fail();
+	if (err != 0) {
+		errno = err;
+		return mpls_cache_fail();
+	}
+	mpls_cache_sort();
+	return 0;
+}
+
+/*
+ * Read the keys from a file instead, one a line, with # comments.
+ */
+int mpls_nhlfe_cache_file(const char *path)
+{
+	char buf[256], *p, *end;
+	unsigned long key;
+	FILE *fp;
+
+	fp = fopen(path, "re");
+	if (fp == NULL)
+		return mpls_cache_fail();
+	mpls_nhlfe_cache.num = 0;
+	mpls_nhlfe_cache.reread = false;
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		p = buf + strspn(buf, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+		errno = 0;
+		key = strtoul(p, &end, 0);
+		if (errno != 0 || end == p || key > UINT32_MAX ||
+		    (*end != '\0' && !isspace((unsigned char)*end))) {
+			fclose(fp);
+			errno = EINVAL;
+			return mpls_cache_fail();
+		}
+		if (mpls_cache_add(key) < 0) {
+			fclose(fp);
+			return mpls_cache_fail();
+		}
+	}
+	fclose(fp);
+	mpls_cache_sort();
+	return 0;
+}
+
+void mpls_nhlfe_cache_flush(void)
+{
+	free(mpls_nhlfe_cache.key);
+	memset(&mpls_nhlfe_cache, 0, sizeof(mpls_nhlfe_cache));
+}
+
+/* From the file named by MPLS_NHLFE_KEYS if set, else from the kernel */
+static void mpls_cache_read(void)
+{
+	const char *path = getenv("MPLS_NHLFE_KEYS");
+	struct mpls_handle *h;
+
+	if (path != NULL) {
+		mpls_nhlfe_cache_file(path);
+	} else if ((h = mpls_open()) == NULL) {
+		mpls_cache_fail();
+	} else {
+		mpls_nhlfe_cache_fill(h);
+		mpls_close(h);
+	}
+	mpls_nhlfe_cache.reread = true;
+}
+
+static int mpls_cache_find(u_int32_t key)
+{
+	if (mpls_nhlfe_cache.state < 0) {
+		errno = mpls_nhlfe_cache.err;
+		return -1;
+	}
+	return bsearch(&key, mpls_nhlfe_cache.key, mpls_nhlfe_cache.num,
+		       sizeof(u_int32_t), mpls_cache_cmp) != NULL;
+}
+
+/*
+ * Whether an NHLFE with this key exists: 1 or 0, or -1 if the keys
+ * could not be read.  The first call reads them, from the file named
+ * by MPLS_NHLFE_KEYS if set, else from the kernel, and a key not found
+ * has them read again; a failure is kept, so that it is not retried
+ * for every key.  Keys filled in by the caller are not read again.
+ */
+int mpls_nhlfe_cached(u_int32_t key)
+{
+	int ret;
+
+	if (mpls_nhlfe_cache.state == 0)
+		mpls_cache_read();
+	ret = mpls_cache_find(key);
+	if (ret != 0 || !mpls_nhlfe_cache.reread)
+		return ret;
+	mpls_cache_read();
+	return mpls_cache_find(key);
+}
@@ -0,0 +1,378 @@
+/*
+ * fake-test: mpls_commit() and mpls_dump() against the fake responder,
+ * seen through a transport that counts what goes out and can lose
+ * acks the way a full receive buffer does.  Run by make check.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/netlink.h>
+
+#include <libmpls/libmpls.h>
+
+#define TEST_WINDOW	64
+#define TEST_BUFSIZE	2048
+#define TEST_MAXLOST	16
+#define TEST_MAXKEY	2048
+
+struct test_tap {
+	struct mpls_transport fake;
+	unsigned int sends, requests, acks, noops, enobufs;
+	size_t max_send;
+	unsigned int inflight, max_inflight[8];
+	/* acks to lose, counted from 1 since the last test_reset */
+	unsigned int drop[TEST_MAXLOST], ndrop;
+	bool lost_pending;
+	u_int32_t first, lost[TEST_MAXLOST];
+	unsigned int nlost;
+};
+
+static struct test_tap tap;
+static int failures;
+
+#define test_check(cond, ...) do { \
+		if (!(cond)) { \
+			fprintf(stderr, "fake-test: " __VA_ARGS__); \
+			fputc('\n', stderr); \
+			++failures; \
+		} \
+	} while (0)
+
+static void test_reset(void)
+{
+	struct mpls_transport fake = tap.fake;
+
+	memset(&tap, 0, sizeof(tap));
+	tap.fake = fake;
+}
+
+static ssize_t tap_send(void *priv, const void *buf, size_t len)
+{
+	const struct nlmsghdr *nlh;
+	unsigned int epoch, requests = tap.requests;
+	int left = len;
+
+	++tap.sends;
+	if (len > tap.max_send)
+		tap.max_send = len;
+	for (nlh = buf; NLMSG_OK(nlh, left); nlh = NLMSG_NEXT(nlh, left)) {
+		if (nlh->nlmsg_type == NLMSG_NOOP) {
+			++tap.noops;
+			continue;
+		}
+		if (!(nlh->nlmsg_flags & NLM_F_ACK))
+			continue;
+		if (tap.requests++ == 0)
+			tap.first = nlh->nlmsg_seq;
+		++tap.inflight;
+	}
+	/* in flight since the last overrun, barriers aside */
+	epoch = tap.enobufs < 8 ? tap.enobufs : 7;
+	if (tap.requests != requests &&
+	    tap.inflight > tap.max_inflight[epoch])
+		tap.max_inflight[epoch] = tap.inflight;
+	return tap.fake.send(tap.fake.priv, buf, len);
+}
+
+static bool tap_dropped(unsigned int ack)
+{
+	unsigned int i;
+
+	for (i = 0; i < tap.ndrop; ++i)
+		if (tap.drop[i] == ack)
+			return true;
+	return false;
+}
+
+/* The fake answers each request with an ack datagram of its own; the
+ * barriers come after the requests of the commit */
+static ssize_t tap_recv(void *priv, void *buf, size_t len)
+{
+	const struct nlmsghdr *nlh = buf;
+	ssize_t ret;
+
+	for (;;) {
+		if (tap.lost_pending) {
+			tap.lost_pending = false;
+			++tap.enobufs;
+			errno = ENOBUFS;
+			return -1;
+		}
+		ret = tap.fake.recv(tap.fake.priv, buf, len);
+		if (ret < 0 || nlh->nlmsg_type != NLMSG_ERROR ||
+		    nlh->nlmsg_seq - tap.first >= tap.requests)
+			return ret;
+		--tap.inflight;
+		if (!tap_dropped(++tap.acks))
+			return ret;
+		tap.lost[tap.nlost++] = nlh->nlmsg_seq - tap.first;
+		tap.lost_pending = true;
+	}
+}
+
+static void tap_close(void *priv)
+{
+	tap.fake.close(tap.fake.priv);
+}
+
+struct test_errors {
+	unsigned int index[TEST_MAXLOST];
+	int error[TEST_MAXLOST];
+	unsigned int n;
+};
+
+static void test_error(unsigned int index, int error, void *data)
+{
+	struct test_errors *e = data;
+
+	if (e->n < TEST_MAXLOST) {
+		e->index[e->n] = index;
+		e->error[e->n] = error;
+	}
+	++e->n;
+}
+
+struct test_dump {
+	unsigned char seen[TEST_MAXKEY];
+	unsigned int count, dups, noinstr;
+};
+
+static void test_dump_nhlfe(const void *obj, size_t len,
+			    const struct mpls_instr_req *instr, void *data)
+{
+	const struct mpls_out_label_req *o = obj;
+	struct test_dump *d = data;
+	u_int32_t key = o->mol_label.u.ml_key;
+
+	++d->count;
+	if (len != sizeof(*o) || key >= TEST_MAXKEY || d->seen[key]++)
+		++d->dups;
+	if (instr == NULL || instr->mir_instr_length != 1)
+		++d->noinstr;
+}
+
+static void test_dump_count(const void *obj, size_t len,
+			    const struct mpls_instr_req *instr, void *data)
+{
+	++*(unsigned int *)data;
+}
+
+static void test_nhlfe(struct mpls_handle *h, u_int32_t key,
+		       const struct mpls_instr_req *instr)
+{
+	struct mpls_out_label_req o;
+
+	memset(&o, 0, sizeof(o));
+	o.mol_label.ml_type  = MPLS_LABEL_KEY;
+	o.mol_label.u.ml_key = key;
+	test_check(mpls_nhlfe_add(h, &o, instr) == 0, "queueing NHLFE %u: %s",
+		   key, strerror(errno));
+}
+
+static void test_ilm_label(struct mpls_label *l, u_int32_t label)
+{
+	memset(l, 0, sizeof(*l));
+	l->ml_type  = MPLS_LABEL_GEN;
+	l->u.ml_gen = label;
+}
+
+/* With the window open, many requests a send, up to bufsize bytes */
+static void test_batching(struct mpls_handle *h,
+			  const struct mpls_instr_req *instr)
+{
+	struct test_errors e = {.n = 0};
+	unsigned int i;
+	int ret;
+
+	test_reset();
+	mpls_set_batch(h, TEST_BUFSIZE, 1000);
+	for (i = 0; i < 1000; ++i)
+		test_nhlfe(h, i, instr);
+	test_check(mpls_queued(h) == 1000, "queued %u, want 1000",
+		   mpls_queued(h));
+	ret = mpls_commit(h, test_error, &e);
+	test_check(ret == 0 && e.n == 0, "batching: commit gave %d, %u errors",
+		   ret, e.n);
+	test_check(mpls_queued(h) == 0, "queue not empty after commit");
+	test_check(tap.requests == 1000 && tap.acks == 1000,
+		   "batching: %u requests sent, %u acks", tap.requests,
+		   tap.acks);
+	test_check(tap.sends <= 1000 / 4 && tap.max_send <= TEST_BUFSIZE,
+		   "batching: %u sends of up to %zu bytes for 1000 requests",
+		   tap.sends, tap.max_send);
+	test_check(tap.noops == 0, "barrier sent without lost acks");
+}
+
+/* Never more than the window unacked */
+static void test_window(struct mpls_handle *h,
+			const struct mpls_instr_req *instr)
+{
+	struct test_errors e = {.n = 0};
+	unsigned int i;
+	int ret;
+
+	test_reset();
+	mpls_set_batch(h, 0, TEST_WINDOW);
+	for (i = 1000; i < 1200; ++i)
+		test_nhlfe(h, i, instr);
+	ret = mpls_commit(h, test_error, &e);
+	test_check(ret == 0 && e.n == 0, "window: commit gave %d, %u errors",
+		   ret, e.n);
+	test_check(tap.max_inflight[0] == TEST_WINDOW,
+		   "window: at most %u in flight, want %u",
+		   tap.max_inflight[0], TEST_WINDOW);
+}
+
+/* Lost acks: each reported with ENOBUFS, the window halved */
+static void test_enobufs(struct mpls_handle *h,
+			 const struct mpls_instr_req *instr)
+{
+	static const unsigned int drop[] = {10, 100, 101, 300};
+	struct test_errors e = {.n = 0};
+	unsigned int i, want;
+	int ret;
+
+	test_reset();
+	memcpy(tap.drop, drop, sizeof(drop));
+	tap.ndrop = sizeof(drop) / sizeof(drop[0]);
+	for (i = 1200; i < 1700; ++i)
+		test_nhlfe(h, i, instr);
+	ret = mpls_commit(h, test_error, &e);
+	test_check(ret == (int)tap.nlost && e.n == tap.nlost &&
+		   tap.nlost == tap.ndrop,
+		   "enobufs: commit gave %d, %u errors, %u acks lost",
+		   ret, e.n, tap.nlost);
+	for (i = 0; i < e.n && i < tap.nlost; ++i)
+		test_check(e.index[i] == tap.lost[i] &&
+			   e.error[i] == ENOBUFS,
+			   "enobufs: error %u for request %u, want %u for %u",
+			   e.error[i], e.index[i], ENOBUFS, tap.lost[i]);
+	test_check(tap.noops == tap.enobufs,
+		   "enobufs: %u barriers for %u overruns", tap.noops,
+		   tap.enobufs);
+	test_check(tap.acks == 500, "enobufs: %u acks for 500 requests",
+		   tap.acks);
+	for (i = 1; i <= tap.enobufs && i < 8; ++i) {
+		want = TEST_WINDOW >> i ? TEST_WINDOW >> i : 1;
+		test_check(tap.max_inflight[i] <= want,
+			   "enobufs: %u in flight after overrun %u, want %u",
+			   tap.max_inflight[i], i, want);
+	}
+	/* put the window back for the tests that follow */
+	mpls_set_batch(h, 0, TEST_WINDOW);
+}
+
+/* Refused requests are reported by their index in the commit */
+static void test_refused(struct mpls_handle *h,
+			 const struct mpls_instr_req *instr)
+{
+	static const struct {
+		unsigned int index;
+		int error;
+	} want[] = {
+		{1, EEXIST},		/* NHLFE 5 is there already */
+		{3, ENOENT},		/* XC from an ILM not there */
+		{4, ENOENT},		/* delete of an ILM not there */
+		{6, EEXIST},		/* ILM 16 queued twice */
+	};
+	struct test_errors e = {.n = 0};
+	struct mpls_in_label_req ilm;
+	struct mpls_xconnect_req xc;
+	unsigned int i;
+	int ret;
+
+	test_reset();
+	memset(&ilm, 0, sizeof(ilm));
+	memset(&xc, 0, sizeof(xc));
+	test_ilm_label(&ilm.mil_label, 16);
+	mpls_ilm_add(h, &ilm, NULL);				/* 0 */
+	test_nhlfe(h, 5, instr);				/* 1 */
+	xc.mx_in = ilm.mil_label;
+	xc.mx_out.ml_type  = MPLS_LABEL_KEY;
+	xc.mx_out.u.ml_key = 6;
+	mpls_xc_add(h, &xc);					/* 2 */
+	test_ilm_label(&xc.mx_in, 17);
+	mpls_xc_add(h, &xc);					/* 3 */
+	test_ilm_label(&ilm.mil_label, 18);
+	mpls_ilm_del(h, &ilm);					/* 4 */
+	test_nhlfe(h, 1700, instr);				/* 5 */
+	test_ilm_label(&ilm.mil_label, 16);
+	mpls_ilm_add(h, &ilm, NULL);				/* 6 */
+
+	ret = mpls_commit(h, test_error, &e);
+	test_check(ret == 4 && e.n == 4, "refused: commit gave %d, %u errors",
+		   ret, e.n);
+	for (i = 0; i < e.n && i < sizeof(want) / sizeof(want[0]); ++i)
+		test_check(e.index[i] == want[i].index &&
+			   e.error[i] == want[i].error,
+			   "refused: error %d for request %u, want %d for %u",
+			   e.error[i], e.index[i], want[i].error,
+			   want[i].index);
+	test_check(tap.acks == 7, "refused: %u acks for 7 requests", tap.acks);
+}
+
+static void test_dump(struct mpls_handle *h)
+{
+	struct test_dump d;
+	unsigned int n;
+	int ret;
+
+	memset(&d, 0, sizeof(d));
+	ret = mpls_dump(h, MPLS_CMD_GETNHLFE, test_dump_nhlfe, &d);
+	test_check(ret == 1701 && d.count == 1701 && d.dups == 0,
+		   "dump: %d NHLFEs, %u seen, %u bad, want 1701",
+		   ret, d.count, d.dups);
+	test_check(d.noinstr == 0, "dump: %u NHLFEs without their instr",
+		   d.noinstr);
+	n = 0;
+	ret = mpls_dump(h, MPLS_CMD_GETILM, test_dump_count, &n);
+	test_check(ret == 1 && n == 1, "dump: %d ILMs, want 1", ret);
+	n = 0;
+	ret = mpls_dump(h, MPLS_CMD_GETXC, test_dump_count, &n);
+	test_check(ret == 1 && n == 1, "dump: %d XCs, want 1", ret);
+}
+
+int main(void)
+{
+	struct mpls_transport tp = {
+		.send  = tap_send,
+		.recv  = tap_recv,
+		.close = tap_close,
+	};
+	struct mpls_instr_req *instr;
+	struct mpls_handle *h;
+	char err[128];
+
+	if (mpls_fake_transport(&tap.fake) < 0) {
+		perror("fake-test: mpls_fake_transport");
+		return 1;
+	}
+	h = mpls_open_transport(&tp);
+	if (h == NULL) {
+		perror("fake-test: mpls_open_transport");
+		return 1;
+	}
+	instr = mpls_instr_compile("drop", MPLS_OUT, err, sizeof(err));
+	if (instr == NULL) {
+		fprintf(stderr, "fake-test: %s\n", err);
+		return 1;
+	}
+	test_batching(h, instr);
+	test_window(h, instr);
+	test_enobufs(h, instr);
+	test_refused(h, instr);
+	test_dump(h);
+
+	free(instr);
+	mpls_close(h);
+	return failures != 0;
+}
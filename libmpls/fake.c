@@ -0,0 +1,453 @@
+/*
+ * fake.c
+ *
+ * An nlmpls responder in the process, for running programs that use
+ * libmpls without the MPLS kernel modules, or without privileges.  It
+ * answers as the kernel does: the controller resolves the family, NEW
+ * and DEL requests change its tables and are acked one datagram each,
+ * and dumps come back as NLM_F_MULTI parts and NLMSG_DONE.  Nothing is
+ * ever forwarded.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libmpls/libmpls.h>
+#include "internal.h"
+
+#define FAKE_FAMILY	(GENL_MIN_ID + 0x10)
+#define FAKE_BUCKETS	4096
+#define FAKE_DUMPSIZE	4096		/* bytes of a dump part */
+
+struct fake_obj {
+	struct fake_obj *next;
+	size_t len, ilen;		/* of the object, of its instr */
+	unsigned char data[0];		/* the object, then the instr */
+};
+
+struct fake_table {
+	struct fake_obj *bucket[FAKE_BUCKETS];
+	unsigned int count;
+};
+
+/* One datagram for recv() */
+struct fake_msg {
+	struct fake_msg *next;
+	size_t len;
+	unsigned char data[0];
+};
+
+struct mpls_fake {
+	struct fake_table table[MPLS_ATTR_MAX + 1];
+	struct fake_msg *head, **tail;
+};
+
+static const size_t fake_objsize[MPLS_ATTR_MAX + 1] = {
+	[MPLS_ATTR_ILM]		= sizeof(struct mpls_in_label_req),
+	[MPLS_ATTR_NHLFE]	= sizeof(struct mpls_out_label_req),
+	[MPLS_ATTR_XC]		= sizeof(struct mpls_xconnect_req),
+	[MPLS_ATTR_LABELSPACE]	= sizeof(struct mpls_labelspace_req),
+};
+
+static int fake_label_same(const struct mpls_label *a,
+			   const struct mpls_label *b)
+{
+	return a->ml_type == b->ml_type && a->u.ml_key == b->u.ml_key &&
+	       a->ml_labelspace == b->ml_labelspace;
+}
+
+static unsigned int fake_label_hash(const struct mpls_label *l)
+{
+	return (l->u.ml_key ^ (l->ml_labelspace << 20) ^ l->ml_type) %
+	       FAKE_BUCKETS;
+}
+
+/* The NHLFE is known by its key alone, the others by their labels */
+static int fake_same(int attr, const void *a, const void *b)
+{
+	switch (attr) {
+	case MPLS_ATTR_ILM:
+		return fake_label_same(
+			&((const struct mpls_in_label_req *)a)->mil_label,
+			&((const struct mpls_in_label_req *)b)->mil_label);
+	case MPLS_ATTR_NHLFE:
+		return ((const struct mpls_out_label_req *)a)->mol_label.u.ml_key ==
+		       ((const struct mpls_out_label_req *)b)->mol_label.u.ml_key;
+	case MPLS_ATTR_XC:
+		return fake_label_same(
+			&((const struct mpls_xconnect_req *)a)->mx_in,
+			&((const struct mpls_xconnect_req *)b)->mx_in);
+	case MPLS_ATTR_LABELSPACE:
+		return ((const struct mpls_labelspace_req *)a)->mls_ifindex ==
+		       ((const struct mpls_labelspace_req *)b)->mls_ifindex;
+	}
+	return 0;
+}
+
+static unsigned int fake_hash(int attr, const void *obj)
+{
+	switch (attr) {
+	case MPLS_ATTR_ILM:
+		return fake_label_hash(
+			&((const struct mpls_in_label_req *)obj)->mil_label);
+	case MPLS_ATTR_NHLFE:
+		return ((const struct mpls_out_label_req *)obj)->mol_label.u.ml_key %
+		       FAKE_BUCKETS;
+	case MPLS_ATTR_XC:
+		return fake_label_hash(
+			&((const struct mpls_xconnect_req *)obj)->mx_in);
+	case MPLS_ATTR_LABELSPACE:
+		return (unsigned int)((const struct mpls_labelspace_req *)obj)->
+		       mls_ifindex % FAKE_BUCKETS;
+	}
+	return 0;
+}
+
+static struct fake_obj **
+fake_find(struct mpls_fake *f, int attr, const void *obj)
+{
+	struct fake_obj **pp;
+
+	pp = &f->table[attr].bucket[fake_hash(attr, obj)];
+	for (; *pp != NULL; pp = &(*pp)->next)
+		if (fake_same(attr, (*pp)->data, obj))
+			break;
+	return pp;
+}
+
+static int fake_insert(struct mpls_fake *f, int attr, struct fake_obj **pp,
+		       const void *obj, const struct nlattr *instr)
+{
+	size_t len = fake_objsize[attr];
+	size_t ilen = instr == NULL ? 0 : instr->nla_len - NLA_HDRLEN;
+	struct fake_obj *o;
+
+	o = malloc(sizeof(*o) + len + ilen);
+	if (o == NULL)
+		return -ENOMEM;
+	o->next = *pp;
+	o->len = len;
+	o->ilen = ilen;
+	memcpy(o->data, obj, len);
+	if (ilen != 0)
+		memcpy(o->data + len, NLA_DATA(instr), ilen);
+	*pp = o;
+	++f->table[attr].count;
+	return 0;
+}
+
+static void fake_remove(struct mpls_fake *f, int attr, struct fake_obj **pp)
+{
+	struct fake_obj *o = *pp;
+
+	*pp = o->next;
+	free(o);
+	--f->table[attr].count;
+}
+
+static struct fake_msg *fake_reply(struct mpls_fake *f, size_t len)
+{
+	struct fake_msg *m;
+
+	m = calloc(1, sizeof(*m) + len);
+	if (m == NULL)
+		return NULL;
+	m->len = len;
+	*f->tail = m;
+	f->tail = &m->next;
+	return m;
+}
+
+static void fake_ack(struct mpls_fake *f, const struct nlmsghdr *req,
+		     int error)
+{
+	struct fake_msg *m;
+	struct nlmsghdr *nlh;
+	struct nlmsgerr *e;
+
+	m = fake_reply(f, NLMSG_SPACE(sizeof(*e)));
+	if (m == NULL)
+		return;
+	nlh = (struct nlmsghdr *)m->data;
+	nlh->nlmsg_len = NLMSG_LENGTH(sizeof(*e));
+	nlh->nlmsg_type = NLMSG_ERROR;
+	nlh->nlmsg_seq = req->nlmsg_seq;
+	e = NLMSG_DATA(nlh);
+	e->error = error;
+	e->msg = *req;
+}
+
+/* Start a generic netlink message at p, answering req */
+static struct nlmsghdr *fake_genl(void *p, const struct nlmsghdr *req,
+				  u_int16_t type, u_int16_t flags, u_int8_t cmd)
+{
+	struct nlmsghdr *nlh = p;
+	struct genlmsghdr *genl = NLMSG_DATA(nlh);
+
+	nlh->nlmsg_len = GENL_HDRLEN_ALL;
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = flags;
+	nlh->nlmsg_seq = req->nlmsg_seq;
+	genl->cmd = cmd;
+	genl->version = MPLS_GENL_VERSION;
+	return nlh;
+}
+
+static void fake_put_attr(struct nlmsghdr *nlh, int type, const void *data,
+			  size_t len)
+{
+	struct nlattr *nla = (void *)((char *)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + len;
+	memcpy(NLA_DATA(nla), data, len);
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+}
+
+static int fake_getfamily(struct mpls_fake *f, const struct nlmsghdr *req)
+{
+	const struct nlattr *name = mpls_nla_find(req, CTRL_ATTR_FAMILY_NAME);
+	u_int16_t id = FAKE_FAMILY;
+	struct fake_msg *m;
+
+	if (name == NULL || strncmp(NLA_DATA(name),
+				    MPLS_NETLINK_NAME,
+				    name->nla_len - NLA_HDRLEN) != 0)
+		return -ENOENT;
+	m = fake_reply(f, GENL_HDRLEN_ALL + NLA_SPACE(sizeof(id)));
+	if (m == NULL)
+		return -ENOMEM;
+	fake_put_attr(fake_genl(m->data, req, GENL_ID_CTRL, 0,
+				CTRL_CMD_NEWFAMILY),
+		      CTRL_ATTR_FAMILY_ID, &id, sizeof(id));
+	return 0;
+}
+
+static int fake_dump(struct mpls_fake *f, const struct nlmsghdr *req,
+		     int attr, u_int8_t cmd)
+{
+	struct fake_table *t = &f->table[attr];
+	struct fake_msg *m = NULL;
+	struct nlmsghdr *nlh, *done;
+	struct fake_obj *o;
+	unsigned int i;
+	size_t used = 0, size;
+
+	for (i = 0; i < FAKE_BUCKETS; ++i)
+		for (o = t->bucket[i]; o != NULL; o = o->next) {
+			size = GENL_HDRLEN_ALL + NLA_SPACE(o->len);
+			if (o->ilen != 0)
+				size += NLA_SPACE(o->ilen);
+			if (m == NULL || used + size > m->len) {
+				if (m != NULL)
+					m->len = used;
+				m = fake_reply(f, size > FAKE_DUMPSIZE ?
+						  size : FAKE_DUMPSIZE);
+				if (m == NULL)
+					return -ENOMEM;
+				used = 0;
+			}
+			nlh = fake_genl(m->data + used, req, FAKE_FAMILY,
+					NLM_F_MULTI, cmd);
+			fake_put_attr(nlh, attr, o->data, o->len);
+			if (o->ilen != 0)
+				fake_put_attr(nlh, MPLS_ATTR_INSTR,
+					      o->data + o->len, o->ilen);
+			used += NLMSG_ALIGN(nlh->nlmsg_len);
+		}
+	if (m != NULL)
+		m->len = used;
+
+	m = fake_reply(f, NLMSG_SPACE(sizeof(int)));
+	if (m == NULL)
+		return -ENOMEM;
+	done = (struct nlmsghdr *)m->data;
+	done->nlmsg_len = NLMSG_LENGTH(sizeof(int));
+	done->nlmsg_type = NLMSG_DONE;
+	done->nlmsg_flags = NLM_F_MULTI;
+	done->nlmsg_seq = req->nlmsg_seq;
+	return 0;
+}
+
+static int fake_xc_check(struct mpls_fake *f, const struct mpls_xconnect_req *xc)
+{
+	struct mpls_in_label_req ilm = {.mil_label = xc->mx_in};
+	struct mpls_out_label_req nhlfe = {.mol_label = xc->mx_out};
+
+	if (*fake_find(f, MPLS_ATTR_ILM, &ilm) == NULL ||
+	    *fake_find(f, MPLS_ATTR_NHLFE, &nhlfe) == NULL)
+		return -ENOENT;
+	return 0;
+}
+
+static int fake_mpls(struct mpls_fake *f, const struct nlmsghdr *req)
+{
+	const struct genlmsghdr *genl = NLMSG_DATA(req);
+	const struct nlattr *nla;
+	struct fake_obj **pp;
+	int attr, err;
+
+	switch (genl->cmd) {
+	case MPLS_CMD_NEWILM:
+	case MPLS_CMD_DELILM:
+	case MPLS_CMD_GETILM:
+		attr = MPLS_ATTR_ILM;
+		break;
+	case MPLS_CMD_NEWNHLFE:
+	case MPLS_CMD_DELNHLFE:
+	case MPLS_CMD_GETNHLFE:
+		attr = MPLS_ATTR_NHLFE;
+		break;
+	case MPLS_CMD_NEWXC:
+	case MPLS_CMD_DELXC:
+	case MPLS_CMD_GETXC:
+		attr = MPLS_ATTR_XC;
+		break;
+	case MPLS_CMD_SETLABELSPACE:
+	case MPLS_CMD_GETLABELSPACE:
+		attr = MPLS_ATTR_LABELSPACE;
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	switch (genl->cmd) {
+	case MPLS_CMD_GETILM:
+	case MPLS_CMD_GETNHLFE:
+	case MPLS_CMD_GETXC:
+	case MPLS_CMD_GETLABELSPACE:
+		if (!(req->nlmsg_flags & NLM_F_DUMP))
+			return -EOPNOTSUPP;
+		return fake_dump(f, req, attr, genl->cmd);
+	}
+
+	nla = mpls_nla_find(req, attr);
+	if (nla == NULL || nla->nla_len < NLA_HDRLEN + fake_objsize[attr])
+		return -EINVAL;
+	pp = fake_find(f, attr, NLA_DATA(nla));
+
+	switch (genl->cmd) {
+	case MPLS_CMD_NEWXC:
+		err = fake_xc_check(f, NLA_DATA(nla));
+		if (err < 0)
+			return err;
+		/* fall through */
+	case MPLS_CMD_NEWILM:
+	case MPLS_CMD_NEWNHLFE:
+		if (*pp != NULL)
+			return -EEXIST;
+		return fake_insert(f, attr, pp, NLA_DATA(nla),
+				   mpls_nla_find(req, MPLS_ATTR_INSTR));
+	case MPLS_CMD_SETLABELSPACE:
+		if (*pp != NULL)
+			fake_remove(f, attr, pp);
+		if (((const struct mpls_labelspace_req *)
+		     NLA_DATA(nla))->mls_labelspace < 0)
+			return 0;
+		return fake_insert(f, attr, pp, NLA_DATA(nla),
+				   NULL);
+	default:
+		if (*pp == NULL)
+			return -ENOENT;
+		fake_remove(f, attr, pp);
+		return 0;
+	}
+}
+
+static ssize_t fake_send(void *priv, const void *buf, size_t len)
+{
+	struct mpls_fake *f = priv;
+	const struct nlmsghdr *nlh;
+	int left = len, err;
+
+	for (nlh = buf; NLMSG_OK(nlh, left); nlh = NLMSG_NEXT(nlh, left)) {
+		if (!(nlh->nlmsg_flags & NLM_F_REQUEST))
+			continue;
+		/* Control messages are only acked */
+		if (nlh->nlmsg_type < NLMSG_MIN_TYPE)
+			err = 0;
+		else if (nlh->nlmsg_len < GENL_HDRLEN_ALL)
+			err = -EINVAL;
+		else if (nlh->nlmsg_type == GENL_ID_CTRL &&
+			 ((const struct genlmsghdr *)NLMSG_DATA(nlh))->cmd ==
+			 CTRL_CMD_GETFAMILY)
+			err = fake_getfamily(f, nlh);
+		else if (nlh->nlmsg_type == FAKE_FAMILY)
+			err = fake_mpls(f, nlh);
+		else
+			err = -EOPNOTSUPP;
+		if (err < 0 || (nlh->nlmsg_flags & NLM_F_ACK))
+			fake_ack(f, nlh, err);
+	}
+	return len;
+}
+
+static ssize_t fake_recv(void *priv, void *buf, size_t len)
+{
+	struct mpls_fake *f = priv;
+	struct fake_msg *m = f->head;
+	ssize_t ret;
+
+	/* A socket would block for good */
+	if (m == NULL) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (m->len > len) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	memcpy(buf, m->data, m->len);
+	ret = m->len;
+	f->head = m->next;
+	if (f->head == NULL)
+		f->tail = &f->head;
+	free(m);
+	return ret;
+}
+
+static void fake_close(void *priv)
+{
+	struct mpls_fake *f = priv;
+	struct fake_obj *o;
+	struct fake_msg *m;
+	unsigned int attr, i;
+
+	for (attr = 0; attr <= MPLS_ATTR_MAX; ++attr)
+		for (i = 0; i < FAKE_BUCKETS; ++i)
+			while ((o = f->table[attr].bucket[i]) != NULL) {
+				f->table[attr].bucket[i] = o->next;
+				free(o);
+			}
+	while ((m = f->head) != NULL) {
+		f->head = m->next;
+		free(m);
+	}
+	free(f);
+}
+
+/*
+ * Fill in tp for a responder of its own, with empty tables, which
+ * goes away when the handle using it is closed.
+ */
+int mpls_fake_transport(struct mpls_transport *tp)
+{
+	struct mpls_fake *f;
+
+	f = calloc(1, sizeof(*f));
+	if (f == NULL)
+		return -1;
+	f->tail = &f->head;
+	tp->send  = fake_send;
+	tp->recv  = fake_recv;
+	tp->close = fake_close;
+	tp->priv  = f;
+	return 0;
+}
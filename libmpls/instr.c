@@ -0,0 +1,731 @@
+/*
+ * instr.c
+ *
+ * Instruction sequences of ILMs and NHLFEs: compiled from text such as
+ * "push 100; set-exp 5; set eth0 192.0.2.1", checked, printed back in
+ * the same form, and kept in sets where equal sequences share one
+ * NHLFE key.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+
+#include <libmpls/libmpls.h>
+
+#define MPLS_LABEL_MAX	0xfffff
+#define MPLS_TABLE_MAX	63		/* largest mask of the 64-entry tables */
+
+enum {
+	OP_IN	= MPLS_IN,
+	OP_OUT	= MPLS_OUT,
+	OP_LAST	= 0x01,			/* nothing may come after it */
+	OP_LSE	= 0x02,			/* needs a label pushed before it */
+	OP_POP	= 0x04,			/* needs a label popped before it */
+};
+
+static const struct {
+	const char *name;
+	unsigned int flags;
+} mpls_ops[MPLS_OP_MAX] = {
+	[MPLS_OP_DROP]		= {"drop",	OP_IN | OP_OUT | OP_LAST},
+	[MPLS_OP_POP]		= {"pop",	OP_IN},
+	[MPLS_OP_PEEK]		= {"peek",	OP_IN | OP_LAST | OP_POP},
+	[MPLS_OP_PUSH]		= {"push",	OP_OUT},
+	[MPLS_OP_FWD]		= {"fwd",	OP_IN | OP_OUT | OP_LAST},
+	[MPLS_OP_NF_FWD]	= {"nf-fwd",	OP_IN | OP_LAST},
+	[MPLS_OP_DS_FWD]	= {"ds-fwd",	OP_IN | OP_LAST},
+	[MPLS_OP_EXP_FWD]	= {"exp-fwd",	OP_IN | OP_LAST},
+	[MPLS_OP_SET]		= {"set",	OP_OUT | OP_LAST},
+	[MPLS_OP_SET_TC]	= {"set-tc",	OP_IN | OP_OUT},
+	[MPLS_OP_SET_DS]	= {"set-ds",	OP_IN},
+	[MPLS_OP_SET_EXP]	= {"set-exp",	OP_OUT | OP_LSE},
+	[MPLS_OP_EXP2TC]	= {"exp2tc",	OP_IN},
+	[MPLS_OP_EXP2DS]	= {"exp2ds",	OP_IN},
+	[MPLS_OP_TC2EXP]	= {"tc2exp",	OP_OUT | OP_LSE},
+	[MPLS_OP_DS2EXP]	= {"ds2exp",	OP_OUT | OP_LSE},
+	[MPLS_OP_NF2EXP]	= {"nf2exp",	OP_OUT | OP_LSE},
+};
+
+static const struct {
+	const char *name;
+	unsigned int label;
+} mpls_reserved[] = {
+	{"ipv4-explicit-null",	MPLS_IPV4_EXPLICIT_NULL},
+	{"router-alert",	MPLS_ROUTER_ALERT},
+	{"ipv6-explicit-null",	MPLS_IPV6_EXPLICIT_NULL},
+	{"implicit-null",	MPLS_IMPLICIT_NULL},
+};
+
+static int mpls_err(char *err, size_t errlen, const char *fmt, ...)
+	__attribute__((format(printf,3,4)));
+
+static int mpls_err(char *err, size_t errlen, const char *fmt, ...)
+{
+	va_list args;
+
+	if (err != NULL && errlen != 0) {
+		va_start(args, fmt);
+		vsnprintf(err, errlen, fmt, args);
+		va_end(args);
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+static int mpls_uint(const char *s, unsigned int max, unsigned int *val)
+{
+	unsigned long v;
+	char *end;
+
+	errno = 0;
+	v = strtoul(s, &end, 0);
+	if (errno != 0 || end == s || *end != '\0' || *s == '-' || v > max)
+		return -1;
+	*val = v;
+	return 0;
+}
+
+/* "i=v,i=v..." into tab[0..nidx-1], each v at most max */
+static int mpls_map(const char *arg, unsigned int nidx, unsigned int max,
+		    unsigned int *tab)
+{
+	char buf[1024], *tok, *next, *eq;
+	unsigned int i, v;
+
+	if (strlen(arg) >= sizeof(buf))
+		return -1;
+	strcpy(buf, arg);
+	memset(tab, 0, nidx * sizeof(*tab));
+	for (tok = buf; tok != NULL; tok = next) {
+		next = strchr(tok, ',');
+		if (next != NULL)
+			*next++ = '\0';
+		eq = strchr(tok, '=');
+		if (eq == NULL)
+			return -1;
+		*eq++ = '\0';
+		if (mpls_uint(tok, nidx - 1, &i) < 0 ||
+		    mpls_uint(eq, max, &v) < 0)
+			return -1;
+		tab[i] = v;
+	}
+	return 0;
+}
+
+static int mpls_parse_label(const char *s, unsigned int *label)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(mpls_reserved) / sizeof(mpls_reserved[0]); ++i)
+		if (strcmp(s, mpls_reserved[i].name) == 0) {
+			*label = mpls_reserved[i].label;
+			return 0;
+		}
+	return mpls_uint(s, MPLS_LABEL_MAX, label);
+}
+
+static int mpls_parse_set(struct mpls_nexthop_info *nh, int argc,
+			  char **argv)
+{
+	struct sockaddr_in *sin = &nh->mni_nh.ipv4;
+	struct sockaddr_in6 *sin6 = &nh->mni_nh.ipv6;
+
+	if (argc < 2 || argc > 3)
+		return -1;
+	nh->mni_if = if_nametoindex(argv[1]);
+	if (nh->mni_if == 0 && mpls_uint(argv[1], ~0U, &nh->mni_if) < 0)
+		return -1;
+	if (argc == 2)
+		return 0;
+	if (inet_pton(AF_INET, argv[2], &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		return 0;
+	}
+	if (inet_pton(AF_INET6, argv[2], &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		return 0;
+	}
+	return -1;
+}
+
+/* Parse one instruction, its words in argv, into e */
+static int mpls_parse_elem(struct mpls_instr_elem *e, int argc, char **argv)
+{
+	unsigned int tab[MPLS_NFMARK_NUM], mask = 0, v, i;
+	const char *arg = argc > 1 ? argv[argc - 1] : "";
+	int nargs;
+
+	/* Most take one argument; the tables a mask and a map */
+	switch (e->mir_opcode) {
+	case MPLS_OP_DROP:
+	case MPLS_OP_POP:
+	case MPLS_OP_PEEK:
+		nargs = 1;
+		break;
+	case MPLS_OP_SET:
+		return mpls_parse_set(&e->mir_set, argc, argv);
+	case MPLS_OP_NF_FWD:
+	case MPLS_OP_DS_FWD:
+	case MPLS_OP_TC2EXP:
+	case MPLS_OP_DS2EXP:
+	case MPLS_OP_NF2EXP:
+		nargs = 3;
+		if (argc == nargs &&
+		    mpls_uint(argv[1], MPLS_TABLE_MAX, &mask) < 0)
+			return -1;
+		break;
+	default:
+		nargs = 2;
+		break;
+	}
+	if (argc != nargs)
+		return -1;
+
+	switch (e->mir_opcode) {
+	case MPLS_OP_PUSH:
+		e->mir_push.ml_type = MPLS_LABEL_GEN;
+		return mpls_parse_label(arg, &e->mir_push.u.ml_gen);
+	case MPLS_OP_FWD:
+		e->mir_fwd.ml_type = MPLS_LABEL_KEY;
+		return mpls_uint(arg, ~0U, &e->mir_fwd.u.ml_key);
+	case MPLS_OP_NF_FWD:
+		e->mir_nf_fwd.nf_mask = mask;
+		return mpls_map(arg, mask + 1, ~0U, e->mir_nf_fwd.nf_key);
+	case MPLS_OP_DS_FWD:
+		e->mir_ds_fwd.df_mask = mask;
+		return mpls_map(arg, mask + 1, ~0U, e->mir_ds_fwd.df_key);
+	case MPLS_OP_EXP_FWD:
+		return mpls_map(arg, MPLS_EXP_NUM, ~0U, e->mir_exp_fwd.ef_key);
+	case MPLS_OP_SET_TC:
+		if (mpls_uint(arg, 0xffff, &v) < 0)
+			return -1;
+		e->mir_set_tc = v;
+		return 0;
+	case MPLS_OP_SET_DS:
+		if (mpls_uint(arg, MPLS_DSMARK_NUM - 1, &v) < 0)
+			return -1;
+		e->mir_set_ds = v;
+		return 0;
+	case MPLS_OP_SET_EXP:
+		if (mpls_uint(arg, MPLS_EXP_NUM - 1, &v) < 0)
+			return -1;
+		e->mir_set_exp = v;
+		return 0;
+	case MPLS_OP_EXP2TC:
+		if (mpls_map(arg, MPLS_EXP_NUM, 0xffff, tab) < 0)
+			return -1;
+		for (i = 0; i < MPLS_EXP_NUM; ++i)
+			e->mir_exp2tc.e2t[i] = tab[i];
+		return 0;
+	case MPLS_OP_EXP2DS:
+		if (mpls_map(arg, MPLS_EXP_NUM, MPLS_DSMARK_NUM - 1, tab) < 0)
+			return -1;
+		for (i = 0; i < MPLS_EXP_NUM; ++i)
+			e->mir_exp2ds.e2d[i] = tab[i];
+		return 0;
+	case MPLS_OP_TC2EXP:
+	case MPLS_OP_DS2EXP:
+	case MPLS_OP_NF2EXP:
+		if (mpls_map(arg, mask + 1, MPLS_EXP_NUM - 1, tab) < 0)
+			return -1;
+		/* The three have the same layout: mask, then the table */
+		e->mir_tc2exp.t2e_mask = mask;
+		for (i = 0; i <= mask; ++i)
+			e->mir_tc2exp.t2e[i] = tab[i];
+		return 0;
+	}
+	return 0;
+}
+
+/* Whether each value of a table of keys or EXPs is within the mask */
+static int mpls_table_ok(const void *tab, size_t size, unsigned int n,
+			 unsigned int mask)
+{
+	const unsigned char *p = tab;
+	unsigned int i;
+	size_t j;
+
+	for (i = mask + 1; i < n; ++i)
+		for (j = 0; j < size; ++j)
+			if (p[i * size + j] != 0)
+				return 0;
+	return mask <= MPLS_TABLE_MAX;
+}
+
+/*
+ * Check a sequence: every opcode allowed in its direction, the one that
+ * ends it last, labels pushed before their EXP is set and popped
+ * before the next is looked at, values within range.  Returns 0, or
+ * -1 with the reason in err.
+ */
+int mpls_instr_check(const struct mpls_instr_req *instr, char *err,
+		     size_t errlen)
+{
+	unsigned int i, n = instr->mir_instr_length, dir = instr->mir_direction;
+	unsigned int pushed = 0, popped = 0, flags = 0;
+	const struct mpls_instr_elem *e = NULL;
+
+	if (dir != MPLS_IN && dir != MPLS_OUT)
+		return mpls_err(err, errlen, "direction is neither in nor out");
+	if (n == 0)
+		return mpls_err(err, errlen, "no instructions");
+	for (i = 0; i < n; ++i) {
+		e = &instr->mir_instr[i];
+		if (e->mir_opcode >= MPLS_OP_MAX)
+			return mpls_err(err, errlen, "instruction %u: bad "
+					"opcode %u", i + 1, e->mir_opcode);
+		flags = mpls_ops[e->mir_opcode].flags;
+		if (e->mir_direction != dir || !(flags & dir))
+			return mpls_err(err, errlen, "%s cannot be used %s",
+					mpls_ops[e->mir_opcode].name,
+					dir == MPLS_IN ? "on input" :
+					"on output");
+		if (i + 1 < n && (flags & OP_LAST))
+			return mpls_err(err, errlen, "nothing can come after "
+					"%s", mpls_ops[e->mir_opcode].name);
+		if ((flags & OP_LSE) && pushed == 0)
+			return mpls_err(err, errlen, "%s needs a label pushed "
+					"before it",
+					mpls_ops[e->mir_opcode].name);
+		if ((flags & OP_POP) && popped == 0)
+			return mpls_err(err, errlen, "%s needs a label popped "
+					"before it",
+					mpls_ops[e->mir_opcode].name);
+
+		switch (e->mir_opcode) {
+		case MPLS_OP_POP:
+			++popped;
+			break;
+		case MPLS_OP_PUSH:
+			if (e->mir_push.ml_type != MPLS_LABEL_GEN ||
+			    e->mir_push.u.ml_gen > MPLS_LABEL_MAX)
+				return mpls_err(err, errlen, "bad label to push");
+			if (e->mir_push.u.ml_gen == MPLS_IMPLICIT_NULL)
+				return mpls_err(err, errlen, "implicit-null is "
+						"never pushed");
+			/* Only valid as the sole entry: at the bottom */
+			if (pushed != 0 &&
+			    (e->mir_push.u.ml_gen == MPLS_IPV4_EXPLICIT_NULL ||
+			     e->mir_push.u.ml_gen == MPLS_IPV6_EXPLICIT_NULL))
+				return mpls_err(err, errlen, "explicit null "
+						"pushed above another label");
+			++pushed;
+			break;
+		case MPLS_OP_FWD:
+			if (e->mir_fwd.ml_type != MPLS_LABEL_KEY ||
+			    e->mir_fwd.u.ml_key == 0)
+				return mpls_err(err, errlen, "fwd needs an "
+						"NHLFE key");
+			break;
+		case MPLS_OP_SET:
+			if (e->mir_set.mni_if == 0)
+				return mpls_err(err, errlen, "set needs an "
+						"interface");
+			break;
+		case MPLS_OP_SET_DS:
+			if (e->mir_set_ds >= MPLS_DSMARK_NUM)
+				return mpls_err(err, errlen, "bad DSCP");
+			break;
+		case MPLS_OP_SET_EXP:
+			if (e->mir_set_exp >= MPLS_EXP_NUM)
+				return mpls_err(err, errlen, "bad EXP");
+			break;
+		case MPLS_OP_NF_FWD:
+			if (!mpls_table_ok(e->mir_nf_fwd.nf_key,
+					   sizeof(unsigned int),
+					   MPLS_NFMARK_NUM,
+					   e->mir_nf_fwd.nf_mask))
+				return mpls_err(err, errlen, "bad nf-fwd mask");
+			break;
+		case MPLS_OP_DS_FWD:
+			if (!mpls_table_ok(e->mir_ds_fwd.df_key,
+					   sizeof(unsigned int),
+					   MPLS_DSMARK_NUM,
+					   e->mir_ds_fwd.df_mask))
+				return mpls_err(err, errlen, "bad ds-fwd mask");
+			break;
+		case MPLS_OP_TC2EXP:
+		case MPLS_OP_DS2EXP:
+		case MPLS_OP_NF2EXP:
+			if (!mpls_table_ok(e->mir_tc2exp.t2e, 1,
+					   MPLS_TCINDEX_NUM,
+					   e->mir_tc2exp.t2e_mask))
+				return mpls_err(err, errlen, "bad %s mask",
+						mpls_ops[e->mir_opcode].name);
+			break;
+		}
+	}
+
+	/* An NHLFE has to send the packet somewhere */
+	if (dir == MPLS_OUT && !(flags & OP_LAST))
+		return mpls_err(err, errlen, "output does not end with set, "
+				"fwd or drop");
+	if (dir == MPLS_IN && !(flags & OP_LAST) &&
+	    e->mir_opcode != MPLS_OP_POP)
+		return mpls_err(err, errlen, "input does not end with pop or "
+				"a forwarding instruction");
+	return 0;
+}
+
+/*
+ * Compile text, instructions separated by ";", into a sequence for
+ * the direction MPLS_IN or MPLS_OUT, and check it.  The result is to
+ * be freed; NULL with the reason in err if the text is not valid.
+ */
+struct mpls_instr_req *mpls_instr_compile(const char *text, int dir,
+					  char *err, size_t errlen)
+{
+	struct mpls_instr_req *instr;
+	char *buf, *piece, *next, *argv[4], *tok, *save;
+	unsigned int n = 1, op;
+	const char *p;
+	int argc;
+
+	for (p = text; *p != '\0'; ++p)
+		if (*p == ';')
+			++n;
+	if (n > 255) {
+		mpls_err(err, errlen, "too many instructions");
+		return NULL;
+	}
+	instr = calloc(1, mpls_instr_size(n));
+	buf = strdup(text);
+	if (instr == NULL || buf == NULL) {
+		free(instr);
+		free(buf);
+		mpls_err(err, errlen, "%s", strerror(ENOMEM));
+		errno = ENOMEM;
+		return NULL;
+	}
+	instr->mir_direction = dir;
+
+	for (piece = buf; piece != NULL; piece = next) {
+		struct mpls_instr_elem *e;
+
+		next = strchr(piece, ';');
+		if (next != NULL)
+			*next++ = '\0';
+		argc = 0;
+		for (tok = strtok_r(piece, " \t\n", &save); tok != NULL;
+		     tok = strtok_r(NULL, " \t\n", &save)) {
+			if (argc == 4)
+				goto bad;
+			argv[argc++] = tok;
+		}
+		/* Allow an empty piece at the end: "push 16; set eth0;" */
+		if (argc == 0 && next == NULL && instr->mir_instr_length > 0)
+			break;
+		if (argc == 0)
+			goto bad;
+		for (op = 0; op < MPLS_OP_MAX; ++op)
+			if (strcmp(argv[0], mpls_ops[op].name) == 0)
+				break;
+		if (op == MPLS_OP_MAX) {
+			mpls_err(err, errlen, "unknown instruction `%s'",
+				 argv[0]);
+			goto fail;
+		}
+		e = &instr->mir_instr[instr->mir_instr_length++];
+		e->mir_opcode = op;
+		e->mir_direction = dir;
+		if (mpls_parse_elem(e, argc, argv) < 0) {
+			mpls_err(err, errlen, "bad arguments to %s",
+				 argv[0]);
+			goto fail;
+		}
+	}
+	free(buf);
+	if (mpls_instr_check(instr, err, errlen) < 0) {
+		free(instr);
+		return NULL;
+	}
+	return instr;
+
+ bad:
+	mpls_err(err, errlen, "instruction %u is not valid",
+		 instr->mir_instr_length + 1);
+ fail:
+	free(buf);
+	free(instr);
+	errno = EINVAL;
+	return NULL;
+}
+
+struct mpls_fmt {
+	char *buf;
+	size_t len, pos;
+};
+
+static void mpls_fmt(struct mpls_fmt *f, const char *fmt, ...)
+	__attribute__((format(printf,2,3)));
+
+static void mpls_fmt(struct mpls_fmt *f, const char *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	va_start(args, fmt);
+	n = vsnprintf(f->buf + f->pos, f->pos < f->len ? f->len - f->pos : 0,
+		      fmt, args);
+	va_end(args);
+	if (n > 0)
+		f->pos += n;
+}
+
+/* The non-zero entries of a table, as "i=v,..."; "0=0" if none is */
+static void mpls_fmt_map(struct mpls_fmt *f, const void *tab, size_t size,
+			 unsigned int n)
+{
+	const char *sep = " ";
+	unsigned int i, v;
+
+	for (i = 0; i < n; ++i) {
+		switch (size) {
+		case 1:
+			v = ((const unsigned char *)tab)[i];
+			break;
+		case 2:
+			v = ((const unsigned short *)tab)[i];
+			break;
+		default:
+			v = ((const unsigned int *)tab)[i];
+			break;
+		}
+		if (v == 0)
+			continue;
+		mpls_fmt(f, "%s%u=%u", sep, i, v);
+		sep = ",";
+	}
+	if (*sep == ' ')
+		mpls_fmt(f, " 0=0");
+}
+
+static void mpls_fmt_set(struct mpls_fmt *f, const struct mpls_nexthop_info *nh)
+{
+	char name[IF_NAMESIZE], addr[INET6_ADDRSTRLEN];
+
+	if (if_indextoname(nh->mni_if, name) != NULL)
+		mpls_fmt(f, " %s", name);
+	else
+		mpls_fmt(f, " %u", nh->mni_if);
+	if (nh->mni_nh.common.sa_family == AF_INET)
+		mpls_fmt(f, " %s", inet_ntop(AF_INET, &nh->mni_nh.ipv4.sin_addr,
+					     addr, sizeof(addr)));
+	else if (nh->mni_nh.common.sa_family == AF_INET6)
+		mpls_fmt(f, " %s", inet_ntop(AF_INET6,
+					     &nh->mni_nh.ipv6.sin6_addr,
+					     addr, sizeof(addr)));
+}
+
+/*
+ * Print a sequence in the form mpls_instr_compile() reads.  Returns
+ * the length of the text, which was cut short if it is len or more.
+ */
+int mpls_instr_format(const struct mpls_instr_req *instr, char *buf,
+		      size_t len)
+{
+	struct mpls_fmt f = {.buf = buf, .len = len};
+	const struct mpls_instr_elem *e;
+	unsigned int i;
+
+	if (len != 0)
+		*buf = '\0';
+	for (i = 0; i < instr->mir_instr_length; ++i) {
+		e = &instr->mir_instr[i];
+		if (e->mir_opcode >= MPLS_OP_MAX)
+			continue;
+		mpls_fmt(&f, "%s%s", i ? "; " : "",
+			 mpls_ops[e->mir_opcode].name);
+		switch (e->mir_opcode) {
+		case MPLS_OP_PUSH:
+			mpls_fmt(&f, " %u", e->mir_push.u.ml_gen);
+			break;
+		case MPLS_OP_FWD:
+			mpls_fmt(&f, " 0x%x", e->mir_fwd.u.ml_key);
+			break;
+		case MPLS_OP_NF_FWD:
+			mpls_fmt(&f, " 0x%x", e->mir_nf_fwd.nf_mask);
+			mpls_fmt_map(&f, e->mir_nf_fwd.nf_key,
+				     sizeof(unsigned int),
+				     e->mir_nf_fwd.nf_mask + 1);
+			break;
+		case MPLS_OP_DS_FWD:
+			mpls_fmt(&f, " 0x%x", e->mir_ds_fwd.df_mask);
+			mpls_fmt_map(&f, e->mir_ds_fwd.df_key,
+				     sizeof(unsigned int),
+				     e->mir_ds_fwd.df_mask + 1);
+			break;
+		case MPLS_OP_EXP_FWD:
+			mpls_fmt_map(&f, e->mir_exp_fwd.ef_key,
+				     sizeof(unsigned int), MPLS_EXP_NUM);
+			break;
+		case MPLS_OP_SET:
+			mpls_fmt_set(&f, &e->mir_set);
+			break;
+		case MPLS_OP_SET_TC:
+			mpls_fmt(&f, " %u", e->mir_set_tc);
+			break;
+		case MPLS_OP_SET_DS:
+			mpls_fmt(&f, " %u", e->mir_set_ds);
+			break;
+		case MPLS_OP_SET_EXP:
+			mpls_fmt(&f, " %u", e->mir_set_exp);
+			break;
+		case MPLS_OP_EXP2TC:
+			mpls_fmt_map(&f, e->mir_exp2tc.e2t,
+				     sizeof(unsigned short), MPLS_EXP_NUM);
+			break;
+		case MPLS_OP_EXP2DS:
+			mpls_fmt_map(&f, e->mir_exp2ds.e2d, 1, MPLS_EXP_NUM);
+			break;
+		case MPLS_OP_TC2EXP:
+		case MPLS_OP_DS2EXP:
+		case MPLS_OP_NF2EXP:
+			mpls_fmt(&f, " 0x%x", e->mir_tc2exp.t2e_mask);
+			mpls_fmt_map(&f, e->mir_tc2exp.t2e, 1,
+				     e->mir_tc2exp.t2e_mask + 1);
+			break;
+		}
+	}
+	return f.pos;
+}
+
+/****************************************************************************
+ *
+ * Sets of sequences, one key each
+ *
+ ****************************************************************************/
+
+#define MPLS_SET_BUCKETS	1024
+
+struct mpls_instr_node {
+	struct mpls_instr_node *next, *seq_next;
+	u_int32_t hash, key;
+	unsigned int uses;
+	struct mpls_instr_req instr;	/* must be last */
+};
+
+struct mpls_instr_set {
+	struct mpls_instr_node *bucket[MPLS_SET_BUCKETS];
+	struct mpls_instr_node *first, **last;	/* in the order added */
+	u_int32_t next_key;
+	unsigned int num;
+};
+
+static u_int32_t mpls_instr_hash(const void *p, size_t len)
+{
+	const unsigned char *c = p;
+	u_int32_t h = 2166136261U;	/* FNV-1a */
+
+	while (len-- > 0)
+		h = (h ^ *c++) * 16777619U;
+	return h;
+}
+
+/*
+ * A set whose keys are given out from base up.
+ */
+struct mpls_instr_set *mpls_instr_set_new(u_int32_t base)
+{
+	struct mpls_instr_set *s;
+
+	if (base == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		return NULL;
+	s->last = &s->first;
+	s->next_key = base;
+	return s;
+}
+
+void mpls_instr_set_free(struct mpls_instr_set *s)
+{
+	struct mpls_instr_node *n;
+
+	if (s == NULL)
+		return;
+	while ((n = s->first) != NULL) {
+		s->first = n->seq_next;
+		free(n);
+	}
+	free(s);
+}
+
+/*
+ * The key of a sequence: that of an equal one already in the set, or
+ * the next key if it is new.  Sequences are equal if their bytes are,
+ * so build them zeroed, as mpls_instr_compile() does.  Returns 0, with
+ * errno set, if the set is out of memory or keys.
+ */
+u_int32_t mpls_instr_set_key(struct mpls_instr_set *s,
+			     const struct mpls_instr_req *instr)
+{
+	size_t len = mpls_instr_size(instr->mir_instr_length);
+	u_int32_t hash = mpls_instr_hash(instr, len);
+	struct mpls_instr_node **pp, *n;
+
+	pp = &s->bucket[hash % MPLS_SET_BUCKETS];
+	for (n = *pp; n != NULL; n = n->next)
+		if (n->hash == hash &&
+		    n->instr.mir_instr_length == instr->mir_instr_length &&
+		    memcmp(&n->instr, instr, len) == 0) {
+			++n->uses;
+			return n->key;
+		}
+	if (s->next_key == 0) {
+		errno = ENOSPC;
+		return 0;
+	}
+	n = malloc(offsetof(struct mpls_instr_node, instr) + len);
+	if (n == NULL)
+		return 0;
+	memcpy(&n->instr, instr, len);
+	n->hash = hash;
+	n->key = s->next_key++;
+	n->uses = 1;
+	n->next = *pp;
+	*pp = n;
+	n->seq_next = NULL;
+	*s->last = n;
+	s->last = &n->seq_next;
+	++s->num;
+	return n->key;
+}
+
+unsigned int mpls_instr_set_size(const struct mpls_instr_set *s)
+{
+	return s->num;
+}
+
+/*
+ * Call fn for each sequence, in the order of their keys, with the
+ * number of times it was added.
+ */
+int mpls_instr_set_walk(const struct mpls_instr_set *s,
+			mpls_instr_walk_fn *fn, void *data)
+{
+	const struct mpls_instr_node *n;
+	int ret;
+
+	for (n = s->first; n != NULL; n = n->seq_next) {
+		ret = fn(n->key, &n->instr, n->uses, data);
+		if (ret != 0)
+			return ret;
+	}
+	return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef _LIBMPLS_INTERNAL_H
+#define _LIBMPLS_INTERNAL_H 1
+
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+
+#define GENL_HDRLEN_ALL	(NLMSG_HDRLEN + GENL_HDRLEN)
+#define NLA_SPACE(len)	NLA_ALIGN(NLA_HDRLEN + (len))
+#define NLA_DATA(nla)	((void *)((char *)(nla) + NLA_HDRLEN))
+
+/* The first attribute of a type in a generic netlink message */
+static inline const struct nlattr *
+mpls_nla_find(const struct nlmsghdr *nlh, int type)
+{
+	const struct nlattr *nla;
+	int len = nlh->nlmsg_len - GENL_HDRLEN_ALL;
+
+	nla = (const void *)((const char *)nlh + GENL_HDRLEN_ALL);
+	while (len >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN &&
+	       nla->nla_len <= len) {
+		if ((nla->nla_type & NLA_TYPE_MASK) == type)
+			return nla;
+		len -= NLA_ALIGN(nla->nla_len);
+		nla = (const void *)((const char *)nla +
+				     NLA_ALIGN(nla->nla_len));
+	}
+	return NULL;
+}
+
+#endif /* _LIBMPLS_INTERNAL_H */
@@ -0,0 +1,625 @@
+/*
+ * libmpls.c
+ *
+ * Batched requests to the nlmpls generic netlink family.
+ *
+ * Requests are encoded into a queue as they are made and go out on
+ * mpls_commit(), packed many to a send, each with NLM_F_ACK.  Up to a
+ * window of them are in flight before the acks are read, so that a
+ * table of 100k entries takes a few hundred sends instead of 100k
+ * round trips, without overrunning the receive buffer with acks.
+ * The window is made to fit the buffer the kernel actually gave; if
+ * acks are dropped all the same, the requests whose acks were lost are
+ * told apart from those that are known to be done.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include <libmpls/libmpls.h>
+#include "internal.h"
+
+#ifndef SOL_NETLINK
+#define SOL_NETLINK	270
+#endif
+#ifndef NETLINK_CAP_ACK
+#define NETLINK_CAP_ACK	10
+#endif
+
+#define MPLS_BUFSIZE	32768		/* bytes of requests per send */
+#define MPLS_WINDOW	1024		/* requests in flight */
+#define MPLS_RCVBUF	(1 << 20)
+#define MPLS_ACKSIZE	2048		/* of the receive buffer, per ack */
+#define MPLS_RBUFSIZE	65536
+
+struct mpls_handle {
+	struct mpls_transport tp;
+	u_int16_t family;		/* of nlmpls, from the controller */
+	u_int32_t seq;			/* of the next message */
+	u_int32_t first;		/* of the first request committed */
+	size_t bufsize;
+	unsigned int window;
+
+	unsigned char *queue;		/* requests queued, encoded */
+	size_t qlen, qsize;
+	unsigned int nqueued;
+
+	unsigned char rbuf[MPLS_RBUFSIZE];
+};
+
+/****************************************************************************
+ *
+ * NETLINK_GENERIC socket transport
+ *
+ ****************************************************************************/
+
+static ssize_t mpls_nl_send(void *priv, const void *buf, size_t len)
+{
+	const struct sockaddr_nl peer = {.nl_family = AF_NETLINK};
+	int fd = *(int *)priv;
+	ssize_t ret;
+
+	do {
+		ret = sendto(fd, buf, len, 0, (const struct sockaddr *)&peer,
+			     sizeof(peer));
+	} while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+static ssize_t mpls_nl_recv(void *priv, void *buf, size_t len)
+{
+	struct sockaddr_nl peer;
+	struct iovec iov = {.iov_base = buf, .iov_len = len};
+	struct msghdr msg = {
+		.msg_name	= &peer,
+		.msg_namelen	= sizeof(peer),
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+	};
+	int fd = *(int *)priv;
+	ssize_t ret;
+
+	for (;;) {
+		ret = recvmsg(fd, &msg, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return ret;
+		if (msg.msg_flags & MSG_TRUNC) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		/* Only the kernel talks to us */
+		if (peer.nl_pid == 0)
+			return ret;
+	}
+}
+
+static void mpls_nl_close(void *priv)
+{
+	close(*(int *)priv);
+	free(priv);
+}
+
+/* window is set to the number of acks the receive buffer holds */
+static int mpls_nl_transport(struct mpls_transport *tp, unsigned int *window)
+{
+	struct sockaddr_nl local = {.nl_family = AF_NETLINK};
+	int rcvbuf = MPLS_RCVBUF, one = 1, acksize = MPLS_ACKSIZE;
+	socklen_t optlen = sizeof(rcvbuf);
+	int *fd;
+
+	fd = malloc(sizeof(*fd));
+	if (fd == NULL)
+		return -1;
+	*fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+	if (*fd < 0) {
+		free(fd);
+		return -1;
+	}
+	/* Room for the acks of a whole window, past rmem_max if allowed;
+	 * acks without the request in them take less */
+	if (setsockopt(*fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf,
+		       sizeof(rcvbuf)) < 0)
+		setsockopt(*fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+			   sizeof(rcvbuf));
+	if (setsockopt(*fd, SOL_NETLINK, NETLINK_CAP_ACK, &one,
+		       sizeof(one)) < 0)
+		acksize *= 2;
+	if (getsockopt(*fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen) < 0) {
+		mpls_nl_close(fd);
+		return -1;
+	}
+	*window = rcvbuf / acksize > 0 ? rcvbuf / acksize : 1;
+	if (bind(*fd, (struct sockaddr *)&local, sizeof(local)) < 0) {
+		mpls_nl_close(fd);
+		return -1;
+	}
+	tp->send  = mpls_nl_send;
+	tp->recv  = mpls_nl_recv;
+	tp->close = mpls_nl_close;
+	tp->priv  = fd;
+	return 0;
+}
+
+/****************************************************************************
+ *
+ * Private interface
+ *
+ ****************************************************************************/
+
+static void *mpls_put_attr(void *p, int type, const void *data, size_t len)
+{
+	struct nlattr *nla = p;
+
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + len;
+	memcpy(NLA_DATA(nla), data, len);
+	return (char *)nla + NLA_ALIGN(nla->nla_len);
+}
+
+/* Make room at the end of the queue for a message of len bytes */
+static struct nlmsghdr *mpls_queue_room(struct mpls_handle *h, size_t len)
+{
+	struct nlmsghdr *nlh;
+
+	if (h->qlen + NLMSG_ALIGN(len) > h->qsize) {
+		size_t size = h->qsize ? h->qsize : MPLS_BUFSIZE;
+		unsigned char *q;
+
+		while (h->qlen + NLMSG_ALIGN(len) > size)
+			size *= 2;
+		q = realloc(h->queue, size);
+		if (q == NULL)
+			return NULL;
+		h->queue = q;
+		h->qsize = size;
+	}
+	nlh = (struct nlmsghdr *)(h->queue + h->qlen);
+	memset(nlh, 0, NLMSG_ALIGN(len));
+	return nlh;
+}
+
+static void mpls_genl_init(struct nlmsghdr *nlh, size_t len, u_int16_t type,
+			   u_int16_t flags, u_int32_t seq, u_int8_t cmd)
+{
+	struct genlmsghdr *genl = NLMSG_DATA(nlh);
+
+	nlh->nlmsg_len = len;
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+	nlh->nlmsg_seq = seq;
+	genl->cmd = cmd;
+	genl->version = MPLS_GENL_VERSION;
+}
+
+/* The attribute each command carries its object in */
+static int mpls_cmd_attr(int cmd)
+{
+	switch (cmd) {
+	case MPLS_CMD_NEWILM:
+	case MPLS_CMD_DELILM:
+	case MPLS_CMD_GETILM:
+		return MPLS_ATTR_ILM;
+	case MPLS_CMD_NEWNHLFE:
+	case MPLS_CMD_DELNHLFE:
+	case MPLS_CMD_GETNHLFE:
+		return MPLS_ATTR_NHLFE;
+	case MPLS_CMD_NEWXC:
+	case MPLS_CMD_DELXC:
+	case MPLS_CMD_GETXC:
+		return MPLS_ATTR_XC;
+	case MPLS_CMD_SETLABELSPACE:
+	case MPLS_CMD_GETLABELSPACE:
+		return MPLS_ATTR_LABELSPACE;
+	}
+	return -1;
+}
+
+/* Send one message and wait for the answers to it: fn is called for
+ * each message with its sequence number, until the ack or NLMSG_DONE */
+static int mpls_transact(struct mpls_handle *h, struct nlmsghdr *nlh,
+			 void (*fn)(struct mpls_handle *,
+				    const struct nlmsghdr *, void *),
+			 void *data)
+{
+	u_int32_t seq = nlh->nlmsg_seq;
+	const struct nlmsghdr *r;
+	ssize_t len;
+
+	if (h->tp.send(h->tp.priv, nlh, nlh->nlmsg_len) < 0)
+		return -1;
+	for (;;) {
+		len = h->tp.recv(h->tp.priv, h->rbuf, sizeof(h->rbuf));
+		if (len < 0)
+			return -1;
+		for (r = (const void *)h->rbuf; NLMSG_OK(r, len);
+		     r = NLMSG_NEXT(r, len)) {
+			if (r->nlmsg_seq != seq)
+				continue;
+			if (r->nlmsg_type == NLMSG_DONE)
+				return 0;
+			if (r->nlmsg_type == NLMSG_ERROR) {
+				const struct nlmsgerr *e = NLMSG_DATA(r);
+
+				if (e->error == 0)
+					return 0;
+				errno = -e->error;
+				return -1;
+			}
+			fn(h, r, data);
+		}
+	}
+}
+
+static void mpls_family_reply(struct mpls_handle *h,
+			      const struct nlmsghdr *nlh, void *data)
+{
+	const struct nlattr *nla = mpls_nla_find(nlh, CTRL_ATTR_FAMILY_ID);
+
+	if (nla != NULL && nla->nla_len >= NLA_HDRLEN + sizeof(u_int16_t))
+		memcpy(&h->family, NLA_DATA(nla),
+		       sizeof(u_int16_t));
+}
+
+static int mpls_resolve(struct mpls_handle *h)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct genlmsghdr genl;
+		char attr[NLA_ALIGN(NLA_HDRLEN + sizeof(MPLS_NETLINK_NAME))];
+	} req;
+
+	memset(&req, 0, sizeof(req));
+	mpls_genl_init(&req.nlh, sizeof(req), GENL_ID_CTRL, NLM_F_ACK,
+		       h->seq++, CTRL_CMD_GETFAMILY);
+	mpls_put_attr(req.attr, CTRL_ATTR_FAMILY_NAME, MPLS_NETLINK_NAME,
+		      sizeof(MPLS_NETLINK_NAME));
+	if (mpls_transact(h, &req.nlh, mpls_family_reply, NULL) < 0)
+		return -1;
+	if (h->family == 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	return 0;
+}
+
+/****************************************************************************
+ *
+ * Public interface
+ *
+ ****************************************************************************/
+
+/*
+ * Create a handle on a transport of the caller's, which it then owns.
+ */
+struct mpls_handle *mpls_open_transport(const struct mpls_transport *tp)
+{
+	struct mpls_handle *h;
+	int err;
+
+	h = calloc(1, sizeof(*h));
+	if (h == NULL) {
+		tp->close(tp->priv);
+		return NULL;
+	}
+	h->tp = *tp;
+	h->seq = 1;
+	h->bufsize = MPLS_BUFSIZE;
+	h->window = MPLS_WINDOW;
+	if (mpls_resolve(h) < 0) {
+		err = errno;
+		mpls_close(h);
+		errno = err;
+		return NULL;
+	}
+	return h;
+}
+
+struct mpls_handle *mpls_open(void)
+{
+	struct mpls_transport tp;
+	struct mpls_handle *h;
+	unsigned int window;
+
+	if (mpls_nl_transport(&tp, &window) < 0)
+		return NULL;
+	h = mpls_open_transport(&tp);
+	if (h != NULL && window < h->window)
+		h->window = window;
+	return h;
+}
+
+void mpls_close(struct mpls_handle *h)
+{
+	if (h == NULL)
+		return;
+	h->tp.close(h->tp.priv);
+	free(h->queue);
+	free(h);
+}
+
+/*
+ * At most bufsize bytes of requests go in one send, and at most window
+ * requests are in flight.  0 keeps the current value.
+ */
+int mpls_set_batch(struct mpls_handle *h, size_t bufsize, unsigned int window)
+{
+	if (bufsize != 0 && bufsize < NLMSG_SPACE(GENL_HDRLEN)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (bufsize != 0)
+		h->bufsize = bufsize;
+	if (window != 0)
+		h->window = window;
+	return 0;
+}
+
+size_t mpls_instr_size(unsigned int n)
+{
+	return sizeof(struct mpls_instr_req) +
+	       n * sizeof(struct mpls_instr_elem);
+}
+
+/*
+ * Queue one request; nothing is sent before mpls_commit().
+ */
+int mpls_request(struct mpls_handle *h, int cmd, const void *obj,
+		 size_t len, const struct mpls_instr_req *instr)
+{
+	int attr = mpls_cmd_attr(cmd);
+	size_t ilen = 0, size;
+	struct nlmsghdr *nlh;
+	void *p;
+
+	if (attr < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (instr != NULL)
+		ilen = mpls_instr_size(instr->mir_instr_length);
+	size = GENL_HDRLEN_ALL + NLA_SPACE(len);
+	if (instr != NULL)
+		size += NLA_SPACE(ilen);
+	nlh = mpls_queue_room(h, size);
+	if (nlh == NULL)
+		return -1;
+	/* Numbered when committed */
+	mpls_genl_init(nlh, size, h->family, NLM_F_ACK, 0, cmd);
+	p = mpls_put_attr((char *)nlh + GENL_HDRLEN_ALL, attr, obj, len);
+	if (instr != NULL)
+		mpls_put_attr(p, MPLS_ATTR_INSTR, instr, ilen);
+	h->qlen += NLMSG_ALIGN(size);
+	++h->nqueued;
+	return 0;
+}
+
+int mpls_ilm_add(struct mpls_handle *h, const struct mpls_in_label_req *ilm,
+		 const struct mpls_instr_req *instr)
+{
+	return mpls_request(h, MPLS_CMD_NEWILM, ilm, sizeof(*ilm), instr);
+}
+
+int mpls_ilm_del(struct mpls_handle *h, const struct mpls_in_label_req *ilm)
+{
+	return mpls_request(h, MPLS_CMD_DELILM, ilm, sizeof(*ilm), NULL);
+}
+
+int mpls_nhlfe_add(struct mpls_handle *h,
+		   const struct mpls_out_label_req *nhlfe,
+		   const struct mpls_instr_req *instr)
+{
+	return mpls_request(h, MPLS_CMD_NEWNHLFE, nhlfe, sizeof(*nhlfe),
+			    instr);
+}
+
+int mpls_nhlfe_del(struct mpls_handle *h,
+		   const struct mpls_out_label_req *nhlfe)
+{
+	return mpls_request(h, MPLS_CMD_DELNHLFE, nhlfe, sizeof(*nhlfe), NULL);
+}
+
+int mpls_xc_add(struct mpls_handle *h, const struct mpls_xconnect_req *xc)
+{
+	return mpls_request(h, MPLS_CMD_NEWXC, xc, sizeof(*xc), NULL);
+}
+
+int mpls_xc_del(struct mpls_handle *h, const struct mpls_xconnect_req *xc)
+{
+	return mpls_request(h, MPLS_CMD_DELXC, xc, sizeof(*xc), NULL);
+}
+
+int mpls_labelspace_set(struct mpls_handle *h,
+			const struct mpls_labelspace_req *ls)
+{
+	return mpls_request(h, MPLS_CMD_SETLABELSPACE, ls, sizeof(*ls), NULL);
+}
+
+unsigned int mpls_queued(const struct mpls_handle *h)
+{
+	return h->nqueued;
+}
+
+/*
+ * Drop the requests queued since the last commit.
+ */
+void mpls_abort(struct mpls_handle *h)
+{
+	h->qlen = 0;
+	h->nqueued = 0;
+}
+
+/* Ask for an ack behind the requests sent: when it comes, those of
+ * them that were not acked have lost their acks */
+static int mpls_barrier(struct mpls_handle *h, u_int32_t *seq)
+{
+	struct nlmsghdr nlh = {
+		.nlmsg_len	= NLMSG_LENGTH(0),
+		.nlmsg_type	= NLMSG_NOOP,
+		.nlmsg_flags	= NLM_F_REQUEST | NLM_F_ACK,
+		.nlmsg_seq	= h->seq++,
+	};
+
+	*seq = nlh.nlmsg_seq;
+	return h->tp.send(h->tp.priv, &nlh, nlh.nlmsg_len) < 0 ? -1 : 0;
+}
+
+/*
+ * Send the queued requests, in order, and collect their acks.  Returns
+ * the number of requests refused, each reported to fn, or -1 if the
+ * transport failed; the queue is empty afterwards either way.  Acks
+ * dropped for want of room make the window smaller; the requests they
+ * were for may or may not have been carried out, and are reported to
+ * fn and counted with ENOBUFS.
+ */
+int mpls_commit(struct mpls_handle *h, mpls_error_fn *fn, void *data)
+{
+	unsigned int n = h->nqueued, sent = 0, done = 0, failed = 0;
+	const struct nlmsghdr *r;
+	u_int32_t barrier = 0;
+	size_t off = 0;
+	ssize_t len;
+	int err;
+
+	h->first = h->seq;
+	h->seq += n;
+	while (done < n) {
+		/* Fill the window, a buffer per send */
+		while (off < h->qlen && barrier == 0 &&
+		       sent - done < h->window) {
+			size_t blen = 0;
+			unsigned int cnt = 0;
+
+			while (off + blen < h->qlen &&
+			       sent + cnt - done < h->window) {
+				struct nlmsghdr *nlh =
+					(void *)(h->queue + off + blen);
+				size_t mlen = NLMSG_ALIGN(nlh->nlmsg_len);
+
+				if (blen != 0 && blen + mlen > h->bufsize)
+					break;
+				nlh->nlmsg_seq = h->first + sent + cnt;
+				blen += mlen;
+				++cnt;
+			}
+			if (h->tp.send(h->tp.priv, h->queue + off, blen) < 0)
+				goto fail;
+			off += blen;
+			sent += cnt;
+		}
+
+		len = h->tp.recv(h->tp.priv, h->rbuf, sizeof(h->rbuf));
+		if (len < 0 && errno == ENOBUFS) {
+			/* Send no more until it is known which acks were
+			 * lost, and fewer at a time afterwards */
+			if (mpls_barrier(h, &barrier) < 0)
+				goto fail;
+			if (h->window > 1)
+				h->window /= 2;
+			continue;
+		}
+		if (len < 0)
+			goto fail;
+		for (r = (const void *)h->rbuf; NLMSG_OK(r, len);
+		     r = NLMSG_NEXT(r, len)) {
+			const struct nlmsgerr *e = NLMSG_DATA(r);
+			unsigned int idx = r->nlmsg_seq - h->first;
+
+			/* Acks only; anything else is not ours */
+			if (r->nlmsg_type != NLMSG_ERROR)
+				continue;
+			if (barrier != 0 && r->nlmsg_seq == barrier) {
+				idx = sent;
+				barrier = 0;
+			} else if (idx >= sent || idx < done) {
+				continue;
+			}
+			/* Acks come in order: those skipped were lost */
+			for (; done < idx; ++done) {
+				++failed;
+				if (fn != NULL)
+					fn(done, ENOBUFS, data);
+			}
+			if (idx == sent)
+				continue;
+			++done;
+			if (e->error == 0)
+				continue;
+			++failed;
+			if (fn != NULL)
+				fn(idx, -e->error, data);
+		}
+	}
+	mpls_abort(h);
+	return failed;
+
+ fail:
+	err = errno;
+	mpls_abort(h);
+	errno = err;
+	return -1;
+}
+
+struct mpls_dump_state {
+	int attr;
+	mpls_dump_fn *fn;
+	void *data;
+	int count;
+};
+
+static void mpls_dump_reply(struct mpls_handle *h,
+			    const struct nlmsghdr *nlh, void *data)
+{
+	struct mpls_dump_state *st = data;
+	const struct nlattr *obj, *instr;
+
+	if (nlh->nlmsg_type != h->family ||
+	    nlh->nlmsg_len < GENL_HDRLEN_ALL)
+		return;
+	obj = mpls_nla_find(nlh, st->attr);
+	if (obj == NULL)
+		return;
+	instr = mpls_nla_find(nlh, MPLS_ATTR_INSTR);
+	st->fn(NLA_DATA(obj), obj->nla_len - NLA_HDRLEN,
+	       instr == NULL ? NULL :
+	       NLA_DATA(instr), st->data);
+	++st->count;
+}
+
+/*
+ * Dump a table, with MPLS_CMD_GETILM, GETNHLFE, GETXC or
+ * GETLABELSPACE.  Returns the number of objects passed to fn.
+ */
+int mpls_dump(struct mpls_handle *h, int cmd, mpls_dump_fn *fn, void *data)
+{
+	struct mpls_dump_state st = {
+		.attr = mpls_cmd_attr(cmd), .fn = fn, .data = data,
+	};
+	struct {
+		struct nlmsghdr nlh;
+		struct genlmsghdr genl;
+	} req;
+
+	if (cmd != MPLS_CMD_GETILM && cmd != MPLS_CMD_GETNHLFE &&
+	    cmd != MPLS_CMD_GETXC && cmd != MPLS_CMD_GETLABELSPACE) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(&req, 0, sizeof(req));
+	mpls_genl_init(&req.nlh, sizeof(req), h->family, NLM_F_DUMP,
+		       h->seq++, cmd);
+	if (mpls_transact(h, &req.nlh, mpls_dump_reply, &st) < 0)
+		return -1;
+	return st.count;
+}
@@ -0,0 +1,381 @@
+/*
+ * mpls-compile: turn lines of "rule => instructions" into NHLFEs and
+ * the -j MPLS rules that use them.  Rules with the same instructions
+ * share one NHLFE.  The rules go in chains of their own, which the
+ * output replaces with iptables-restore --noflush and leaves the rest
+ * of the table alone.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libmpls/libmpls.h>
+
+#define SEPARATOR	"=>"
+
+struct compile_rule {
+	char *spec;			/* chain and matches */
+	u_int32_t key;
+};
+
+static const struct option compile_opts[] = {
+	{.name = "table",   .has_arg = true,  .val = 't'},
+	{.name = "base",    .has_arg = true,  .val = 'b'},
+	{.name = "mtu",     .has_arg = true,  .val = 'm'},
+	{.name = "no-ttl",  .has_arg = false, .val = 'T'},
+	{.name = "apply",   .has_arg = false, .val = 'a'},
+	{.name = "whole-table", .has_arg = false, .val = 'W'},
+	{.name = "help",    .has_arg = false, .val = 'h'},
+	{NULL},
+};
+
+static void compile_usage(void)
+{
+	printf(
+"Usage: mpls-compile [-t table] [-b key] [-m mtu] [-T] [-a] [-W] [file]\n"
+"\n"
+"Each line of file, or of standard input, is a rule in a chain of\n"
+"its own and the instructions for its NHLFE:\n"
+"\n"
+"  MPLS-FWD -d 10.1.0.0/16 => push 100; set-exp 5; set eth0 192.0.2.1\n"
+"\n"
+"  -t, --table table    table of the rules (default mangle)\n"
+"  -b, --base key       first NHLFE key to give out (default 0x100)\n"
+"  -m, --mtu mtu        MTU of the NHLFEs (default 1500)\n"
+"  -T, --no-ttl         do not propagate the TTL into the label\n"
+"  -a, --apply          create the NHLFEs in the kernel\n"
+"  -W, --whole-table    allow built-in chains; the output replaces\n"
+"                       the whole table\n");
+}
+
+static bool compile_builtin(const char *chain, size_t len)
+{
+	static const char *const builtin[] = {
+		"PREROUTING", "INPUT", "FORWARD", "OUTPUT", "POSTROUTING",
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(builtin) / sizeof(*builtin); ++i)
+		if (strlen(builtin[i]) == len &&
+		    strncmp(chain, builtin[i], len) == 0)
+			return true;
+	return false;
+}
+
+/* Declare each chain of the rules once, where it is first used */
+static void compile_chains(const struct compile_rule *rules,
+			   unsigned int nrules)
+{
+	unsigned int i, j;
+	size_t len;
+
+	for (i = 0; i < nrules; ++i) {
+		len = strcspn(rules[i].spec, " \t");
+		if (compile_builtin(rules[i].spec, len))
+			continue;
+		for (j = 0; j < i; ++j)
+			if (strncmp(rules[j].spec, rules[i].spec, len) == 0 &&
+			    strcspn(rules[j].spec, " \t") == len)
+				break;
+		if (j == i)
+			printf(":%.*s - [0:0]\n", (int)len, rules[i].spec);
+	}
+}
+
+static int compile_print(u_int32_t key, const struct mpls_instr_req *instr,
+			 unsigned int uses, void *data)
+{
+	char buf[4096];
+
+	mpls_instr_format(instr, buf, sizeof(buf));
+	printf("# nhlfe 0x%x: %s (%u rule%s)\n", key, buf, uses,
+	       uses == 1 ? "" : "s");
+	return 0;
+}
+
+struct compile_apply {
+	struct mpls_handle *h;
+	u_int32_t mtu;
+	int8_t ttl;
+	/* by request, to report failures; the keys go up */
+	u_int32_t *keys;
+	const struct mpls_instr_req **instrs;
+	unsigned char *exists;		/* 1 if EEXIST, 2 if the same */
+	unsigned int nreq, nexist;
+};
+
+static int compile_queue(u_int32_t key, const struct mpls_instr_req *instr,
+			 unsigned int uses, void *data)
+{
+	struct compile_apply *a = data;
+	struct mpls_out_label_req nhlfe;
+
+	memset(&nhlfe, 0, sizeof(nhlfe));
+	nhlfe.mol_label.ml_type = MPLS_LABEL_KEY;
+	nhlfe.mol_label.u.ml_key = key;
+	nhlfe.mol_mtu = a->mtu;
+	nhlfe.mol_propagate_ttl = a->ttl;
+	a->keys[a->nreq] = key;
+	a->instrs[a->nreq++] = instr;
+	return mpls_nhlfe_add(a->h, &nhlfe, instr) < 0 ? -1 : 0;
+}
+
+static void compile_refused(unsigned int index, int error, void *data)
+{
+	struct compile_apply *a = data;
+
+	/* Left for compile_existing() */
+	if (error == EEXIST) {
+		a->exists[index] = 1;
+		++a->nexist;
+		return;
+	}
+	if (error == ENOBUFS)
+		fprintf(stderr, "mpls-compile: NHLFE 0x%x: ack lost, "
+			"may or may not have been added\n", a->keys[index]);
+	else
+		fprintf(stderr, "mpls-compile: NHLFE 0x%x: %s\n",
+			a->keys[index], strerror(error));
+}
+
+static int compile_key_cmp(const void *a, const void *b)
+{
+	u_int32_t x = *(const u_int32_t *)a, y = *(const u_int32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void compile_dumped(const void *obj, size_t len,
+			   const struct mpls_instr_req *instr, void *data)
+{
+	struct compile_apply *a = data;
+	const struct mpls_out_label_req *nhlfe = obj;
+	const struct mpls_instr_req *want;
+	const u_int32_t *k;
+	unsigned int i;
+
+	if (len < sizeof(*nhlfe))
+		return;
+	k = bsearch(&nhlfe->mol_label.u.ml_key, a->keys, a->nreq,
+		    sizeof(*a->keys), compile_key_cmp);
+	if (k == NULL)
+		return;
+	i = k - a->keys;
+	want = a->instrs[i];
+	if (a->exists[i] == 1 && instr != NULL &&
+	    nhlfe->mol_mtu == a->mtu &&
+	    nhlfe->mol_propagate_ttl == a->ttl &&
+	    instr->mir_instr_length == want->mir_instr_length &&
+	    memcmp(instr, want,
+		   mpls_instr_size(want->mir_instr_length)) == 0)
+		a->exists[i] = 2;
+}
+
+/* An NHLFE that was there already is fine if it is the one that would
+ * have been made, so that the same input can be applied again */
+static int compile_existing(struct compile_apply *a)
+{
+	unsigned int i;
+	int failed = 0;
+
+	if (mpls_dump(a->h, MPLS_CMD_GETNHLFE, compile_dumped, a) < 0) {
+		fprintf(stderr, "mpls-compile: %s\n", strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < a->nreq; ++i) {
+		if (a->exists[i] != 1)
+			continue;
+		fprintf(stderr, "mpls-compile: NHLFE 0x%x: exists, with "
+			"other instructions, MTU or TTL setting\n",
+			a->keys[i]);
+		++failed;
+	}
+	return failed;
+}
+
+static int compile_apply(const struct mpls_instr_set *set, u_int32_t mtu,
+			 int8_t ttl)
+{
+	struct compile_apply a = {.mtu = mtu, .ttl = ttl};
+	unsigned int n = mpls_instr_set_size(set);
+	int ret = -1, same;
+
+	a.keys = calloc(n, sizeof(*a.keys));
+	a.instrs = calloc(n, sizeof(*a.instrs));
+	a.exists = calloc(n, sizeof(*a.exists));
+	if (a.keys == NULL || a.instrs == NULL || a.exists == NULL)
+		goto out;
+	a.h = mpls_open();
+	if (a.h == NULL) {
+		fprintf(stderr, "mpls-compile: %s\n", strerror(errno));
+	} else if (mpls_instr_set_walk(set, compile_queue, &a) != 0) {
+		fprintf(stderr, "mpls-compile: %s\n", strerror(errno));
+	} else {
+		ret = mpls_commit(a.h, compile_refused, &a);
+		if (ret < 0)
+			fprintf(stderr, "mpls-compile: %s\n",
+				strerror(errno));
+	}
+	if (ret > 0 && a.nexist > 0) {
+		same = compile_existing(&a);
+		ret = same < 0 ? -1 : ret - a.nexist + same;
+	}
+	mpls_close(a.h);
+ out:
+	free(a.keys);
+	free(a.instrs);
+	free(a.exists);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *table = "mangle";
+	u_int32_t base = 0x100, mtu = 1500;
+	struct compile_rule *rules = NULL;
+	unsigned int nrules = 0, line = 0, i;
+	struct mpls_instr_set *set;
+	bool apply = false, whole = false;
+	int8_t ttl = 1;
+	char buf[8192], err[256], *sep, *p;
+	FILE *in = stdin;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "t:b:m:TaWh", compile_opts,
+				NULL)) != -1) {
+		switch (c) {
+		case 't':
+			table = optarg;
+			break;
+		case 'b':
+			base = strtoul(optarg, &p, 0);
+			if (*p != '\0' || base == 0) {
+				fprintf(stderr, "mpls-compile: bad key `%s'\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		case 'm':
+			mtu = strtoul(optarg, &p, 0);
+			if (*p != '\0' || mtu == 0) {
+				fprintf(stderr, "mpls-compile: bad MTU `%s'\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		case 'T':
+			ttl = 0;
+			break;
+		case 'a':
+			apply = true;
+			break;
+		case 'W':
+			whole = true;
+			break;
+		case 'h':
+			compile_usage();
+			exit(0);
+		default:
+			compile_usage();
+			exit(1);
+		}
+	}
+	if (optind + 1 < argc) {
+		compile_usage();
+		exit(1);
+	}
+	if (optind < argc) {
+		in = fopen(argv[optind], "re");
+		if (in == NULL) {
+			fprintf(stderr, "mpls-compile: %s: %s\n", argv[optind],
+				strerror(errno));
+			exit(1);
+		}
+	}
+
+	set = mpls_instr_set_new(base);
+	if (set == NULL) {
+		fprintf(stderr, "mpls-compile: %s\n", strerror(errno));
+		exit(1);
+	}
+	while (fgets(buf, sizeof(buf), in) != NULL) {
+		struct mpls_instr_req *instr;
+		struct compile_rule *r;
+
+		++line;
+		buf[strcspn(buf, "\n")] = '\0';
+		p = buf + strspn(buf, " \t");
+		if (*p == '#' || *p == '\0')
+			continue;
+		sep = strstr(p, SEPARATOR);
+		if (sep == NULL) {
+			fprintf(stderr, "mpls-compile: line %u: no `%s'\n",
+				line, SEPARATOR);
+			exit(1);
+		}
+		*sep = '\0';
+		instr = mpls_instr_compile(sep + strlen(SEPARATOR), MPLS_OUT,
+					   err, sizeof(err));
+		if (instr == NULL) {
+			fprintf(stderr, "mpls-compile: line %u: %s\n", line,
+				err);
+			exit(1);
+		}
+		r = realloc(rules, (nrules + 1) * sizeof(*rules));
+		if (r == NULL) {
+			fprintf(stderr, "mpls-compile: %s\n", strerror(errno));
+			exit(1);
+		}
+		rules = r;
+		r = &rules[nrules++];
+		/* Trim the blanks around the rule */
+		while (sep > p && (sep[-1] == ' ' || sep[-1] == '\t'))
+			*--sep = '\0';
+		if (!whole && compile_builtin(p, strcspn(p, " \t"))) {
+			fprintf(stderr, "mpls-compile: line %u: built-in "
+				"chain %.*s, only with --whole-table\n", line,
+				(int)strcspn(p, " \t"), p);
+			exit(1);
+		}
+		r->spec = strdup(p);
+		r->key = mpls_instr_set_key(set, instr);
+		free(instr);
+		if (r->spec == NULL || r->key == 0) {
+			fprintf(stderr, "mpls-compile: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+	if (in != stdin)
+		fclose(in);
+
+	/* The NHLFEs first, so that the rules can be restored at once */
+	if (apply && compile_apply(set, mtu, ttl) != 0)
+		exit(1);
+
+	printf("# %u rule%s, %u NHLFE%s, for iptables-restore%s\n", nrules,
+	       nrules == 1 ? "" : "s", mpls_instr_set_size(set),
+	       mpls_instr_set_size(set) == 1 ? "" : "s",
+	       whole ? "" : " --noflush");
+	mpls_instr_set_walk(set, compile_print, NULL);
+	printf("*%s\n", table);
+	compile_chains(rules, nrules);
+	for (i = 0; i < nrules; ++i) {
+		printf("-A %s -j MPLS --nhlfe 0x%x\n", rules[i].spec,
+		       rules[i].key);
+		free(rules[i].spec);
+	}
+	printf("COMMIT\n");
+	free(rules);
+	mpls_instr_set_free(set);
+	return 0;
+}
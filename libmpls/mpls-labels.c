@@ -0,0 +1,267 @@
+/*
+ * mpls-labels: give out and take back the labels of a label space,
+ * kept in a snapshot file between runs.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+#include <libmpls/libmpls.h>
+
+static const struct option labels_opts[] = {
+	{.name = "file",       .has_arg = true,  .val = 'f'},
+	{.name = "labelspace", .has_arg = true,  .val = 'L'},
+	{.name = "help",       .has_arg = false, .val = 'h'},
+	{NULL},
+};
+
+static void labels_usage(void)
+{
+	printf(
+"Usage: mpls-labels -f file [-L labelspace] command\n"
+"       mpls-labels bench [count]\n"
+"\n"
+"Commands:\n"
+"  alloc [count]          give out the lowest free labels\n"
+"  take label             give out this label\n"
+"  release label...       take labels back\n"
+"  reserve first[-last]   keep labels from being given out\n"
+"  unreserve first[-last] undo a reservation\n"
+"  show                   print how many labels are free\n"
+"  bench [count]          time count allocations, in memory\n"
+"\n"
+"  -f, --file file            snapshot of the labels given out\n"
+"  -L, --labelspace space     label space (default 0)\n");
+}
+
+static void __attribute__((noreturn)) labels_fail(const char *what)
+{
+	fprintf(stderr, "mpls-labels: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+static u_int32_t labels_parse(const char *arg, u_int32_t *last)
+{
+	unsigned long a, b;
+	char *end;
+
+	a = b = strtoul(arg, &end, 0);
+	if (last != NULL && end != arg && *end == '-')
+		b = strtoul(end + 1, &end, 0);
+	if (end == arg || *end != '\0' || a > b || b > 0xfffff) {
+		fprintf(stderr, "mpls-labels: bad label `%s'\n", arg);
+		exit(1);
+	}
+	if (last != NULL)
+		*last = b;
+	return a;
+}
+
+static unsigned int labels_count(const char *arg)
+{
+	unsigned long n;
+	char *end;
+
+	n = strtoul(arg, &end, 0);
+	if (end == arg || *end != '\0' || n == 0 || n > 0x100000) {
+		fprintf(stderr, "mpls-labels: bad count `%s'\n", arg);
+		exit(1);
+	}
+	return n;
+}
+
+static double labels_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void labels_report(const char *what, unsigned int n, double t)
+{
+	printf("%-28s %8u  %8.3f s  %6.1f ns each\n", what, n, t,
+	       n ? t * 1e9 / n : 0);
+}
+
+/*
+ * One label at a time, as labels are asked for one LSP at a time, then
+ * with holes all over the space, then in bulk.
+ */
+static void labels_bench(unsigned int n)
+{
+	struct mpls_label_pool *p;
+	u_int32_t *labels;
+	unsigned int i;
+	double t;
+
+	p = mpls_pool_new();
+	labels = calloc(n, sizeof(*labels));
+	if (p == NULL || labels == NULL)
+		labels_fail("bench");
+	if (n > mpls_pool_avail(p, 0)) {
+		fprintf(stderr, "mpls-labels: at most %u labels\n",
+			mpls_pool_avail(p, 0));
+		exit(1);
+	}
+
+	t = labels_now();
+	for (i = 0; i < n; ++i)
+		if (mpls_pool_alloc(p, 0, &labels[i], 1) < 0)
+			labels_fail("alloc");
+	labels_report("alloc, one at a time", n, labels_now() - t);
+
+	/* Every other one back, so that each word has holes */
+	t = labels_now();
+	for (i = 0; i < n; i += 2)
+		if (mpls_pool_release(p, 0, &labels[i], 1) < 0)
+			labels_fail("release");
+	labels_report("release, every other one", (n + 1) / 2,
+		      labels_now() - t);
+
+	t = labels_now();
+	for (i = 0; i < n; i += 2)
+		if (mpls_pool_alloc(p, 0, &labels[i], 1) < 0)
+			labels_fail("alloc");
+	labels_report("alloc, into the holes", (n + 1) / 2, labels_now() - t);
+
+	t = labels_now();
+	if (mpls_pool_release(p, 0, labels, n) < 0)
+		labels_fail("release");
+	labels_report("release, in bulk", n, labels_now() - t);
+
+	t = labels_now();
+	if (mpls_pool_alloc(p, 0, labels, n) < 0)
+		labels_fail("alloc");
+	labels_report("alloc, in bulk", n, labels_now() - t);
+
+	free(labels);
+	mpls_pool_free(p);
+}
+
+int main(int argc, char **argv)
+{
+	const char *file = NULL, *cmd;
+	struct mpls_label_pool *p;
+	u_int32_t first, last, *labels, *given = NULL;
+	unsigned int n, i, ngiven = 0;
+	char lock[4096];
+	int ls = 0, fd, c;
+	char *end;
+
+	while ((c = getopt_long(argc, argv, "+f:L:h", labels_opts,
+				NULL)) != -1) {
+		switch (c) {
+		case 'f':
+			file = optarg;
+			break;
+		case 'L':
+			ls = strtol(optarg, &end, 0);
+			if (*end != '\0' || ls < 0 || ls > MPLS_LABELSPACE_MAX) {
+				fprintf(stderr, "mpls-labels: bad label space "
+					"`%s'\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'h':
+			labels_usage();
+			exit(0);
+		default:
+			labels_usage();
+			exit(1);
+		}
+	}
+	if (optind == argc) {
+		labels_usage();
+		exit(1);
+	}
+	cmd = argv[optind++];
+
+	if (strcmp(cmd, "bench") == 0) {
+		n = optind < argc ? labels_count(argv[optind]) : 1000000;
+		labels_bench(n);
+		return 0;
+	}
+	if (file == NULL) {
+		labels_usage();
+		exit(1);
+	}
+
+	/* Scripts run us for each LSP, possibly at once */
+	snprintf(lock, sizeof(lock), "%s.lock", file);
+	fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0 || flock(fd, LOCK_EX) < 0)
+		labels_fail(lock);
+	p = mpls_pool_load(file);
+	if (p == NULL && errno == ENOENT)
+		p = mpls_pool_new();
+	if (p == NULL)
+		labels_fail(file);
+
+	if (strcmp(cmd, "alloc") == 0) {
+		n = optind < argc ? labels_count(argv[optind]) : 1;
+		given = calloc(n, sizeof(*given));
+		if (given == NULL || mpls_pool_alloc(p, ls, given, n) < 0)
+			labels_fail("alloc");
+		/* printed once they are saved as given out */
+		ngiven = n;
+	} else if (strcmp(cmd, "take") == 0 && optind + 1 == argc) {
+		if (mpls_pool_take(p, ls, labels_parse(argv[optind],
+							 NULL)) < 0)
+			labels_fail(argv[optind]);
+	} else if (strcmp(cmd, "release") == 0) {
+		n = argc - optind;
+		labels = calloc(n ? n : 1, sizeof(*labels));
+		if (labels == NULL)
+			labels_fail("release");
+		for (i = 0; i < n; ++i)
+			labels[i] = labels_parse(argv[optind + i], NULL);
+		if (mpls_pool_release(p, ls, labels, n) < 0) {
+			fprintf(stderr, "mpls-labels: %s\n", errno == ENOENT ?
+				"a label was not given out" : errno == EINVAL ?
+				"a label is reserved" : strerror(errno));
+			exit(1);
+		}
+		free(labels);
+	} else if (strcmp(cmd, "reserve") == 0 && optind + 1 == argc) {
+		first = labels_parse(argv[optind], &last);
+		if (mpls_pool_reserve(p, ls, first, last) < 0)
+			labels_fail(argv[optind]);
+	} else if (strcmp(cmd, "unreserve") == 0 && optind + 1 == argc) {
+		first = labels_parse(argv[optind], &last);
+		if (mpls_pool_unreserve(p, ls, first, last) < 0)
+			labels_fail(argv[optind]);
+	} else if (strcmp(cmd, "show") == 0) {
+		printf("labelspace %d: %u free\n", ls, mpls_pool_avail(p, ls));
+		mpls_pool_free(p);
+		return 0;
+	} else {
+		labels_usage();
+		exit(1);
+	}
+
+	if (mpls_pool_save(p, file) < 0)
+		labels_fail(file);
+	for (i = 0; i < ngiven; ++i)
+		printf("%u\n", given[i]);
+	if (fflush(stdout) != 0)
+		labels_fail("stdout");
+	free(given);
+	mpls_pool_free(p);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,505 @@
+/*
+ * pool.c
+ *
+ * The 2^20 labels of each label space, and which of them are given out
+ * or reserved.  A bit per label, with two levels of summary above it:
+ * a bit per word of labels that is set when the word is full, and the
+ * same again above that, so that the lowest free label is found by
+ * looking at three words however full the space is.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libmpls/libmpls.h>
+
+#define MPLS_LABEL_NUM		(1U << 20)
+#define MPLS_LABEL_FIRST	16	/* 0-15 are reserved by RFC 3032 */
+
+#define POOL_L0_WORDS		(MPLS_LABEL_NUM / 64)
+#define POOL_L1_WORDS		(POOL_L0_WORDS / 64)
+#define POOL_L2_WORDS		(POOL_L1_WORDS / 64)
+
+struct mpls_label_range {
+	u_int32_t first, last;
+};
+
+struct mpls_label_space {
+	uint64_t l0[POOL_L0_WORDS];	/* label taken */
+	uint64_t l1[POOL_L1_WORDS];	/* word of l0 full */
+	uint64_t l2[POOL_L2_WORDS];	/* word of l1 full */
+	unsigned int taken;		/* reserved ones included */
+	struct mpls_label_range *resv;	/* sorted, not overlapping */
+	unsigned int nresv;
+};
+
+struct mpls_label_pool {
+	struct mpls_label_space *space[MPLS_LABELSPACE_MAX + 1];
+};
+
+static inline int pool_bit(const uint64_t *map, unsigned int i)
+{
+	return (map[i / 64] >> (i % 64)) & 1;
+}
+
+static void pool_set(struct mpls_label_space *s, u_int32_t label)
+{
+	unsigned int w = label / 64;
+
+	s->l0[w] |= 1ULL << (label % 64);
+	++s->taken;
+	if (s->l0[w] != ~0ULL)
+		return;
+	s->l1[w / 64] |= 1ULL << (w % 64);
+	if (s->l1[w / 64] == ~0ULL)
+		s->l2[w / 4096] |= 1ULL << (w / 64 % 64);
+}
+
+static void pool_clear(struct mpls_label_space *s, u_int32_t label)
+{
+	unsigned int w = label / 64;
+
+	s->l0[w] &= ~(1ULL << (label % 64));
+	s->l1[w / 64] &= ~(1ULL << (w % 64));
+	s->l2[w / 4096] &= ~(1ULL << (w / 64 % 64));
+	--s->taken;
+}
+
+/* The first word of l0 with a free label; -1 if there is none */
+static int pool_first_word(const struct mpls_label_space *s)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < POOL_L2_WORDS; ++i)
+		if (s->l2[i] != ~0ULL)
+			break;
+	if (i == POOL_L2_WORDS)
+		return -1;
+	j = i * 64 + __builtin_ctzll(~s->l2[i]);
+	return j * 64 + __builtin_ctzll(~s->l1[j]);
+}
+
+static const struct mpls_label_range *
+pool_find_resv(const struct mpls_label_space *s, u_int32_t label)
+{
+	unsigned int lo = 0, hi = s->nresv, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (label < s->resv[mid].first)
+			hi = mid;
+		else if (label > s->resv[mid].last)
+			lo = mid + 1;
+		else
+			return &s->resv[mid];
+	}
+	return NULL;
+}
+
+static int pool_add_resv(struct mpls_label_space *s, u_int32_t first,
+			 u_int32_t last)
+{
+	struct mpls_label_range *r;
+	unsigned int i;
+	u_int32_t l;
+
+	for (l = first; l <= last; ++l)
+		if (pool_bit(s->l0, l)) {
+			errno = EBUSY;
+			return -1;
+		}
+	r = realloc(s->resv, (s->nresv + 1) * sizeof(*r));
+	if (r == NULL)
+		return -1;
+	s->resv = r;
+	for (i = s->nresv; i > 0 && r[i-1].first > first; --i)
+		r[i] = r[i-1];
+	r[i].first = first;
+	r[i].last  = last;
+	++s->nresv;
+	for (l = first; l <= last; ++l)
+		pool_set(s, l);
+	return 0;
+}
+
+/* The space, made on first use with its first 16 labels reserved */
+static struct mpls_label_space *pool_space_make(struct mpls_label_pool *p,
+						int ls)
+{
+	struct mpls_label_space *s;
+
+	if (ls < 0 || ls > MPLS_LABELSPACE_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (p->space[ls] != NULL)
+		return p->space[ls];
+	s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		return NULL;
+	if (pool_add_resv(s, 0, MPLS_LABEL_FIRST - 1) < 0) {
+		free(s);
+		return NULL;
+	}
+	p->space[ls] = s;
+	return s;
+}
+
+struct mpls_label_pool *mpls_pool_new(void)
+{
+	return calloc(1, sizeof(struct mpls_label_pool));
+}
+
+void mpls_pool_free(struct mpls_label_pool *p)
+{
+	unsigned int i;
+
+	if (p == NULL)
+		return;
+	for (i = 0; i <= MPLS_LABELSPACE_MAX; ++i)
+		if (p->space[i] != NULL) {
+			free(p->space[i]->resv);
+			free(p->space[i]);
+		}
+	free(p);
+}
+
+/*
+ * Keep first to last from being given out.  EBUSY if one of them is
+ * taken already, reserved ones included.
+ */
+int mpls_pool_reserve(struct mpls_label_pool *p, int ls, u_int32_t first,
+		      u_int32_t last)
+{
+	struct mpls_label_space *s;
+
+	if (first > last || last >= MPLS_LABEL_NUM) {
+		errno = EINVAL;
+		return -1;
+	}
+	s = pool_space_make(p, ls);
+	if (s == NULL)
+		return -1;
+	return pool_add_resv(s, first, last);
+}
+
+/* Undo a reservation, given as it was made; 0-15 stay reserved */
+int mpls_pool_unreserve(struct mpls_label_pool *p, int ls, u_int32_t first,
+			u_int32_t last)
+{
+	const struct mpls_label_range *r;
+	struct mpls_label_space *s;
+	unsigned int i;
+	u_int32_t l;
+
+	if (ls < 0 || ls > MPLS_LABELSPACE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	s = p->space[ls];
+	r = s != NULL ? pool_find_resv(s, first) : NULL;
+	if (r == NULL || r->first != first || r->last != last) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (first < MPLS_LABEL_FIRST) {
+		errno = EPERM;
+		return -1;
+	}
+	for (l = first; l <= last; ++l)
+		pool_clear(s, l);
+	i = r - s->resv;
+	memmove(&s->resv[i], &s->resv[i+1],
+		(s->nresv - i - 1) * sizeof(*s->resv));
+	--s->nresv;
+	return 0;
+}
+
+/*
+ * Give out n labels, the lowest free ones, into labels.  All or none:
+ * ENOSPC if there are not n free.
+ */
+int mpls_pool_alloc(struct mpls_label_pool *p, int ls, u_int32_t *labels,
+		    unsigned int n)
+{
+	struct mpls_label_space *s = pool_space_make(p, ls);
+	unsigned int i = 0;
+	uint64_t free_bits;
+	int w;
+
+	if (s == NULL)
+		return -1;
+	if (MPLS_LABEL_NUM - s->taken < n) {
+		errno = ENOSPC;
+		return -1;
+	}
+	/* Take what a word has free before looking for the next */
+	while (i < n) {
+		w = pool_first_word(s);
+		free_bits = ~s->l0[w];
+		while (free_bits != 0 && i < n) {
+			labels[i] = w * 64 + __builtin_ctzll(free_bits);
+			pool_set(s, labels[i++]);
+			free_bits &= free_bits - 1;
+		}
+	}
+	return 0;
+}
+
+/* Give out this one label; EBUSY if it is taken or reserved */
+int mpls_pool_take(struct mpls_label_pool *p, int ls, u_int32_t label)
+{
+	struct mpls_label_space *s;
+
+	if (label >= MPLS_LABEL_NUM) {
+		errno = EINVAL;
+		return -1;
+	}
+	s = pool_space_make(p, ls);
+	if (s == NULL)
+		return -1;
+	if (pool_bit(s->l0, label)) {
+		errno = EBUSY;
+		return -1;
+	}
+	pool_set(s, label);
+	return 0;
+}
+
+/*
+ * Take back n labels.  All or none: EINVAL if one is reserved or out
+ * of range, ENOENT if one was not given out.
+ */
+int mpls_pool_release(struct mpls_label_pool *p, int ls,
+		      const u_int32_t *labels, unsigned int n)
+{
+	struct mpls_label_space *s;
+	unsigned int i;
+
+	if (ls < 0 || ls > MPLS_LABELSPACE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	s = p->space[ls];
+	for (i = 0; i < n; ++i) {
+		if (labels[i] >= MPLS_LABEL_NUM ||
+		    mpls_pool_test(p, ls, labels[i]) == MPLS_POOL_RESERVED) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (s == NULL || !pool_bit(s->l0, labels[i])) {
+			errno = ENOENT;
+			return -1;
+		}
+	}
+	for (i = 0; i < n; ++i)
+		if (pool_bit(s->l0, labels[i]))
+			pool_clear(s, labels[i]);
+	return 0;
+}
+
+/* MPLS_POOL_FREE, _USED or _RESERVED; -1 if ls or label is not valid */
+int mpls_pool_test(const struct mpls_label_pool *p, int ls, u_int32_t label)
+{
+	const struct mpls_label_space *s;
+
+	if (ls < 0 || ls > MPLS_LABELSPACE_MAX || label >= MPLS_LABEL_NUM) {
+		errno = EINVAL;
+		return -1;
+	}
+	s = p->space[ls];
+	if (s == NULL)
+		return label < MPLS_LABEL_FIRST ? MPLS_POOL_RESERVED :
+		       MPLS_POOL_FREE;
+	if (!pool_bit(s->l0, label))
+		return MPLS_POOL_FREE;
+	return pool_find_resv(s, label) != NULL ? MPLS_POOL_RESERVED :
+	       MPLS_POOL_USED;
+}
+
+/* How many labels of ls are free */
+unsigned int mpls_pool_avail(const struct mpls_label_pool *p, int ls)
+{
+	const struct mpls_label_space *s;
+
+	if (ls < 0 || ls > MPLS_LABELSPACE_MAX)
+		return 0;
+	s = p->space[ls];
+	return MPLS_LABEL_NUM - (s != NULL ? s->taken : MPLS_LABEL_FIRST);
+}
+
+/****************************************************************************
+ *
+ * Snapshots
+ *
+ ****************************************************************************/
+
+static void pool_save_range(FILE *fp, const char *what, u_int32_t first,
+			    u_int32_t last)
+{
+	if (first == last)
+		fprintf(fp, "%s %u\n", what, first);
+	else
+		fprintf(fp, "%s %u-%u\n", what, first, last);
+}
+
+/* The runs of labels given out, reservations left out */
+static void pool_save_used(FILE *fp, const struct mpls_label_space *s)
+{
+	const struct mpls_label_range *r = s->resv, *end = s->resv + s->nresv;
+	u_int32_t l = 0, first = 0;
+	int in_run = 0, used;
+
+	while (l < MPLS_LABEL_NUM) {
+		/* Whole words free or full of labels in use go at once */
+		if (l % 64 == 0 && (r == end || r->first >= l + 64) &&
+		    (s->l0[l / 64] == 0 || s->l0[l / 64] == ~0ULL)) {
+			used = s->l0[l / 64] != 0;
+			if (used && !in_run)
+				first = l;
+			else if (!used && in_run)
+				pool_save_range(fp, "used", first, l - 1);
+			in_run = used;
+			l += 64;
+			continue;
+		}
+		while (r != end && r->last < l)
+			++r;
+		used = pool_bit(s->l0, l) && (r == end || l < r->first);
+		if (used && !in_run)
+			first = l;
+		else if (!used && in_run)
+			pool_save_range(fp, "used", first, l - 1);
+		in_run = used;
+		++l;
+	}
+	if (in_run)
+		pool_save_range(fp, "used", first, MPLS_LABEL_NUM - 1);
+}
+
+/*
+ * Write the pool to path, as text: for each label space, its
+ * reservations and the runs of labels given out.  The file is
+ * replaced at once, by a rename.
+ */
+int mpls_pool_save(const struct mpls_label_pool *p, const char *path)
+{
+	const struct mpls_label_space *s;
+	unsigned int i, j;
+	char *tmp;
+	FILE *fp;
+	int err;
+
+	tmp = malloc(strlen(path) + sizeof(".tmp"));
+	if (tmp == NULL)
+		return -1;
+	sprintf(tmp, "%s.tmp", path);
+	fp = fopen(tmp, "we");
+	if (fp == NULL) {
+		free(tmp);
+		return -1;
+	}
+	fprintf(fp, "# libmpls label pool\n");
+	for (i = 0; i <= MPLS_LABELSPACE_MAX; ++i) {
+		s = p->space[i];
+		if (s == NULL)
+			continue;
+		fprintf(fp, "labelspace %u\n", i);
+		for (j = 0; j < s->nresv; ++j)
+			if (s->resv[j].first >= MPLS_LABEL_FIRST)
+				pool_save_range(fp, "reserve",
+						s->resv[j].first,
+						s->resv[j].last);
+		pool_save_used(fp, s);
+	}
+	if (ferror(fp) | (fclose(fp) != 0) || rename(tmp, path) < 0) {
+		err = errno;
+		unlink(tmp);
+		free(tmp);
+		errno = err;
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+static int pool_parse_range(const char *arg, u_int32_t *first,
+			    u_int32_t *last)
+{
+	unsigned long a, b;
+	char *end;
+
+	a = strtoul(arg, &end, 0);
+	b = a;
+	if (end != arg && *end == '-')
+		b = strtoul(end + 1, &end, 0);
+	if (end == arg || *end != '\0' || a > b || b >= MPLS_LABEL_NUM)
+		return -1;
+	*first = a;
+	*last  = b;
+	return 0;
+}
+
+/* Read back what mpls_pool_save() wrote; EINVAL if it is not that */
+struct mpls_label_pool *mpls_pool_load(const char *path)
+{
+	char buf[256], what[32], arg[64], *end;
+	struct mpls_label_space *s;
+	struct mpls_label_pool *p;
+	u_int32_t first, last, l;
+	int ls = -1, err = 0;
+	FILE *fp;
+
+	fp = fopen(path, "re");
+	if (fp == NULL)
+		return NULL;
+	p = mpls_pool_new();
+	if (p == NULL) {
+		fclose(fp);
+		return NULL;
+	}
+	while (err == 0 && fgets(buf, sizeof(buf), fp) != NULL) {
+		if (*buf == '#' || *buf == '\n')
+			continue;
+		if (sscanf(buf, "%31s %63s", what, arg) != 2) {
+			err = EINVAL;
+		} else if (strcmp(what, "labelspace") == 0) {
+			ls = strtol(arg, &end, 10);
+			if (*end != '\0' || pool_space_make(p, ls) == NULL)
+				err = EINVAL;
+		} else if (ls < 0 || pool_parse_range(arg, &first, &last) < 0) {
+			err = EINVAL;
+		} else if (strcmp(what, "reserve") == 0) {
+			if (mpls_pool_reserve(p, ls, first, last) < 0)
+				err = errno;
+		} else if (strcmp(what, "used") == 0) {
+			s = p->space[ls];
+			for (l = first; l <= last; ++l) {
+				if (pool_bit(s->l0, l)) {
+					err = EINVAL;
+					break;
+				}
+				pool_set(s, l);
+			}
+		} else {
+			err = EINVAL;
+		}
+	}
+	fclose(fp);
+	if (err != 0) {
+		mpls_pool_free(p);
+		errno = err;
+		return NULL;
+	}
+	return p;
+}
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# iptables-daemon: two clients have commands in the same commit, one of
+# them a rule the kernel rejects (DNAT outside the nat table). Only that
+# client may get an error; the other's rule must be committed.
+#
+# Run as root in a network namespace of its own, from the build tree:
+#	unshare -n sh tests/daemon-reject.sh
+# XT names the xtables-multi binary to test.
+#
+XT="${XT:-iptables/xtables-multi}"
+SOCK="${TMPDIR:-/tmp}/daemon-reject.$$.sock"
+
+$XT iptables-daemon --socket "$SOCK" --window 500 &
+pid=$!
+trap 'kill $pid 2>/dev/null; rm -f "$SOCK"' EXIT
+while [ ! -S "$SOCK" ]; do sleep 0.1; done
+
+python3 - "$SOCK" <<'EOF' || exit 1
+import socket, sys
+
+def reply(s):
+    hdr = b""
+    while not hdr.endswith(b"\n"):
+        hdr += s.recv(1)
+    status, n = hdr.split()
+    body = b""
+    while len(body) < int(n):
+        body += s.recv(int(n) - len(body))
+    return status.decode(), body.decode().strip()
+
+good, bad = socket.socket(socket.AF_UNIX), socket.socket(socket.AF_UNIX)
+good.connect(sys.argv[1])
+bad.connect(sys.argv[1])
+good.sendall(b"-A INPUT -s 192.0.2.1 -j ACCEPT\n")
+bad.sendall(b"-A INPUT -p tcp -j DNAT --to-destination 192.0.2.2\n")
+ok = True
+for name, s, want in (("good", good, "OK"), ("bad", bad, "ERR")):
+    status, text = reply(s)
+    print("%s client: %s %s" % (name, status, text))
+    ok = ok and status == want
+sys.exit(0 if ok else 1)
+EOF
+
+$XT iptables -S INPUT | grep -qx -- "-A INPUT -s 192.0.2.1/32 -j ACCEPT" || {
+	echo "rule of the good client is missing" >&2
+	exit 1
+}
+$XT iptables -S INPUT | grep -q DNAT && {
+	echo "rejected rule got committed" >&2
+	exit 1
+}
+echo PASS
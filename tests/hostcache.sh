@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# iptables: names given to -s and -d are looked up once and kept, those
+# that do not exist too, until their lifetime runs out. /etc/hosts is
+# replaced with one of the test's own, which is changed under the
+# running program: a name looked up again would show the new address.
+#
+# Run in user, mount and network namespaces of its own, from the build
+# tree:
+#	unshare -Urmn sh tests/hostcache.sh
+# XT names the xtables-multi binary to test.
+#
+XT="${XT:-iptables/xtables-multi}"
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+echo "hosts: files" >"$DIR/nsswitch.conf"
+echo "192.0.2.1 alpha" >"$DIR/hosts"
+mount --bind "$DIR/nsswitch.conf" /etc/nsswitch.conf &&
+mount --bind "$DIR/hosts" /etc/hosts || exit 1
+
+status=0
+fail()
+{
+	echo "$*" >&2
+	status=1
+}
+
+sources()
+{
+	$XT iptables -S INPUT | sed -n 's/^-A INPUT -s \([^/]*\).*/\1/p' |
+		tr '\n' ' '
+}
+
+# Restore, with the names looked up before the rules are parsed
+cat >"$DIR/restore" <<'EOT'
+*filter
+-A INPUT -s alpha -j ACCEPT
+-A INPUT -d 192.0.2.9 -s alpha -j ACCEPT
+-A INPUT -s 192.0.2.8,alpha -j ACCEPT
+COMMIT
+EOT
+$XT iptables-restore <"$DIR/restore" || fail "restore failed"
+[ "$(sources)" = "192.0.2.1 192.0.2.1 192.0.2.8 192.0.2.1 " ] ||
+	fail "restore: got $(sources)"
+$XT iptables -F INPUT
+
+# A long running batch, fed a line at a time: each name is looked up
+# the first time only, until the lifetime of 3 seconds, or 2 for a
+# name that does not exist, is over
+mkfifo "$DIR/fifo"
+XTABLES_HOSTCACHE_TTL=3,2 $XT iptables --batch - --commit-every 1 \
+	<"$DIR/fifo" 2>"$DIR/errors" &
+pid=$!
+exec 3>"$DIR/fifo"
+line()
+{
+	echo "$1" >&3
+	sleep 0.3
+}
+line "-A INPUT -s alpha -j ACCEPT"
+line "-A INPUT -s beta -j ACCEPT"
+printf "192.0.2.2 alpha\n192.0.2.3 beta\n" >"$DIR/hosts"
+line "-A INPUT -s alpha -j ACCEPT"
+line "-A INPUT -s beta -j ACCEPT"
+sleep 3
+line "-A INPUT -s alpha -j ACCEPT"
+line "-A INPUT -s beta -j ACCEPT"
+exec 3>&-
+wait $pid
+
+[ "$(sources)" = "192.0.2.1 192.0.2.1 192.0.2.2 192.0.2.3 " ] ||
+	fail "batch: got $(sources)"
+[ "$(grep -c 'failed' "$DIR/errors")" = 2 ] &&
+grep -q "line 2 failed" "$DIR/errors" &&
+grep -q "line 4 failed" "$DIR/errors" ||
+	fail "batch: beta not refused twice: $(cat "$DIR/errors")"
+
+[ $status -eq 0 ] && echo PASS
+exit $status
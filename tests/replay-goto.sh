@@ -0,0 +1,81 @@
+#!/bin/sh
+#
+# iptables-replay: a chain entered with -g (goto) leaves no return frame.
+# When the chain gone to runs off its end, or hits RETURN, evaluation
+# goes back to the caller of the chain that did the goto, or to the
+# policy, never to the rule after the goto.  A non-terminating target
+# (MPLS) lets the packet go on to the next rule; it is not the verdict.
+#
+# Needs no privileges. Run from the build tree, with libmpls where the
+# MPLS extension finds it:
+#	LD_LIBRARY_PATH=libmpls/.libs sh tests/replay-goto.sh
+# XT names the xtables-multi binary to test.
+#
+XT="${XT:-iptables/xtables-multi}"
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+cat >"$DIR/filter.rules" <<'EOF'
+*filter
+:INPUT ACCEPT [0:0]
+:FORWARD DROP [0:0]
+:OUTPUT ACCEPT [0:0]
+:CALLER - [0:0]
+:FALLOFF - [0:0]
+:RET - [0:0]
+-A INPUT -j CALLER
+-A INPUT -j DROP
+-A CALLER -g FALLOFF
+-A CALLER -j ACCEPT
+-A FALLOFF -p udp -j ACCEPT
+-A FORWARD -g RET
+-A FORWARD -j ACCEPT
+-A RET -j RETURN
+COMMIT
+EOF
+
+cat >"$DIR/mangle.rules" <<'EOF'
+*mangle
+:PREROUTING ACCEPT [0:0]
+:INPUT ACCEPT [0:0]
+:FORWARD ACCEPT [0:0]
+:OUTPUT ACCEPT [0:0]
+:POSTROUTING ACCEPT [0:0]
+-A FORWARD -d 10.0.0.0/8 -j MPLS --nhlfe 0x5
+-A FORWARD -j DROP
+COMMIT
+EOF
+
+# One TCP SYN 10.0.0.1:1234 -> 10.0.0.2:80, as a raw IP capture
+python3 - "$DIR/tcp.pcap" <<'EOF' || exit 1
+import struct, sys
+ip = bytes([0x45, 0, 0, 40, 0, 0, 0x40, 0, 64, 6, 0, 0,
+            10, 0, 0, 1, 10, 0, 0, 2])
+tcp = struct.pack(">HHIIBBHHH", 1234, 80, 0, 0, 0x50, 2, 1024, 0, 0)
+pkt = ip + tcp
+with open(sys.argv[1], "wb") as f:
+    f.write(struct.pack("<IHHiIII", 0xa1b2c3d4, 2, 4, 0, 0, 65535, 101))
+    f.write(struct.pack("<IIII", 0, 0, len(pkt), len(pkt)))
+    f.write(pkt)
+EOF
+
+status=0
+check()
+{
+	verdict=$($XT iptables-replay -t "$1" -c "$2" "$DIR/$1.rules" \
+		  "$DIR/tcp.pcap" | awk '/^Verdicts:/ {getline; print $1}')
+	if [ "$verdict" = "$3" ]; then
+		echo "$1 $2: $verdict"
+	else
+		echo "$1 $2: got $verdict, want $3" >&2
+		status=1
+	fi
+}
+
+# goto chain runs off its end: back to INPUT, after -j CALLER
+check filter INPUT DROP
+# goto chain returns: FORWARD returns too, to its policy
+check filter FORWARD DROP
+# MPLS only sets the NHLFE: on to the next rule
+check mangle FORWARD DROP
+exit $status
@@ -0,0 +1,101 @@
+#!/bin/sh
+#
+# iptables: a multiport list longer than one match holds is split into
+# a rule per part. -I must leave the parts in order at the position
+# given, -D must delete all of them or none, and a split that could
+# make a packet match two of the rules must be refused.  In batch mode
+# and in the daemon, a split command whose later part fails must leave
+# nothing of its earlier parts to be committed.
+#
+# Run as root in a network namespace of its own, from the build tree:
+#	unshare -n sh tests/split-ports.sh
+# XT names the xtables-multi binary to test.
+#
+XT="${XT:-iptables/xtables-multi}"
+IPT="$XT iptables"
+SOCK="${TMPDIR:-/tmp}/split-ports.$$.sock"
+
+# 20 ports: 1..15 in the first part, 16..20 in the second
+PORTS=$(seq -s, 1 20)
+status=0
+
+fail()
+{
+	echo "$*" >&2
+	status=1
+}
+
+rules()
+{
+	$IPT -S INPUT | sed -n 's/^-A INPUT //p' | tr '\n' '|'
+}
+
+$IPT -A INPUT -s 192.0.2.1 -j ACCEPT
+$IPT -A INPUT -s 192.0.2.2 -j ACCEPT
+$IPT -I INPUT 2 -p tcp -m multiport --dports "$PORTS" -j DROP ||
+	fail "split insert failed"
+want="-s 192.0.2.1/32 -j ACCEPT|\
+-p tcp -m multiport --dports $(seq -s, 1 15) -j DROP|\
+-p tcp -m multiport --dports 16,17,18,19,20 -j DROP|\
+-s 192.0.2.2/32 -j ACCEPT|"
+[ "$(rules)" = "$want" ] || fail "insert: got $(rules)"
+
+# with one part gone, -D must leave the other alone
+$IPT -D INPUT -p tcp -m multiport --dports 16,17,18,19,20 -j DROP
+$IPT -D INPUT -p tcp -m multiport --dports "$PORTS" -j DROP 2>/dev/null &&
+	fail "delete of a partly missing split rule succeeded"
+$IPT -S INPUT | grep -q -- "--dports 1,2," ||
+	fail "delete of a partly missing split rule removed a part"
+
+$IPT -I INPUT 2 -p tcp -m multiport --dports 16,17,18,19,20 -j DROP
+$IPT -C INPUT -p tcp -m multiport --dports "$PORTS" -j DROP ||
+	fail "check of a split rule failed"
+$IPT -D INPUT -p tcp -m multiport --dports "$PORTS" -j DROP ||
+	fail "split delete failed"
+$IPT -S INPUT | grep -q multiport && fail "split delete left rules"
+
+# a packet could be counted or logged twice
+$IPT -A INPUT -p tcp -m multiport --ports "$PORTS" 2>/dev/null &&
+	fail "split of --ports without a verdict accepted"
+$IPT -A INPUT -p tcp -m multiport --dports "1:100,$PORTS" 2>/dev/null &&
+	fail "split of overlapping parts without a verdict accepted"
+$IPT -A INPUT -p tcp -m multiport --dports "$PORTS" ||
+	fail "split of disjoint parts without a verdict refused"
+
+# the second part has the bad port: the first must not be committed
+# with the good command after it
+BAD="-A INPUT -p tcp -m multiport --dports $(seq -s, 1 16),bogus -j DROP"
+$IPT -F INPUT
+printf '%s\n' "$BAD" "-A INPUT -s 192.0.2.3 -j ACCEPT" |
+	$IPT --batch - 2>/dev/null && fail "batch with a bad split succeeded"
+[ "$(rules)" = "-s 192.0.2.3/32 -j ACCEPT|" ] ||
+	fail "batch: got $(rules)"
+
+$IPT -F INPUT
+$XT iptables-daemon --socket "$SOCK" &
+pid=$!
+trap 'kill $pid 2>/dev/null; rm -f "$SOCK"' EXIT
+while [ ! -S "$SOCK" ]; do sleep 0.1; done
+python3 - "$SOCK" "$BAD" <<'EOF' || fail "daemon: wrong replies"
+import socket, sys
+
+def reply(s):
+    hdr = b""
+    while not hdr.endswith(b"\n"):
+        hdr += s.recv(1)
+    status, n = hdr.split()
+    body = b""
+    while len(body) < int(n):
+        body += s.recv(int(n) - len(body))
+    return status.decode()
+
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+s.sendall(sys.argv[2].encode() + b"\n-A INPUT -s 192.0.2.4 -j ACCEPT\n")
+sys.exit(0 if (reply(s), reply(s)) == ("ERR", "OK") else 1)
+EOF
+[ "$(rules)" = "-s 192.0.2.4/32 -j ACCEPT|" ] ||
+	fail "daemon: got $(rules)"
+
+[ $status -eq 0 ] && echo PASS
+exit $status